@@ -24,9 +24,10 @@
         NTERMS=3
 
 #
-# Set the number of disks that we should be launching
+# Set the number of disks that we should be launching. The second disk,
+# if there is one, is used as swap space for anonymous memory.
 #
-        NDISKS=1
+        NDISKS=2
 
 # Switches for non-required components. If you wish to try implementing
 # some extra features in Weenix, there are some pre-designed features
@@ -46,18 +47,30 @@
         UPREEMPT=0 # userland preemption
              MTP=0 # multiple kernel threads per process
          SHADOWD=0 # shadow page cleanup
+            KSMD=0 # merge identical private pages when memory is tight
+        MEMBENCH=0 # time memcpy, memset and memcmp at boot
 
 # Boolean options specified in this specified in this file that should be
 # included as definitions at compile time
-        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP SHADOWD GETCWD UPREEMPT"
+        COMPILE_CONFIG_BOOLS=" DRIVERS VFS S5FS VM FI DYNAMIC MOUNTING MTP SHADOWD KSMD MEMBENCH GETCWD UPREEMPT"
 # As above, but not booleans
-        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE BOCHS_INSTALL_DIR"
+        COMPILE_CONFIG_DEFS=" NTERMS NDISKS DBG DISK_SIZE BOCHS_INSTALL_DIR SWAP_MB ZPAGE_KB"
 
 # Parameters for the hard disk we build (must be compatible!)
-# If the FS is too big for the disk, BAD things happen!
-        DISK_BLOCKS=1024 # For fsmaker
+# If the FS is too big for the disk, BAD things happen! The files in
+# user/ take about 3.5 MB, and usr/bin/bigfile writes another 6 MB. The
+# journal takes a sixteenth of the blocks on top of that.
+        DISK_BLOCKS=4096 # For fsmaker
         DISK_INODES=240 # for fsmaker
 
+# Size of the swap disk the run script makes for the second disk; the
+# kernel uses this many megabytes of it
+        SWAP_MB=16
+
+# Memory (in kilobytes) pageoutd may use to keep compressed copies of the
+# pages it reclaims, 0 turns the compressed page store off
+        ZPAGE_KB=1024
+
 # Debug message behavior. Note that this can be changed at runtime by
 # modifying the dbg_modes global variable.
 # All debug statements
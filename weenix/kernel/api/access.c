@@ -1,3 +1,4 @@
+#include "kernel.h"
 #include "globals.h"
 #include "errno.h"
 
@@ -8,6 +9,7 @@
 #include "mm/page.h"
 #include "mm/mm.h"
 #include "mm/kmalloc.h"
+#include "mm/pagetable.h"
 
 #include "proc/proc.h"
 
@@ -16,12 +18,79 @@
 #include "api/access.h"
 #include "api/syscall.h"
 
+/* Entries of the __ex_table section: if the instruction at ex_insn
+ * faults on a user address which cannot be mapped in, the page fault
+ * handler resumes at ex_fixup instead of panicking. */
+typedef struct ex_entry {
+        uintptr_t ex_insn;
+        uintptr_t ex_fixup;
+} ex_entry_t;
+
+uintptr_t access_fixup(uintptr_t eip)
+{
+        ex_entry_t *e;
+        for (e = (ex_entry_t *) &kernel_start_ex_table;
+             e < (ex_entry_t *) &kernel_end_ex_table; ++e) {
+                if (e->ex_insn == eip) {
+                        return e->ex_fixup;
+                }
+        }
+        return 0;
+}
+
+/* Copies nbytes from src to dst, one of which is a user address
+ * mapped by the current page table. Missing and copy-on-write pages
+ * are faulted in as the copy goes; if one cannot be, the copy stops
+ * at the fixup (label 3) and returns -EFAULT. */
+static int copy_user_fast(void *dst, const void *src, size_t nbytes)
+{
+        int ret, d0, d1, d2;
+
+        __asm__ volatile(
+                "1:     rep movsl\n"
+                "       movl %[rest], %%ecx\n"
+                "2:     rep movsb\n"
+                "       xorl %[ret], %[ret]\n"
+                "       jmp 4f\n"
+                "3:     movl %[efault], %[ret]\n"
+                "4:\n"
+                "       .section __ex_table, \"a\"\n"
+                "       .long 1b, 3b\n"
+                "       .long 2b, 3b\n"
+                "       .previous\n"
+                : [ret] "=&a"(ret), "=&c"(d0), "=&D"(d1), "=&S"(d2)
+                : [rest] "g"(nbytes & 3), "1"(nbytes >> 2), "2"(dst), "3"(src),
+                [efault] "i"(-EFAULT)
+                : "memory");
+        return ret;
+}
+
+/* Returns non-zero if [uaddr, uaddr + nbytes) lies in user memory. */
+static int user_range_ok(const void *uaddr, size_t nbytes)
+{
+        uintptr_t lo = (uintptr_t) uaddr;
+        return lo >= USER_MEM_LOW && lo <= USER_MEM_HIGH
+               && nbytes <= USER_MEM_HIGH - lo;
+}
+
 /* copy_to_user and copy_from_user are used to copy to and from the
- * user space of the current process.  They first check that the range
- * of addresses has valid mappings, then call vmmap_read/write.
+ * user space of the current process. Normally the current page table
+ * is the process's, and the copy goes straight through the user's
+ * mappings, letting the page fault handler fill in whatever is not
+ * mapped yet. Otherwise they check that the range of addresses has
+ * valid mappings, then call vmmap_read/write.
  */
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 {
+        if (0 == nbytes) {
+                return 0;
+        }
+        if (!user_range_ok(uaddr, nbytes)) {
+                return -EFAULT;
+        }
+        if (pt_get() == curproc->p_pagedir) {
+                return copy_user_fast(kaddr, uaddr, nbytes);
+        }
         if (!range_perm(curproc, uaddr, nbytes, PROT_READ)) {
                 return -EFAULT;
         }
@@ -30,6 +99,15 @@ int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes)
 
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes)
 {
+        if (0 == nbytes) {
+                return 0;
+        }
+        if (!user_range_ok(uaddr, nbytes)) {
+                return -EFAULT;
+        }
+        if (pt_get() == curproc->p_pagedir) {
+                return copy_user_fast(uaddr, kaddr, nbytes);
+        }
         if (!range_perm(curproc, uaddr, nbytes, PROT_WRITE)) {
                 return -EFAULT;
         }
@@ -122,21 +200,8 @@ fail:
  */
 int addr_perm(struct proc *p, const void *vaddr, int perm)
 {
-        int i = 0;
-	vmmap_t *map = p->p_vmmap;
-	if(map){
-		vmarea_t *vma = vmmap_lookup(map,*((uint32_t*)vaddr));
-		if(vma){
-			int vmaperm = vma->vma_prot;
-			if(vmaperm & perm){
-				i = 1;
-			}
-		}
-	}
-	if(i)
-	dbg(DBG_VM,"INFO: The given address 0x%x has required permissions",*((uint32_t*)vaddr)); 
-	/*NOT_YET_IMPLEMENTED("VM: ***none***");*/
-        return i;
+        vmarea_t *vma = vmmap_lookup(p->p_vmmap, ADDR_TO_PN(vaddr));
+        return NULL != vma && perm == (vma->vma_prot & perm);
 }
 
 /*
@@ -150,22 +215,21 @@ int addr_perm(struct proc *p, const void *vaddr, int perm)
  */
 int range_perm(struct proc *p, const void *avaddr, size_t len, int perm)
 {
-	int i = addr_perm(p,avaddr,perm);
-	if(i){
-		uint32_t newaddr = *((uint32_t*)avaddr);
-	        vmarea_t *vma = NULL;
-	repeat:	vma = vmmap_lookup(p->p_vmmap, newaddr);
-		while(vma->vma_end >=newaddr && newaddr< *((uint32_t*)avaddr)+len){
-			newaddr +=+1;
-			}
-		
-		i = addr_perm(p,&newaddr, perm);
-		if(i&&newaddr< (*((uint32_t*)avaddr)+len-1))
-			goto repeat;
-	}
-
-	if(i)
-	dbg(DBG_VM,"INFO: The given address range 0x%x-0x%x has required permissions",*((uint32_t*)avaddr),*((uint32_t*)avaddr)+len);
-        /*NOT_YET_IMPLEMENTED("VM: ***none***");*/
-        return i;
+        uint32_t vfn, endvfn;
+        vmarea_t *vma;
+
+        if (0 == len) {
+                return 1;
+        }
+        vfn = ADDR_TO_PN(avaddr);
+        endvfn = ADDR_TO_PN((uintptr_t) avaddr + len - 1);
+        while (vfn <= endvfn) {
+                /* one check covers the rest of the area */
+                if (NULL == (vma = vmmap_lookup(p->p_vmmap, vfn))
+                    || perm != (vma->vma_prot & perm)) {
+                        return 0;
+                }
+                vfn = vma->vma_end;
+        }
+        return 1;
 }
@@ -19,8 +19,11 @@
 #include "mm/pframe.h"
 #include "mm/kmalloc.h"
 
+#include "fs/vfs.h"
 #include "fs/vfs_syscall.h"
 #include "fs/vnode.h"
+#include "fs/file.h"
+#include "fs/stat.h"
 
 #include "test/kshell/kshell.h"
 
@@ -30,6 +33,7 @@
 
 #include "api/syscall.h"
 #include "api/utsname.h"
+#include "api/resource.h"
 #include "api/access.h"
 #include "api/exec.h"
 
@@ -43,85 +47,106 @@ static __attribute__((unused)) void syscall_init(void)
 init_func(syscall_init);
 
 /*
- * this is one of the few sys_* functions you have to write. be sure to
- * check out the sys_* functions we have provided before trying to write
- * this one.
- *  - copy_from_user() the read_args_t
- *  - page_alloc() a temporary buffer
- *  - call do_read(), and copy_to_user() the read bytes
- *  - page_free() your buffer
- *  - return the number of bytes actually read, or if anything goes wrong
- *    set curthr->kt_errno and return -1
+ * read(2) and write(2) do I/O straight between the file and the frames
+ * behind the user's buffer, a page of the buffer at a time, rather than
+ * through a kernel bounce page: one copy instead of two, and no limit
+ * on how much is transferred in one call. The frames are found (and
+ * faulted in if need be) with vmmap_pin_user_page and stay pinned while
+ * the file system works on them.
+ *  - return the number of bytes actually transferred, or if anything
+ *    goes wrong before any were, set curthr->kt_errno and return -1
  */
 static int sys_read(read_args_t *arg)
 {
-	read_args_t reading;
-        if (copy_from_user(&reading, arg, sizeof(read_args_t)) < 0)     /* Copy from the user the read_args_t */
-        {
+        read_args_t reading;
+        size_t done = 0;
+        int regular, ret;
+        file_t *f;
+
+        if (copy_from_user(&reading, arg, sizeof(read_args_t)) < 0) {
                 curthr->kt_errno = EFAULT;
                 return -1;
         }
-        void *temporary_buffer = page_alloc();/* A temporary buffer */
-        
-        int no_of_bytes_read = do_read(reading.fd, temporary_buffer, reading.nbytes);      /* Calling do_read() */
-        if(no_of_bytes_read<0)
-        {
-                curthr->kt_errno = -no_of_bytes_read;
-                return -1;    
+        if (0 == reading.nbytes || NULL == (f = fget(reading.fd))) {
+                /* let do_read report a bad descriptor */
+                if ((ret = do_read(reading.fd, NULL, 0)) < 0) {
+                        curthr->kt_errno = -ret;
+                        return -1;
+                }
+                return 0;
+        }
+        regular = S_ISREG(f->f_vnode->vn_mode);
+        fput(f);
+
+        while (done < reading.nbytes) {
+                char *ubuf = (char *) reading.buf + done;
+                size_t n = MIN(reading.nbytes - done, PAGE_SIZE - PAGE_OFFSET(ubuf));
+                pframe_t *pf;
+
+                if ((ret = vmmap_pin_user_page(curproc->p_vmmap, ubuf, 1, &pf)) >= 0) {
+                        ret = do_read(reading.fd, (char *) pf->pf_addr + PAGE_OFFSET(ubuf), n);
+                        pframe_unpin(pf);
+                }
+                if (ret < 0) {
+                        if (0 < done) {
+                                break;
+                        }
+                        curthr->kt_errno = -ret;
+                        return -1;
+                }
+                done += ret;
+                /* stop at end of file; a terminal must not be asked for
+                 * more than the one read the caller made would have */
+                if ((size_t) ret < n || !regular) {
+                        break;
+                }
         }
-        
-        if (copy_to_user(arg->buf, temporary_buffer, no_of_bytes_read) < 0)   /* Copy to the user the read bytes */
-        {
-                curthr->kt_errno = EFAULT;
-                return -1;
-        }     
-        
-        page_free(temporary_buffer);	
-        /* page_free() the buffer */
-        
-        return(no_of_bytes_read);
-        /* Returns the no of bytes */
-        
-        /*NOT_YET_IMPLEMENTED("VM: sys_read");
-        return -1;*/
+        return (int) done;
 }
 
 /*
- * This function is almost identical to sys_read.  See comments above.
+ * This is almost identical to sys_read.  See comments above.
  */
 static int sys_write(write_args_t *arg)
 {
         write_args_t writing;
-        if (copy_from_user(&writing, arg, sizeof(write_args_t)) < 0)    /* Copy from the user the read_args_t */
-        {
-                curthr->kt_errno = EFAULT;
-                return -1;
-        }
-        
-        void *temporary_buffer = page_alloc();                  
-             /* A temporary buffer */
-        if (copy_from_user(temporary_buffer, arg->buf, writing.nbytes) < 0) 
-        {
+        size_t done = 0;
+        int ret;
+
+        if (copy_from_user(&writing, arg, sizeof(write_args_t)) < 0) {
                 curthr->kt_errno = EFAULT;
                 return -1;
         }
-    
-        int no_of_bytes_write = do_write(writing.fd, temporary_buffer, writing.nbytes);     /* Calling do_write() */
-        
-        if(no_of_bytes_write<0)
-        {
-                curthr->kt_errno = -no_of_bytes_write;
-                return -1;    
+        if (0 == writing.nbytes) {
+                if ((ret = do_write(writing.fd, NULL, 0)) < 0) {
+                        curthr->kt_errno = -ret;
+                        return -1;
+                }
+                return 0;
+        }
+
+        while (done < writing.nbytes) {
+                const char *ubuf = (const char *) writing.buf + done;
+                size_t n = MIN(writing.nbytes - done, PAGE_SIZE - PAGE_OFFSET(ubuf));
+                pframe_t *pf;
+
+                if ((ret = vmmap_pin_user_page(curproc->p_vmmap, ubuf, 0, &pf)) >= 0) {
+                        ret = do_write(writing.fd, (char *) pf->pf_addr + PAGE_OFFSET(ubuf), n);
+                        pframe_unpin(pf);
+                }
+                if (ret < 0) {
+                        if (0 < done) {
+                                break;
+                        }
+                        curthr->kt_errno = -ret;
+                        return -1;
+                }
+                done += ret;
+                if ((size_t) ret < n) {
+                        break;
+                }
         }
-        
-        page_free(temporary_buffer); 
-        /* page_free() the buffer */
-        
-        return (no_of_bytes_write);	
-        /* Returns the no of bytes 
-        
-        NOT_YET_IMPLEMENTED("VM: sys_write");
-        return -1;*/
+        return (int) done;
 }
 
 /*
@@ -503,6 +528,24 @@ static int sys_munmap(munmap_args_t *args)
         return 0;
 }
 
+static int sys_madvise(madvise_args_t *args)
+{
+        madvise_args_t          kargs;
+        int                     err;
+
+        if (copy_from_user(&kargs, args, sizeof(madvise_args_t))) {
+                curthr->kt_errno = EFAULT;
+                return -1;
+        }
+
+        err = do_madvise(kargs.addr, kargs.len, kargs.advice);
+        if (err < 0) {
+                curthr->kt_errno = -err;
+                return -1;
+        }
+        return 0;
+}
+
 static void *sys_mmap(mmap_args_t *arg)
 {
         mmap_args_t             kargs;
@@ -562,6 +605,7 @@ static void *sys_brk(void *addr)
 
 static void sys_sync(void)
 {
+        vfs_sync();
         pframe_clean_all();
 }
 
@@ -639,6 +683,27 @@ err:
         return -1;
 }
 
+static int sys_getrusage(getrusage_args_t *arg)
+{
+        getrusage_args_t kern_args;
+        struct rusage usage;
+        int ret;
+
+        if ((ret = copy_from_user(&kern_args, arg, sizeof(kern_args))) < 0) {
+                goto err;
+        }
+        if ((ret = do_getrusage(kern_args.who, &usage)) < 0) {
+                goto err;
+        }
+        if ((ret = copy_to_user(kern_args.usage, &usage, sizeof(usage))) < 0) {
+                goto err;
+        }
+        return 0;
+err:
+        curthr->kt_errno = -ret;
+        return -1;
+}
+
 static int sys_fork(regs_t *regs)
 {
         int ret = do_fork(regs);
@@ -821,6 +886,9 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_munmap:
                         return sys_munmap((munmap_args_t *) args);
 
+                case SYS_madvise:
+                        return sys_madvise((madvise_args_t *) args);
+
                 case SYS_open:
                         return sys_open((open_args_t *) args);
 
@@ -886,6 +954,9 @@ static int syscall_dispatch(uint32_t sysnum, uint32_t args, regs_t *regs)
                 case SYS_uname:
                         return sys_uname((struct utsname *)args);
 
+                case SYS_getrusage:
+                        return sys_getrusage((getrusage_args_t *)args);
+
                 case SYS_debug:
                         return sys_debug((argstr_t *)args);
                 case SYS_kshell:
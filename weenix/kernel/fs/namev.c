@@ -24,6 +24,10 @@
 #include "util/string.h"
 #include "util/printf.h"
 #include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "mm/slab.h"
 
 #include "fs/dirent.h"
 #include "fs/fcntl.h"
@@ -31,10 +35,163 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 
+/*
+ * The name cache remembers what the filesystems' lookup() found for
+ * (directory, name), and also which names were not there, so that
+ * resolving a path does not go through the filesystem (for s5fs, a
+ * read of every block of the directory) for every component every
+ * time. Entries refer to the directory and the child by vno rather
+ * than by vnode pointer so that they keep nothing in core; a hit is
+ * turned back into a vnode with vget(). Whoever adds or removes a
+ * directory entry must call dcache_invalidate() for its name (see
+ * vfs_syscall.c).
+ */
+typedef struct dentry {
+        list_link_t     d_link;         /* hash chain */
+        list_link_t     d_lrulink;      /* on dcache_lru */
+        struct fs      *d_fs;
+        ino_t           d_dir;
+        ino_t           d_vno;          /* DCACHE_NEGATIVE if not there */
+        size_t          d_namelen;
+        char            d_name[NAME_LEN];
+} dentry_t;
+
+#define DCACHE_NEGATIVE ((ino_t) -1)
+
+#define DCACHE_HASH_SIZE (DCACHE_MAX / 4 + 1)
+
+static slab_allocator_t *dentry_allocator;
+static list_t dcache_hash[DCACHE_HASH_SIZE];
+
+/* All entries, least recently used first */
+static list_t dcache_lru;
+static int dcache_count = 0;
+
+/* Bumped whenever an entry is thrown away, so that a lookup which
+ * blocked in the filesystem can tell it may be about to cache a name
+ * that has changed under it */
+static uint32_t dcache_gen = 0;
+
+static __attribute__((unused)) void
+dcache_init(void)
+{
+        int i;
+        for (i = 0; i < DCACHE_HASH_SIZE; ++i)
+                list_init(&dcache_hash[i]);
+        list_init(&dcache_lru);
+        dentry_allocator = slab_allocator_create("dentry", sizeof(dentry_t));
+        KASSERT(NULL != dentry_allocator);
+}
+init_func(dcache_init);
+
+static list_t *
+dcache_bucket(struct fs *fs, ino_t dir, const char *name, size_t len)
+{
+        uint32_t h = ((uint32_t) fs >> 4) ^ (uint32_t) dir * 31;
+        size_t i;
+
+        for (i = 0; i < len; ++i)
+                h = h * 33 + (unsigned char) name[i];
+        return &dcache_hash[h % DCACHE_HASH_SIZE];
+}
+
+static dentry_t *
+dcache_find(struct fs *fs, ino_t dir, const char *name, size_t len)
+{
+        dentry_t *d;
+
+        list_iterate_begin(dcache_bucket(fs, dir, name, len), d, dentry_t, d_link) {
+                if (d->d_fs == fs && d->d_dir == dir && d->d_namelen == len
+                    && 0 == memcmp(d->d_name, name, len))
+                        return d;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+dcache_free(dentry_t *d)
+{
+        list_remove(&d->d_link);
+        list_remove(&d->d_lrulink);
+        slab_obj_free(dentry_allocator, d);
+        dcache_count--;
+        dcache_gen++;
+}
+
+static void
+dcache_enter(vnode_t *dir, const char *name, size_t len, ino_t vno)
+{
+        dentry_t *d;
+
+        KASSERT(len <= NAME_LEN);
+        if (0 >= DCACHE_MAX)
+                return;
+        KASSERT(NULL == dcache_find(dir->vn_fs, dir->vn_vno, name, len));
+
+        if (dcache_count >= DCACHE_MAX
+            || NULL == (d = slab_obj_alloc(dentry_allocator))) {
+                /* reuse the oldest entry */
+                if (list_empty(&dcache_lru))
+                        return;
+                d = list_head(&dcache_lru, dentry_t, d_lrulink);
+                list_remove(&d->d_link);
+                list_remove(&d->d_lrulink);
+                dcache_count--;
+        }
+
+        d->d_fs = dir->vn_fs;
+        d->d_dir = dir->vn_vno;
+        d->d_vno = vno;
+        d->d_namelen = len;
+        memcpy(d->d_name, name, len);
+        list_insert_head(dcache_bucket(d->d_fs, d->d_dir, name, len), &d->d_link);
+        list_insert_tail(&dcache_lru, &d->d_lrulink);
+        dcache_count++;
+}
+
+/* Forgets whatever the cache knows about 'name' in 'dir'. Call it
+ * after any operation that may have added or removed the name. */
+void
+dcache_invalidate(vnode_t *dir, const char *name, size_t len)
+{
+        dentry_t *d;
+
+        dcache_gen++;
+        if (len <= NAME_LEN
+            && NULL != (d = dcache_find(dir->vn_fs, dir->vn_vno, name, len)))
+                dcache_free(d);
+}
+
+/* Forgets every name cached in 'dir', which is about to go away (its
+ * vno may be given to a new directory) */
+void
+dcache_purge_dir(vnode_t *dir)
+{
+        dentry_t *d;
+
+        list_iterate_begin(&dcache_lru, d, dentry_t, d_lrulink) {
+                if (d->d_fs == dir->vn_fs && d->d_dir == dir->vn_vno)
+                        dcache_free(d);
+        } list_iterate_end();
+}
+
+/* Forgets every name cached for 'fs', which is being unmounted */
+void
+dcache_purge(fs_t *fs)
+{
+        dentry_t *d;
+
+        list_iterate_begin(&dcache_lru, d, dentry_t, d_lrulink) {
+                if (d->d_fs == fs)
+                        dcache_free(d);
+        } list_iterate_end();
+}
+
 /* This takes a base 'dir', a 'name', its 'len', and a result vnode.
- * Most of the work should be done by the vnode's implementation
- * specific lookup() function, but you may want to special case
- * "." and/or ".." here depnding on your implementation.
+ * Most of the work is done by the vnode's implementation specific
+ * lookup() function; what it finds (or does not find) is remembered
+ * in the name cache. "." is answered here. ".." always goes to the
+ * filesystem, which is how a mount point is crossed on the way up.
  *
  * If dir has no lookup(), return -ENOTDIR.
  *
@@ -43,24 +200,45 @@
 int
 lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
 {
-		if (!dir || dir->vn_mode != S_IFDIR || dir->vn_ops->lookup == NULL) {
-			return -ENOTDIR;
-		}
-
-		int ret;
-
-		/* . and .. need to be finished */
-        if (!strcmp(name, ".")) {
-			ret = 0;
-		}
-		else if (!strcmp(name, "..")) {
-			ret = 0;
-		}
-		else {
-			ret = dir->vn_ops->lookup(dir, name, len, result);
-		}
-		
-		return ret;
+        dentry_t *d;
+        uint32_t gen;
+        int ret;
+
+        KASSERT(NULL != dir && NULL != name && NULL != result);
+        if (!S_ISDIR(dir->vn_mode) || NULL == dir->vn_ops->lookup)
+                return -ENOTDIR;
+        if (len > NAME_LEN)
+                return -ENAMETOOLONG;
+
+        if (1 == len && '.' == name[0]) {
+                vref(dir);
+                *result = dir;
+                return 0;
+        }
+        if (2 == len && '.' == name[0] && '.' == name[1])
+                return dir->vn_ops->lookup(dir, name, len, result);
+
+        if (NULL != (d = dcache_find(dir->vn_fs, dir->vn_vno, name, len))) {
+                list_remove(&d->d_lrulink);
+                list_insert_tail(&dcache_lru, &d->d_lrulink);
+                if (DCACHE_NEGATIVE == d->d_vno)
+                        return -ENOENT;
+                *result = vget(dir->vn_fs, d->d_vno);
+                return 0;
+        }
+
+        gen = dcache_gen;
+        ret = dir->vn_ops->lookup(dir, name, len, result);
+        /* the filesystem may have blocked, and someone else may have
+         * entered or removed the name meanwhile */
+        if (gen != dcache_gen || NULL != dcache_find(dir->vn_fs, dir->vn_vno, name, len))
+                return ret;
+
+        if (0 == ret && (*result)->vn_fs == dir->vn_fs)
+                dcache_enter(dir, name, len, (*result)->vn_vno);
+        else if (-ENOENT == ret)
+                dcache_enter(dir, name, len, DCACHE_NEGATIVE);
+        return ret;
 }
 
 
@@ -79,6 +257,8 @@ lookup(vnode_t *dir, const char *name, size_t len, vnode_t **result)
  * vfs_root_vn.  dir_namev() should call lookup() to take care of resolving each
  * piece of the pathname.
  *
+ * A path with no basename, such as "/", gives a namelen of 0.
+ *
  * Note: A successful call to this causes vnode refcount on *res_vnode to
  * be incremented.
  */
@@ -86,69 +266,58 @@ int
 dir_namev(const char *pathname, size_t *namelen, const char **name,
           vnode_t *base, vnode_t **res_vnode)
 {
-		if (strlen(pathname) > MAXPATHLEN) {
-			return -ENAMETOOLONG;
-		}
-		if (!strlen(pathname)) {
-			return -EINVAL;
-		}
-		
-		/* Set **res_vnode */
-		vnode_t *ptr, *temp;
-		int ret, len;
-		char *child = (char *)pathname, *parent = (char *)pathname;
-		if (*pathname == '/') {
-			ptr = vfs_root_vn;
-			parent++;
-			child++;
-		} else if (!base) {
-			ptr = curproc->p_cwd;
-		} else {
-			ptr = base;
-		}
-
-		vref(ptr);
-		
-		while (1) {
-			if (!ptr) {
-				return -ENOENT;
-			}
-			if (!S_ISDIR(ptr->vn_mode)) {
-				vput(ptr);
-				return -ENOTDIR;
-			}
-
-			child = strchr(parent, '/');
-			len = child - parent;
-
-			if (len > NAME_LEN) {
-				vput(ptr);
-				return -ENAMETOOLONG;
-			}
-			
-			while (*child == '/') {
-				child++;
-			}
-
-			if (*child == '\0' || !child) {
-				break;
-			}
-
-			ret = lookup(ptr, parent, len, &temp);
-			vput(ptr);
-			if (!ret) {
-				ptr = temp;
-				parent = child;
-			} else {
-				return ret;
-			}
-		}
-
-		*namelen = len;
-		*name = parent;
-		*res_vnode = ptr;
-		
-		return 0;
+        vnode_t *dir, *next;
+        const char *comp, *end;
+        size_t len;
+        int ret;
+
+        KASSERT(NULL != pathname);
+        if ('\0' == *pathname)
+                return -EINVAL;
+        if (strlen(pathname) > MAXPATHLEN)
+                return -ENAMETOOLONG;
+
+        if ('/' == *pathname)
+                dir = vfs_root_vn;
+        else if (NULL == base)
+                dir = curproc->p_cwd;
+        else
+                dir = base;
+        vref(dir);
+
+        comp = pathname;
+        while ('/' == *comp)
+                comp++;
+        while (1) {
+                for (end = comp; '\0' != *end && '/' != *end; ++end)
+                        ;
+                len = end - comp;
+                while ('/' == *end)
+                        end++;
+                if (len > NAME_LEN) {
+                        vput(dir);
+                        return -ENAMETOOLONG;
+                }
+                if ('\0' == *end)
+                        break;
+
+                ret = lookup(dir, comp, len, &next);
+                vput(dir);
+                if (0 > ret)
+                        return ret;
+                dir = next;
+                comp = end;
+        }
+
+        if (!S_ISDIR(dir->vn_mode)) {
+                vput(dir);
+                return -ENOTDIR;
+        }
+
+        *namelen = len;
+        *name = comp;
+        *res_vnode = dir;
+        return 0;
 }
 
 /* This returns in res_vnode the vnode requested by the other parameters.
@@ -162,34 +331,26 @@ dir_namev(const char *pathname, size_t *namelen, const char **name,
 int
 open_namev(const char *pathname, int flag, vnode_t **res_vnode, vnode_t *base)
 {
-        /*************** kernel 2 ***************/
         size_t namelen;
-		const char *name;
-		vnode_t *temp;
-		int base_ret = dir_namev(pathname, &namelen, &name, base, res_vnode);
-		if (!base_ret) {
-			return base_ret;
-		}
-
-		if (!S_ISDIR((*res_vnode)->vn_mode)) {
-			vput(*res_vnode);
-			return -ENOTDIR;
-		}
-
-		int lookup_ret = lookup(*res_vnode, name, namelen, &temp);
-		if (!lookup_ret) {
-			if (flag & O_CREAT) {
-				int create_ret = (*res_vnode)->vn_ops->create(*res_vnode, name, namelen, res_vnode);
-				if (!create_ret) {
-					return create_ret;
-				}
-			}
-		} else {
-			*res_vnode = temp;
-		}
-
-		return 0;
-		/*************** kernel 2 ***************/
+        const char *name;
+        vnode_t *dir;
+        int ret;
+
+        if (0 > (ret = dir_namev(pathname, &namelen, &name, base, &dir)))
+                return ret;
+        if (0 == namelen) {
+                *res_vnode = dir;
+                return 0;
+        }
+
+        ret = lookup(dir, name, namelen, res_vnode);
+        if (-ENOENT == ret && (flag & O_CREAT)) {
+                KASSERT(NULL != dir->vn_ops->create);
+                ret = dir->vn_ops->create(dir, name, namelen, res_vnode);
+                dcache_invalidate(dir, name, namelen);
+        }
+        vput(dir);
+        return ret;
 }
 
 #ifdef __GETCWD__
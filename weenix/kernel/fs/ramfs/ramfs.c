@@ -168,7 +168,7 @@ ramfs_alloc_inode(fs_t *fs, int type, devid_t devid)
                                         kfree(inode);
                                         return -ENOSPC;
                                 }
-                                memset(inode->rf_mem, 0, PAGE_SIZE);
+                                page_zero(inode->rf_mem);
                         }
                         inode->rf_size = 0;
                         inode->rf_ino = i;
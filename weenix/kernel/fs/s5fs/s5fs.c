@@ -17,6 +17,8 @@
 
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_fsck.h"
 #include "fs/dirent.h"
 #include "fs/vfs.h"
 #include "fs/vnode.h"
@@ -27,6 +29,7 @@
 #include "drivers/blockdev.h"
 
 #include "mm/kmalloc.h"
+#include "mm/page.h"
 #include "mm/pframe.h"
 #include "mm/mmobj.h"
 #include "mm/mm.h"
@@ -38,12 +41,14 @@
 /* Diagnostic/Utility: */
 static int s5_check_super(s5_super_t *super);
 static int s5fs_check_refcounts(fs_t *fs);
+static void s5fs_fix_linkcounts(fs_t *fs);
 
 /* fs_t entry points: */
 static void s5fs_read_vnode(vnode_t *vnode);
 static void s5fs_delete_vnode(vnode_t *vnode);
 static int  s5fs_query_vnode(vnode_t *vnode);
 static int  s5fs_umount(fs_t *fs);
+static int  s5fs_sync(fs_t *fs);
 
 /* vnode_t entry points: */
 static int  s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len);
@@ -66,7 +71,8 @@ fs_ops_t s5fs_fsops = {
         s5fs_read_vnode,
         s5fs_delete_vnode,
         s5fs_query_vnode,
-        s5fs_umount
+        s5fs_umount,
+        s5fs_sync
 };
 
 /* vnode operations table for directory files: */
@@ -114,12 +120,17 @@ static vnode_ops_t s5fs_file_vops = {
  * verify the superblock (using s5_check_super()).  Use vget() to get
  * the root vnode for fs_root.
  *
+ * A journaled fs has its journal replayed before anything else is read.
+ * A version 4 fs is marked dirty on disk until it is unmounted, and
+ * one that was dirty already has its link counts fixed and is checked
+ * in the background (see s5fs_fsck.c).
+ *
  * Return 0 on success, negative on failure.
  */
 int
 s5fs_mount(struct fs *fs)
 {
-        int num;
+        int num, err;
         blockdev_t *dev;
         s5fs_t *s5;
         pframe_t *vp;
@@ -139,6 +150,9 @@ s5fs_mount(struct fs *fs)
 
         if (!s5)
                 return -ENOMEM;
+        memset(s5, 0, sizeof(s5fs_t));
+        for (num = 0; num < S5_NPREALLOC; ++num)
+                s5->s5f_prealloc[num].s5p_ino = (uint32_t) -1;
 
         /*     init s5f_disk: */
         s5->s5f_bdev  = dev;
@@ -156,8 +170,61 @@ s5fs_mount(struct fs *fs)
                 return -EINVAL;
         }
 
+        if (S5_CURRENT_VERSION == s5->s5f_super->s5s_version) {
+                if (0 > (err = s5_journal_recover(s5))
+                    || 0 > (err = dev->bd_ops->read_block(dev, vp->pf_addr,
+                                                          S5_SUPER_BLOCK, 1))) {
+                        kfree(s5);
+                        return err;
+                }
+                if (s5_check_super(s5->s5f_super)) {
+                        kfree(s5);
+                        return -EINVAL;
+                }
+        }
+
+        if (S5_CURRENT_VERSION == s5->s5f_super->s5s_version) {
+                s5->s5f_unchecked = (S5_STATE_CLEAN != s5->s5f_super->s5s_state);
+                s5->s5f_super->s5s_state = S5_STATE_DIRTY;
+                if (0 > (err = dev->bd_ops->write_block(dev, vp->pf_addr,
+                                                        S5_SUPER_BLOCK, 1))) {
+                        kfree(s5);
+                        return err;
+                }
+        }
+
         pframe_pin(vp);
 
+        /*     keep the inode bitmap in memory: */
+        if (S5_CURRENT_VERSION == s5->s5f_super->s5s_version) {
+                s5->s5f_ibitmap = (pframe_t **)kmalloc(
+                        s5->s5f_super->s5s_ibitmap_nblocks * sizeof(pframe_t *));
+                if (!s5->s5f_ibitmap) {
+                        pframe_unpin(vp);
+                        kfree(s5);
+                        return -ENOMEM;
+                }
+                for (num = 0; num < (int)s5->s5f_super->s5s_ibitmap_nblocks; ++num) {
+                        pframe_get(S5FS_TO_VMOBJ(s5),
+                                   s5->s5f_super->s5s_ibitmap_block + num,
+                                   &s5->s5f_ibitmap[num]);
+                        KASSERT(s5->s5f_ibitmap[num]);
+                        pframe_pin(s5->s5f_ibitmap[num]);
+                }
+        }
+
+        if (S5_CURRENT_VERSION == s5->s5f_super->s5s_version
+            && 0 > (err = s5_journal_open(s5))) {
+                if (s5->s5f_ibitmap) {
+                        for (num = 0; num < (int)s5->s5f_super->s5s_ibitmap_nblocks; ++num)
+                                pframe_unpin(s5->s5f_ibitmap[num]);
+                        kfree(s5->s5f_ibitmap);
+                }
+                pframe_unpin(vp);
+                kfree(s5);
+                return err;
+        }
+
         /*     init s5f_mutex: */
         kmutex_init(&s5->s5f_mutex);
 
@@ -171,6 +238,16 @@ s5fs_mount(struct fs *fs)
         fs->fs_op = &s5fs_fsops;
         fs->fs_root = vget(fs, s5->s5f_super->s5s_root_inode);
 
+        if (s5->s5f_unchecked) {
+                s5fs_fix_linkcounts(fs);
+                if (0 > s5_fsck_start(s5)) {
+                        dbg(DBG_PRINT, "s5fs_mount: no memory to check the fs on "
+                            "block device with major %d and minor %d, which was "
+                            "not unmounted cleanly\n", MAJOR(dev->bd_id),
+                            MINOR(dev->bd_id));
+                }
+        }
+
         return 0;
 }
 
@@ -208,7 +285,48 @@ s5fs_mount(struct fs *fs)
 static void
 s5fs_read_vnode(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_read_vnode");
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode;
+        pframe_t *p;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(vnode->vn_vno), &p);
+        KASSERT(p && "shouldn\'t fail for a page belonging to a block device");
+        pframe_pin(p);
+
+        inode = (s5_inode_t *)p->pf_addr + S5_INODE_OFFSET(vnode->vn_vno);
+        KASSERT(inode->s5_number == vnode->vn_vno);
+
+        /* the link is only there while the vnode is: if the fs is not
+         * unmounted cleanly, s5fs_fix_linkcounts() takes it off */
+        inode->s5_linkcount++;
+        s5_dirty_inode(fs, inode);
+
+        vnode->vn_i = inode;
+        vnode->vn_len = inode->s5_size;
+
+        switch (S5_INODE_TYPE(inode)) {
+                case S5_TYPE_DATA:
+                        vnode->vn_mode = S_IFREG;
+                        vnode->vn_ops = &s5fs_file_vops;
+                        break;
+                case S5_TYPE_DIR:
+                        vnode->vn_mode = S_IFDIR;
+                        vnode->vn_ops = &s5fs_dir_vops;
+                        break;
+                case S5_TYPE_CHR:
+                        vnode->vn_mode = S_IFCHR;
+                        vnode->vn_devid = inode->s5_indirect_block;
+                        vnode->vn_len = 0;
+                        break;
+                case S5_TYPE_BLK:
+                        vnode->vn_mode = S_IFBLK;
+                        vnode->vn_devid = inode->s5_indirect_block;
+                        vnode->vn_len = 0;
+                        break;
+                default:
+                        panic("s5fs_read_vnode: inode %d has bad type %d\n",
+                              vnode->vn_vno, inode->s5_type);
+        }
 }
 
 /*
@@ -218,11 +336,28 @@ s5fs_read_vnode(vnode_t *vnode)
  *
  * You probably want to use s5_free_inode() if there are no more links to
  * the inode, and dont forget to unpin the page
+ *
+ * vput() gets here both with a journal handle open (removing a name)
+ * and without one (closing a file), so this cannot take one: the
+ * change goes to the running transaction either way.
  */
 static void
 s5fs_delete_vnode(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_delete_vnode");
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *p;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(vnode->vn_vno), &p);
+        KASSERT(p && (s5_inode_t *)p->pf_addr + S5_INODE_OFFSET(vnode->vn_vno) == inode);
+
+        KASSERT(0 < inode->s5_linkcount);
+        if (0 == --inode->s5_linkcount)
+                s5_free_inode(vnode);
+        else
+                s5_dirty_inode(fs, inode);
+
+        pframe_unpin(p);
 }
 
 /*
@@ -235,13 +370,15 @@ s5fs_delete_vnode(vnode_t *vnode)
 static int
 s5fs_query_vnode(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_query_vnode");
-        return 0;
+        return 1 < VNODE_TO_S5INODE(vnode)->s5_linkcount;
 }
 
 /*
  * s5fs_check_refcounts()
  * vput root vnode
+ *
+ * The superblock is marked clean last, once everything else is on
+ * disk, unless the fs has yet to be checked.
  */
 static int
 s5fs_umount(fs_t *fs)
@@ -249,8 +386,11 @@ s5fs_umount(fs_t *fs)
         s5fs_t *s5 = (s5fs_t *)fs->fs_i;
         blockdev_t *bd = s5->s5f_bdev;
         pframe_t *sbp;
+        char *clean = NULL;
         int ret;
 
+        s5_fsck_stop(s5);
+
         if (s5fs_check_refcounts(fs)) {
                 dbg(DBG_PRINT, "s5fs_umount: WARNING: linkcount corruption "
                     "discovered in fs on block device with major %d "
@@ -262,10 +402,27 @@ s5fs_umount(fs_t *fs)
                     "and minor %d!!\n", MAJOR(bd->bd_id), MINOR(bd->bd_id));
         }
 
+        s5_journal_start(s5);
+        s5_drop_prealloc(fs, (uint32_t) -1);
+        s5_journal_stop(s5);
+
+        /* let go of the directories the running transaction holds */
+        s5_journal_commit(s5);
+
         vnode_flush_all(fs);
 
         vput(fs->fs_root);
 
+        s5_journal_close(s5);
+
+        if (s5->s5f_ibitmap) {
+                uint32_t i;
+
+                for (i = 0; i < s5->s5f_super->s5s_ibitmap_nblocks; ++i)
+                        pframe_unpin(s5->s5f_ibitmap[i]);
+                kfree(s5->s5f_ibitmap);
+        }
+
         if (0 > (ret = pframe_get(S5FS_TO_VMOBJ(s5), S5_SUPER_BLOCK, &sbp))) {
                 panic("s5fs_umount: failed to pframe_get super block. "
                       "This should never happen (the page should already "
@@ -276,16 +433,40 @@ s5fs_umount(fs_t *fs)
 
         KASSERT(sbp);
 
+        if (S5_CURRENT_VERSION == s5->s5f_super->s5s_version
+            && !s5->s5f_unchecked && NULL != (clean = (char *)page_alloc())) {
+                memcpy(clean, sbp->pf_addr, S5_BLOCK_SIZE);
+                ((s5_super_t *)clean)->s5s_state = S5_STATE_CLEAN;
+        }
+
         pframe_unpin(sbp);
 
         kfree(s5);
 
         blockdev_flush_all(bd);
 
+        if (NULL != clean) {
+                if (0 > (ret = bd->bd_ops->write_block(bd, clean, S5_SUPER_BLOCK, 1))) {
+                        dbg(DBG_PRINT, "s5fs_umount: WARNING: failed to mark "
+                            "the fs on block device with major %d and minor "
+                            "%d clean (errno %d)\n", MAJOR(bd->bd_id),
+                            MINOR(bd->bd_id), -ret);
+                }
+                page_free(clean);
+        }
+
         return 0;
 }
 
-
+/*
+ * Commits the running transaction, so its blocks are no longer pinned
+ * and sync() can write them home.
+ */
+static int
+s5fs_sync(fs_t *fs)
+{
+        return s5_journal_commit(FS_TO_S5FS(fs));
+}
 
 
 /* Implementation of vnode_t entry points: */
@@ -310,6 +491,10 @@ s5fs_umount(fs_t *fs)
  * Finally, you should read and understand the basic overview of
  * the s5fs_subr functions. All of the following functions might delegate,
  * and it will make your life easier if you know what is going on.
+ *
+ * Functions which change metadata do it between s5_journal_start() and
+ * s5_journal_stop(), started before locking any vnode mutex, and log at
+ * most S5_JOURNAL_RESERVE blocks in between.
  */
 
 
@@ -317,16 +502,34 @@ s5fs_umount(fs_t *fs)
 static int
 s5fs_read(vnode_t *vnode, off_t offset, void *buf, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_read");
-        return -1;
+        int ret;
+
+        kmutex_lock(&vnode->vn_mutex);
+        ret = s5_read_file(vnode, offset, buf, len);
+        kmutex_unlock(&vnode->vn_mutex);
+        return ret;
 }
 
-/* Simply call s5_write_file. */
+/* Simply call s5_write_file, a journal handle's worth at a time. */
 static int
 s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_write");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        size_t done = 0, n;
+        int ret;
+
+        do {
+                n = MIN(len - done, (size_t)S5_JOURNAL_WRITE_MAX);
+                s5_journal_start(fs);
+                kmutex_lock(&vnode->vn_mutex);
+                ret = s5_write_file(vnode, offset + done,
+                                    (const char *)buf + done, n);
+                kmutex_unlock(&vnode->vn_mutex);
+                s5_journal_stop(fs);
+                if (0 < ret)
+                        done += ret;
+        } while ((size_t)ret == n && done < len);
+        return done ? (int)done : ret;
 }
 
 /* This function is deceptivly simple, just return the vnode's
@@ -338,9 +541,8 @@ s5fs_write(vnode_t *vnode, off_t offset, const void *buf, size_t len)
 static int
 s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
 {
-		
-		NOT_YET_IMPLEMENTED("VM: s5fs_mmap");
-
+        /* vmmap_map() takes the reference for the area's shadow object */
+        *ret = &file->vn_mmobj;
         return 0;
 }
 
@@ -355,8 +557,37 @@ s5fs_mmap(vnode_t *file, vmarea_t *vma, mmobj_t **ret)
 static int
 s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_create");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        vnode_t *child;
+        int ino, ret;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+
+        s5_journal_start(fs);
+        kmutex_lock(&dir->vn_mutex);
+
+        if (0 > (ino = s5_alloc_inode(dir->vn_fs, S5_TYPE_DATA, 0, dir->vn_vno))) {
+                ret = ino;
+                goto out;
+        }
+        child = vget(dir->vn_fs, ino);
+        KASSERT(child && 1 == VNODE_TO_S5INODE(child)->s5_linkcount);
+
+        if (0 > (ret = s5_link(dir, child, name, namelen))) {
+                /* the inode is freed as the vnode goes */
+                vput(child);
+                goto out;
+        }
+        KASSERT(2 == VNODE_TO_S5INODE(child)->s5_linkcount);
+        *result = child;
+
+out:
+        kmutex_unlock(&dir->vn_mutex);
+        s5_journal_stop(fs);
+        return ret;
 }
 
 
@@ -371,8 +602,38 @@ s5fs_create(vnode_t *dir, const char *name, size_t namelen, vnode_t **result)
 static int
 s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t devid)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_mknod");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        vnode_t *child;
+        uint16_t type;
+        int ino, ret;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        if (S_ISCHR(mode))
+                type = S5_TYPE_CHR;
+        else if (S_ISBLK(mode))
+                type = S5_TYPE_BLK;
+        else
+                return -EINVAL;
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+
+        s5_journal_start(fs);
+        kmutex_lock(&dir->vn_mutex);
+
+        if (0 > (ino = s5_alloc_inode(dir->vn_fs, type, devid, dir->vn_vno))) {
+                ret = ino;
+                goto out;
+        }
+        child = vget(dir->vn_fs, ino);
+        KASSERT(child);
+        ret = s5_link(dir, child, name, namelen);
+        vput(child);
+
+out:
+        kmutex_unlock(&dir->vn_mutex);
+        s5_journal_stop(fs);
+        return ret;
 }
 
 /*
@@ -383,8 +644,22 @@ s5fs_mknod(vnode_t *dir, const char *name, size_t namelen, int mode, devid_t dev
 int
 s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_lookup");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(base);
+        int ino;
+
+        KASSERT(S_ISDIR(base->vn_mode));
+
+        /* a handle, as vget() may bring the inode in (and count a link) */
+        s5_journal_start(fs);
+        kmutex_lock(&base->vn_mutex);
+        ino = s5_find_dirent(base, name, namelen);
+        kmutex_unlock(&base->vn_mutex);
+        if (0 <= ino) {
+                *result = vget(base->vn_fs, ino);
+                KASSERT(*result);
+        }
+        s5_journal_stop(fs);
+        return (0 > ino) ? ino : 0;
 }
 
 /*
@@ -398,8 +673,18 @@ s5fs_lookup(vnode_t *base, const char *name, size_t namelen, vnode_t **result)
 static int
 s5fs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_link");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        int ret;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+        KASSERT(src->vn_fs == dir->vn_fs);
+
+        s5_journal_start(fs);
+        kmutex_lock(&dir->vn_mutex);
+        ret = s5_link(dir, src, name, namelen);
+        kmutex_unlock(&dir->vn_mutex);
+        s5_journal_stop(fs);
+        return ret;
 }
 
 /*
@@ -413,8 +698,17 @@ s5fs_link(vnode_t *src, vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_unlink");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        int ret;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        s5_journal_start(fs);
+        kmutex_lock(&dir->vn_mutex);
+        ret = s5_remove_dirent(dir, name, namelen);
+        kmutex_unlock(&dir->vn_mutex);
+        s5_journal_stop(fs);
+        return ret;
 }
 
 /*
@@ -438,8 +732,54 @@ s5fs_unlink(vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_mkdir");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(dir);
+        s5_inode_t *parent = VNODE_TO_S5INODE(dir);
+        vnode_t *child;
+        int ino, ret;
+
+        KASSERT(S_ISDIR(dir->vn_mode));
+
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+
+        s5_journal_start(fs);
+        kmutex_lock(&dir->vn_mutex);
+
+        if (-ENOENT != (ret = s5_find_dirent(dir, name, namelen))) {
+                if (0 <= ret)
+                        ret = -EEXIST;
+                goto out;
+        }
+        if (0 > (ino = s5_alloc_inode(dir->vn_fs, S5_TYPE_DIR, 0, dir->vn_vno))) {
+                ret = ino;
+                goto out;
+        }
+        child = vget(dir->vn_fs, ino);
+        KASSERT(child && S_ISDIR(child->vn_mode));
+        KASSERT(1 == VNODE_TO_S5INODE(child)->s5_linkcount);
+
+        /* "." does not count as a link */
+        if (0 > (ret = s5_link(child, child, ".", 1)))
+                goto put;
+        VNODE_TO_S5INODE(child)->s5_linkcount--;
+        s5_dirty_inode(fs, VNODE_TO_S5INODE(child));
+
+        if (0 > (ret = s5_link(child, dir, "..", 2)))
+                goto put;
+        if (0 > (ret = s5_link(dir, child, name, namelen))) {
+                parent->s5_linkcount--;
+                s5_dirty_inode(fs, parent);
+                goto put;
+        }
+        KASSERT(2 == VNODE_TO_S5INODE(child)->s5_linkcount);
+
+put:
+        /* if it was not linked in, the inode is freed as the vnode goes */
+        vput(child);
+out:
+        kmutex_unlock(&dir->vn_mutex);
+        s5_journal_stop(fs);
+        return ret;
 }
 
 /*
@@ -455,8 +795,45 @@ s5fs_mkdir(vnode_t *dir, const char *name, size_t namelen)
 static int
 s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_rmdir");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(parent);
+        s5_inode_t *pinode = VNODE_TO_S5INODE(parent);
+        vnode_t *child;
+        int ino, ret;
+
+        KASSERT(S_ISDIR(parent->vn_mode));
+
+        if (name_match(".", name, namelen))
+                return -EINVAL;
+        if (name_match("..", name, namelen))
+                return -ENOTEMPTY;
+
+        s5_journal_start(fs);
+        kmutex_lock(&parent->vn_mutex);
+
+        if (0 > (ino = s5_find_dirent(parent, name, namelen))) {
+                ret = ino;
+                goto out;
+        }
+        child = vget(parent->vn_fs, ino);
+        KASSERT(child);
+
+        if (!S_ISDIR(child->vn_mode)) {
+                ret = -ENOTDIR;
+        } else if (child->vn_len - S5_DIR_BASE(VNODE_TO_S5INODE(child))
+                   > (off_t)(2 * sizeof(s5_dirent_t))) {
+                ret = -ENOTEMPTY;
+        } else if (0 <= (ret = s5_remove_dirent(parent, name, namelen))) {
+                /* its ".." goes with it */
+                KASSERT(1 < pinode->s5_linkcount);
+                pinode->s5_linkcount--;
+                s5_dirty_inode(fs, pinode);
+        }
+        vput(child);
+
+out:
+        kmutex_unlock(&parent->vn_mutex);
+        s5_journal_stop(fs);
+        return ret;
 }
 
 
@@ -467,12 +844,38 @@ s5fs_rmdir(vnode_t *parent, const char *name, size_t namelen)
  * and copy that data into the given dirent. The value of d_off is dependent on
  * your implementation and may or may not b e necessary.  Finally, return the
  * number of bytes read.
+ *
+ * The index block at the start of a hashed directory is stepped over as
+ * if it were part of the first entry.
  */
 static int
 s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_readdir");
-        return -1;
+        s5_dirent_t s5d;
+        off_t base = S5_DIR_BASE(VNODE_TO_S5INODE(vnode));
+        off_t skip = 0;
+        int ret;
+
+        if (offset < base) {
+                skip = base - offset;
+                offset = base;
+        }
+        if (offset >= vnode->vn_len)
+                return 0;
+
+        kmutex_lock(&vnode->vn_mutex);
+        ret = s5_read_file(vnode, offset, (char *)&s5d, sizeof(s5_dirent_t));
+        kmutex_unlock(&vnode->vn_mutex);
+        if (0 > ret)
+                return ret;
+        KASSERT(sizeof(s5_dirent_t) == ret);
+
+        d->d_ino = s5d.s5d_inode;
+        d->d_off = offset + sizeof(s5_dirent_t);
+        strncpy(d->d_name, s5d.s5d_name, S5_NAME_LEN);
+        d->d_name[S5_NAME_LEN - 1] = '\0';
+
+        return skip + sizeof(s5_dirent_t);
 }
 
 
@@ -488,8 +891,23 @@ s5fs_readdir(vnode_t *vnode, off_t offset, struct dirent *d)
 static int
 s5fs_stat(vnode_t *vnode, struct stat *ss)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_stat");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+
+        memset(ss, 0, sizeof(struct stat));
+        ss->st_mode    = vnode->vn_mode;
+        ss->st_ino     = (int) vnode->vn_vno;
+        if (S_ISCHR(vnode->vn_mode) || S_ISBLK(vnode->vn_mode))
+                ss->st_rdev = (int) vnode->vn_devid;
+        /* the vnode holds one of the links */
+        ss->st_nlink   = inode->s5_linkcount - 1;
+        ss->st_size    = (int) vnode->vn_len;
+        ss->st_blksize = (int) S5_BLOCK_SIZE;
+
+        kmutex_lock(&vnode->vn_mutex);
+        ss->st_blocks  = s5_inode_blocks(vnode);
+        kmutex_unlock(&vnode->vn_mutex);
+
+        return 0;
 }
 
 
@@ -498,12 +916,30 @@ s5fs_stat(vnode_t *vnode, struct stat *ss)
  *
  * You'll probably want to use s5_seek_to_block and the device's
  * read_block function.
+ *
+ * An inline file's first page comes from the inode.
  */
 static int
 s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_fillpage");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        int block;
+
+        if (S5_INODE_INLINE(inode)) {
+                memset(pagebuf, 0, PAGE_SIZE);
+                if (0 == offset)
+                        memcpy(pagebuf, inode->s5_direct_blocks, S5_INLINE_SIZE);
+                return 0;
+        }
+
+        if (0 > (block = s5_seek_to_block(vnode, offset, 0)))
+                return block;
+        if (0 == block) {
+                memset(pagebuf, 0, PAGE_SIZE);
+                return 0;
+        }
+        return fs->s5f_bdev->bd_ops->read_block(fs->s5f_bdev, pagebuf, block, 1);
 }
 
 
@@ -520,12 +956,27 @@ s5fs_fillpage(vnode_t *vnode, off_t offset, void *pagebuf)
  *         - dirty the page containing this inode
  *
  * Much of this can be done with s5_seek_to_block()
+ *
+ * An inline file needs no block; cleanpage puts it back in the inode.
+ *
+ * Called from s5_write_file() the caller holds the vnode's mutex and a
+ * journal handle; a write fault on a mapping of the file has neither.
  */
 static int
 s5fs_dirtypage(vnode_t *vnode, off_t offset)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_dirtypage");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        int handle = (curthr != vnode->vn_mutex.km_holder);
+        int ret;
+
+        if (S5_INODE_INLINE(VNODE_TO_S5INODE(vnode)))
+                return 0;
+        if (handle)
+                s5_journal_start(fs);
+        ret = s5_seek_to_block(vnode, offset, 1);
+        if (handle)
+                s5_journal_stop(fs);
+        return (0 > ret) ? ret : 0;
 }
 
 /*
@@ -534,8 +985,22 @@ s5fs_dirtypage(vnode_t *vnode, off_t offset)
 static int
 s5fs_cleanpage(vnode_t *vnode, off_t offset, void *pagebuf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5fs_cleanpage");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        int block;
+
+        if (S5_INODE_INLINE(inode)) {
+                if (0 == offset) {
+                        memcpy(inode->s5_direct_blocks, pagebuf,
+                               MIN((size_t)vnode->vn_len, S5_INLINE_SIZE));
+                        s5_dirty_inode(fs, inode);
+                }
+                return 0;
+        }
+
+        if (0 > (block = s5_seek_to_block(vnode, offset, 1)))
+                return block;
+        return fs->s5f_bdev->bd_ops->write_block(fs->s5f_bdev, pagebuf, block, 1);
 }
 
 /* Diagnostic/Utility: */
@@ -552,18 +1017,40 @@ s5_check_super(s5_super_t *super)
                   || super->s5s_free_inode == (uint32_t) - 1)
               && super->s5s_root_inode < super->s5s_num_inodes))
                 return -1;
-        if (super->s5s_version != S5_CURRENT_VERSION) {
+        if (super->s5s_version < S5_OLDEST_VERSION
+            || super->s5s_version > S5_CURRENT_VERSION) {
                 dbg(DBG_PRINT, "Filesystem is version %d; "
-                    "only version %d is supported.\n",
-                    super->s5s_version, S5_CURRENT_VERSION);
+                    "only versions %d to %d are supported.\n",
+                    super->s5s_version, S5_OLDEST_VERSION,
+                    S5_CURRENT_VERSION);
                 return -1;
         }
+        if (super->s5s_version == S5_CURRENT_VERSION
+            && (super->s5s_bitmap_nblocks * S5_BITS_PER_BLOCK < super->s5s_num_blocks
+                || super->s5s_bitmap_block + super->s5s_bitmap_nblocks > super->s5s_num_blocks
+                || super->s5s_nfree_blocks > super->s5s_num_blocks))
+                return -1;
+        if (super->s5s_version == S5_CURRENT_VERSION
+            && (super->s5s_ibitmap_nblocks * S5_BITS_PER_BLOCK < super->s5s_num_inodes
+                || super->s5s_ibitmap_block + super->s5s_ibitmap_nblocks > super->s5s_num_blocks
+                || super->s5s_nfree_inodes > super->s5s_num_inodes))
+                return -1;
+        if (super->s5s_version == S5_CURRENT_VERSION
+            && (super->s5s_journal_nblocks < S5_JOURNAL_MIN_BLOCKS
+                || super->s5s_journal_nblocks > S5_JOURNAL_MAX_BLOCKS
+                || super->s5s_journal_block + super->s5s_journal_nblocks > super->s5s_num_blocks))
+                return -1;
         return 0;
 }
 
+/*
+ * The vget()s and vput()s take a journal handle each, as bringing an
+ * inode in or out changes its link count.
+ */
 static void
 calculate_refcounts(int *counts, vnode_t *vnode)
 {
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
         int ret;
 
         counts[vnode->vn_vno]++;
@@ -585,9 +1072,13 @@ calculate_refcounts(int *counts, vnode_t *vnode)
                          * link count of 1).
                          */
                         if (0 != strcmp(d.d_name, ".")) {
+                                s5_journal_start(fs);
                                 child = vget(vnode->vn_fs, d.d_ino);
+                                s5_journal_stop(fs);
                                 calculate_refcounts(counts, child);
+                                s5_journal_start(fs);
                                 vput(child);
+                                s5_journal_stop(fs);
                         }
                         offset += ret;
                 }
@@ -629,6 +1120,7 @@ s5fs_check_refcounts(fs_t *fs)
 
                 if (!refcounts[i]) continue;
 
+                s5_journal_start(s5fs);
                 vn = vget(fs, i);
                 KASSERT(vn);
 
@@ -638,6 +1130,7 @@ s5fs_check_refcounts(fs_t *fs)
                         ret = -1;
                 }
                 vput(vn);
+                s5_journal_stop(s5fs);
         }
 
         dbg(DBG_PRINT, "Refcount check of s5fs filesystem on block "
@@ -648,3 +1141,56 @@ s5fs_check_refcounts(fs_t *fs)
         kfree(refcounts);
         return ret;
 }
+
+/*
+ * Sets the link count of every inode to the number of directory entries
+ * for it, on a file system that was not unmounted cleanly: the links
+ * the VFS held (see s5fs_read_vnode()) were left behind. Inodes with no
+ * entries left, like files which were unlinked while open, are freed.
+ * Called by s5fs_mount() before anyone else can use the fs.
+ */
+static void
+s5fs_fix_linkcounts(fs_t *fs)
+{
+        s5fs_t *s5fs = (s5fs_t *)fs->fs_i;
+        uint32_t i, n = s5fs->s5f_super->s5s_num_inodes;
+        s5_inode_t *inode;
+        pframe_t *p;
+        vnode_t *vn;
+        int *counts;
+
+        if (NULL == (counts = kmalloc(n * sizeof(int)))) {
+                dbg(DBG_PRINT, "s5fs_fix_linkcounts: no memory to count "
+                    "links on block device with major %d and minor %d\n",
+                    MAJOR(s5fs->s5f_bdev->bd_id), MINOR(s5fs->s5f_bdev->bd_id));
+                return;
+        }
+        memset(counts, 0, n * sizeof(int));
+
+        calculate_refcounts(counts, fs->fs_root);
+        --counts[fs->fs_root->vn_vno]; /* as in s5fs_check_refcounts() */
+
+        for (i = 0; i < n; i++) {
+                pframe_get(S5FS_TO_VMOBJ(s5fs), S5_INODE_BLOCK(i), &p);
+                KASSERT(p);
+                inode = (s5_inode_t *)p->pf_addr + S5_INODE_OFFSET(i);
+                if (S5_TYPE_FREE == S5_INODE_TYPE(inode))
+                        continue;
+
+                s5_journal_start(s5fs);
+                vn = vget(fs, i);
+                KASSERT(vn);
+                inode = VNODE_TO_S5INODE(vn);
+                /* plus the link the vnode holds */
+                if (inode->s5_linkcount != counts[i] + 1) {
+                        dbg(DBG_PRINT, "   Inode %d, found %d links, "
+                            "had %d\n", i, counts[i], inode->s5_linkcount - 1);
+                        inode->s5_linkcount = counts[i] + 1;
+                        s5_dirty_inode(s5fs, inode);
+                }
+                vput(vn);
+                s5_journal_stop(s5fs);
+        }
+
+        kfree(counts);
+}
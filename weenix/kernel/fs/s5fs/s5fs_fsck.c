@@ -0,0 +1,521 @@
+/*
+ *   FILE: s5fs_fsck.c
+ *  DESCR: checking an s5fs that was not unmounted cleanly, while in use
+ *
+ * On a version 4 disk s5fs_mount() marks the superblock dirty, and only
+ * a clean unmount marks it clean again, after everything else has been
+ * written. A disk that is clean when mounted needs no checking at all.
+ * One that is dirty has had its journal replayed, so its metadata hangs
+ * together, but blocks and inodes may have been taken and never given
+ * back: blocks set aside for a file being written, say. Link counts are
+ * put right by s5fs_mount() first.
+ *
+ * s5fsckd checks such a file system while it is in use. It reads every
+ * inode, a block of inodes at a time, noting the blocks and inodes in
+ * use, then makes the two bitmaps agree. While it goes on the allocator
+ * tells it what is taken and given back, so a block freed behind it is
+ * not kept and one taken behind it is not freed. Each inode is looked
+ * at with the fs locked, so nothing is allocated or freed halfway
+ * through it. A block being freed right then, whose pointer is not yet
+ * cleared, at worst stays marked in use until the next check.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+#include "proc/kmutex.h"
+
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/pframe.h"
+
+#include "fs/vfs.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_fsck.h"
+
+#define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
+
+#define S5_FSCK_TEST(map, n)    (0 != ((map)[(n) / 32] & (1U << ((n) % 32))))
+
+/* file systems waiting to be checked. Set up here rather than in
+ * s5fsckd_init(), since the root fs is mounted before that runs. */
+static list_t s5fsckd_list = { &s5fsckd_list, &s5fsckd_list };
+static ktqueue_t s5fsckd_waitq;
+
+/* the check s5fsckd is running, and where unmount waits for it to be
+ * done with it */
+static s5_fsck_t *s5fsckd_current;
+static ktqueue_t s5fsckd_doneq;
+
+static kthread_t *s5fsckd_thr;
+
+/* checking is only there to get lost space back, let everyone else go
+ * first */
+static void
+s5fsckd_yield(void)
+{
+        sched_make_runnable(curthr);
+        sched_switch();
+}
+
+static void
+s5_fsck_mark(uint32_t *map, uint32_t n, int used)
+{
+        if (used)
+                map[n / 32] |= 1U << (n % 32);
+        else
+                map[n / 32] &= ~(1U << (n % 32));
+}
+
+static void
+s5_fsck_free(s5_fsck_t *f)
+{
+        kfree(f->sf_blocks);
+        kfree(f->sf_inodes);
+        kfree(f);
+}
+
+/*
+ * Has s5fsckd check the file system. Called by s5fs_mount(), once the
+ * file system is ready for use.
+ */
+int
+s5_fsck_start(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        s5_fsck_t *f;
+        size_t bsize = (s->s5s_num_blocks + 31) / 32 * sizeof(uint32_t);
+        size_t isize = (s->s5s_num_inodes + 31) / 32 * sizeof(uint32_t);
+
+        KASSERT(S5_CURRENT_VERSION == s->s5s_version);
+
+        if (NULL == (f = (s5_fsck_t *)kmalloc(sizeof(s5_fsck_t))))
+                return -ENOMEM;
+        f->sf_blocks = (uint32_t *)kmalloc(bsize);
+        f->sf_inodes = (uint32_t *)kmalloc(isize);
+        if (!f->sf_blocks || !f->sf_inodes) {
+                if (f->sf_blocks)
+                        kfree(f->sf_blocks);
+                if (f->sf_inodes)
+                        kfree(f->sf_inodes);
+                kfree(f);
+                return -ENOMEM;
+        }
+        memset(f->sf_blocks, 0, bsize);
+        memset(f->sf_inodes, 0, isize);
+        f->sf_fs = fs;
+        f->sf_next = 0;
+        f->sf_cancel = 0;
+
+        fs->s5f_fsck = f;
+        list_insert_tail(&s5fsckd_list, &f->sf_link);
+        if (NULL != s5fsckd_thr)
+                sched_wakeup_on(&s5fsckd_waitq);
+        return 0;
+}
+
+/*
+ * Gives up on the check if it is not done yet, leaving the file system
+ * unchecked. Called by s5fs_umount().
+ */
+void
+s5_fsck_stop(s5fs_t *fs)
+{
+        s5_fsck_t *f = fs->s5f_fsck;
+
+        if (NULL == f)
+                return;
+
+        f->sf_cancel = 1;
+        if (list_link_is_linked(&f->sf_link))
+                list_remove(&f->sf_link);
+        while (s5fsckd_current == f)
+                sched_sleep_on(&s5fsckd_doneq);
+
+        fs->s5f_fsck = NULL;
+        s5_fsck_free(f);
+}
+
+/* The allocator's side: called with the fs locked whenever a block or
+ * inode is taken or given back. */
+void
+s5_fsck_note_block(s5fs_t *fs, uint32_t block, int used)
+{
+        if (NULL != fs->s5f_fsck)
+                s5_fsck_mark(fs->s5f_fsck->sf_blocks, block, used);
+}
+
+void
+s5_fsck_note_inode(s5fs_t *fs, uint32_t ino, int used)
+{
+        if (NULL != fs->s5f_fsck)
+                s5_fsck_mark(fs->s5f_fsck->sf_inodes, ino, used);
+}
+
+/* Marks block 'block' of inode 'ino' in use, if it is on the disk */
+static void
+s5_fsck_block(s5_fsck_t *f, uint32_t ino, uint32_t block)
+{
+        if (block >= f->sf_fs->s5f_super->s5s_num_blocks) {
+                dbg(DBG_PRINT, "s5fsck: inode %u points past the end of "
+                    "the disk, to block %u\n", ino, block);
+                return;
+        }
+        s5_fsck_mark(f->sf_blocks, block, 1);
+}
+
+/* Marks indirect block 'block' and the blocks under it in use */
+static void
+s5_fsck_indirect(s5_fsck_t *f, uint32_t ino, uint32_t block, int depth)
+{
+        s5fs_t *fs = f->sf_fs;
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        if (block >= fs->s5f_super->s5s_num_blocks) {
+                s5_fsck_block(f, ino, block);
+                return;
+        }
+        s5_fsck_mark(f->sf_blocks, block, 1);
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+        KASSERT(ibp);
+        pframe_pin(ibp);
+        b = (uint32_t *)ibp->pf_addr;
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                if (!b[i])
+                        continue;
+                if (1 < depth)
+                        s5_fsck_indirect(f, ino, b[i], depth - 1);
+                else
+                        s5_fsck_block(f, ino, b[i]);
+        }
+        pframe_unpin(ibp);
+}
+
+/* Marks the inode and its blocks in use, unless it is free */
+static void
+s5_fsck_inode(s5_fsck_t *f, s5_inode_t *inode)
+{
+        uint32_t i, ndirect;
+
+        if (S5_TYPE_FREE == S5_INODE_TYPE(inode))
+                return;
+        s5_fsck_mark(f->sf_inodes, inode->s5_number, 1);
+
+        if (S5_TYPE_DATA != S5_INODE_TYPE(inode)
+            && S5_TYPE_DIR != S5_INODE_TYPE(inode))
+                return;
+        if (S5_INODE_INLINE(inode))
+                return;
+
+        ndirect = S5_INODE_NDIRECT(inode);
+        for (i = 0; i < ndirect; ++i) {
+                if (inode->s5_direct_blocks[i])
+                        s5_fsck_block(f, inode->s5_number,
+                                      inode->s5_direct_blocks[i]);
+        }
+        if (inode->s5_indirect_block)
+                s5_fsck_indirect(f, inode->s5_number,
+                                 inode->s5_indirect_block, 1);
+        if ((inode->s5_type & S5_FLAG_DINDIRECT) && inode->s5_dindirect_block)
+                s5_fsck_indirect(f, inode->s5_number,
+                                 inode->s5_dindirect_block, 2);
+}
+
+/* Looks at every inode, a block of them at a time */
+static void
+s5_fsck_scan(s5_fsck_t *f)
+{
+        s5fs_t *fs = f->sf_fs;
+        uint32_t ninodes = fs->s5f_super->s5s_num_inodes;
+        pframe_t *p;
+        s5_inode_t *inodes;
+
+        while (f->sf_next < ninodes && !f->sf_cancel) {
+                kmutex_lock(&fs->s5f_mutex);
+                pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(f->sf_next), &p);
+                KASSERT(p);
+                pframe_pin(p);
+                inodes = (s5_inode_t *)p->pf_addr;
+                do {
+                        s5_fsck_inode(f, inodes + S5_INODE_OFFSET(f->sf_next));
+                        ++f->sf_next;
+                } while (f->sf_next < ninodes && 0 != S5_INODE_OFFSET(f->sf_next));
+                pframe_unpin(p);
+                kmutex_unlock(&fs->s5f_mutex);
+
+                s5fsckd_yield();
+        }
+}
+
+/* Is 'block' one of the file system's own: the superblock, inodes,
+ * bitmaps or journal? */
+static int
+s5_fsck_reserved(s5_super_t *s, uint32_t block)
+{
+        if (block <= S5_INODE_BLOCK(s->s5s_num_inodes - 1))
+                return 1;
+        if (block >= s->s5s_bitmap_block
+            && block < s->s5s_bitmap_block + s->s5s_bitmap_nblocks)
+                return 1;
+        if (block >= s->s5s_ibitmap_block
+            && block < s->s5s_ibitmap_block + s->s5s_ibitmap_nblocks)
+                return 1;
+        return block >= s->s5s_journal_block
+               && block < s->s5s_journal_block + s->s5s_journal_nblocks;
+}
+
+/* Is 'block' set aside for a file being written? Called with the fs
+ * locked. */
+static int
+s5_fsck_prealloc(s5fs_t *fs, uint32_t block)
+{
+        s5_prealloc_t *p;
+
+        for (p = fs->s5f_prealloc; p < fs->s5f_prealloc + S5_NPREALLOC; ++p) {
+                if ((uint32_t) -1 != p->s5p_ino && block >= p->s5p_next
+                    && block < p->s5p_next + p->s5p_count)
+                        return 1;
+        }
+        return 0;
+}
+
+/* Dirties a block of metadata. Called with the fs locked. */
+static void
+s5_fsck_dirty(s5fs_t *fs, uint32_t block)
+{
+        pframe_t *p;
+        int err;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &p);
+        KASSERT(p);
+        err = pframe_dirty(p);
+        KASSERT(!err);
+        s5_journal_add(fs, p, NULL);
+}
+
+/*
+ * Makes block 'bi' of the free block bitmap agree with what the scan
+ * found. Returns the number of bits that were wrong.
+ */
+static int
+s5_fsck_fix_blocks(s5_fsck_t *f, uint32_t bi)
+{
+        s5fs_t *fs = f->sf_fs;
+        s5_super_t *s = fs->s5f_super;
+        uint32_t blk, end, bit, *w;
+        pframe_t *p;
+        int used, nwrong = 0;
+
+        s5_journal_start(fs);
+        kmutex_lock(&fs->s5f_mutex);
+
+        pframe_get(S5FS_TO_VMOBJ(fs), s->s5s_bitmap_block + bi, &p);
+        KASSERT(p);
+        pframe_pin(p);
+        end = MIN((bi + 1) * S5_BITS_PER_BLOCK, s->s5s_num_blocks);
+        for (blk = bi * S5_BITS_PER_BLOCK; blk < end; ++blk) {
+                w = (uint32_t *)p->pf_addr + (blk % S5_BITS_PER_BLOCK) / 32;
+                bit = 1U << (blk % 32);
+                used = S5_FSCK_TEST(f->sf_blocks, blk)
+                       || s5_fsck_reserved(s, blk) || s5_fsck_prealloc(fs, blk);
+                if (!used == !(*w & bit))
+                        continue;
+                dprintf("block %u is %s but marked %s\n", blk,
+                        used ? "in use" : "free", used ? "free" : "in use");
+                if (used) {
+                        *w |= bit;
+                } else {
+                        s5_journal_revoke(fs, blk);
+                        *w &= ~bit;
+                }
+                ++nwrong;
+        }
+        if (0 < nwrong)
+                s5_fsck_dirty(fs, s->s5s_bitmap_block + bi);
+        pframe_unpin(p);
+
+        kmutex_unlock(&fs->s5f_mutex);
+        s5_journal_stop(fs);
+        return nwrong;
+}
+
+/* The same for block 'bi' of the inode bitmap */
+static int
+s5_fsck_fix_inodes(s5_fsck_t *f, uint32_t bi)
+{
+        s5fs_t *fs = f->sf_fs;
+        s5_super_t *s = fs->s5f_super;
+        uint32_t ino, end, bit, *w;
+        int used, nwrong = 0;
+
+        s5_journal_start(fs);
+        kmutex_lock(&fs->s5f_mutex);
+
+        end = MIN((bi + 1) * S5_BITS_PER_BLOCK, s->s5s_num_inodes);
+        for (ino = bi * S5_BITS_PER_BLOCK; ino < end; ++ino) {
+                w = (uint32_t *)fs->s5f_ibitmap[bi]->pf_addr
+                    + (ino % S5_BITS_PER_BLOCK) / 32;
+                bit = 1U << (ino % 32);
+                used = S5_FSCK_TEST(f->sf_inodes, ino);
+                if (!used == !(*w & bit))
+                        continue;
+                dprintf("inode %u is %s but marked %s\n", ino,
+                        used ? "in use" : "free", used ? "free" : "in use");
+                if (used)
+                        *w |= bit;
+                else
+                        *w &= ~bit;
+                ++nwrong;
+        }
+        if (0 < nwrong)
+                s5_fsck_dirty(fs, s->s5s_ibitmap_block + bi);
+
+        kmutex_unlock(&fs->s5f_mutex);
+        s5_journal_stop(fs);
+        return nwrong;
+}
+
+/* Counts the clear bits among the first 'n' of a bitmap page */
+static uint32_t
+s5_fsck_count(uint32_t *w, uint32_t n)
+{
+        uint32_t i, nfree = 0;
+
+        for (i = 0; i < n; ++i) {
+                if (!(w[i / 32] & (1U << (i % 32))))
+                        ++nfree;
+        }
+        return nfree;
+}
+
+/* Sets the superblock's free counts from the bitmaps */
+static void
+s5_fsck_fix_counts(s5_fsck_t *f)
+{
+        s5fs_t *fs = f->sf_fs;
+        s5_super_t *s = fs->s5f_super;
+        uint32_t i, nfree_blocks = 0, nfree_inodes = 0;
+        pframe_t *p;
+
+        s5_journal_start(fs);
+        kmutex_lock(&fs->s5f_mutex);
+
+        for (i = 0; i < s->s5s_bitmap_nblocks; ++i) {
+                pframe_get(S5FS_TO_VMOBJ(fs), s->s5s_bitmap_block + i, &p);
+                KASSERT(p);
+                nfree_blocks += s5_fsck_count((uint32_t *)p->pf_addr,
+                                              MIN(S5_BITS_PER_BLOCK, s->s5s_num_blocks - i * S5_BITS_PER_BLOCK));
+        }
+        for (i = 0; i < s->s5s_ibitmap_nblocks; ++i)
+                nfree_inodes += s5_fsck_count((uint32_t *)fs->s5f_ibitmap[i]->pf_addr,
+                                              MIN(S5_BITS_PER_BLOCK, s->s5s_num_inodes - i * S5_BITS_PER_BLOCK));
+
+        if (nfree_blocks != s->s5s_nfree_blocks
+            || nfree_inodes != s->s5s_nfree_inodes) {
+                dprintf("superblock had %u free blocks and %u free inodes, "
+                        "there are %u and %u\n", s->s5s_nfree_blocks,
+                        s->s5s_nfree_inodes, nfree_blocks, nfree_inodes);
+                s->s5s_nfree_blocks = nfree_blocks;
+                s->s5s_nfree_inodes = nfree_inodes;
+                s5_fsck_dirty(fs, S5_SUPER_BLOCK);
+        }
+
+        kmutex_unlock(&fs->s5f_mutex);
+        s5_journal_stop(fs);
+}
+
+static void
+s5_fsck_run(s5_fsck_t *f)
+{
+        s5fs_t *fs = f->sf_fs;
+        blockdev_t *bd = fs->s5f_bdev;
+        int nblocks = 0, ninodes = 0;
+        uint32_t i;
+
+        dbg(DBG_PRINT, "s5fsck: checking the fs on block device with major "
+            "%d and minor %d, which was not unmounted cleanly\n",
+            MAJOR(bd->bd_id), MINOR(bd->bd_id));
+
+        s5_fsck_scan(f);
+        for (i = 0; i < fs->s5f_super->s5s_bitmap_nblocks && !f->sf_cancel; ++i) {
+                nblocks += s5_fsck_fix_blocks(f, i);
+                s5fsckd_yield();
+        }
+        for (i = 0; i < fs->s5f_super->s5s_ibitmap_nblocks && !f->sf_cancel; ++i) {
+                ninodes += s5_fsck_fix_inodes(f, i);
+                s5fsckd_yield();
+        }
+        if (f->sf_cancel)
+                return;
+        s5_fsck_fix_counts(f);
+
+        fs->s5f_unchecked = 0;
+        dbg(DBG_PRINT, "s5fsck: checked the fs on block device with major %d "
+            "and minor %d, %d blocks and %d inodes were marked wrongly\n",
+            MAJOR(bd->bd_id), MINOR(bd->bd_id), nblocks, ninodes);
+}
+
+/*
+ * The checker daemon main routine: checks the file systems queued by
+ * s5_fsck_start(), one at a time.
+ */
+static void *
+s5fsckd(int arg1, void *arg2)
+{
+        s5_fsck_t *f;
+
+        while (1) {
+                while (!list_empty(&s5fsckd_list)) {
+                        f = list_head(&s5fsckd_list, s5_fsck_t, sf_link);
+                        list_remove(&f->sf_link);
+                        s5fsckd_current = f;
+                        s5_fsck_run(f);
+                        /* if it was cancelled, unmount frees it */
+                        if (!f->sf_cancel) {
+                                f->sf_fs->s5f_fsck = NULL;
+                                s5_fsck_free(f);
+                        }
+                        s5fsckd_current = NULL;
+                        sched_broadcast_on(&s5fsckd_doneq);
+                }
+
+                if (sched_cancellable_sleep_on(&s5fsckd_waitq) < 0) {
+                        return (void *)0;
+                }
+        }
+}
+
+static proc_t *s5fsckd_proc;
+
+static __attribute__((unused)) void
+s5fsckd_init(void)
+{
+        sched_queue_init(&s5fsckd_waitq);
+        sched_queue_init(&s5fsckd_doneq);
+
+        KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
+        s5fsckd_proc = proc_create("s5fsckd");
+        KASSERT(NULL != s5fsckd_proc);
+        s5fsckd_thr = kthread_create(s5fsckd_proc, s5fsckd, 0, NULL);
+        KASSERT(NULL != s5fsckd_thr);
+
+        sched_make_runnable(s5fsckd_thr);
+}
+init_func(s5fsckd_init);
+init_depends(sched_init);
@@ -0,0 +1,604 @@
+/*
+ *   FILE: s5fs_journal.c
+ *  DESCR: the s5fs metadata journal
+ *
+ * Metadata is journaled a whole block at a time. A change is made in
+ * the page cache as before and the page is added to the running
+ * transaction, which pins it until the transaction is committed:
+ * written to the journal, followed by a commit block. After that the
+ * page cache may write the page home whenever it likes. Before the
+ * journal is reused, the transactions in it are copied home from the
+ * journal (a checkpoint), which is also what mounting a file system
+ * that was not unmounted does.
+ *
+ * Changes go to the running transaction in handles, which keep it from
+ * being committed with an operation half done. Handles do not nest, and
+ * are taken before any vnode mutex, since committing waits for the
+ * handles open to be stopped while new ones wait for the commit.
+ *
+ * When a handle is stopped s5journald is asked to commit the running
+ * transaction. It gets to run only once the threads making changes
+ * block, so a burst of operations usually shares one commit.
+ *
+ * A block logged and then freed is revoked: replay leaves out the
+ * copies of it logged before, as it may hold a file's data by then.
+ */
+
+#include "kernel.h"
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/string.h"
+#include "util/debug.h"
+#include "util/init.h"
+#include "util/list.h"
+
+#include "proc/proc.h"
+#include "proc/kthread.h"
+#include "proc/sched.h"
+#include "proc/kmutex.h"
+
+#include "drivers/blockdev.h"
+
+#include "mm/kmalloc.h"
+#include "mm/page.h"
+#include "mm/pframe.h"
+
+#include "fs/vfs.h"
+#include "fs/vnode.h"
+#include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_subr.h"
+#include "fs/s5fs/s5fs_journal.h"
+
+#define dprintf(...) dbg(DBG_S5FS, __VA_ARGS__)
+
+/* journals with a transaction for s5journald to commit */
+static list_t s5journald_list;
+static ktqueue_t s5journald_waitq;
+
+/* the journal s5journald is committing, and where unmount waits for it
+ * to be done with it */
+static s5_journal_t *s5journald_current;
+static ktqueue_t s5journald_doneq;
+
+static void
+s5_journal_io(int ret)
+{
+        /* like the page cache, we count on the disk */
+        if (0 > ret)
+                panic("s5fs: journal I/O failed with errno %d\n", -ret);
+}
+
+/*
+ * Checks for a committed transaction with sequence number 'seq' at
+ * block 'pos' of the journal, reading its descriptor into 'd' ('buf'
+ * is clobbered). Returns the number of blocks it takes up, or 0 if
+ * there is none.
+ */
+static uint32_t
+s5_journal_valid(blockdev_t *bd, uint32_t jblock, uint32_t nblocks,
+                 uint32_t pos, uint32_t seq, s5_jdesc_t *d, char *buf)
+{
+        s5_jcommit_t *c = (s5_jcommit_t *)buf;
+        uint32_t i, ndata = 0;
+
+        if (pos + 2 > nblocks)
+                return 0;
+        s5_journal_io(bd->bd_ops->read_block(bd, (char *)d, jblock + pos, 1));
+        if (S5_JDESC_MAGIC != d->s5j_magic || seq != d->s5j_seq
+            || S5_JOURNAL_NTAGS < d->s5j_ntags)
+                return 0;
+        for (i = 0; i < d->s5j_ntags; ++i) {
+                if (!(d->s5j_tags[i] & S5_JTAG_REVOKE))
+                        ++ndata;
+        }
+        if (pos + ndata + 2 > nblocks)
+                return 0;
+        s5_journal_io(bd->bd_ops->read_block(bd, buf, jblock + pos + ndata + 1, 1));
+        if (S5_JCOMMIT_MAGIC != c->s5j_magic || seq != c->s5j_seq
+            || d->s5j_ntags != c->s5j_ntags)
+                return 0;
+        return ndata + 2;
+}
+
+/*
+ * Copies the committed transactions in the journal home, in order,
+ * leaving out blocks revoked in the same or a later transaction. The
+ * first transaction has sequence number *seqp; it is set to the number
+ * after the last. A block outside the first fsblocks of the device is
+ * corruption. Returns how many there were or -errno.
+ */
+static int
+s5_journal_replay(blockdev_t *bd, uint32_t fsblocks, uint32_t jblock,
+                  uint32_t nblocks, uint32_t *seqp)
+{
+        s5_jdesc_t *d;
+        char *buf;
+        uint32_t *rblock, *rseq;
+        uint32_t nrevoke = 0, pos, seq, len, i, r, home, data;
+        int pass, ntxn = 0, ret = 0;
+
+        d = (s5_jdesc_t *)page_alloc();
+        buf = (char *)page_alloc();
+        rblock = (uint32_t *)kmalloc(nblocks * sizeof(uint32_t));
+        rseq = (uint32_t *)kmalloc(nblocks * sizeof(uint32_t));
+        if (!d || !buf || !rblock || !rseq) {
+                ret = -ENOMEM;
+                goto out;
+        }
+
+        /* find the revoked blocks first, then copy the rest home */
+        for (pass = 0; pass < 2; ++pass) {
+                pos = 1;
+                seq = *seqp;
+                ntxn = 0;
+                while (0 != (len = s5_journal_valid(bd, jblock, nblocks,
+                                                    pos, seq, d, buf))) {
+                        data = pos + 1;
+                        for (i = 0; i < d->s5j_ntags; ++i) {
+                                home = d->s5j_tags[i] & ~S5_JTAG_REVOKE;
+                                if (home >= fsblocks) {
+                                        ret = -EINVAL;
+                                        goto out;
+                                }
+                                if (d->s5j_tags[i] & S5_JTAG_REVOKE) {
+                                        if (0 != pass)
+                                                continue;
+                                        if (nrevoke == nblocks) {
+                                                ret = -EINVAL;
+                                                goto out;
+                                        }
+                                        rblock[nrevoke] = home;
+                                        rseq[nrevoke++] = seq;
+                                        continue;
+                                }
+                                if (0 == pass) {
+                                        ++data;
+                                        continue;
+                                }
+                                for (r = 0; r < nrevoke; ++r) {
+                                        if (rblock[r] == home && rseq[r] >= seq)
+                                                break;
+                                }
+                                if (r == nrevoke) {
+                                        s5_journal_io(bd->bd_ops->read_block(bd, buf, jblock + data, 1));
+                                        s5_journal_io(bd->bd_ops->write_block(bd, buf, home, 1));
+                                }
+                                ++data;
+                        }
+                        pos += len;
+                        ++seq;
+                        ++ntxn;
+                }
+        }
+        *seqp = seq;
+        ret = ntxn;
+
+out:
+        if (d)
+                page_free(d);
+        if (buf)
+                page_free(buf);
+        if (rblock)
+                kfree(rblock);
+        if (rseq)
+                kfree(rseq);
+        return ret;
+}
+
+/*
+ * Replays the journal, if the file system was not unmounted cleanly.
+ * Called by s5fs_mount() before it reads anything but the superblock,
+ * which it must read again afterwards.
+ */
+int
+s5_journal_recover(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        blockdev_t *bd = fs->s5f_bdev;
+        s5_jheader_t *h;
+        uint32_t seq;
+        int ret;
+
+        if (NULL == (h = (s5_jheader_t *)page_alloc()))
+                return -ENOMEM;
+        s5_journal_io(bd->bd_ops->read_block(bd, (char *)h, s->s5s_journal_block, 1));
+        if (S5_JOURNAL_MAGIC != h->s5j_magic) {
+                ret = -EINVAL;
+                goto out;
+        }
+
+        seq = h->s5j_seq;
+        ret = s5_journal_replay(bd, s->s5s_num_blocks, s->s5s_journal_block,
+                                s->s5s_journal_nblocks, &seq);
+        if (0 < ret) {
+                dbg(DBG_PRINT, "s5fs: replayed %d transactions from the "
+                    "journal of the fs on block device with major %d and "
+                    "minor %d\n", ret, MAJOR(bd->bd_id), MINOR(bd->bd_id));
+                h->s5j_seq = seq;
+                s5_journal_io(bd->bd_ops->write_block(bd, (char *)h, s->s5s_journal_block, 1));
+        }
+        ret = (0 > ret) ? ret : 0;
+
+out:
+        page_free(h);
+        return ret;
+}
+
+/*
+ * Copies the transactions in the journal home and empties it. Called
+ * with the journal's mutex held and no transaction being written.
+ */
+static void
+s5_journal_checkpoint(s5_journal_t *j)
+{
+        blockdev_t *bd = j->sj_fs->s5f_bdev;
+        s5_jheader_t *h = (s5_jheader_t *)j->sj_buf;
+        uint32_t seq;
+        int ret;
+
+        if (1 == j->sj_head)
+                return;
+
+        s5_journal_io(bd->bd_ops->read_block(bd, j->sj_buf, j->sj_block, 1));
+        seq = h->s5j_seq;
+        ret = s5_journal_replay(bd, j->sj_fs->s5f_super->s5s_num_blocks,
+                                j->sj_block, j->sj_nblocks, &seq);
+        s5_journal_io(ret);
+        KASSERT(seq == j->sj_seq);
+
+        h->s5j_magic = S5_JOURNAL_MAGIC;
+        h->s5j_seq = j->sj_seq;
+        s5_journal_io(bd->bd_ops->write_block(bd, j->sj_buf, j->sj_block, 1));
+
+        j->sj_head = 1;
+        j->sj_nlogged = 0;
+        dprintf("checkpointed journal, next transaction %u\n", j->sj_seq);
+}
+
+/* Has s5journald commit the running transaction when it next runs */
+static void
+s5_journal_kick(s5_journal_t *j)
+{
+        if (0 == j->sj_n && 0 == j->sj_nrevoke)
+                return;
+        if (j->sj_closing || list_link_is_linked(&j->sj_link))
+                return;
+        list_insert_tail(&s5journald_list, &j->sj_link);
+        sched_wakeup_on(&s5journald_waitq);
+}
+
+int
+s5_journal_open(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        s5_journal_t *j;
+
+        if (NULL == (j = (s5_journal_t *)kmalloc(sizeof(s5_journal_t))))
+                return -ENOMEM;
+        memset(j, 0, sizeof(s5_journal_t));
+        j->sj_revoke = (uint32_t *)kmalloc(s->s5s_journal_nblocks * sizeof(uint32_t));
+        j->sj_logged = (uint32_t *)kmalloc(s->s5s_journal_nblocks * sizeof(uint32_t));
+        j->sj_buf = (char *)page_alloc();
+        if (!j->sj_revoke || !j->sj_logged || !j->sj_buf) {
+                if (j->sj_revoke)
+                        kfree(j->sj_revoke);
+                if (j->sj_logged)
+                        kfree(j->sj_logged);
+                if (j->sj_buf)
+                        page_free(j->sj_buf);
+                kfree(j);
+                return -ENOMEM;
+        }
+
+        j->sj_fs = fs;
+        kmutex_init(&j->sj_mutex);
+        j->sj_block = s->s5s_journal_block;
+        j->sj_nblocks = s->s5s_journal_nblocks;
+        s5_journal_io(fs->s5f_bdev->bd_ops->read_block(fs->s5f_bdev, j->sj_buf,
+                                                       j->sj_block, 1));
+        j->sj_seq = ((s5_jheader_t *)j->sj_buf)->s5j_seq;
+        j->sj_head = 1;
+        sched_queue_init(&j->sj_waitq);
+        sched_queue_init(&j->sj_commitq);
+        list_link_init(&j->sj_link);
+
+        fs->s5f_journal = j;
+        return 0;
+}
+
+/*
+ * Commits what is left and checkpoints the journal, so that the next
+ * mount has nothing to replay. Called by s5fs_umount().
+ */
+void
+s5_journal_close(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        j->sj_closing = 1;
+        if (list_link_is_linked(&j->sj_link))
+                list_remove(&j->sj_link);
+        while (s5journald_current == j)
+                sched_sleep_on(&s5journald_doneq);
+
+        /* committing puts vnodes, which may change more metadata */
+        while (0 < j->sj_n || 0 < j->sj_nrevoke)
+                s5_journal_commit(fs);
+
+        kmutex_lock(&j->sj_mutex);
+        s5_journal_checkpoint(j);
+        kmutex_unlock(&j->sj_mutex);
+        KASSERT(0 == j->sj_updates);
+
+        fs->s5f_journal = NULL;
+        kfree(j->sj_revoke);
+        kfree(j->sj_logged);
+        page_free(j->sj_buf);
+        kfree(j);
+}
+
+/*
+ * Opens a handle on the running transaction. Waits while it is being
+ * committed, or while it might not have room for one more handle.
+ */
+void
+s5_journal_start(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        while (j->sj_locked
+               || j->sj_n + (j->sj_updates + 1) * S5_JOURNAL_RESERVE > S5_JOURNAL_TXN_MAX) {
+                if (j->sj_locked || 0 == j->sj_n)
+                        sched_sleep_on(&j->sj_waitq);
+                else
+                        s5_journal_commit(fs);
+        }
+        j->sj_updates++;
+}
+
+void
+s5_journal_stop(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+
+        if (NULL == j)
+                return;
+
+        KASSERT(0 < j->sj_updates);
+        if (0 == --j->sj_updates && j->sj_locked)
+                sched_wakeup_on(&j->sj_commitq);
+        if (!j->sj_locked)
+                sched_broadcast_on(&j->sj_waitq);
+        s5_journal_kick(j);
+}
+
+/*
+ * Adds the page 'pf', just changed, to the running transaction: a block
+ * device page, or a page of directory 'vn'. Done once the page is
+ * dirty, before anything can block.
+ */
+void
+s5_journal_add(s5fs_t *fs, pframe_t *pf, vnode_t *vn)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        s5_jentry_t *e;
+        int i, block;
+
+        if (NULL == j)
+                return;
+
+        if (vn)
+                block = s5_seek_to_block(vn, (off_t)pf->pf_pagenum * S5_BLOCK_SIZE, 0);
+        else
+                block = pf->pf_pagenum;
+        KASSERT(0 < block);
+
+        /* a block logged again before it is freed is no longer revoked */
+        for (i = 0; i < j->sj_nrevoke; ++i) {
+                if (j->sj_revoke[i] == (uint32_t)block) {
+                        j->sj_revoke[i] = j->sj_revoke[--j->sj_nrevoke];
+                        break;
+                }
+        }
+
+        for (i = j->sj_ncommit; i < j->sj_n; ++i) {
+                e = &j->sj_entries[i];
+                if (e->sje_pf == pf) {
+                        e->sje_block = block;
+                        return;
+                }
+        }
+
+        if (S5_JOURNAL_TXN_MAX == j->sj_n)
+                panic("s5fs: journal transaction overflow\n");
+        pframe_pin(pf);
+        if (vn)
+                vref(vn);
+        e = &j->sj_entries[j->sj_n++];
+        e->sje_pf = pf;
+        e->sje_block = block;
+        e->sje_vn = vn;
+
+        /* changes made outside a handle (by page faults and the page
+         * cache) are committed too */
+        if (0 == j->sj_updates)
+                s5_journal_kick(j);
+}
+
+/*
+ * Called as block 'block' is freed. If it is in the journal since the
+ * last checkpoint, a revoke tag goes in the next commit.
+ */
+void
+s5_journal_revoke(s5fs_t *fs, uint32_t block)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        int i;
+
+        if (NULL == j)
+                return;
+
+        for (i = j->sj_ncommit; i < j->sj_n; ++i) {
+                if (j->sj_entries[i].sje_block == block)
+                        j->sj_entries[i].sje_block = 0;
+        }
+        for (i = 0; i < j->sj_nlogged; ++i) {
+                if (j->sj_logged[i] == block) {
+                        j->sj_logged[i] = j->sj_logged[--j->sj_nlogged];
+                        KASSERT((uint32_t)j->sj_nrevoke < j->sj_nblocks);
+                        j->sj_revoke[j->sj_nrevoke++] = block;
+                        break;
+                }
+        }
+}
+
+/*
+ * Commits the running transaction: waits for its handles to be
+ * stopped, keeping new ones out, and writes the descriptor, the blocks
+ * and the commit block to the journal, checkpointing first if there is
+ * no room. Then the pages are unpinned. Changes made without a handle
+ * while it is written go to the next transaction.
+ */
+int
+s5_journal_commit(s5fs_t *fs)
+{
+        s5_journal_t *j = fs->s5f_journal;
+        blockdev_t *bd = fs->s5f_bdev;
+        s5_jdesc_t *d;
+        s5_jcommit_t *c;
+        s5_jentry_t *e;
+        vnode_t *vns[S5_JOURNAL_TXN_MAX];
+        uint32_t pos, ndata = 0;
+        int i, k, n, nvn = 0;
+
+        if (NULL == j)
+                return 0;
+
+        kmutex_lock(&j->sj_mutex);
+        if (0 == j->sj_n && 0 == j->sj_nrevoke) {
+                kmutex_unlock(&j->sj_mutex);
+                return 0;
+        }
+
+        j->sj_locked = 1;
+        while (0 < j->sj_updates)
+                sched_sleep_on(&j->sj_commitq);
+
+        n = j->sj_ncommit = j->sj_n;
+        for (i = 0; i < n; ++i) {
+                if (j->sj_entries[i].sje_block)
+                        ++ndata;
+        }
+        if (j->sj_head + ndata + 2 > j->sj_nblocks)
+                s5_journal_checkpoint(j);
+
+        d = (s5_jdesc_t *)j->sj_buf;
+        memset(d, 0, S5_BLOCK_SIZE);
+        d->s5j_magic = S5_JDESC_MAGIC;
+        d->s5j_seq = j->sj_seq;
+        for (i = 0; i < n; ++i) {
+                e = &j->sj_entries[i];
+                if (!e->sje_block)
+                        continue;
+                d->s5j_tags[d->s5j_ntags++] = e->sje_block;
+                for (k = 0; k < j->sj_nlogged; ++k) {
+                        if (j->sj_logged[k] == e->sje_block)
+                                break;
+                }
+                if (k == j->sj_nlogged)
+                        j->sj_logged[j->sj_nlogged++] = e->sje_block;
+        }
+        for (i = 0; i < j->sj_nrevoke; ++i)
+                d->s5j_tags[d->s5j_ntags++] = j->sj_revoke[i] | S5_JTAG_REVOKE;
+        j->sj_nrevoke = 0;
+
+        pos = j->sj_block + j->sj_head;
+        s5_journal_io(bd->bd_ops->write_block(bd, j->sj_buf, pos++, 1));
+        for (i = 0; i < n; ++i) {
+                e = &j->sj_entries[i];
+                if (e->sje_block)
+                        s5_journal_io(bd->bd_ops->write_block(bd, e->sje_pf->pf_addr, pos++, 1));
+        }
+        c = (s5_jcommit_t *)j->sj_buf;
+        c->s5j_magic = S5_JCOMMIT_MAGIC;
+        c->s5j_seq = j->sj_seq;
+        c->s5j_ntags = d->s5j_ntags;
+        s5_journal_io(bd->bd_ops->write_block(bd, j->sj_buf, pos, 1));
+
+        dprintf("committed transaction %u: %u blocks\n", j->sj_seq, ndata);
+        j->sj_head += ndata + 2;
+        j->sj_seq++;
+
+        /* the blocks may go home now */
+        for (i = 0; i < n; ++i) {
+                e = &j->sj_entries[i];
+                pframe_unpin(e->sje_pf);
+                if (e->sje_vn)
+                        vns[nvn++] = e->sje_vn;
+        }
+        for (i = n; i < j->sj_n; ++i)
+                j->sj_entries[i - n] = j->sj_entries[i];
+        j->sj_n -= n;
+        j->sj_ncommit = 0;
+        j->sj_locked = 0;
+        sched_broadcast_on(&j->sj_waitq);
+        kmutex_unlock(&j->sj_mutex);
+
+        for (i = 0; i < nvn; ++i)
+                vput(vns[i]);
+        return 0;
+}
+
+/*
+ * The journal daemon main routine: commits the transactions of the
+ * journals queued by s5_journal_stop() and s5_journal_add().
+ */
+static void *
+s5journald(int arg1, void *arg2)
+{
+        s5_journal_t *j;
+
+        while (1) {
+                while (!list_empty(&s5journald_list)) {
+                        j = list_head(&s5journald_list, s5_journal_t, sj_link);
+                        list_remove(&j->sj_link);
+                        s5journald_current = j;
+                        s5_journal_commit(j->sj_fs);
+                        s5journald_current = NULL;
+                        sched_broadcast_on(&s5journald_doneq);
+                }
+
+                if (sched_cancellable_sleep_on(&s5journald_waitq) < 0) {
+                        return (void *)0;
+                }
+        }
+}
+
+static proc_t *s5journald_proc;
+static kthread_t *s5journald_thr;
+
+static __attribute__((unused)) void
+s5journald_init(void)
+{
+        list_init(&s5journald_list);
+        sched_queue_init(&s5journald_waitq);
+        sched_queue_init(&s5journald_doneq);
+
+        KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
+        s5journald_proc = proc_create("s5journald");
+        KASSERT(NULL != s5journald_proc);
+        s5journald_thr = kthread_create(s5journald_proc, s5journald, 0, NULL);
+        KASSERT(NULL != s5journald_thr);
+
+        sched_make_runnable(s5journald_thr);
+}
+init_func(s5journald_init);
+init_depends(sched_init);
@@ -23,6 +23,8 @@
 #include "fs/vnode.h"
 #include "fs/s5fs/s5fs_subr.h"
 #include "fs/s5fs/s5fs.h"
+#include "fs/s5fs/s5fs_journal.h"
+#include "fs/s5fs/s5fs_fsck.h"
 #include "mm/mm.h"
 #include "mm/page.h"
 
@@ -38,13 +40,86 @@
                 KASSERT(!err                                         \
                         && "shouldn\'t fail for a page belonging "   \
                         "to a block device");                        \
+                s5_journal_add((fs), p, NULL);                       \
         } while (0)
 
 
 static void s5_free_block(s5fs_t *fs, int block);
-static int s5_alloc_block(s5fs_t *);
+static int s5_alloc_block(s5fs_t *fs, uint32_t ino, uint32_t goal);
 
 
+/*
+ * Where a new block for block 'blocknum' of the file would best go: just
+ * after the file's previous block, if it has one. Returns 0 for no
+ * preference.
+ */
+static uint32_t
+s5_block_goal(vnode_t *vnode, uint32_t blocknum)
+{
+        int prev;
+
+        if (0 == blocknum)
+                return 0;
+        prev = s5_seek_to_block(vnode, (off_t)(blocknum - 1) * S5_BLOCK_SIZE, 0);
+        return (0 < prev) ? (uint32_t)prev + 1 : 0;
+}
+
+/*
+ * Returns the block pointer *bp (in the inode, or in the block held by
+ * pframe 'holder'), which maps block 'blocknum' of the file or an
+ * indirect block on the way to it. If it is sparse and alloc is true, a
+ * new block is allocated for it first, and zeroed if it is an indirect
+ * block. Returns 0 for a sparse pointer, otherwise the block or -errno.
+ */
+static int
+s5_map_pointer(vnode_t *vnode, pframe_t *holder, uint32_t *bp,
+               uint32_t blocknum, int alloc, int indirect)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *p;
+        int ret;
+
+        if (*bp || !alloc)
+                return *bp;
+
+        if (holder)
+                pframe_pin(holder);
+        ret = s5_alloc_block(fs, inode->s5_number,
+                             s5_block_goal(vnode, blocknum));
+        if (0 <= ret) {
+                if (indirect) {
+                        pframe_get(S5FS_TO_VMOBJ(fs), ret, &p);
+                        KASSERT(p);
+                        memset(p->pf_addr, 0, S5_BLOCK_SIZE);
+                        pframe_dirty(p);
+                        s5_journal_add(fs, p, NULL);
+                }
+                *bp = ret;
+                if (holder) {
+                        pframe_dirty(holder);
+                        s5_journal_add(fs, holder, NULL);
+                } else
+                        s5_dirty_inode(fs, inode);
+        }
+        if (holder)
+                pframe_unpin(holder);
+        return ret;
+}
+
+/* s5_map_pointer() for entry 'index' of indirect block 'iblock' */
+static int
+s5_map_indirect(vnode_t *vnode, uint32_t iblock, uint32_t index,
+                uint32_t blocknum, int alloc, int indirect)
+{
+        pframe_t *ibp;
+
+        pframe_get(S5FS_TO_VMOBJ(VNODE_TO_S5FS(vnode)), iblock, &ibp);
+        KASSERT(ibp);
+        return s5_map_pointer(vnode, ibp, (uint32_t *)ibp->pf_addr + index,
+                              blocknum, alloc, indirect);
+}
+
 /*
  * Return the disk-block number for the given seek pointer (aka file
  * position).
@@ -52,19 +127,60 @@ static int s5_alloc_block(s5fs_t *);
  * If the seek pointer refers to a sparse block, and alloc is false,
  * then return 0. If the seek pointer refers to a sparse block, and
  * alloc is true, then allocate a new disk block (and make the inode
- * point to it) and return it.
+ * point to it) and return it. New blocks (indirect blocks too) are
+ * asked for right after the file's previous block.
  *
- * Be sure to handle indirect blocks!
+ * Blocks under the double indirect block go through an indirect block
+ * found in the double indirect block. The vnode remembers the last of
+ * those, so going through a file in order only looks one up every
+ * S5_NIDIRECT_BLOCKS blocks.
  *
  * If there is an error, return -errno.
- *
- * You probably want to use pframe_get, pframe_pin, pframe_unpin, pframe_dirty.
  */
 int
 s5_seek_to_block(vnode_t *vnode, off_t seekptr, int alloc)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_seek_to_block");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        uint32_t blocknum = S5_DATA_BLOCK(seekptr);
+        uint32_t ndirect = S5_INODE_NDIRECT(inode);
+        uint32_t index, base;
+        int ret;
+
+        KASSERT(!S5_INODE_INLINE(inode));
+
+        if (blocknum >= S5_INODE_MAX_BLOCKS(inode))
+                return -EFBIG;
+
+        if (blocknum < ndirect)
+                return s5_map_pointer(vnode, NULL,
+                                      &inode->s5_direct_blocks[blocknum],
+                                      blocknum, alloc, 0);
+
+        index = blocknum - ndirect;
+        if (index < S5_NIDIRECT_BLOCKS) {
+                ret = s5_map_pointer(vnode, NULL, &inode->s5_indirect_block,
+                                     blocknum, alloc, 1);
+                if (0 >= ret)
+                        return ret;
+                return s5_map_indirect(vnode, ret, index, blocknum, alloc, 0);
+        }
+
+        index -= S5_NIDIRECT_BLOCKS;
+        base = blocknum - index % S5_NIDIRECT_BLOCKS;
+        if (vnode->vn_iblock_base != base || !vnode->vn_iblock) {
+                ret = s5_map_pointer(vnode, NULL, &inode->s5_dindirect_block,
+                                     blocknum, alloc, 1);
+                if (0 >= ret)
+                        return ret;
+                ret = s5_map_indirect(vnode, ret, index / S5_NIDIRECT_BLOCKS,
+                                      blocknum, alloc, 1);
+                if (0 >= ret)
+                        return ret;
+                vnode->vn_iblock = ret;
+                vnode->vn_iblock_base = base;
+        }
+        return s5_map_indirect(vnode, vnode->vn_iblock,
+                               index % S5_NIDIRECT_BLOCKS, blocknum, alloc, 0);
 }
 
 
@@ -87,6 +203,49 @@ unlock_s5(s5fs_t *fs)
 }
 
 
+/*
+ * Moves an inline file's data to a block of its own. Page 0 is brought
+ * in (from the inode) while the file is still inline; once the flag is
+ * off, dirtying it allocates the block the page will be written to.
+ */
+static int
+s5_inline_spill(vnode_t *vnode)
+{
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *p;
+        int ret;
+
+        if (0 > (ret = pframe_get(&vnode->vn_mmobj, 0, &p)))
+                return ret;
+        pframe_pin(p);
+        inode->s5_type &= ~S5_FLAG_INLINE;
+        memset(inode->s5_direct_blocks, 0, S5_INLINE_SIZE);
+        if (0 > (ret = pframe_dirty(p))) {
+                memcpy(inode->s5_direct_blocks, p->pf_addr, S5_INLINE_SIZE);
+                inode->s5_type |= S5_FLAG_INLINE;
+        }
+        s5_dirty_inode(fs, inode);
+        pframe_unpin(p);
+        return ret;
+}
+
+/*
+ * Writes to an inline file which stays within S5_INLINE_SIZE go
+ * straight to the inode, and to page 0 too if it is in memory (which
+ * happens if the file is mapped) so the two do not disagree.
+ */
+static void
+s5_inline_write(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *p;
+
+        memcpy((char *)inode->s5_direct_blocks + seek, bytes, len);
+        if (NULL != (p = pframe_get_resident(&vnode->vn_mmobj, 0)))
+                memcpy((char *)p->pf_addr + seek, bytes, len);
+}
+
 /*
  * Write len bytes to the given inode, starting at seek bytes from the
  * beginning of the inode. On success, return the number of bytes
@@ -110,8 +269,54 @@ unlock_s5(s5fs_t *fs)
 int
 s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_write_file");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *p;
+        size_t done = 0, n;
+        off_t pos;
+        int ret = 0;
+
+        if (0 == len)
+                return 0;
+
+        if (S5_INODE_INLINE(inode)) {
+                if ((size_t)seek + len <= S5_INLINE_SIZE) {
+                        s5_inline_write(vnode, seek, bytes, len);
+                        done = len;
+                        goto grow;
+                }
+                if (0 > (ret = s5_inline_spill(vnode)))
+                        return ret;
+        }
+
+        while (done < len) {
+                pos = seek + done;
+                n = MIN(len - done, (size_t)(S5_BLOCK_SIZE - S5_DATA_OFFSET(pos)));
+                if (0 > (ret = pframe_get(&vnode->vn_mmobj, S5_DATA_BLOCK(pos), &p)))
+                        break;
+                pframe_pin(p);
+                if (0 > (ret = pframe_dirty(p))) {
+                        pframe_unpin(p);
+                        break;
+                }
+                memcpy((char *)p->pf_addr + S5_DATA_OFFSET(pos), bytes + done, n);
+                if (S5_TYPE_DIR == S5_INODE_TYPE(inode))
+                        s5_journal_add(fs, p, vnode);
+                pframe_unpin(p);
+                done += n;
+        }
+        if (0 == done)
+                return ret;
+
+grow:
+        if (seek + (off_t)done > vnode->vn_len) {
+                vnode->vn_len = seek + done;
+                inode->s5_size = vnode->vn_len;
+                s5_dirty_inode(fs, inode);
+        } else if (S5_INODE_INLINE(inode)) {
+                s5_dirty_inode(fs, inode);
+        }
+        return done;
 }
 
 /*
@@ -137,32 +342,285 @@ s5_write_file(vnode_t *vnode, off_t seek, const char *bytes, size_t len)
 int
 s5_read_file(struct vnode *vnode, off_t seek, char *dest, size_t len)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_read_file");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        pframe_t *p;
+        size_t done = 0, n;
+        off_t pos;
+        int ret;
+
+        if (seek >= vnode->vn_len)
+                return 0;
+        len = MIN(len, (size_t)(vnode->vn_len - seek));
+
+        /* if page 0 is in memory it is at least as new as the inode */
+        if (S5_INODE_INLINE(inode)
+            && NULL == pframe_get_resident(&vnode->vn_mmobj, 0)) {
+                memcpy(dest, (char *)inode->s5_direct_blocks + seek, len);
+                return len;
+        }
+
+        while (done < len) {
+                pos = seek + done;
+                n = MIN(len - done, (size_t)(S5_BLOCK_SIZE - S5_DATA_OFFSET(pos)));
+                if (0 > (ret = pframe_get(&vnode->vn_mmobj, S5_DATA_BLOCK(pos), &p)))
+                        return done ? (int)done : ret;
+                memcpy(dest + done, (char *)p->pf_addr + S5_DATA_OFFSET(pos), n);
+                done += n;
+        }
+        return done;
 }
 
 /*
- * Allocate a new disk-block off the block free list and return it. If
- * there are no free blocks, return -ENOSPC.
+ * The free block bitmap has one bit for each block on the disk, set if
+ * the block is in use (the superblock, inodes and bitmap included, and
+ * so are the bits past the end of the disk).
+ */
+static uint32_t *
+s5_bitmap_word(s5fs_t *fs, uint32_t blockno)
+{
+        pframe_t *p;
+
+        pframe_get(S5FS_TO_VMOBJ(fs),
+                   fs->s5f_super->s5s_bitmap_block + blockno / S5_BITS_PER_BLOCK,
+                   &p);
+        KASSERT(p);
+        return (uint32_t *)p->pf_addr + (blockno % S5_BITS_PER_BLOCK) / 32;
+}
+
+static void
+s5_bitmap_dirty(s5fs_t *fs, uint32_t blockno)
+{
+        pframe_t *p;
+        int err;
+
+        pframe_get(S5FS_TO_VMOBJ(fs),
+                   fs->s5f_super->s5s_bitmap_block + blockno / S5_BITS_PER_BLOCK,
+                   &p);
+        KASSERT(p);
+        err = pframe_dirty(p);
+        KASSERT(!err);
+        s5_journal_add(fs, p, NULL);
+}
+
+static int
+s5_bitmap_test(s5fs_t *fs, uint32_t blockno)
+{
+        return 0 != (*s5_bitmap_word(fs, blockno) & (1U << (blockno % 32)));
+}
+
+static void
+s5_bitmap_set(s5fs_t *fs, uint32_t blockno, int used)
+{
+        uint32_t *w = s5_bitmap_word(fs, blockno);
+
+        KASSERT(!used != !(*w & (1U << (blockno % 32))));
+        if (used)
+                *w |= 1U << (blockno % 32);
+        else
+                *w &= ~(1U << (blockno % 32));
+        s5_bitmap_dirty(fs, blockno);
+}
+
+/*
+ * Finds a free block, looking from 'goal' to the end of the disk and
+ * then from the start, a word of the bitmap at a time where it is full.
+ * Returns the block number or -ENOSPC.
+ */
+static int
+s5_bitmap_find(s5fs_t *fs, uint32_t goal)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t blk, end, *w;
+        int pass;
+
+        if (0 == s->s5s_nfree_blocks)
+                return -ENOSPC;
+        if (goal >= s->s5s_num_blocks)
+                goal = 0;
+
+        blk = goal;
+        end = s->s5s_num_blocks;
+        for (pass = 0; pass < 2; ++pass) {
+                while (blk < end) {
+                        w = s5_bitmap_word(fs, blk);
+                        if (0 == blk % 32 && 0xffffffff == *w) {
+                                blk += 32;
+                                continue;
+                        }
+                        if (!(*w & (1U << (blk % 32))))
+                                return blk;
+                        ++blk;
+                }
+                blk = 0;
+                end = goal;
+        }
+        return -ENOSPC;
+}
+
+/* Gives back the blocks set aside in 'p'. Called with the fs locked. */
+static void
+s5_prealloc_release(s5fs_t *fs, s5_prealloc_t *p)
+{
+        while (0 < p->s5p_count) {
+                s5_bitmap_set(fs, p->s5p_next, 0);
+                fs->s5f_super->s5s_nfree_blocks++;
+                p->s5p_next++;
+                p->s5p_count--;
+        }
+        p->s5p_ino = (uint32_t) -1;
+        s5_dirty_super(fs);
+}
+
+static s5_prealloc_t *
+s5_prealloc_find(s5fs_t *fs, uint32_t ino)
+{
+        int i;
+
+        for (i = 0; i < S5_NPREALLOC; ++i) {
+                if (fs->s5f_prealloc[i].s5p_ino == ino)
+                        return &fs->s5f_prealloc[i];
+        }
+        return NULL;
+}
+
+/* Sets aside the free blocks following 'blockno' (up to the first one
+ * in use) for the next writes to file 'ino'. Called with the fs locked. */
+static void
+s5_prealloc_make(s5fs_t *fs, uint32_t ino, uint32_t blockno)
+{
+        s5_prealloc_t *p;
+        uint32_t next = blockno + 1;
+
+        if (NULL == (p = s5_prealloc_find(fs, ino))) {
+                p = &fs->s5f_prealloc[fs->s5f_prealloc_next];
+                fs->s5f_prealloc_next = (fs->s5f_prealloc_next + 1) % S5_NPREALLOC;
+        }
+        s5_prealloc_release(fs, p);
+
+        p->s5p_ino = ino;
+        p->s5p_next = next;
+        while (p->s5p_count < S5_PREALLOC_BLOCKS
+               && next < fs->s5f_super->s5s_num_blocks
+               && !s5_bitmap_test(fs, next)) {
+                s5_bitmap_set(fs, next, 1);
+                fs->s5f_super->s5s_nfree_blocks--;
+                p->s5p_count++;
+                next++;
+        }
+}
+
+/*
+ * Gives back whatever blocks are set aside for file 'ino', or for every
+ * file if 'ino' is -1.
+ */
+void
+s5_drop_prealloc(fs_t *vfs, uint32_t ino)
+{
+        s5fs_t *fs = FS_TO_S5FS(vfs);
+        int i;
+
+        if (fs->s5f_super->s5s_version < S5_CURRENT_VERSION)
+                return;
+
+        lock_s5(fs);
+        for (i = 0; i < S5_NPREALLOC; ++i) {
+                if ((uint32_t) -1 == ino || fs->s5f_prealloc[i].s5p_ino == ino)
+                        s5_prealloc_release(fs, &fs->s5f_prealloc[i]);
+        }
+        unlock_s5(fs);
+}
+
+/* Takes a block off a version 3 disk's free block list */
+static int
+s5_alloc_block_list(s5fs_t *fs)
+{
+        s5_super_t *s = fs->s5f_super;
+        pframe_t *next_free_blocks;
+        int ret;
+
+        lock_s5(fs);
+
+        KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
+
+        if (0 == s->s5s_nfree) {
+                if ((uint32_t) -1 == s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1]) {
+                        unlock_s5(fs);
+                        return -ENOSPC;
+                }
+                /* the last block on the list holds the next node of it */
+                ret = s->s5s_free_blocks[S5_NBLKS_PER_FNODE - 1];
+                pframe_get(S5FS_TO_VMOBJ(fs), ret, &next_free_blocks);
+                KASSERT(next_free_blocks);
+                memcpy((void *)s->s5s_free_blocks, next_free_blocks->pf_addr,
+                       S5_NBLKS_PER_FNODE * sizeof(uint32_t));
+                s->s5s_nfree = S5_NBLKS_PER_FNODE - 1;
+        } else {
+                ret = s->s5s_free_blocks[--s->s5s_nfree];
+        }
+
+        s5_dirty_super(fs);
+
+        unlock_s5(fs);
+
+        return ret;
+}
+
+/*
+ * Allocate a new disk block for file 'ino' and return it. If there are
+ * no free blocks, return -ENOSPC.
  *
  * This will not initialize the contents of an allocated block; these
  * contents are undefined.
  *
- * If the super block's s5s_nfree is 0, you need to refill 
- * s5s_free_blocks and reset s5s_nfree.  You need to read the contents 
- * of this page using the pframe system in order to obtain the next set of
- * free block numbers.
- *
- * Don't forget to dirty the appropriate blocks!
- *
- * You'll probably want to use lock_s5(), unlock_s5(), pframe_get(),
- * and s5_dirty_super()
+ * On disks with a free block bitmap the block will be 'goal' if that
+ * is free, or the first free one after it. A file being written
+ * sequentially has the blocks after the one it got set aside for it,
+ * so that other files being written at the same time do not take
+ * them. Older disks take the block off the free list, and ignore
+ * 'goal'.
  */
 static int
-s5_alloc_block(s5fs_t *fs)
+s5_alloc_block(s5fs_t *fs, uint32_t ino, uint32_t goal)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_alloc_block");
-        return -1;
+        s5_super_t *s = fs->s5f_super;
+        s5_prealloc_t *p;
+        int ret;
+
+        if (s->s5s_version < S5_CURRENT_VERSION)
+                return s5_alloc_block_list(fs);
+
+        lock_s5(fs);
+
+        p = s5_prealloc_find(fs, ino);
+        if (NULL != p && 0 < p->s5p_count && (0 == goal || p->s5p_next == goal)) {
+                ret = p->s5p_next++;
+                p->s5p_count--;
+                s5_fsck_note_block(fs, ret, 1);
+                unlock_s5(fs);
+                return ret;
+        }
+
+        if (0 == goal)
+                goal = fs->s5f_rotor;
+        if (0 > (ret = s5_bitmap_find(fs, goal))) {
+                /* maybe somebody is sitting on the last free blocks */
+                if (NULL != p)
+                        s5_prealloc_release(fs, p);
+                ret = s5_bitmap_find(fs, goal);
+        }
+        if (0 <= ret) {
+                s5_bitmap_set(fs, ret, 1);
+                s5_fsck_note_block(fs, ret, 1);
+                s->s5s_nfree_blocks--;
+                fs->s5f_rotor = ret + 1;
+                if ((uint32_t)ret == goal)
+                        s5_prealloc_make(fs, ino, ret);
+                s5_dirty_super(fs);
+        }
+
+        unlock_s5(fs);
+
+        return ret;
 }
 
 
@@ -183,6 +641,17 @@ s5_free_block(s5fs_t *fs, int blockno)
 
         lock_s5(fs);
 
+        if (S5_CURRENT_VERSION == s->s5s_version) {
+                KASSERT((uint32_t)blockno < s->s5s_num_blocks);
+                s5_journal_revoke(fs, blockno);
+                s5_bitmap_set(fs, blockno, 0);
+                s5_fsck_note_block(fs, blockno, 0);
+                s->s5s_nfree_blocks++;
+                s5_dirty_super(fs);
+                unlock_s5(fs);
+                return;
+        }
+
         KASSERT(S5_NBLKS_PER_FNODE > s->s5s_nfree);
 
         if ((S5_NBLKS_PER_FNODE - 1) == s->s5s_nfree) {
@@ -210,13 +679,130 @@ s5_free_block(s5fs_t *fs, int blockno)
 }
 
 /*
- * Creates a new inode from the free list and initializes its fields.
+ * On a version 4 disk the inode bitmap has one bit for each inode,
+ * set if the inode is in use (as are the bits past the last inode).
+ * Its pages stay in memory while the fs is mounted and are written back
+ * whenever the page cache gets to them.
+ */
+static uint32_t *
+s5_ibitmap_word(s5fs_t *fs, uint32_t ino)
+{
+        return (uint32_t *)fs->s5f_ibitmap[ino / S5_BITS_PER_BLOCK]->pf_addr
+               + (ino % S5_BITS_PER_BLOCK) / 32;
+}
+
+static void
+s5_ibitmap_set(s5fs_t *fs, uint32_t ino, int used)
+{
+        uint32_t *w = s5_ibitmap_word(fs, ino);
+        pframe_t *p;
+        int err;
+
+        KASSERT(!used != !(*w & (1U << (ino % 32))));
+        if (used)
+                *w |= 1U << (ino % 32);
+        else
+                *w &= ~(1U << (ino % 32));
+
+        pframe_get(S5FS_TO_VMOBJ(fs),
+                   fs->s5f_super->s5s_ibitmap_block + ino / S5_BITS_PER_BLOCK,
+                   &p);
+        KASSERT(p == fs->s5f_ibitmap[ino / S5_BITS_PER_BLOCK]);
+        err = pframe_dirty(p);
+        KASSERT(!err);
+        s5_journal_add(fs, p, NULL);
+}
+
+/*
+ * Finds a free inode, trying the ones stored in the same block as inode
+ * 'near' first and going on from there, wrapping around at the end.
+ * Returns the inode number or -ENOSPC.
+ */
+static int
+s5_ibitmap_find(s5fs_t *fs, uint32_t near)
+{
+        s5_super_t *s = fs->s5f_super;
+        uint32_t ino, end, goal, *w;
+        int pass;
+
+        if (0 == s->s5s_nfree_inodes)
+                return -ENOSPC;
+        goal = (near < s->s5s_num_inodes)
+               ? near - near % S5_INODES_PER_BLOCK : 0;
+
+        ino = goal;
+        end = s->s5s_num_inodes;
+        for (pass = 0; pass < 2; ++pass) {
+                while (ino < end) {
+                        w = s5_ibitmap_word(fs, ino);
+                        if (0 == ino % 32 && 0xffffffff == *w) {
+                                ino += 32;
+                                continue;
+                        }
+                        if (!(*w & (1U << (ino % 32))))
+                                return ino;
+                        ++ino;
+                }
+                ino = 0;
+                end = goal;
+        }
+        return -ENOSPC;
+}
+
+/*
+ * Takes a free inode out of the inode bitmap, or off the free list on
+ * version 3 disks. Called with the fs locked.
+ */
+static int
+s5_take_inode(s5fs_t *fs, uint32_t near)
+{
+        s5_super_t *s = fs->s5f_super;
+        pframe_t *inodep;
+        s5_inode_t *inode;
+        int ino;
+
+        if (S5_CURRENT_VERSION == s->s5s_version) {
+                if (0 > (ino = s5_ibitmap_find(fs, near)))
+                        return ino;
+                s5_ibitmap_set(fs, ino, 1);
+                s5_fsck_note_inode(fs, ino, 1);
+                s->s5s_nfree_inodes--;
+                s5_dirty_super(fs);
+                return ino;
+        }
+
+        if (s->s5s_free_inode == (uint32_t) -1)
+                return -ENOSPC;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), S5_INODE_BLOCK(s->s5s_free_inode),
+                   &inodep);
+        KASSERT(inodep);
+
+        inode = (s5_inode_t *)(inodep->pf_addr)
+                + S5_INODE_OFFSET(s->s5s_free_inode);
+
+        KASSERT(inode->s5_number == s->s5s_free_inode);
+
+        ino = inode->s5_number;
+
+        /* reset s5s_free_inode; remove the inode from the inode free list: */
+        s->s5s_free_inode = inode->s5_next_free;
+        pframe_pin(inodep);
+        s5_dirty_super(fs);
+        pframe_unpin(inodep);
+        return ino;
+}
+
+/*
+ * Creates a new inode and initializes its fields. It is put near inode
+ * 'near' (the directory it will go in) if there is room, so looking
+ * through a directory's files reads few inode blocks.
  * Uses S5_INODE_BLOCK to get the page from which to create the inode
  *
  * This function may block.
  */
 int
-s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
+s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid, ino_t near)
 {
         s5fs_t *s5fs = FS_TO_S5FS(fs);
         pframe_t *inodep;
@@ -231,33 +817,35 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
 
         lock_s5(s5fs);
 
-        if (s5fs->s5f_super->s5s_free_inode == (uint32_t) -1) {
+        if (0 > (ret = s5_take_inode(s5fs, near))) {
                 unlock_s5(s5fs);
-                return -ENOSPC;
+                return ret;
         }
 
-        pframe_get(&s5fs->s5f_bdev->bd_mmobj,
-                   S5_INODE_BLOCK(s5fs->s5f_super->s5s_free_inode),
-                   &inodep);
+        pframe_get(S5FS_TO_VMOBJ(s5fs), S5_INODE_BLOCK(ret), &inodep);
         KASSERT(inodep);
 
-        inode = (s5_inode_t *)(inodep->pf_addr)
-                + S5_INODE_OFFSET(s5fs->s5f_super->s5s_free_inode);
-
-        KASSERT(inode->s5_number == s5fs->s5f_super->s5s_free_inode);
+        inode = (s5_inode_t *)(inodep->pf_addr) + S5_INODE_OFFSET(ret);
 
-        ret = inode->s5_number;
-
-        /* reset s5s_free_inode; remove the inode from the inode free list: */
-        s5fs->s5f_super->s5s_free_inode = inode->s5_next_free;
-        pframe_pin(inodep);
-        s5_dirty_super(s5fs);
-        pframe_unpin(inodep);
+        KASSERT(inode->s5_number == (uint32_t) ret
+                && S5_TYPE_FREE == inode->s5_type);
 
 
         /* init the newly-allocated inode: */
         inode->s5_size = 0;
         inode->s5_type = type;
+        if (S5_TYPE_DIR == type
+            && S5_CURRENT_VERSION == s5fs->s5f_super->s5s_version) {
+                /* the index block stays sparse until a name is added */
+                inode->s5_type |= S5_FLAG_HASHED;
+                inode->s5_size = S5_BLOCK_SIZE;
+        }
+        if ((S5_TYPE_DATA == type || S5_TYPE_DIR == type)
+            && S5_CURRENT_VERSION == s5fs->s5f_super->s5s_version)
+                inode->s5_type |= S5_FLAG_DINDIRECT;
+        if (S5_TYPE_DATA == type
+            && S5_CURRENT_VERSION == s5fs->s5f_super->s5s_version)
+                inode->s5_type |= S5_FLAG_INLINE;
         inode->s5_linkcount = 0;
         memset(inode->s5_direct_blocks, 0, S5_NDIRECT_BLOCKS * sizeof(int));
         if ((S5_TYPE_CHR == type) || (S5_TYPE_BLK == type))
@@ -273,6 +861,39 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
 }
 
 
+/*
+ * Frees indirect block 'block' and the blocks it points to, which are
+ * indirect blocks themselves if depth is 2.
+ */
+static void
+s5_free_indirect(s5fs_t *fs, uint32_t block, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+        KASSERT(ibp
+                && "because never fails for block_device "
+                "vm_objects");
+        pframe_pin(ibp);
+
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                KASSERT(b[i] != block);
+                if (!b[i])
+                        continue;
+                if (1 < depth)
+                        s5_free_indirect(fs, b[i], depth - 1);
+                else
+                        s5_free_block(fs, b[i]);
+        }
+
+        pframe_unpin(ibp);
+
+        s5_free_block(fs, block);
+}
+
 /*
  * Free an inode by freeing its disk blocks and putting it back on the
  * inode free list.
@@ -287,17 +908,25 @@ s5_alloc_inode(fs_t *fs, uint16_t type, devid_t devid)
 void
 s5_free_inode(vnode_t *vnode)
 {
-        uint32_t i;
+        uint32_t i, ndirect;
         s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
         s5fs_t *fs = VNODE_TO_S5FS(vnode);
 
-        KASSERT((S5_TYPE_DATA == inode->s5_type)
-                || (S5_TYPE_DIR == inode->s5_type)
-                || (S5_TYPE_CHR == inode->s5_type)
-                || (S5_TYPE_BLK == inode->s5_type));
+        s5_drop_prealloc(vnode->vn_fs, inode->s5_number);
+        vnode->vn_iblock = 0;
+
+        KASSERT((S5_TYPE_DATA == S5_INODE_TYPE(inode))
+                || (S5_TYPE_DIR == S5_INODE_TYPE(inode))
+                || (S5_TYPE_CHR == S5_INODE_TYPE(inode))
+                || (S5_TYPE_BLK == S5_INODE_TYPE(inode)));
+
+        /* an inline file's direct blocks are its data */
+        if (S5_INODE_INLINE(inode))
+                memset(inode->s5_direct_blocks, 0, S5_INLINE_SIZE);
 
         /* free any direct blocks */
-        for (i = 0; i < S5_NDIRECT_BLOCKS; ++i) {
+        ndirect = S5_INODE_INLINE(inode) ? 0 : S5_INODE_NDIRECT(inode);
+        for (i = 0; i < ndirect; ++i) {
                 if (inode->s5_direct_blocks[i]) {
                         dprintf("freeing block %d\n", inode->s5_direct_blocks[i]);
                         s5_free_block(fs, inode->s5_direct_blocks[i]);
@@ -307,30 +936,15 @@ s5_free_inode(vnode_t *vnode)
                 }
         }
 
-        if (((S5_TYPE_DATA == inode->s5_type)
-             || (S5_TYPE_DIR == inode->s5_type))
-            && inode->s5_indirect_block) {
-                pframe_t *ibp;
-                uint32_t *b;
-
-                pframe_get(S5FS_TO_VMOBJ(fs),
-                           (unsigned)inode->s5_indirect_block,
-                           &ibp);
-                KASSERT(ibp
-                        && "because never fails for block_device "
-                        "vm_objects");
-                pframe_pin(ibp);
-
-                b = (uint32_t *)(ibp->pf_addr);
-                for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
-                        KASSERT(b[i] != inode->s5_indirect_block);
-                        if (b[i])
-                                s5_free_block(fs, b[i]);
-                }
-
-                pframe_unpin(ibp);
+        if (((S5_TYPE_DATA == S5_INODE_TYPE(inode))
+             || (S5_TYPE_DIR == S5_INODE_TYPE(inode)))
+            && inode->s5_indirect_block)
+                s5_free_indirect(fs, inode->s5_indirect_block, 1);
 
-                s5_free_block(fs, inode->s5_indirect_block);
+        if ((inode->s5_type & S5_FLAG_DINDIRECT) && !S5_INODE_INLINE(inode)
+            && inode->s5_dindirect_block) {
+                s5_free_indirect(fs, inode->s5_dindirect_block, 2);
+                inode->s5_dindirect_block = 0;
         }
 
         inode->s5_indirect_block = 0;
@@ -338,29 +952,182 @@ s5_free_inode(vnode_t *vnode)
         s5_dirty_inode(fs, inode);
 
         lock_s5(fs);
-        inode->s5_next_free = fs->s5f_super->s5s_free_inode;
-        fs->s5f_super->s5s_free_inode = inode->s5_number;
+        if (S5_CURRENT_VERSION == fs->s5f_super->s5s_version) {
+                inode->s5_size = 0;
+                s5_ibitmap_set(fs, inode->s5_number, 0);
+                s5_fsck_note_inode(fs, inode->s5_number, 0);
+                fs->s5f_super->s5s_nfree_inodes++;
+        } else {
+                inode->s5_next_free = fs->s5f_super->s5s_free_inode;
+                fs->s5f_super->s5s_free_inode = inode->s5_number;
+        }
         unlock_s5(fs);
 
         s5_dirty_inode(fs, inode);
         s5_dirty_super(fs);
 }
 
+static uint32_t
+s5_name_bucket(const char *name, size_t namelen)
+{
+        uint32_t h = S5_NAME_HASH_INIT;
+        size_t i;
+
+        for (i = 0; i < namelen; ++i)
+                h = S5_NAME_HASH_STEP(h, name[i]);
+        return h % S5_DIR_NBUCKETS;
+}
+
+/* Which block of dirents (counting from the first after the index) the
+ * entry at offset 'off' in a hashed directory is in */
+#define S5_DIR_BLOCK(off) (((off) - S5_BLOCK_SIZE) / S5_BLOCK_SIZE)
+
+static int
+s5_read_dirent(vnode_t *vnode, off_t off, s5_dirent_t *d)
+{
+        int ret = s5_read_file(vnode, off, (char *)d, sizeof(s5_dirent_t));
+
+        if (0 > ret)
+                return ret;
+        KASSERT(sizeof(s5_dirent_t) == ret);
+        return 0;
+}
+
+/*
+ * Looks through the dirents from offset 'start' up to 'end' for 'name'
+ * (or, if 'name' is NULL, for any name in bucket 'bucket'). Returns the
+ * inode number of the entry and sets *offp to its offset, or returns
+ * -ENOENT.
+ */
+static int
+s5_scan_dirents(vnode_t *vnode, off_t start, off_t end, const char *name,
+                size_t namelen, uint32_t bucket, off_t *offp)
+{
+        s5_dirent_t d;
+        off_t off;
+        int ret;
+
+        for (off = start; off + (off_t)sizeof(s5_dirent_t) <= end;
+             off += sizeof(s5_dirent_t)) {
+                if (0 > (ret = s5_read_dirent(vnode, off, &d)))
+                        return ret;
+                if (NULL != name ? name_match(d.s5d_name, name, namelen)
+                    : s5_name_bucket(d.s5d_name, strlen(d.s5d_name)) == bucket) {
+                        *offp = off;
+                        return d.s5d_inode;
+                }
+        }
+        return -ENOENT;
+}
+
+/* Reads or writes the index entry for 'bucket' of a hashed directory */
+static int
+s5_dirhash_get(vnode_t *vnode, uint32_t bucket, s5_dirhash_t *h)
+{
+        int ret = s5_read_file(vnode, bucket * sizeof(s5_dirhash_t),
+                               (char *)h, sizeof(s5_dirhash_t));
+        return (0 > ret) ? ret : 0;
+}
+
+static int
+s5_dirhash_put(vnode_t *vnode, uint32_t bucket, s5_dirhash_t *h)
+{
+        int ret = s5_write_file(vnode, bucket * sizeof(s5_dirhash_t),
+                                (char *)h, sizeof(s5_dirhash_t));
+        return (0 > ret) ? ret : 0;
+}
+
+/* Notes in the index that block 'blk' of dirents holds a name in 'bucket' */
+static int
+s5_dirhash_mark(vnode_t *vnode, uint32_t blk, uint32_t bucket)
+{
+        s5_dirhash_t h;
+        int ret;
+
+        if (S5_DIR_NINDEXED <= blk)
+                return 0;
+        if (0 > (ret = s5_dirhash_get(vnode, bucket, &h)))
+                return ret;
+        if (h.s5h_blocks[blk / 32] & (1U << (blk % 32)))
+                return 0;
+        h.s5h_blocks[blk / 32] |= 1U << (blk % 32);
+        return s5_dirhash_put(vnode, bucket, &h);
+}
+
+/* Clears the index bit for block 'blk' and 'bucket' if no name left in
+ * the block is in that bucket. Failing to do so is harmless. */
+static void
+s5_dirhash_unmark(vnode_t *vnode, uint32_t blk, uint32_t bucket)
+{
+        s5_dirhash_t h;
+        off_t start, end, off;
+
+        if (S5_DIR_NINDEXED <= blk)
+                return;
+        start = S5_BLOCK_SIZE + (off_t)blk * S5_BLOCK_SIZE;
+        end = MIN(start + S5_BLOCK_SIZE, vnode->vn_len);
+        if (-ENOENT != s5_scan_dirents(vnode, start, end, NULL, 0, bucket, &off))
+                return;
+        if (0 > s5_dirhash_get(vnode, bucket, &h))
+                return;
+        h.s5h_blocks[blk / 32] &= ~(1U << (blk % 32));
+        (void) s5_dirhash_put(vnode, bucket, &h);
+}
+
+/*
+ * Finds 'name' in the directory, returning its inode number and setting
+ * *offp to the offset of its dirent, or returning -ENOENT. A hashed
+ * directory only has the blocks its index points at searched.
+ */
+static int
+s5_lookup_dirent(vnode_t *vnode, const char *name, size_t namelen, off_t *offp)
+{
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5_dirhash_t h;
+        uint32_t bucket, blk;
+        off_t start;
+        int ret;
+
+        KASSERT(S5_TYPE_DIR == S5_INODE_TYPE(inode));
+
+        if (!(inode->s5_type & S5_FLAG_HASHED))
+                return s5_scan_dirents(vnode, 0, vnode->vn_len, name, namelen,
+                                       0, offp);
+
+        bucket = s5_name_bucket(name, namelen);
+        if (0 > (ret = s5_dirhash_get(vnode, bucket, &h)))
+                return ret;
+        for (blk = 0; blk < S5_DIR_NINDEXED; ++blk) {
+                start = S5_BLOCK_SIZE + (off_t)blk * S5_BLOCK_SIZE;
+                if (start >= vnode->vn_len)
+                        return -ENOENT;
+                if (!(h.s5h_blocks[blk / 32] & (1U << (blk % 32))))
+                        continue;
+                ret = s5_scan_dirents(vnode, start,
+                                      MIN(start + S5_BLOCK_SIZE, vnode->vn_len),
+                                      name, namelen, 0, offp);
+                if (-ENOENT != ret)
+                        return ret;
+        }
+        /* whatever lies past the indexed blocks has to be searched */
+        return s5_scan_dirents(vnode, start + S5_BLOCK_SIZE, vnode->vn_len,
+                               name, namelen, 0, offp);
+}
+
 /*
  * Locate the directory entry in the given inode with the given name,
  * and return its inode number. If there is no entry with the given
  * name, return -ENOENT.
  *
- * You'll probably want to use s5_read_file and name_match
- *
- * You can either read one dirent at a time or optimize and read more.
- * Either is fine.
+ * Directories on a version 3 disk are searched from start to end;
+ * hashed ones only in the blocks their index names.
  */
 int
 s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_find_dirent");
-        return -1;
+        off_t off;
+
+        return s5_lookup_dirent(vnode, name, namelen, &off);
 }
 
 /*
@@ -369,25 +1136,59 @@ s5_find_dirent(vnode_t *vnode, const char *name, size_t namelen)
  * -ENOENT.
  *
  * In order to ensure that the directory entries are contiguous in the
- * directory file, you will need to move the last directory entry into
- * the remove dirent's place.
+ * directory file, the last directory entry is moved into the removed
+ * dirent's place. In a hashed directory the index is updated for both
+ * the name removed and the one moved.
  *
  * When this function returns, the inode refcount on the removed file
  * should be decremented.
- *
- * It would be a nice extension to free blocks from the end of the
- * directory file which are no longer needed.
- *
- * Don't forget to dirty appropriate blocks!
- *
- * You probably want to use vget(), vput(), s5_read_file(),
- * s5_write_file(), and s5_dirty_inode().
  */
 int
 s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_remove_dirent");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        s5_dirent_t last;
+        vnode_t *child;
+        off_t off, lastoff;
+        uint32_t moved = 0;
+        int ino, ret;
+
+        if (0 > (ino = s5_lookup_dirent(vnode, name, namelen, &off)))
+                return ino;
+
+        lastoff = vnode->vn_len - sizeof(s5_dirent_t);
+        if (off != lastoff) {
+                if (0 > (ret = s5_read_dirent(vnode, lastoff, &last)))
+                        return ret;
+                moved = s5_name_bucket(last.s5d_name, strlen(last.s5d_name));
+                if (inode->s5_type & S5_FLAG_HASHED) {
+                        ret = s5_dirhash_mark(vnode, S5_DIR_BLOCK(off), moved);
+                        if (0 > ret)
+                                return ret;
+                }
+                ret = s5_write_file(vnode, off, (char *)&last, sizeof(s5_dirent_t));
+                if (0 > ret)
+                        return ret;
+        }
+
+        vnode->vn_len = lastoff;
+        inode->s5_size = lastoff;
+        s5_dirty_inode(VNODE_TO_S5FS(vnode), inode);
+
+        if (inode->s5_type & S5_FLAG_HASHED) {
+                s5_dirhash_unmark(vnode, S5_DIR_BLOCK(off),
+                                  s5_name_bucket(name, namelen));
+                if (off != lastoff)
+                        s5_dirhash_unmark(vnode, S5_DIR_BLOCK(lastoff), moved);
+        }
+
+        child = vget(vnode->vn_fs, ino);
+        KASSERT(child);
+        VNODE_TO_S5INODE(child)->s5_linkcount--;
+        s5_dirty_inode(VNODE_TO_S5FS(child), VNODE_TO_S5INODE(child));
+        vput(child);
+
+        return 0;
 }
 
 /*
@@ -397,15 +1198,69 @@ s5_remove_dirent(vnode_t *vnode, const char *name, size_t namelen)
  * When this function returns, the inode refcount on the file that was linked to
  * should be incremented.
  *
- * Remember to incrament the ref counts appropriately
- *
- * You probably want to use s5_find_dirent(), s5_write_file(), and s5_dirty_inode().
+ * The entry goes at the end of the directory; in a hashed directory the
+ * index is marked first, since a mark with no entry behind it does no
+ * harm.
  */
 int
 s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_link");
-        return -1;
+        s5_inode_t *inode = VNODE_TO_S5INODE(parent);
+        s5_dirent_t d;
+        off_t off;
+        int ret;
+
+        KASSERT(S5_TYPE_DIR == S5_INODE_TYPE(inode));
+
+        if (namelen >= S5_NAME_LEN)
+                return -ENAMETOOLONG;
+        if (-ENOENT != (ret = s5_lookup_dirent(parent, name, namelen, &off)))
+                return (0 > ret) ? ret : -EEXIST;
+
+        off = parent->vn_len;
+        if (inode->s5_type & S5_FLAG_HASHED) {
+                ret = s5_dirhash_mark(parent, S5_DIR_BLOCK(off),
+                                      s5_name_bucket(name, namelen));
+                if (0 > ret)
+                        return ret;
+        }
+
+        memset(&d, 0, sizeof(s5_dirent_t));
+        d.s5d_inode = child->vn_vno;
+        memcpy(d.s5d_name, name, namelen);
+        ret = s5_write_file(parent, off, (char *)&d, sizeof(s5_dirent_t));
+        if (0 > ret)
+                return ret;
+        KASSERT(sizeof(s5_dirent_t) == ret);
+
+        VNODE_TO_S5INODE(child)->s5_linkcount++;
+        s5_dirty_inode(VNODE_TO_S5FS(child), VNODE_TO_S5INODE(child));
+        return 0;
+}
+
+/* Counts the non-sparse entries of an indirect block, and the blocks
+ * under them if depth is 2 */
+static int
+s5_indirect_blocks(s5fs_t *fs, uint32_t block, int depth)
+{
+        pframe_t *ibp;
+        uint32_t *b;
+        uint32_t i;
+        int count = 0;
+
+        pframe_get(S5FS_TO_VMOBJ(fs), block, &ibp);
+        KASSERT(ibp);
+        pframe_pin(ibp);
+        b = (uint32_t *)(ibp->pf_addr);
+        for (i = 0; i < S5_NIDIRECT_BLOCKS; ++i) {
+                if (!b[i])
+                        continue;
+                count++;
+                if (1 < depth)
+                        count += s5_indirect_blocks(fs, b[i], depth - 1);
+        }
+        pframe_unpin(ibp);
+        return count;
 }
 
 /*
@@ -420,7 +1275,26 @@ s5_link(vnode_t *parent, vnode_t *child, const char *name, size_t namelen)
 int
 s5_inode_blocks(vnode_t *vnode)
 {
-        NOT_YET_IMPLEMENTED("S5FS: s5_inode_blocks");
-        return -1;
+        s5fs_t *fs = VNODE_TO_S5FS(vnode);
+        s5_inode_t *inode = VNODE_TO_S5INODE(vnode);
+        uint32_t i, ndirect;
+        int count = 0;
+
+        if (S5_TYPE_DATA != S5_INODE_TYPE(inode)
+            && S5_TYPE_DIR != S5_INODE_TYPE(inode))
+                return 0;
+        if (S5_INODE_INLINE(inode))
+                return 0;
+
+        ndirect = S5_INODE_NDIRECT(inode);
+        for (i = 0; i < ndirect; ++i) {
+                if (inode->s5_direct_blocks[i])
+                        count++;
+        }
+        if (inode->s5_indirect_block)
+                count += 1 + s5_indirect_blocks(fs, inode->s5_indirect_block, 1);
+        if ((inode->s5_type & S5_FLAG_DINDIRECT) && inode->s5_dindirect_block)
+                count += 1 + s5_indirect_blocks(fs, inode->s5_dindirect_block, 2);
+        return count;
 }
 
@@ -133,6 +133,25 @@ init_func(vfs_init);
 init_depends(vnode_init);
 init_depends(file_init);
 
+void
+vfs_sync(void)
+{
+        fs_t *fs;
+
+        KASSERT(vfs_root_vn);
+
+#ifdef __MOUNTING__
+        list_iterate_begin(&mounted_fs_list, fs, fs_t, fs_link) {
+                if (fs->fs_op->sync)
+                        fs->fs_op->sync(fs);
+        } list_iterate_end();
+#endif
+
+        fs = vfs_root_vn->vn_fs;
+        if (fs->fs_op->sync)
+                fs->fs_op->sync(fs);
+}
+
 int
 vfs_shutdown()
 {
@@ -165,6 +184,8 @@ vfs_shutdown()
                 panic("vfs_shutdown: found active vnodes in root "
                       "filesystem!!! This shouldn't happen!!\n");
         }
+        vnode_cache_purge(fs);
+        dcache_purge(fs);
 
         if (vn->vn_fs->fs_op->umount) {
                 ret = vn->vn_fs->fs_op->umount(fs);
@@ -201,6 +222,7 @@ mountfunc(fs_t *fs)
         };
         unsigned i;
 
+        list_init(&fs->fs_vnodes);
         for (i = 0; i < sizeof(types) / sizeof(types[0]); i++)
                 if (strcmp(fs->fs_type, types[i].fstype) == 0)
                         return types[i].mountfunc(fs);
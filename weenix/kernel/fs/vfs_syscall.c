@@ -354,9 +354,10 @@ do_mknod(const char *path, int mode, unsigned devid)
                         return -EEXIST;
                 }
         }
-        vput(res_vnode);
         KASSERT(NULL!=res_vnode->vn_ops->mknod);
         i=(res_vnode->vn_ops->mknod)(res_vnode,name,namelen,mode,devid);
+        dcache_invalidate(res_vnode,name,namelen);
+        vput(res_vnode);
         dbg(DBG_VFS,"INFO: Making Device node successful. Path=%s, mode=%d, devid=%u\n",path,mode,devid);
          /*  NOT_YET_IMPLEMENTED("VFS: do_mknod");*/
         return i;
@@ -437,6 +438,7 @@ do_mkdir(const char *path)
         
         KASSERT(NULL!=res_vnode->vn_ops->mkdir);                
         i=(res_vnode->vn_ops->mkdir)(res_vnode,name,namelen);
+        dcache_invalidate(res_vnode,name,namelen);
         vput(res_vnode);
         dbg(DBG_VFS,"INFO: The new directory is successfully made. Path=%s\n",path);
         
@@ -538,6 +540,9 @@ do_rmdir(const char *path)
        
         KASSERT(NULL!=res_vnode->vn_ops->rmdir);                
         i=(res_vnode->vn_ops->rmdir)(res_vnode,name,namelen);
+        dcache_invalidate(res_vnode,name,namelen);
+        if(i==0)
+                dcache_purge_dir(result);
         vput(result);
         vput(res_vnode);
         dbg(DBG_VFS,"INFO: Directory remove successful. Path=%s\n",path);
@@ -641,6 +646,7 @@ do_unlink(const char *path)
        
         KASSERT(NULL!=res_vnode->vn_ops->unlink); 
         i=(res_vnode->vn_ops->unlink)(res_vnode,name,namelen);
+        dcache_invalidate(res_vnode,name,namelen);
         vput(res_vnode);
         vput(result);
         dbg(DBG_VFS,"INFO: Unlink successful. Path=%s\n",path);
@@ -739,6 +745,7 @@ do_link(const char *from, const char *to)
         }
         KASSERT(node2->vn_ops->link);                   
         i=(node2->vn_ops->link)(node1,node2,name,namelen);
+        dcache_invalidate(node2,name,namelen);
         vput(node1);
         vput(node2);
         dbg(DBG_VFS,"INFO: Linking successful. From:%s To:%s\n",from,to);
@@ -14,6 +14,7 @@
 #include "fs/vfs.h"
 #include "fs/vnode.h"
 #include "mm/slab.h"
+#include "mm/zpage.h"
 #include "proc/sched.h"
 #include "util/debug.h"
 #include "vm/vmmap.h"
@@ -21,7 +22,20 @@
 
 static slab_allocator_t *vnode_allocator;
 
-static list_t vnode_inuse_list;
+/* In-core vnodes are hashed on (fs, vno) so that vget does not have
+ * to look at all of them; each filesystem also keeps a list of its own
+ * for unmounting and flushing. */
+#define VNODE_HASH_SIZE (MAX_VNODES / 4)
+#define vnode_hash_bucket(fs, vno) \
+        (&vnode_hash[(((uint32_t)(fs) >> 4) ^ (uint32_t)(vno)) % VNODE_HASH_SIZE])
+
+static list_t vnode_hash[VNODE_HASH_SIZE];
+
+/* Vnodes nobody references any more, least recently used first */
+static list_t vnode_inactive_list;
+static int vnode_ninactive = 0;
+
+static void vnode_free(vnode_t *vn);
 
 /* Related to vnodes representing special files: */
 static void init_special_vnode(vnode_t *vn);
@@ -93,7 +107,10 @@ static vnode_ops_t blockdev_spec_vops = {
 static __attribute__((unused)) void
 vnode_init(void)
 {
-        list_init(&vnode_inuse_list);
+        int i;
+        for (i = 0; i < VNODE_HASH_SIZE; ++i)
+                list_init(&vnode_hash[i]);
+        list_init(&vnode_inactive_list);
         vnode_allocator = slab_allocator_create("vnode", sizeof(vnode_t));
 }
 init_func(vnode_init);
@@ -120,7 +137,7 @@ vget(struct fs *fs, ino_t vno)
 
         /* look for inuse vnode */
 find:
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
+        list_iterate_begin(vnode_hash_bucket(fs, vno), vn, vnode_t, vn_link) {
                 if ((vn->vn_fs == fs) && (vn->vn_vno == vno)) {
                         /* found it... */
                         if (VN_BUSY & vn->vn_flags) {
@@ -135,6 +152,17 @@ find:
                                 goto find;
                         }
 
+                        if (0 == vn->vn_refcount) {
+                                /* inactive, bring it back */
+                                list_remove(&vn->vn_lrulink);
+                                vnode_ninactive--;
+                                vn->vn_refcount = 1;
+#ifdef __MOUNTING__
+                                KASSERT(vn->vn_mount == vn);
+#endif
+                                return vn;
+                        }
+
 #ifndef __MOUNTING__
                         /* If we are implementing mountpoint support
                            then we should get the mounted vnode,
@@ -156,6 +184,8 @@ find:
         if (!vn) {
                 dbg(DBG_VNREF, "vget: kmem has been exhausted. "
                     "will then re-attempt to vget vnode later %d of fs %p\n", vno, fs);
+                if (0 < vnode_cache_shrink(1))
+                        goto find;
                 sched_make_runnable(curthr);
                 sched_switch();
                 goto find;
@@ -177,14 +207,15 @@ find:
          *     vn_mode, vn_len, vn_i, and vn_devid (if
          *     appropriate)): */
 
-        /*       mark it busy and place it on vnode_inuse_list (so it can
+        /*       mark it busy and place it in the hash (so it can
          *       be found while we are possibly blocking): (also, seems
          *       appropriate not to ref it yet since no references from
          *       outside this context (vnode.c) will exist until we are
          *       done bringing the vnode in)
          */
         vn->vn_flags |= VN_BUSY;
-        list_insert_head(&vnode_inuse_list, &vn->vn_link);
+        list_insert_head(vnode_hash_bucket(fs, vno), &vn->vn_link);
+        list_insert_head(&fs->fs_vnodes, &vn->vn_fslink);
 
         KASSERT(vn->vn_fs->fs_op && vn->vn_fs->fs_op->read_vnode);
         /*       this is where we might block (depending on the underlying
@@ -276,9 +307,30 @@ vput(struct vnode *vn)
         KASSERT(vn->vn_mount == vn);
 #endif
 
-        /* no res pages and no more active references; free the vnode */
+        /* no res pages and no more active references */
+        KASSERT(0 == vn->vn_refcount);
+        KASSERT(0 == vn->vn_nrespages);
+
+        /* if the file is still there keep the vnode around in case it
+         * is wanted again soon (the root of a filesystem only loses its
+         * last reference when the filesystem is being unmounted) */
+        if (0 < VNODE_CACHE_MAX && vn != vn->vn_fs->fs_root
+            && vn->vn_fs->fs_op->query_vnode(vn)) {
+                list_insert_tail(&vnode_inactive_list, &vn->vn_lrulink);
+                if (++vnode_ninactive > VNODE_CACHE_MAX)
+                        vnode_cache_shrink(vnode_ninactive - VNODE_CACHE_MAX);
+                return;
+        }
+        vnode_free(vn);
+}
+
+/* Frees a vnode with no references, which is not on the inactive list */
+static void
+vnode_free(vnode_t *vn)
+{
         KASSERT(0 == vn->vn_refcount);
         KASSERT(0 == vn->vn_nrespages);
+        KASSERT(!list_link_is_linked(&vn->vn_lrulink));
 
         vn->vn_flags |= VN_BUSY;
         if (vn->vn_fs->fs_op->delete_vnode) {
@@ -298,10 +350,56 @@ vput(struct vnode *vn)
          * we were taking it away: */
         sched_broadcast_on(&vn->vn_waitq);
 
-        list_remove(&vn->vn_link); /* remove from vn_inuse_list */
+        list_remove(&vn->vn_link); /* remove from the hash */
+        list_remove(&vn->vn_fslink);
+        /* clean pages of it pageoutd compressed must not turn up in
+         * whatever vnode gets this memory next */
+        zpage_discard_obj(&vn->vn_mmobj);
         slab_obj_free(vnode_allocator, vn);
 }
 
+vnode_t *
+mmobj_as_vnode(mmobj_t *o)
+{
+        if (&vnode_mmobj_ops != o->mmo_ops) {
+                return NULL;
+        }
+        return CONTAINER_OF(o, vnode_t, vn_mmobj);
+}
+
+int
+vnode_cache_shrink(int n)
+{
+        vnode_t *vn;
+        int nfreed = 0;
+
+        while (nfreed < n && !list_empty(&vnode_inactive_list)) {
+                vn = list_head(&vnode_inactive_list, vnode_t, vn_lrulink);
+                list_remove(&vn->vn_lrulink);
+                vnode_ninactive--;
+                vnode_free(vn);
+                nfreed++;
+        }
+        return nfreed;
+}
+
+void
+vnode_cache_purge(fs_t *fs)
+{
+        vnode_t *vn;
+
+again:
+        list_iterate_begin(&fs->fs_vnodes, vn, vnode_t, vn_fslink) {
+                if (0 == vn->vn_refcount && list_link_is_linked(&vn->vn_lrulink)) {
+                        list_remove(&vn->vn_lrulink);
+                        vnode_ninactive--;
+                        vnode_free(vn);
+                        /* This may have blocked. */
+                        goto again;
+                }
+        } list_iterate_end();
+}
+
 int
 vfs_is_in_use(fs_t *fs)
 {
@@ -319,20 +417,16 @@ vfs_is_in_use(fs_t *fs)
          *             - return -EBUSY
          *
          */
-        list_t *list = &vnode_inuse_list;
+        list_t *list = &fs->fs_vnodes;
         list_link_t *link;
         int ret = 0;
         for (link = list->l_next; link != list; link = link->l_next) {
-                vnode_t *vn = list_item(link, vnode_t, vn_link);
+                vnode_t *vn = list_item(link, vnode_t, vn_fslink);
                 int refs;
 
                 KASSERT(vn->vn_refcount >= vn->vn_nrespages);
                 KASSERT(vn->vn_nrespages >= 0);
-
-                if (fs != vn->vn_fs)
-                        continue;
-
-                /* otherwise, vn belongs to the given fs */
+                KASSERT(fs == vn->vn_fs);
 
                 /* if it is the root vnode and it has more than one
                  * reference
@@ -365,7 +459,7 @@ vnode_flush_all(struct fs *fs)
         int err;
 
 clean:
-        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
+        list_iterate_begin(&fs->fs_vnodes, v, vnode_t, vn_fslink) {
                 list_iterate_begin(&v->vn_mmobj.mmo_respages,
                                    p, pframe_t, pf_olink) {
                         if (pframe_is_dirty(p)) {
@@ -385,7 +479,7 @@ clean:
 
         /* all pages of all vnodes belonging to this fs have been cleaned.
          * Now, uncache all of them: */
-        list_iterate_begin(&vnode_inuse_list, v, vnode_t, vn_link) {
+        list_iterate_begin(&fs->fs_vnodes, v, vnode_t, vn_fslink) {
                 list_iterate_begin(&v->vn_mmobj.mmo_respages,
                                    p, pframe_t, pf_olink) {
                         KASSERT(!pframe_is_dirty(p));
@@ -404,9 +498,9 @@ vnode_inuse(struct fs *fs)
         vnode_t *vn;
         int n = 0;
 
-        list_iterate_begin(&vnode_inuse_list, vn, vnode_t, vn_link) {
-                if (vn->vn_fs == fs)
-                        n++;
+        list_iterate_begin(&fs->fs_vnodes, vn, vnode_t, vn_fslink) {
+                KASSERT(vn->vn_fs == fs);
+                n++;
         } list_iterate_end();
         return n;
 }
@@ -627,16 +721,55 @@ vo_vput(mmobj_t *o)
         vput(mmobj_to_vnode(o));
 }
 
+/*
+ * For files being read sequentially (see do_madvise()): gets the next
+ * VN_READAHEAD pages into memory, and throws away the page VN_READAHEAD
+ * pages back if nobody is using it, so that streaming through a big
+ * file doesn't push everything else out of memory.
+ */
+static void
+vreadahead(mmobj_t *o, uint32_t pagenum)
+{
+        vnode_t *vn = mmobj_to_vnode(o);
+        pframe_t *pf;
+        uint32_t i;
+
+        for (i = pagenum + 1; i <= pagenum + VN_READAHEAD; ++i) {
+                if ((uint32_t) vn->vn_len <= i * PAGE_SIZE
+                    || 0 > pframe_get(o, i, &pf)) {
+                        break;
+                }
+        }
+
+        if (pagenum >= VN_READAHEAD
+            && NULL != (pf = pframe_get_resident(o, pagenum - VN_READAHEAD))
+            && !pframe_is_busy(pf) && !pframe_is_dirty(pf) && !pframe_is_pinned(pf)) {
+                pframe_free(pf);
+        }
+}
+
 static int
 vlookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 {
+        int ret;
+
         KASSERT(NULL != pf);
         KASSERT(NULL != o);
         if ((uint32_t) mmobj_to_vnode(o)->vn_len <= pagenum * PAGE_SIZE) {
                 return -EINVAL;
         }
 
-        return pframe_get(o, pagenum, pf);
+        if (0 > (ret = pframe_get(o, pagenum, pf))) {
+                return ret;
+        }
+        if (VN_SEQUENTIAL & mmobj_to_vnode(o)->vn_flags) {
+                /* pin the page we are returning, reading ahead can
+                 * block and pageoutd must not take it meanwhile */
+                pframe_pin(*pf);
+                vreadahead(o, pagenum);
+                pframe_unpin(*pf);
+        }
+        return 0;
 }
 
 static int
@@ -646,6 +779,7 @@ vreadpage(mmobj_t *o, pframe_t *pf)
         KASSERT(NULL != o);
 
         vnode_t *v = mmobj_to_vnode(o);
+        proc_account(ru_inblock);
         return v->vn_ops->fillpage(v, (int)PN_TO_ADDR(pf->pf_pagenum), pf->pf_addr);
 }
 
@@ -9,6 +9,10 @@ struct argvec;
 int copy_from_user(void *kaddr, const void *uaddr, size_t nbytes);
 int copy_to_user(void *uaddr, const void *kaddr, size_t nbytes);
 
+/* Returns the fixup address for a user copy instruction at eip which
+ * faulted, or 0 if eip is not one of them. */
+uintptr_t access_fixup(uintptr_t eip);
+
 char *user_strdup(struct argstr *ustr);
 char **user_vecdup(struct argvec *uvec);
 
@@ -0,0 +1,19 @@
+#pragma once
+
+/* Kernel and user header (via symlink) */
+
+#define RUSAGE_SELF     0
+#define RUSAGE_SYSTEM   1 /* totals for every process since boot */
+
+/* Memory usage counters kept for each process by the page fault
+ * handler and the fillpage operations of the VM objects. */
+struct rusage {
+        int ru_minflt;   /* faults serviced without reading a file */
+        int ru_majflt;   /* faults which read a page in from a file */
+        int ru_cowflt;   /* pages copied on write */
+        int ru_zeroflt;  /* anonymous pages filled with zeros */
+        int ru_inblock;  /* pages read in from files (faults and read(2)) */
+        int ru_resident; /* pages mapped into the address space right now */
+};
+
+int getrusage(int who, struct rusage *usage);
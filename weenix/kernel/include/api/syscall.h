@@ -56,6 +56,8 @@
 #define SYS_mount               45
 #define SYS_umount              46
 #define SYS_stat                47
+#define SYS_getrusage           48
+#define SYS_madvise             49
 
 /*
  * ... what does the scouter say about his syscall?
@@ -67,6 +69,7 @@
 
 struct regs;
 struct stat;
+struct rusage;
 
 typedef struct argstr {
         const char *as_str;
@@ -98,6 +101,12 @@ typedef struct munmap_args {
         size_t  len;
 } munmap_args_t;
 
+typedef struct madvise_args {
+        void   *addr;
+        size_t  len;
+        int     advice;
+} madvise_args_t;
+
 typedef struct open_args {
         argstr_t filename;
         int      flags;
@@ -167,4 +176,9 @@ typedef struct stat_args {
         struct stat *buf;
 } stat_args_t;
 
+typedef struct getrusage_args {
+        int            who;
+        struct rusage *usage;
+} getrusage_args_t;
+
 struct utsname;
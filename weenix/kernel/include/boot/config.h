@@ -1,4 +1,6 @@
 #pragma once
 
-#define KERNEL_PHYS_BASE 0x100000
+/* 4mb aligned, so that the kernel's window onto physical memory
+ * (which starts here) can be mapped with 4mb pages */
+#define KERNEL_PHYS_BASE 0x400000
 #define MEMORY_MAP_BASE 0x9000
@@ -39,7 +39,11 @@
 #define MAX_FILES               1024    /* max number of files */
 #define MAX_VFS                 8       /* max # of vfses */
 #define MAX_VNODES              1024    /* max number of in-core vnodes */
+#define VNODE_CACHE_MAX         256     /* max number of unreferenced vnodes
+                                         * kept in core (0 frees them at once) */
 #define NAME_LEN                28      /* maximum directory entry length */
+#define DCACHE_MAX              512     /* max number of names kept in the
+                                         * name cache (0 turns it off) */
 #define NFILES                  32      /* maximum number of open files */
 
 /* Note: if rootfs is ramfs, this is completely ignored */
@@ -25,6 +25,8 @@
 #define S5_INODES_PER_BLOCK     (S5_BLOCK_SIZE /  sizeof(s5_inode_t))
 #define S5_DIRENTS_PER_BLOCK    (S5_BLOCK_SIZE / sizeof(s5_dirent_t))
 #define S5_MAX_FILE_BLOCKS      (S5_NDIRECT_BLOCKS + (S5_BLOCK_SIZE / sizeof(uint32_t)))
+#define S5_MAX_DINDIRECT_FILE_BLOCKS \
+        (S5_NDIRECT_BLOCKS - 1 + S5_NIDIRECT_BLOCKS + S5_NDINDIRECT_BLOCKS)
 #define S5_NAME_LEN             28
 
 #define S5_TYPE_FREE            0x0
@@ -32,13 +34,86 @@
 #define S5_TYPE_DIR             0x2
 #define S5_TYPE_CHR             0x4
 #define S5_TYPE_BLK             0x8
+#define S5_TYPE_MASK            0xff
+
+/* Flags kept in the high byte of s5_type */
+#define S5_FLAG_HASHED          0x100   /* directory with a name index */
+#define S5_FLAG_DINDIRECT       0x200   /* has a double indirect block */
+#define S5_FLAG_INLINE          0x400   /* data is in s5_direct_blocks */
+
+/* The type of an inode without its flags */
+#define S5_INODE_TYPE(inode)    ((inode)->s5_type & S5_TYPE_MASK)
 
 #define S5_MAGIC                071177
-#define S5_CURRENT_VERSION      3
+#define S5_CURRENT_VERSION      4
+#define S5_OLDEST_VERSION       3       /* oldest version we can mount */
+
+/*
+ * Version 4 keeps free blocks and free inodes in bitmaps rather than
+ * lists, writes metadata to a journal first and says whether it was
+ * unmounted cleanly. Its new directories are hashed, and its new files
+ * have a double indirect block and start out inline. A version 3 disk
+ * is used as it is; fsmaker's migrate command makes it version 4.
+ */
+
+/* s5s_state: a file system is dirty on disk while it is mounted */
+#define S5_STATE_CLEAN          1
+#define S5_STATE_DIRTY          2
+
+/* Blocks covered by one block of the free block bitmap */
+#define S5_BITS_PER_BLOCK       (S5_BLOCK_SIZE * 8)
+
+/* A file written sequentially has up to this many blocks after the one
+ * it asked for set aside for it, in up to S5_NPREALLOC files at once */
+#define S5_PREALLOC_BLOCKS      8
+#define S5_NPREALLOC            8
+
+/*
+ * On a version 4 disk, changes to metadata (the superblock, the
+ * bitmaps, inodes, indirect blocks and directories) are written to the
+ * journal before they may go to their home blocks, a transaction at a
+ * time. The journal's first block is a s5_jheader_t. Each transaction
+ * after it is a descriptor block, copies of the blocks its tags name,
+ * in order, and a commit block; one without its commit block never
+ * happened. Mounting copies the committed transactions home.
+ */
+#define S5_JOURNAL_MAGIC        0x4a524e4c
+#define S5_JDESC_MAGIC          0x4a444553
+#define S5_JCOMMIT_MAGIC        0x4a434d54
+
+/* A tag with this bit set logs no block: it says copies of the block
+ * earlier in the journal are not to be written home (it was freed, and
+ * may hold something else by now) */
+#define S5_JTAG_REVOKE          0x80000000
+
+#define S5_JOURNAL_NTAGS        ((S5_BLOCK_SIZE - 3 * sizeof(uint32_t)) / sizeof(uint32_t))
+
+/* The most blocks one transaction logs */
+#define S5_JOURNAL_TXN_MAX      64
+
+/* Every block a transaction logs may be revoked in a later one, so a
+ * journal has room for the revoke tags of all its blocks as well */
+#define S5_JOURNAL_MIN_BLOCKS   (S5_JOURNAL_TXN_MAX + 3)
+#define S5_JOURNAL_MAX_BLOCKS   (S5_JOURNAL_NTAGS - S5_JOURNAL_TXN_MAX)
 
 /* Number of blocks stored in the indirect block */
 #define S5_NIDIRECT_BLOCKS      (S5_BLOCK_SIZE / sizeof(uint32_t))
 
+/* Number of blocks reached through the double indirect block */
+#define S5_NDINDIRECT_BLOCKS    (S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS)
+
+/*
+ * An inode with S5_FLAG_DINDIRECT gives up its last direct block for
+ * the double indirect block, which points to indirect blocks. Its
+ * blocks are numbered direct, then indirect, then double indirect.
+ */
+#define S5_INODE_NDIRECT(inode)                                         \
+        (((inode)->s5_type & S5_FLAG_DINDIRECT)                         \
+         ? S5_NDIRECT_BLOCKS - 1 : S5_NDIRECT_BLOCKS)
+#define S5_INODE_MAX_BLOCKS(inode)                                      \
+        (((inode)->s5_type & S5_FLAG_DINDIRECT)                         \
+         ? S5_MAX_DINDIRECT_FILE_BLOCKS : S5_MAX_FILE_BLOCKS)
+
 /* Given a file offset, returns the block number that it is in */
 #define S5_DATA_BLOCK(seekptr)  ((seekptr) / S5_BLOCK_SIZE)
 
@@ -54,6 +129,31 @@
  */
 #define S5_INODE_OFFSET(inum)  ((inum) % S5_INODES_PER_BLOCK)
 
+/*
+ * A data file with S5_FLAG_INLINE has no blocks: its contents, up to
+ * S5_INLINE_SIZE bytes, are kept in place of its direct block pointers.
+ * When it grows past that they move to a block and the flag is cleared.
+ */
+#define S5_INLINE_SIZE          (S5_NDIRECT_BLOCKS * sizeof(uint32_t))
+#define S5_INODE_INLINE(inode)  ((inode)->s5_type & S5_FLAG_INLINE)
+
+/*
+ * A hashed directory starts with an index block, which is not part of
+ * the list of entries: the dirents follow it as usual, from
+ * S5_DIR_BASE() on. The index has a bitmap for each name hash bucket
+ * telling which of the first S5_DIR_NINDEXED blocks of dirents may
+ * hold a name in that bucket, so a lookup only reads those blocks
+ * (and any past the indexed ones). Bits may be set for blocks which
+ * no longer hold such a name, but never the other way around.
+ */
+#define S5_DIR_NBUCKETS         512
+#define S5_DIR_NINDEXED         64
+#define S5_DIR_BASE(inode)      (((inode)->s5_type & S5_FLAG_HASHED) ? S5_BLOCK_SIZE : 0)
+
+/* The hash of a directory entry name; fsmaker uses the same one */
+#define S5_NAME_HASH_INIT       2166136261U
+#define S5_NAME_HASH_STEP(h, c) (((h) ^ (unsigned char)(c)) * 16777619U)
+
 /* Given an FS struct, get the S5FS (private data) struct. */
 #define FS_TO_S5FS(fs)  ( (s5fs_t *)((fs)->fs_i))
 
@@ -80,6 +180,23 @@ typedef struct s5_super {
         uint32_t s5s_root_inode;         /* root inode */
         uint32_t s5s_num_inodes;         /* number of inodes */
         uint32_t s5s_version;            /* version of this disk format */
+
+        /* from version 4 on, s5s_nfree and s5s_free_blocks are unused
+         * and free blocks are clear bits in the bitmap, s5s_free_inode
+         * is -1 and free inodes are clear bits in the inode bitmap: */
+        uint32_t s5s_num_blocks;         /* size of the disk in blocks */
+        uint32_t s5s_bitmap_block;       /* first block of the bitmap */
+        uint32_t s5s_bitmap_nblocks;     /* number of bitmap blocks */
+        uint32_t s5s_nfree_blocks;       /* number of clear bits */
+
+        uint32_t s5s_ibitmap_block;      /* first block of the bitmap */
+        uint32_t s5s_ibitmap_nblocks;    /* number of bitmap blocks */
+        uint32_t s5s_nfree_inodes;       /* number of clear bits */
+
+        uint32_t s5s_journal_block;      /* first block of the journal */
+        uint32_t s5s_journal_nblocks;    /* number of journal blocks */
+
+        uint32_t s5s_state;              /* S5_STATE_CLEAN or _DIRTY */
 } s5_super_t;
 
 /* The contents of an inode, as stored on disk. */
@@ -95,8 +212,37 @@ typedef struct s5_inode {
         int16_t    s5_linkcount;    /* link count of this inode */
         uint32_t   s5_direct_blocks[S5_NDIRECT_BLOCKS];
         uint32_t   s5_indirect_block;
+/* only with S5_FLAG_DINDIRECT: */
+#define        s5_dindirect_block s5_direct_blocks[S5_NDIRECT_BLOCKS - 1]
 } s5_inode_t;
 
+/* One bucket of a hashed directory's index, as stored on disk */
+typedef struct s5_dirhash {
+        uint32_t   s5h_blocks[S5_DIR_NINDEXED / 32];
+} s5_dirhash_t;
+
+/* The first block of the journal */
+typedef struct s5_jheader {
+        uint32_t   s5j_magic;           /* S5_JOURNAL_MAGIC */
+        uint32_t   s5j_seq;             /* sequence number of the
+                                         * transaction in block 1 */
+} s5_jheader_t;
+
+/* The first block of a transaction in the journal */
+typedef struct s5_jdesc {
+        uint32_t   s5j_magic;           /* S5_JDESC_MAGIC */
+        uint32_t   s5j_seq;             /* one more than the last one's */
+        uint32_t   s5j_ntags;
+        uint32_t   s5j_tags[S5_JOURNAL_NTAGS]; /* home block numbers */
+} s5_jdesc_t;
+
+/* The last block of a transaction in the journal */
+typedef struct s5_jcommit {
+        uint32_t   s5j_magic;           /* S5_JCOMMIT_MAGIC */
+        uint32_t   s5j_seq;             /* the descriptor's */
+        uint32_t   s5j_ntags;           /* the descriptor's */
+} s5_jcommit_t;
+
 /* The contents of a directory entry, as stored on disk. */
 typedef struct s5_dirent {
         uint32_t   s5d_inode;
@@ -104,12 +250,34 @@ typedef struct s5_dirent {
 } s5_dirent_t;
 
 #ifndef __FSMAKER__
+/* Blocks set aside (marked used in the bitmap) for the next writes to
+ * the end of a file */
+typedef struct s5_prealloc {
+        uint32_t                s5p_ino;        /* file, or -1 if unused */
+        uint32_t                s5p_next;       /* first block set aside */
+        uint32_t                s5p_count;      /* how many are left */
+} s5_prealloc_t;
+
 /* Our in-memory representation of a s5fs filesytem (fs_i points to this) */
 typedef struct s5fs {
         blockdev_t              *s5f_bdev;
         s5_super_t              *s5f_super;
         kmutex_t                s5f_mutex;
         fs_t                    *s5f_fs;
+
+        uint32_t                s5f_rotor;      /* where to look for free
+                                                 * blocks without a goal */
+        s5_prealloc_t           s5f_prealloc[S5_NPREALLOC];
+        int                     s5f_prealloc_next; /* slot to reuse next */
+
+        struct pframe           **s5f_ibitmap;  /* the inode bitmap's pages,
+                                                 * pinned while mounted */
+        struct s5_journal       *s5f_journal;   /* NULL if not journaled */
+
+        int                     s5f_unchecked;  /* was not unmounted
+                                                 * cleanly, and has not
+                                                 * been checked since */
+        struct s5_fsck          *s5f_fsck;      /* the check, until done */
 } s5fs_t;
 
 int s5fs_mount(struct fs *fs);
@@ -0,0 +1,29 @@
+/*
+ *   FILE: s5fs_fsck.h
+ *  DESCR: checking an s5fs that was not unmounted cleanly, while in use
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "util/list.h"
+
+struct s5fs;
+
+/* The check of one file system, by s5fsckd */
+typedef struct s5_fsck {
+        struct s5fs     *sf_fs;
+        uint32_t        *sf_blocks;     /* bit set for each block found
+                                         * in use */
+        uint32_t        *sf_inodes;     /* and for each inode */
+        uint32_t        sf_next;        /* next inode to look at */
+        int             sf_cancel;      /* being unmounted: stop */
+        list_link_t     sf_link;        /* on s5fsckd's list */
+} s5_fsck_t;
+
+int  s5_fsck_start(struct s5fs *fs);
+void s5_fsck_stop(struct s5fs *fs);
+
+void s5_fsck_note_block(struct s5fs *fs, uint32_t block, int used);
+void s5_fsck_note_inode(struct s5fs *fs, uint32_t ino, int used);
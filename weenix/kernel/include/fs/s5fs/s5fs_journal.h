@@ -0,0 +1,86 @@
+/*
+ *   FILE: s5fs_journal.h
+ *  DESCR: the s5fs metadata journal
+ */
+
+#pragma once
+
+#include "types.h"
+
+#include "proc/kmutex.h"
+#include "util/list.h"
+
+#include "fs/s5fs/s5fs.h"
+
+struct pframe;
+struct vnode;
+struct s5fs;
+
+/*
+ * The most blocks one handle may log. A handle is let into a
+ * transaction only if every handle open in it still has this much room.
+ */
+#define S5_JOURNAL_RESERVE      16
+
+/* s5fs_write() takes a handle for each this many bytes it writes */
+#define S5_JOURNAL_WRITE_MAX    (64 * S5_BLOCK_SIZE)
+
+/* A block logged in the running transaction */
+typedef struct s5_jentry {
+        struct pframe   *sje_pf;        /* the block's page, pinned */
+        uint32_t        sje_block;      /* its home, 0 if since freed */
+        struct vnode    *sje_vn;        /* the directory the page belongs
+                                         * to, referenced, or NULL for a
+                                         * block device page */
+} s5_jentry_t;
+
+/*
+ * An s5fs journal. There is one running transaction, which the
+ * metadata changes made in handles (s5_journal_start() to
+ * s5_journal_stop()) go to. s5journald commits it when it gets to run,
+ * by which time other handles have usually joined it. Until a block is
+ * committed its page stays pinned, so the page cache cannot write it
+ * home first.
+ */
+typedef struct s5_journal {
+        struct s5fs     *sj_fs;
+        kmutex_t        sj_mutex;       /* held to commit or checkpoint */
+        uint32_t        sj_block;       /* where the journal is */
+        uint32_t        sj_nblocks;
+        uint32_t        sj_head;        /* next journal block to write */
+        uint32_t        sj_seq;         /* the running transaction's */
+
+        int             sj_updates;     /* handles open */
+        int             sj_locked;      /* being committed: no new
+                                         * handles until it is written */
+        int             sj_closing;     /* being unmounted */
+        ktqueue_t       sj_waitq;       /* new handles wait here */
+        ktqueue_t       sj_commitq;     /* the commit waits here for
+                                         * the open handles */
+
+        int             sj_n;           /* blocks logged */
+        int             sj_ncommit;     /* of those, the ones being
+                                         * written out */
+        s5_jentry_t     sj_entries[S5_JOURNAL_TXN_MAX];
+        int             sj_nrevoke;
+        uint32_t        *sj_revoke;     /* blocks revoked, up to
+                                         * sj_nblocks of them */
+
+        int             sj_nlogged;
+        uint32_t        *sj_logged;     /* blocks in the journal since
+                                         * the last checkpoint */
+
+        char            *sj_buf;        /* page for descriptor and
+                                         * commit blocks */
+        list_link_t     sj_link;        /* on s5journald's list */
+} s5_journal_t;
+
+int  s5_journal_recover(struct s5fs *fs);
+int  s5_journal_open(struct s5fs *fs);
+void s5_journal_close(struct s5fs *fs);
+
+void s5_journal_start(struct s5fs *fs);
+void s5_journal_stop(struct s5fs *fs);
+void s5_journal_add(struct s5fs *fs, struct pframe *pf, struct vnode *vn);
+void s5_journal_revoke(struct s5fs *fs, uint32_t block);
+int  s5_journal_commit(struct s5fs *fs);
@@ -11,7 +11,7 @@
 struct fs;
 struct vnode;
 
-int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid);
+int s5_alloc_inode(struct fs *fs, uint16_t type, devid_t devid, ino_t near);
 void s5_free_inode(struct vnode *vnode);
 
 
@@ -29,6 +29,7 @@ int s5_find_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_remove_dirent(struct vnode *vnode, const char *name, size_t namelen);
 int s5_seek_to_block(struct vnode *vnode, off_t seekptr, int alloc);
 int s5_inode_blocks(struct vnode *vnode);
+void s5_drop_prealloc(struct fs *fs, uint32_t ino);
 
 #define VNODE_TO_S5FS(vn)       ( (s5fs_t *)((vn)->vn_fs->fs_i))
 #define VNODE_TO_S5INODE(vn)    ( (s5_inode_t *)(vn)->vn_i )
@@ -49,6 +50,7 @@ int s5_inode_blocks(struct vnode *vnode);
                 KASSERT(!err                                            \
                         && "shouldn\'t fail for a page belonging "      \
                         "to a block device");                           \
+                s5_journal_add((fs), p, NULL);                          \
         } while (0)
 
 /*
@@ -58,6 +58,15 @@ typedef struct fs_ops {
          * This entry point is ALLOWED TO BLOCK.
          */
         int (*umount)(struct fs *fs);
+
+        /*
+         * Called by sync() before it writes out the dirty pages, to get
+         * what the filesystem holds back from the page cache written
+         * (s5fs commits its journal). May be NULL.
+         *
+         * This entry point is ALLOWED TO BLOCK.
+         */
+        int (*sync)(struct fs *fs);
 } fs_ops_t;
 
 #ifndef STR_MAX
@@ -115,6 +124,10 @@ typedef struct fs {
 
         /* Filesystem-specific data. */
         void            *fs_i;
+
+        /* Every in-core vnode of this filesystem (maintained by
+         * vnode.c, initialized by mountfunc) */
+        list_t          fs_vnodes;
 } fs_t;
 
 /* - this is the vnode on which we will mount the vfsroot fs.
@@ -141,6 +154,11 @@ extern struct vnode *vfs_root_vn;
  */
 int vfs_shutdown();
 
+/*
+ *     Called by sync() for every mounted filesystem's sync entry point.
+ */
+void vfs_sync(void);
+
 /* Pathname resolution: */
 /* (the corresponding definitions live in namev.c) */
 int lookup(struct vnode *dir, const char *name, size_t len,
@@ -150,6 +168,12 @@ int dir_namev(const char *pathname, size_t *namelen, const char **name,
 int open_namev(const char *pathname, int flag,
                struct vnode **res_vnode, struct vnode *base);
 
+/* Name cache used by lookup(); anything that adds or removes a
+ * directory entry has to invalidate its name */
+void dcache_invalidate(struct vnode *dir, const char *name, size_t len);
+void dcache_purge_dir(struct vnode *dir);
+void dcache_purge(fs_t *fs);
+
 #ifdef __GETCWD__
 int lookup_name(struct vnode *dir, struct vnode *entry, char *buf, size_t size);
 int lookup_dirpath(struct vnode *dir, char *buf, size_t size);
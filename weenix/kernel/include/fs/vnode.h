@@ -146,6 +146,11 @@ typedef struct vnode_ops {
 
 
 #define VN_BUSY        0x1
+#define VN_SEQUENTIAL  0x2     /* set by MADV_SEQUENTIAL, see vlookuppage */
+
+/* With VN_SEQUENTIAL set, a page lookup reads this many pages ahead
+ * and drops the clean page this many pages behind. */
+#define VN_READAHEAD   8
 
 typedef struct vnode {
         /*
@@ -248,10 +253,26 @@ typedef struct vnode {
         blockdev_t        *vn_bdev;
 
         /* Used (only) by the v{get,ref,put} facilities (vfs/vnode.c): */
-        list_link_t        vn_link;        /* link on system vnode list */
-        int                vn_flags;       /* VN_BUSY */
+        list_link_t        vn_link;        /* link on vnode hash chain */
+        int                vn_flags;       /* VN_BUSY, VN_SEQUENTIAL */
         ktqueue_t          vn_waitq;       /* queue of threads waiting for vnode
                                               to become not busy */
+
+        /*
+         * The fields above are laid out as the prebuilt libraries linked
+         * into the kernel (lib*.a) expect them, new fields go below.
+         */
+        list_link_t        vn_fslink;      /* link on vn_fs->fs_vnodes */
+        list_link_t        vn_lrulink;     /* link on the inactive list, while
+                                              vn_refcount is zero */
+
+        /*
+         * The indirect block the file system last used to find one of
+         * this file's blocks, and the first file block it points to.
+         * Zero until the file system sets them.
+         */
+        uint32_t           vn_iblock;
+        uint32_t           vn_iblock_base;
 } vnode_t;
 
 /* Core vnode management routines: */
@@ -321,9 +342,38 @@ void vref(vnode_t *vn);
  *
  *     If the vnode is freed, vn will not point to a valid memory address
  *     anymore.
+ *
+ *     (Unless the file is gone from the filesystem, a vnode whose
+ *     refcount reaches zero is in fact kept in core, on an LRU list of
+ *     at most VNODE_CACHE_MAX inactive vnodes, so that vget can hand it
+ *     out again without the fs reading the inode back in. The least
+ *     recently used ones are freed as above when the list is full, when
+ *     memory runs low and when the filesystem is unmounted.)
  */
 void vput(vnode_t *vn);
 
+/*
+ *     Frees up to n of the least recently used inactive vnodes. Returns
+ *     the number freed.
+ *
+ *     MAY BLOCK.
+ */
+int vnode_cache_shrink(int n);
+
+/*
+ *     Frees every inactive vnode of the given filesystem; called before
+ *     unmounting it.
+ *
+ *     MAY BLOCK.
+ */
+void vnode_cache_purge(struct fs *fs);
+
+/*
+ *     Returns the vnode whose page cache o is, or NULL if o belongs to
+ *     something else (an anonymous or shadow object, or a device).
+ */
+vnode_t *mmobj_as_vnode(struct mmobj *o);
+
 
 /* Auxilliary: */
 
@@ -350,7 +400,7 @@ void vnode_flush_all(struct fs *fs);
 
 /*
  *         Returns the number of vnodes from this filesystem that are in
- *         use.
+ *         core (inactive ones included).
  */
 int vnode_inuse(struct fs *fs);
 
@@ -23,3 +23,11 @@
 */
 #define MAP_FIXED       4
 #define MAP_ANON        8
+
+/* Advice for madvise().
+*/
+#define MADV_NORMAL     0     /* No special treatment. */
+#define MADV_RANDOM     1     /* Expect random page references. */
+#define MADV_SEQUENTIAL 2     /* Expect sequential page references. */
+#define MADV_WILLNEED   3     /* Will need these pages. */
+#define MADV_DONTNEED   4     /* Don't need these pages. */
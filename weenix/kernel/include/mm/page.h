@@ -20,7 +20,8 @@
 
 #define PAGE_ALIGNED(x) (0 == ((uintptr_t)(x)) % PAGE_SIZE)
 
-#define PAGE_NSIZES  8
+/* up to 1024 pages (4mb), so that large pages can be allocated */
+#define PAGE_NSIZES  11
 
 #define PAGE_SAME(addr1, addr2) (PAGE_ALIGN_DOWN(addr1) == PAGE_ALIGN_DOWN(addr2))
 
@@ -6,6 +6,7 @@
 #define PD_WRITE_THROUGH  0x008
 #define PD_CACHE_DISABLED 0x010
 #define PD_ACCESSED       0x020
+#define PD_LARGE          0x080
 
 #define PT_PRESENT        0x001
 #define PT_WRITE          0x002
@@ -17,6 +18,18 @@
 #define PT_SIZE           0x080
 #define PT_GLOBAL         0x100
 
+/* a page directory entry with PD_LARGE set maps a single 4mb page
+ * instead of pointing at a page table, this requires PSE, which
+ * is turned on in cr4 by pt_init if the processor supports it */
+#define CR4_PSE           0x010
+
+/* with write protect on in cr0 the kernel honours read-only user
+ * entries too, so copy_to_user into a copy-on-write page faults and
+ * breaks the sharing instead of scribbling on the shared frame */
+#define CR0_WP            0x10000
+#define PT_LARGE_PAGE_SIZE 0x400000
+#define PT_LARGE_ALIGNED(x) (0 == ((uintptr_t)(x)) % PT_LARGE_PAGE_SIZE)
+
 typedef uint32_t pte_t;
 typedef uint32_t pde_t;
 
@@ -49,15 +62,54 @@ uintptr_t pt_virt_to_phys(uintptr_t vaddr);
  * Note that the TLB is not flushed by this function. */
 int pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags);
 
+/* Returns non-zero if 4mb pages are available on this processor. */
+int pt_large_supported(void);
+
+/* Maps the 4mb of physical memory starting at paddr in at vaddr with a
+ * single page directory entry, replacing (and freeing) any page table
+ * that was there before. Both addresses must be 4mb aligned and vaddr
+ * must be in the user address space. Returns -ENOTSUP if the processor
+ * does not support large pages. As with pt_map, the TLB is not flushed.
+ * Calling pt_map, pt_unmap or pt_copy_range on part of a large mapping
+ * splits it back up into a page table of 4kb entries first. */
+int pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags);
+
+/* If the page table covering vaddr has all of its entries present, with
+ * identical permissions, pointing at physically contiguous frames which
+ * start on a 4mb boundary, replaces the page table with a single large
+ * mapping. Returns 1 if the mapping was promoted, 0 otherwise. The TLB
+ * is flushed for the affected range. */
+int pt_promote(pagedir_t *pd, uintptr_t vaddr);
+
+/* Returns non-zero if every entry of the page table covering vaddr is
+ * present with all of ptflags set. The block must not already be
+ * mapped with a large entry. */
+int pt_block_full(pagedir_t *pd, uintptr_t vaddr, uint32_t ptflags);
+
 /* Unmaps the page for the given virtual page from the given page
  * directory. vaddr must be in the user address space. vaddr must
  * be page aligned. Note that the TLB is not flushed by this function. */
 void pt_unmap(pagedir_t *pd, uintptr_t vaddr);
 
 /* Unmaps the given range of addresses [low, high). As with pt_unmap,
- * the addresses must be page aligned in the user address space */
+ * the addresses must be page aligned in the user address space. Both
+ * functions free any page table left with no present entries. */
 void pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh);
 
+/* Copies every present mapping in the range [vlow, vhigh) of 'from'
+ * into 'to', creating page tables in 'to' as necessary. If cow is
+ * non-zero the write bit is first cleared on the entries in 'from',
+ * so both directories end up sharing the frames read-only and the
+ * next write in either one faults (copy-on-write). Returns the number
+ * of entries in 'from' which were write-protected, or -ENOMEM. As
+ * with pt_map, the TLB is not flushed by this function; the caller
+ * should flush once for the whole batch. */
+int pt_copy_range(pagedir_t *from, pagedir_t *to, uintptr_t vlow, uintptr_t vhigh, int cow);
+
+/* Returns the number of user pages mapped in the given page
+ * directory, from the per-table counts pt_map and friends keep. */
+uint32_t pt_resident(pagedir_t *pd);
+
 /* Creates a new page directory which is initialized to contain
  * mappings for all kernel memory. If there is not enough memory
  * to allocate the directory NULL is returned. Note that destroying
@@ -53,6 +53,7 @@ void pframe_pageoutd_init(void);
 void pframe_shutdown(void);
 
 pframe_t *pframe_get_resident(struct mmobj *o, uint32_t pagenum);
+pframe_t *pframe_peek_resident(struct mmobj *o, uint32_t pagenum);
 
 int pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result);
 int pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result);
@@ -68,3 +69,4 @@ void pframe_free(pframe_t *pf);
 void pframe_clean_all(void);
 
 void pframe_remove_from_pts(pframe_t *pf);
+void pframe_unmap_page(struct mmobj *o, uint32_t pagenum);
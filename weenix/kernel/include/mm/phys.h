@@ -7,3 +7,9 @@
  * while the first megabyte of memory is identity mapped,
  * otherwise its behavior is undefined. */
 uintptr_t phys_detect_highmem();
+
+/* Returns the lowest physical address of the same range, but above
+ * the first megabyte, which belongs to the BIOS and boot loader. The
+ * memory from there up to KERNEL_PHYS_BASE is not in the kernel's
+ * window. The same restrictions apply as for phys_detect_highmem. */
+uintptr_t phys_detect_lowmem();
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+struct pframe;
+
+/* The compressed page store sits between physical memory and the disk.
+ * Pages pageoutd is about to reclaim are compressed into a pool of at
+ * most ZPAGE_POOL_SIZE bytes, keyed by (object, page number), and
+ * pframe_get looks there before asking the object to fill a page. A
+ * page only ever lives in one place: loading it removes it from the
+ * pool. */
+
+/* Compresses the page into the pool. A clean page is a copy of what is
+ * on disk and may be dropped whenever room is needed; storing one never
+ * blocks and does nothing if the page is already in the pool. A dirty
+ * page (one whose only other home would be swap) replaces any older
+ * copy, and may block writing older dirty pages out to swap to make
+ * room. Returns 0 if the page was stored, -ENOSPC if it did not
+ * compress well or there was no room, -ENOMEM if out of memory. */
+int zpage_store(struct pframe *pf, int dirty);
+
+/* If the page is in the pool, decompresses it into pf->pf_addr, marks
+ * the page dirty if the pool held the only copy, and removes it from
+ * the pool. Returns 1 if the page was found, 0 if not. May block if the
+ * page is on its way out to swap. */
+int zpage_load(struct pframe *pf);
+
+/* Returns non-zero if the given page is in the pool. */
+int zpage_has(struct mmobj *o, uint32_t pagenum);
+
+/* Throws away the pool's copy of a page, if there is one. */
+void zpage_discard(struct mmobj *o, uint32_t pagenum);
+
+/* Throws away every page of an object which is about to be freed. */
+void zpage_discard_obj(struct mmobj *o);
+
+/* Hands all of src's pages in the pool over to dest, dropping those
+ * which dest already has a newer version of. */
+void zpage_migrate(struct mmobj *src, struct mmobj *dest);
+
+/* Prints the pool's usage and hit counters. */
+size_t zpage_info(const void *arg, char *buf, size_t osize);
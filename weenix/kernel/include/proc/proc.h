@@ -7,6 +7,7 @@
 #include "mm/pagetable.h"
 
 #include "vm/vmmap.h"
+#include "api/resource.h"
 
 #include "config.h"
 
@@ -42,8 +43,23 @@ typedef struct proc {
         struct vmmap   *p_vmmap;         /* list of areas mapped into
                                           * process' user address
                                           * space */
+        struct rusage   p_rusage;        /* fault counters, see
+                                          * proc_account() */
 } proc_t;
 
+/* Counters for every process since boot. */
+extern struct rusage proc_rusage_total;
+
+/* Counts one event of the given kind (a field of struct rusage)
+ * against the current process and the system totals. */
+#define proc_account(field) \
+        do { \
+                ++proc_rusage_total.field; \
+                if (NULL != curproc) { \
+                        ++curproc->p_rusage.field; \
+                } \
+        } while (0)
+
 /* Process states. */
 #define PROC_RUNNING    1       /* has running threads */
 #define PROC_DEAD       2       /* has already exited, hasn't been wait'ed */
@@ -127,6 +143,18 @@ pid_t do_waitpid(pid_t pid, int options, int *status);
  */
 int do_fork(struct regs *regs);
 
+/**
+ * This function implements the getrusage(2) system call, filling in
+ * usage with the counters of the current process (RUSAGE_SELF) or the
+ * whole system (RUSAGE_SYSTEM). ru_resident is computed on the spot
+ * from the page tables.
+ *
+ * @param who RUSAGE_SELF or RUSAGE_SYSTEM
+ * @param usage the kernel buffer to fill in
+ * @return 0 on success, or -EINVAL if who is not valid
+ */
+int do_getrusage(int who, struct rusage *usage);
+
 /**
  * Provides detailed debug information about a given process.
  *
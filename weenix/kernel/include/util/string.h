@@ -74,5 +74,9 @@ char  *strcat(char *dest, const char *src);
 char  *strdup(const char *s);
 char  *strtok(char *s, const char *d);
 
+/* copy and zero a whole page; both addresses must be page aligned */
+void   page_copy(void *dest, const void *src);
+void   page_zero(void *page);
+
 /* return string-representation of an errno */
 char  *strerror(int errnum);
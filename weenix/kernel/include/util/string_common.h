@@ -0,0 +1,210 @@
+/*
+ * memcmp, memcpy, memset, strcmp, strlen and strchr for both the kernel
+ * and libc: this file is included once by kernel/util/string.c and once
+ * (through a symlink in user/include/weenix) by user/lib/libc/string.c,
+ * after their own headers have defined size_t, uint32_t and uintptr_t.
+ */
+
+#pragma once
+
+/* Below MEM_SMALL bytes it is not worth lining anything up, the
+ * whole thing is moved a byte at a time. From there up to MEM_LARGE
+ * bytes dwords are moved by an unrolled loop, which gets going faster
+ * than rep movsl; above that rep movsl wins. */
+#define MEM_SMALL 16
+#define MEM_LARGE 512
+
+int memcmp(const void *cs, const void *ct, size_t count)
+{
+        const unsigned char *su1 = cs, *su2 = ct;
+        size_t n = count >> 2;
+
+        /* Skip the equal prefix a dword at a time. repe cmpsl stops
+         * one dword past the first difference, so step back over it
+         * and let the byte loop below find the byte. (The test makes
+         * ZF=1 when there are no dwords, as cmpsl then does nothing) */
+        __asm__ volatile(
+                "cld\n\t"
+                "testl %%ecx, %%ecx\n\t"
+                "repe\n\t"
+                "cmpsl\n\t"
+                "je 1f\n\t"
+                "subl $4, %%esi\n\t"
+                "subl $4, %%edi\n\t"
+                "incl %%ecx\n"
+                "1:"
+                : "+S"(su1), "+D"(su2), "+c"(n)
+                : /* No input */
+                : "cc", "memory"
+        );
+        for (count = (n << 2) + (count & 3); 0 < count; ++su1, ++su2, --count)
+                if (*su1 != *su2)
+                        return *su1 - *su2;
+        return 0;
+}
+
+void *memcpy(void *dest, const void *src, size_t count)
+{
+        void *d = dest;
+        size_t n;
+
+        if (count >= MEM_SMALL) {
+                /* align the destination, misaligned stores cost
+                 * more than misaligned loads */
+                n = -(uintptr_t) d & 3;
+                count -= n;
+                __asm__ volatile(
+                        "cld\n\t"
+                        "rep\n\t"
+                        "movsb"
+                        : "+D"(d), "+S"(src), "+c"(n)
+                        : /* No input */
+                        : "cc", "memory"
+                );
+                if (count < MEM_LARGE) {
+                        /* 16 bytes per trip through the loop */
+                        n = count >> 4;
+                        count &= 15;
+                        if (n) {
+                                __asm__ volatile(
+                                        "1:\n\t"
+                                        "movl (%%esi), %%eax\n\t"
+                                        "movl 4(%%esi), %%edx\n\t"
+                                        "movl %%eax, (%%edi)\n\t"
+                                        "movl %%edx, 4(%%edi)\n\t"
+                                        "movl 8(%%esi), %%eax\n\t"
+                                        "movl 12(%%esi), %%edx\n\t"
+                                        "movl %%eax, 8(%%edi)\n\t"
+                                        "movl %%edx, 12(%%edi)\n\t"
+                                        "addl $16, %%esi\n\t"
+                                        "addl $16, %%edi\n\t"
+                                        "decl %%ecx\n\t"
+                                        "jnz 1b"
+                                        : "+D"(d), "+S"(src), "+c"(n)
+                                        : /* No input */
+                                        : "eax", "edx", "cc", "memory"
+                                );
+                        }
+                }
+                n = count >> 2;
+                count &= 3;
+                __asm__ volatile(
+                        "rep\n\t"
+                        "movsl"
+                        : "+D"(d), "+S"(src), "+c"(n)
+                        : /* No input */
+                        : "cc", "memory"
+                );
+        }
+        /* Move %ecx bytes from %esi to %edi */
+        __asm__ volatile(
+                "cld\n\t" /* Make sure direction is forwards */
+                "rep\n\t"
+                "movsb"
+                : "+D"(d), "+S"(src), "+c"(count)
+                : /* No input */
+                : "cc", "memory" /* We overwrite condition codes - i.e., flags */
+        );
+        return dest;
+}
+
+void *memset(void *s, int c, size_t count)
+{
+        void *d = s;
+        uint32_t fill = 0x01010101 * (unsigned char) c;
+        size_t n;
+
+        if (count >= MEM_SMALL) {
+                n = -(uintptr_t) d & 3;
+                count -= n;
+                __asm__ volatile(
+                        "cld\n\t"
+                        "rep\n\t"
+                        "stosb\n\t"
+                        "movl %[rest], %%ecx\n\t"
+                        "rep\n\t"
+                        "stosl"
+                        : "+D"(d), "+c"(n)
+                        : "a"(fill), [rest] "g"(count >> 2)
+                        : "cc", "memory"
+                );
+                count &= 3;
+        }
+        /* Fill %ecx bytes at %edi with %eax (actually %al) */
+        __asm__ volatile(
+                "cld\n\t" /* Make sure direction is forwards */
+                "rep\n\t"
+                "stosb"
+                : "+D"(d), "+c"(count)
+                : "a"(fill)
+                : "cc", "memory" /* Overwrite flags */
+        );
+        return s;
+}
+
+/* The string routines here look at a word at a time. HASZERO(w) is non-zero
+ * if and only if some byte of w is zero. Once the pointer is aligned
+ * every word read lies inside one page, so a scan never touches a
+ * page the string does not reach into. */
+typedef uint32_t __attribute__((__may_alias__)) word_t;
+#define WORD_MASK (sizeof(word_t) - 1)
+#define ONES  0x01010101UL
+#define HIGHS 0x80808080UL
+#define HASZERO(w) (((w) - ONES) & ~(w) & HIGHS)
+
+int strcmp(const char *cs, const char *ct)
+{
+        const word_t *w1, *w2;
+
+        /* whole words can only be compared if the strings are
+         * aligned the same way, otherwise one of them would be
+         * read across word (and so maybe page) boundaries */
+        if (0 == (((uintptr_t) cs ^ (uintptr_t) ct) & WORD_MASK)) {
+                for (; (uintptr_t) cs & WORD_MASK; ++cs, ++ct)
+                        if (*cs != *ct || '\0' == *cs)
+                                return (unsigned char) *cs - (unsigned char) *ct;
+                for (w1 = (const word_t *) cs, w2 = (const word_t *) ct;
+                     *w1 == *w2 && !HASZERO(*w1); ++w1, ++w2)
+                        /* nothing */;
+                cs = (const char *) w1;
+                ct = (const char *) w2;
+        }
+        for (; *cs == *ct && '\0' != *cs; ++cs, ++ct)
+                /* nothing */;
+        return (unsigned char) *cs - (unsigned char) *ct;
+}
+
+size_t strlen(const char *s)
+{
+        const char *sc;
+        const word_t *w;
+
+        for (sc = s; (uintptr_t) sc & WORD_MASK; ++sc)
+                if (*sc == '\0')
+                        return sc - s;
+        for (w = (const word_t *) sc; !HASZERO(*w); ++w)
+                /* nothing */;
+        for (sc = (const char *) w; *sc != '\0'; ++sc)
+                /* nothing */;
+        return sc - s;
+}
+
+char *strchr(const char *s, int c)
+{
+        const word_t *w;
+        word_t cs = ONES * (unsigned char) c;
+
+        for (; (uintptr_t) s & WORD_MASK; ++s) {
+                if (*s == (char) c)
+                        return (char *)s;
+                if (*s == '\0')
+                        return NULL;
+        }
+        /* stop at the first word holding either c or the end */
+        for (w = (const word_t *) s; !HASZERO(*w) && !HASZERO(*w ^ cs); ++w)
+                /* nothing */;
+        for (s = (const char *) w; *s != (char) c; ++s)
+                if (*s == '\0')
+                        return NULL;
+        return (char *)s;
+}
@@ -4,6 +4,9 @@ struct mmobj;
 
 void anon_init();
 struct mmobj *anon_create(void);
+/* nonzero if o is an anonymous object, which keeps each of its pages
+ * pinned once while it is resident if there is no swap disk */
+int mmobj_is_anon(struct mmobj *o);
 
 extern int anon_count;
 
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+
+struct mmobj;
+struct pframe;
+
+/* ksmd merges identical pages of private memory. When woken it hashes
+ * the resident pages of every process's shadow objects, and pages found
+ * to hold the same bytes are freed in favour of a single pinned copy
+ * which is mapped read-only wherever they were. A write fault on such a
+ * page gives the object its own copy back through shadow_fillpage,
+ * exactly as copy-on-write after fork does. A merged page lives in no
+ * other place: not resident in its object, not in the compressed store
+ * and not in swap. The lookups below work (and find nothing) when ksmd
+ * is not configured. */
+
+/* Returns the shared frame holding the given page if it was merged,
+ * NULL if not. The frame is pinned and must never be written. */
+struct pframe *ksm_lookup(struct mmobj *o, uint32_t pagenum);
+
+/* Returns non-zero if the given page was merged. */
+int ksm_has(struct mmobj *o, uint32_t pagenum);
+
+/* If the page was merged, copies the shared frame into pf->pf_addr,
+ * marks the page dirty and drops the page's share of the frame. Returns
+ * 1 if the page was merged, 0 if not. Does not block. */
+int ksm_in(struct pframe *pf);
+
+/* Drops the page's share of its frame, if it was merged. */
+void ksm_discard(struct mmobj *o, uint32_t pagenum);
+
+/* Drops every merged page of an object which is about to be freed. */
+void ksm_discard_obj(struct mmobj *o);
+
+/* Hands all of src's merged pages over to dest, as pframe_migrate does
+ * for resident pages. Pages dest already has are dropped. */
+void ksm_migrate(struct mmobj *src, struct mmobj *dest);
+
+/* Asks ksmd to make a pass over memory. */
+void ksmd_wakeup(void);
+
+/* Prints how many pages were merged and how much memory that saved. */
+size_t ksm_info(const void *arg, char *buf, size_t osize);
@@ -8,4 +8,7 @@
 #define FAULT_RESERVED 0x08
 #define FAULT_EXEC     0x10
 
-void handle_pagefault(uintptr_t vaddr, uint32_t cause);
+/* Maps in the page for a fault on a user address. Returns 0 on
+ * success, -EFAULT if the access is not allowed (and, for a fault
+ * taken in user mode, kills the process). */
+int handle_pagefault(uintptr_t vaddr, uint32_t cause);
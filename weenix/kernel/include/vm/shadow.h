@@ -4,6 +4,7 @@ struct mmobj;
 
 void shadow_init();
 struct mmobj *shadow_create(void);
+int mmobj_is_shadow(struct mmobj *o);
 
 extern int shadow_count;
 
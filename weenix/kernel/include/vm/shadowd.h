@@ -1,4 +1,11 @@
 #pragma once
 
+struct vmarea;
+
 void shadowd_wakeup(void);
 void shadowd_alloc_sleep(void);
+
+/* Called when an object in the chain under vma may have lost a parent
+ * (fork, exit, munmap); every area over the same bottom object gets its
+ * generation bumped and is queued for shadowd's next pass. */
+void shadowd_chain_changed(struct vmarea *vma);
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+
+#include "drivers/dev.h"
+
+struct mmobj;
+struct pframe;
+
+/* Pages of anonymous and shadow objects have no file behind them, so
+ * when memory runs low pageoutd writes them out to the second disk
+ * instead. The disk is divided into page sized slots, one block each.
+ * If the disk is missing anonymous pages stay pinned in memory. */
+#define SWAP_DEVID MKDEVID(DISK_MAJOR, 1)
+
+/* Returns non-zero if a swap disk was found at boot. */
+int swap_enabled(void);
+
+/* Returns non-zero if the given page of the given object currently
+ * lives in a swap slot. */
+int swap_has(struct mmobj *o, uint32_t pagenum);
+
+/* Writes the page out to its slot, allocating one if the page does not
+ * have one yet. Returns 0 on success, -ENOSPC if swap is full or
+ * disabled, or the error from the disk. */
+int swap_out(struct pframe *pf);
+
+/* As swap_out, for a copy of the page held somewhere else. buf must be
+ * page aligned. */
+int swap_write(struct mmobj *o, uint32_t pagenum, const void *buf);
+
+/* If the page was swapped out, reads it back into pf->pf_addr, frees
+ * its slot and marks the page dirty (memory now holds the only copy).
+ * Returns 1 if the page came from swap, 0 if it has no slot, or the
+ * error from the disk. */
+int swap_in(struct pframe *pf);
+
+/* Throws away the swapped out copy of a page, if there is one. */
+void swap_discard(struct mmobj *o, uint32_t pagenum);
+
+/* Throws away every swapped out page of an object which is about to
+ * be freed. */
+void swap_discard_obj(struct mmobj *o);
+
+/* Hands all of src's swapped out pages over to dest, as pframe_migrate
+ * does for resident pages. Pages dest already has are discarded. */
+void swap_migrate(struct mmobj *src, struct mmobj *dest);
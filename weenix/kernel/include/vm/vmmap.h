@@ -10,6 +10,7 @@
 struct mmobj;
 struct proc;
 struct vnode;
+struct pframe;
 
 typedef struct vmmap {
         list_t       vmm_list;
@@ -32,6 +33,10 @@ typedef struct vmarea {
         list_link_t    vma_olink;    /* link on the list of all vm_areas
                                       * having the same vm_object at the
                                       * bottom of their chain */
+        uint32_t       vma_chaingen; /* bumped whenever an object in the
+                                      * chain may have lost a parent */
+        list_link_t    vma_dlink;    /* link on shadowd's list of areas
+                                      * whose chain changed */
 } vmarea_t;
 
 void vmmap_init(void);
@@ -47,6 +52,7 @@ int vmmap_find_range(vmmap_t *map, uint32_t npages, int dir);
 
 int vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count);
 int vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count);
+int vmmap_pin_user_page(vmmap_t *map, const void *vaddr, int forwrite, struct pframe **pf);
 
 vmmap_t *vmmap_clone(vmmap_t *map);
 
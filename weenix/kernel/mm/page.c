@@ -51,11 +51,12 @@ _pagegroup_create(uintptr_t start, uintptr_t end)
         /* allocate some of the space for the buddy bit maps,
          * we allocate enough bits to track all pages even
          * though some pages will be unavailable since they
-         * are being used as bitmaps */
+         * are being used as bitmaps (and at least a byte, as a
+         * group can be smaller than the largest block) */
         int order;
         for (order = 1; order < PAGE_NSIZES; ++order) {
                 uintptr_t count = npages >> order;
-                count = ((count - 1) & ~((uintptr_t)0x7)) + 8;
+                count = (count & ~((uintptr_t)0x7)) + 8;
                 count = count >> 3;
                 end -= count;
                 group->pg_map[order] = (void *)end;
@@ -6,6 +6,7 @@
 #include "globals.h"
 
 #include "main/interrupt.h"
+#include "main/cpuid.h"
 
 #include "mm/mm.h"
 #include "mm/page.h"
@@ -20,6 +21,8 @@
 
 #include "vm/pagefault.h"
 
+#include "api/access.h"
+
 #include "boot/config.h"
 
 #define PT_ENTRY_COUNT    (PAGE_SIZE / sizeof (uint32_t))
@@ -41,13 +44,51 @@ struct pagedir {
 #define vaddr_to_offset(vaddr) \
         (((uint32_t)(vaddr)) & (~PAGE_MASK))
 
+/* the bits of a large page directory entry which hold the physical
+ * address of the 4mb frame, and the flags a page table entry can
+ * inherit from such an entry when it is split up */
+#define PD_LARGE_MASK     (~(PT_LARGE_PAGE_SIZE - 1))
+#define PD_LARGE_PTFLAGS  (PT_PRESENT | PT_WRITE | PT_USER | PT_WRITE_THROUGH \
+                           | PT_CACHE_DISABLED | PT_ACCESSED | PT_DIRTY)
+
+#define pde_is_large(pde) \
+        ((PD_PRESENT & (pde)) && (PD_LARGE & (pde)))
+
+/* page tables are page aligned, so the low bits of each pd_virtual
+ * entry are free; for user page tables they hold the number of present
+ * entries in the table (0 to PT_ENTRY_COUNT) so that a table can be
+ * freed as soon as its last entry is unmapped. Always go through these
+ * macros rather than using pd_virtual directly. */
+#define pd_table(pd, index) \
+        ((pte_t *)((uintptr_t)(pd)->pd_virtual[index] & PAGE_MASK))
+#define pd_live(pd, index) \
+        ((uint32_t)((uintptr_t)(pd)->pd_virtual[index] & ~PAGE_MASK))
+#define pd_set_live(pd, index, n) \
+        ((pd)->pd_virtual[index] = (uintptr_t *)((uintptr_t)pd_table(pd, index) | (n)))
+
 /* the virtual address of the page directory in cr3 */
 static pagedir_t *current_pagedir = NULL;
 static pagedir_t *template_pagedir = NULL;
 
+/* The page table in slot 'index' of a page directory for debugging
+ * output: directories made by pt_create_pagedir leave pd_virtual unset
+ * for the kernel's slots, so those are looked up in the template. */
+static pte_t *
+_pt_table_at(const pagedir_t *pd, uint32_t index)
+{
+        if (NULL != template_pagedir
+            && (index < USER_MEM_LOW / PT_VADDR_SIZE || index >= USER_MEM_HIGH / PT_VADDR_SIZE)) {
+                pd = template_pagedir;
+        }
+        return pd_table(pd, index);
+}
+
 static uint32_t phys_map_count = 1;
 static pte_t *final_page;
 
+/* set by pt_init if the processor supports (and we enabled) PSE */
+static int pse_enabled = 0;
+
 uintptr_t
 pt_phys_tmp_map(uintptr_t paddr)
 {
@@ -85,6 +126,11 @@ pt_virt_to_phys(uintptr_t vaddr)
         uint32_t entry = vaddr_to_ptindex(vaddr);
         uint32_t offset = vaddr_to_offset(vaddr);
 
+        if (pde_is_large(current_pagedir->pd_physical[table])) {
+                return (current_pagedir->pd_physical[table] & PD_LARGE_MASK)
+                       + (vaddr & ~PD_LARGE_MASK);
+        }
+
         pte_t *pagetable = (pte_t *)pt_phys_tmp_map(current_pagedir->pd_physical[table] & PAGE_MASK);
         uintptr_t page = pagetable[entry] & PAGE_MASK;
         return page + offset;
@@ -104,6 +150,167 @@ pt_get(void)
         return current_pagedir;
 }
 
+int
+pt_large_supported(void)
+{
+        return pse_enabled;
+}
+
+/* Replaces the large (4mb) mapping in slot 'index' of the page
+ * directory with an equivalent page table of 4kb entries. Returns
+ * 0 on success or -ENOMEM if no page table could be allocated. */
+static int
+_pt_demote(pagedir_t *pd, uint32_t index)
+{
+        KASSERT(pde_is_large(pd->pd_physical[index]));
+
+        pte_t *pt;
+        if (NULL == (pt = page_alloc())) {
+                return -ENOMEM;
+        }
+
+        pde_t pde = pd->pd_physical[index];
+        uintptr_t pstart = pde & PD_LARGE_MASK;
+        uint32_t i;
+        for (i = 0; i < PT_ENTRY_COUNT; ++i) {
+                pt[i] = (pstart + i * PAGE_SIZE) | (pde & PD_LARGE_PTFLAGS);
+        }
+
+        pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt)
+                                 | (pde & (PD_PRESENT | PD_WRITE | PD_USER));
+        pd->pd_virtual[index] = pt;
+        pd_set_live(pd, index, PT_ENTRY_COUNT);
+        tlb_flush_range(index * PT_VADDR_SIZE, PT_ENTRY_COUNT);
+        return 0;
+}
+
+/* Drops the page table in slot 'index' of the page directory once it
+ * no longer has any present entries. */
+static void
+_pt_release_if_empty(pagedir_t *pd, uint32_t index)
+{
+        if (0 == pd_live(pd, index)) {
+                page_free(pd_table(pd, index));
+                pd->pd_physical[index] = 0;
+                pd->pd_virtual[index] = NULL;
+        }
+}
+
+/* Clears entries [first, last) of the page table in slot 'index',
+ * keeping its live count up to date, and frees the table if that
+ * leaves it empty. */
+static void
+_pt_clear_entries(pagedir_t *pd, uint32_t index, uint32_t first, uint32_t last)
+{
+        pte_t *pt = pd_table(pd, index);
+        uint32_t live = pd_live(pd, index);
+        uint32_t i;
+        for (i = first; i < last; ++i) {
+                if (PT_PRESENT & pt[i]) {
+                        KASSERT(live > 0);
+                        --live;
+                }
+                pt[i] = 0;
+        }
+        pd_set_live(pd, index, live);
+        _pt_release_if_empty(pd, index);
+}
+
+/* For pt_unmap_range, splits a large mapping which is only partially
+ * covered by the range, or drops it completely if it cannot be split */
+static void
+_pt_demote_or_clear(pagedir_t *pd, uint32_t index)
+{
+        if (pde_is_large(pd->pd_physical[index]) && 0 > _pt_demote(pd, index)) {
+                pd->pd_physical[index] = 0;
+                pd->pd_virtual[index] = NULL;
+        }
+}
+
+int
+pt_map_large(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags)
+{
+        KASSERT(PT_LARGE_ALIGNED(vaddr) && PT_LARGE_ALIGNED(paddr));
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+        KASSERT((pdflags & ~PAGE_MASK) == pdflags);
+
+        if (!pse_enabled) {
+                return -ENOTSUP;
+        }
+
+        int index = vaddr_to_pdindex(vaddr);
+        if (PD_PRESENT & pd->pd_physical[index] && !pde_is_large(pd->pd_physical[index])) {
+                page_free(pd_table(pd, index));
+        }
+        pd->pd_physical[index] = paddr | pdflags | PD_LARGE;
+        pd->pd_virtual[index] = NULL;
+
+        return 0;
+}
+
+int
+pt_promote(pagedir_t *pd, uintptr_t vaddr)
+{
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        if (!pse_enabled) {
+                return 0;
+        }
+
+        int index = vaddr_to_pdindex(vaddr);
+        if (!(PD_PRESENT & pd->pd_physical[index]) || pde_is_large(pd->pd_physical[index])) {
+                return 0;
+        }
+
+        pte_t *pt = pd_table(pd, index);
+        uint32_t flags = pt[0] & (PT_PRESENT | PT_WRITE | PT_USER);
+        uintptr_t pstart = pt[0] & PAGE_MASK;
+        if (!(PT_PRESENT & flags) || !PT_LARGE_ALIGNED(pstart)) {
+                return 0;
+        }
+
+        /* every entry has to be there, with the same permissions,
+         * and the frames have to be physically contiguous */
+        uint32_t i;
+        for (i = 1; i < PT_ENTRY_COUNT; ++i) {
+                if ((pt[i] & (PT_PRESENT | PT_WRITE | PT_USER)) != flags
+                    || (pt[i] & PAGE_MASK) != pstart + i * PAGE_SIZE) {
+                        return 0;
+                }
+        }
+
+        pt_map_large(pd, (uintptr_t)index * PT_VADDR_SIZE, pstart,
+                     pd->pd_physical[index] & flags);
+        tlb_flush_range((uintptr_t)index * PT_VADDR_SIZE, PT_ENTRY_COUNT);
+        return 1;
+}
+
+int
+pt_block_full(pagedir_t *pd, uintptr_t vaddr, uint32_t ptflags)
+{
+        KASSERT(USER_MEM_LOW <= vaddr && USER_MEM_HIGH > vaddr);
+
+        int index = vaddr_to_pdindex(vaddr);
+        if (!(PD_PRESENT & pd->pd_physical[index]) || pde_is_large(pd->pd_physical[index])) {
+                return 0;
+        }
+
+        /* blocks are mostly filled in from one end or the other, so
+         * the ends are looked at before the whole table is */
+        pte_t *pt = pd_table(pd, index);
+        if ((pt[0] & ptflags) != ptflags
+            || (pt[PT_ENTRY_COUNT - 1] & ptflags) != ptflags) {
+                return 0;
+        }
+        uint32_t i;
+        for (i = 1; i < PT_ENTRY_COUNT - 1; ++i) {
+                if ((pt[i] & ptflags) != ptflags) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
 int
 pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32_t ptflags)
 {
@@ -112,26 +319,40 @@ pt_map(pagedir_t *pd, uintptr_t vaddr, uintptr_t paddr, uint32_t pdflags, uint32
 
         int index = vaddr_to_pdindex(vaddr);
 
+        /* a single page inside a large mapping is changing, so
+         * the large mapping has to go back to a page table */
+        if (pde_is_large(pd->pd_physical[index])) {
+                if (0 > _pt_demote(pd, index)) {
+                        return -ENOMEM;
+                }
+        }
+
         pte_t *pt;
         if (!(PT_PRESENT & pd->pd_physical[index])) {
                 if (NULL == (pt = page_alloc())) {
                         return -ENOMEM;
                 } else {
                         KASSERT((pdflags & ~PAGE_MASK) == pdflags);
-                        memset(pt, 0, PAGE_SIZE);
+                        page_zero(pt);
                         pd->pd_physical[index] = pt_virt_to_phys((uintptr_t)pt) | pdflags;
                         pd->pd_virtual[index] = pt;
                 }
         } else {
                 /* Be sure to add additional pagedir flags if necessary */
                 pd->pd_physical[index] = pd->pd_physical[index] | pdflags;
-                pt = (pte_t *)pd->pd_virtual[index];
+                pt = pd_table(pd, index);
         }
 
-        index = vaddr_to_ptindex(vaddr);
+        uint32_t entry = vaddr_to_ptindex(vaddr);
 
         KASSERT((ptflags & ~PAGE_MASK) == ptflags);
-        pt[index] = paddr | ptflags;
+        if (!(PT_PRESENT & pt[entry]) && (PT_PRESENT & ptflags)) {
+                pd_set_live(pd, index, pd_live(pd, index) + 1);
+        } else if ((PT_PRESENT & pt[entry]) && !(PT_PRESENT & ptflags)) {
+                pd_set_live(pd, index, pd_live(pd, index) - 1);
+        }
+        pt[entry] = paddr | ptflags;
+        _pt_release_if_empty(pd, index);
 
         return 0;
 }
@@ -144,11 +365,16 @@ pt_unmap(pagedir_t *pd, uintptr_t vaddr)
 
         int index = vaddr_to_pdindex(vaddr);
 
-        if (PT_PRESENT & pd->pd_physical[index]) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[index];
+        if (pde_is_large(pd->pd_physical[index]) && 0 > _pt_demote(pd, index)) {
+                /* can't split it, drop the whole thing, the other
+                 * pages will simply be faulted back in */
+                pd->pd_physical[index] = 0;
+                return;
+        }
 
-                index = vaddr_to_ptindex(vaddr);
-                pt[index] = 0;
+        if (PT_PRESENT & pd->pd_physical[index]) {
+                uint32_t entry = vaddr_to_ptindex(vaddr);
+                _pt_clear_entries(pd, index, entry, entry + 1);
         }
 }
 
@@ -162,31 +388,122 @@ pt_unmap_range(pagedir_t *pd, uintptr_t vlow, uintptr_t vhigh)
         KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
 
         index = vaddr_to_ptindex(vlow);
-        if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vlow)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vlow)];
-                size_t size = (PT_ENTRY_COUNT - index) * sizeof(*pt);
-                memset(&pt[index], 0, size);
+        if (index != 0) {
+                uint32_t table = vaddr_to_pdindex(vlow);
+                int sametable = (table == vaddr_to_pdindex(vhigh));
+
+                _pt_demote_or_clear(pd, table);
+                if (PT_PRESENT & pd->pd_physical[table]) {
+                        _pt_clear_entries(pd, table, index,
+                                          sametable ? vaddr_to_ptindex(vhigh) : PT_ENTRY_COUNT);
+                }
+                if (sametable) {
+                        return;
+                }
         }
         vlow += PAGE_SIZE * ((PT_ENTRY_COUNT - index) % PT_ENTRY_COUNT);
 
         index = vaddr_to_ptindex(vhigh);
+        if (index != 0) {
+                _pt_demote_or_clear(pd, vaddr_to_pdindex(vhigh));
+        }
         if (PT_PRESENT & pd->pd_physical[vaddr_to_pdindex(vhigh)] && index != 0) {
-                pte_t *pt = (pte_t *)pd->pd_virtual[vaddr_to_pdindex(vhigh)];
-                size_t size = index * sizeof(*pt);
-                memset(&pt[0], 0, size);
+                _pt_clear_entries(pd, vaddr_to_pdindex(vhigh), 0, index);
         }
         vhigh -= PAGE_SIZE * index;
 
         uint32_t i;
         for (i = vaddr_to_pdindex(vlow); i < vaddr_to_pdindex(vhigh); ++i) {
-                if (PT_PRESENT & pd->pd_physical[i]) {
-                        page_free(pd->pd_virtual[i]);
+                if (pde_is_large(pd->pd_physical[i])) {
+                        pd->pd_physical[i] = 0;
+                } else if (PT_PRESENT & pd->pd_physical[i]) {
+                        page_free(pd_table(pd, i));
                         pd->pd_virtual[i] = NULL;
                         pd->pd_physical[i] = 0;
                 }
         }
 }
 
+int
+pt_copy_range(pagedir_t *from, pagedir_t *to, uintptr_t vlow, uintptr_t vhigh, int cow)
+{
+        KASSERT(from != to);
+        KASSERT(vlow < vhigh);
+        KASSERT(PAGE_ALIGNED(vlow) && PAGE_ALIGNED(vhigh));
+        KASSERT(USER_MEM_LOW <= vlow && USER_MEM_HIGH >= vhigh);
+
+        int nprotected = 0;
+        uintptr_t vaddr = vlow;
+        while (vaddr < vhigh) {
+                uint32_t table = vaddr_to_pdindex(vaddr);
+                uintptr_t tend = MIN(vhigh, (table + 1) * PT_VADDR_SIZE);
+
+                /* nothing mapped in this slot of the parent, so there
+                 * is nothing to share with the child either */
+                if (!(PT_PRESENT & from->pd_physical[table])) {
+                        vaddr = tend;
+                        continue;
+                }
+
+                /* the child gets its own page table either way, so
+                 * the parent's large mapping is split up here */
+                if (pde_is_large(from->pd_physical[table])
+                    && 0 > _pt_demote(from, table)) {
+                        return -ENOMEM;
+                }
+
+                pte_t *src = pd_table(from, table);
+                pte_t *dst;
+                if (!(PT_PRESENT & to->pd_physical[table])) {
+                        if (NULL == (dst = page_alloc())) {
+                                return -ENOMEM;
+                        }
+                        page_zero(dst);
+                        to->pd_physical[table] = pt_virt_to_phys((uintptr_t)dst)
+                                                 | (from->pd_physical[table] & ~PAGE_MASK);
+                        to->pd_virtual[table] = dst;
+                } else {
+                        dst = pd_table(to, table);
+                }
+
+                uint32_t live = pd_live(to, table);
+                for (; vaddr < tend; vaddr += PAGE_SIZE) {
+                        uint32_t entry = vaddr_to_ptindex(vaddr);
+                        if (!(PT_PRESENT & src[entry])) {
+                                continue;
+                        }
+                        if (cow && (PT_WRITE & src[entry])) {
+                                src[entry] &= ~PT_WRITE;
+                                ++nprotected;
+                        }
+                        if (!(PT_PRESENT & dst[entry])) {
+                                ++live;
+                        }
+                        dst[entry] = src[entry];
+                }
+                pd_set_live(to, table, live);
+        }
+
+        return nprotected;
+}
+
+uint32_t
+pt_resident(pagedir_t *pd)
+{
+        uint32_t begin = USER_MEM_LOW / PT_VADDR_SIZE;
+        uint32_t end = USER_MEM_HIGH / PT_VADDR_SIZE;
+        uint32_t count = 0;
+
+        uint32_t i;
+        for (i = begin; i < end; ++i) {
+                if (pde_is_large(pd->pd_physical[i])) {
+                        count += PT_ENTRY_COUNT;
+                } else if (PD_PRESENT & pd->pd_physical[i]) {
+                        count += pd_live(pd, i);
+                }
+        }
+        return count;
+}
 
 pagedir_t *
 pt_create_pagedir()
@@ -198,7 +515,19 @@ pt_create_pagedir()
                 return NULL;
         }
 
-        memcpy(pdir, template_pagedir, sizeof(*pdir));
+        /* the processor walks the one page directory in cr3, so the
+         * kernel's entries have to be copied into every directory; the
+         * page tables they point at are shared with the template. Only
+         * pd_physical is initialized: pd_virtual of a kernel slot is
+         * read from the template (see _pt_table_at), and that of a
+         * user slot is only read once its pd_physical entry is present */
+        uint32_t begin = USER_MEM_LOW / PT_VADDR_SIZE;
+        uint32_t end = USER_MEM_HIGH / PT_VADDR_SIZE;
+        uint32_t nkern = PT_ENTRY_COUNT - end;
+
+        memcpy(pdir->pd_physical, template_pagedir->pd_physical, begin * sizeof(pde_t));
+        memset(&pdir->pd_physical[begin], 0, (end - begin) * sizeof(pde_t));
+        memcpy(&pdir->pd_physical[end], &template_pagedir->pd_physical[end], nkern * sizeof(pde_t));
         return pdir;
 }
 
@@ -213,8 +542,8 @@ pt_destroy_pagedir(pagedir_t *pdir)
 
         uint32_t i;
         for (i = begin; i <= end; ++i) {
-                if (PT_PRESENT & pdir->pd_physical[i]) {
-                        page_free(pdir->pd_virtual[i]);
+                if (PT_PRESENT & pdir->pd_physical[i] && !pde_is_large(pdir->pd_physical[i])) {
+                        page_free(pd_table(pdir, i));
                 }
         }
         page_free_n(pdir, 2);
@@ -231,9 +560,20 @@ _pt_fault_handler(regs_t *regs)
         /* Check if pagefault was in user space (otherwise, BAD!) */
         if (cause & FAULT_USER) {
                 handle_pagefault(vaddr, cause);
-        } else {
+                return;
+        }
+
+        /* the only kernel code allowed to fault is the user copy
+         * routines in api/access.c touching a user address; if the
+         * page cannot be brought in they carry on at their fixup,
+         * which makes the copy return -EFAULT */
+        uintptr_t fixup = access_fixup(regs->r_eip);
+        if (0 == fixup || vaddr < USER_MEM_LOW || vaddr >= USER_MEM_HIGH) {
                 panic("\nPage faulted while accessing 0x%08x\n", vaddr);
         }
+        if (0 > handle_pagefault(vaddr, cause)) {
+                regs->r_eip = fixup;
+        }
 }
 
 static void
@@ -244,7 +584,7 @@ _pt_fill_page(pagedir_t *pd, pte_t *pt, pde_t pdflags, pte_t ptflags,
         KASSERT(0 == vstart % PT_VADDR_SIZE);
 
         uint32_t i;
-        memset(pt, 0, PAGE_SIZE);
+        page_zero(pt);
         for (i = 0; i < PT_ENTRY_COUNT; ++i) {
                 pt[i] = (i * PAGE_SIZE + pstart) & PAGE_MASK;
                 pt[i] = pt[i] | (ptflags & ~(PAGE_MASK));
@@ -283,42 +623,87 @@ pt_init(void)
         /* set up the necessary stuff for temporary mappings */
         final_page = (pde_t *)((char *)pagedir + sizeof(*pagedir));
         KASSERT(PAGE_ALIGNED(final_page));
-        memset(final_page, 0, PAGE_SIZE);
+        page_zero(final_page);
         temppdir[PT_ENTRY_COUNT - 1] = ((uintptr_t)final_page
                                         - (uintptr_t)&kernel_start + KERNEL_PHYS_BASE) | PT_PRESENT | PT_WRITE;
         pagedir->pd_physical[PT_ENTRY_COUNT - 1] = temppdir[PT_ENTRY_COUNT - 1];
         pagedir->pd_virtual[PT_ENTRY_COUNT - 1] = final_page;
 
-        /* identity map the first 4mb (one page table) of physical memory */
-        pte_t *pagetable = final_page + PT_ENTRY_COUNT;
-        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, 0, 0);
-
-        /* map in 4mb (one page table) where the kernel is
-         * this will make our new page table identical to the temporary
-         * page table the boot loader created. */
-        pagetable += PT_ENTRY_COUNT;
-        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE,
-                      (uintptr_t)&kernel_start, KERNEL_PHYS_BASE);
-
-        current_pagedir = pagedir;
-        /* swap the temporary page table with our identical, but more
-         * permanant page table */
-        pt_set(pagedir);
+        /* turn on 4mb pages if the processor has them, before the
+         * new page directory (which uses them) is put in cr3 */
+        uint32_t eax, edx;
+        cpuid(CPUID_GETFEATURES, &eax, &edx);
+        if (CPUID_FEAT_EDX_PSE & edx) {
+                uint32_t cr4;
+                __asm__ volatile("movl %%cr4, %0" : "=r"(cr4));
+                __asm__ volatile("movl %0, %%cr4" :: "r"(cr4 | CR4_PSE) : "memory");
+                pse_enabled = 1;
+        }
+        dbgq(DBG_MM, "4mb pages: %s\n", pse_enabled ? "enabled" : "not supported");
 
         uintptr_t physmax = phys_detect_highmem();
+        uintptr_t physmin = phys_detect_lowmem();
         dbgq(DBG_MM, "Highest usable physical memory: 0x%08x\n", physmax);
-        dbgq(DBG_MM, "Available memory: 0x%08x\n", physmax - KERNEL_PHYS_BASE);
+        dbgq(DBG_MM, "Available memory: 0x%08x\n", physmax - physmin);
+
+        /* the page tables below are filled in while the boot loader's
+         * page directory is still in cr3, as _pt_fill_page finds their
+         * physical addresses through it */
+
+        /* identity map the first 4mb (one page table) of physical memory */
+        pte_t *pagetable = final_page + PT_ENTRY_COUNT;
+        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, 0, 0);
 
+        /* map in the kernel's window onto physical memory, starting
+         * with the 4mb the boot loader mapped. The kernel is loaded on
+         * a 4mb boundary (KERNEL_PHYS_BASE) so with PSE each 4mb of the
+         * window is a single large page */
         uintptr_t vaddr = ((uintptr_t)&kernel_start);
         uintptr_t paddr = KERNEL_PHYS_BASE;
+        KASSERT(PT_LARGE_ALIGNED(vaddr) && PT_LARGE_ALIGNED(paddr));
         do {
-                pagetable += PT_ENTRY_COUNT;
+                if (pse_enabled) {
+                        pagedir->pd_physical[vaddr_to_pdindex(vaddr)] = paddr | PD_PRESENT | PD_WRITE | PD_LARGE;
+                        pagedir->pd_virtual[vaddr_to_pdindex(vaddr)] = NULL;
+                } else {
+                        pagetable += PT_ENTRY_COUNT;
+                        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
+                }
                 vaddr += PT_VADDR_SIZE;
                 paddr += PT_VADDR_SIZE;
-                _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, vaddr, paddr);
         } while (paddr < physmax);
 
-        page_add_range((uintptr_t) pagetable + PT_ENTRY_COUNT, physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE);
+        /* the memory between the first mb and the kernel is not in the
+         * window, so it gets a page table of its own just past the end */
+        uintptr_t lowmem = vaddr;
+        KASSERT(lowmem < UPTR_MAX - 2 * PT_VADDR_SIZE + 1);
+        pagetable += PT_ENTRY_COUNT;
+        _pt_fill_page(pagedir, pagetable, PD_PRESENT | PD_WRITE, PT_PRESENT | PT_WRITE, lowmem, 0);
+
+        current_pagedir = pagedir;
+        /* swap the temporary page table with our identical, but more
+         * permanant page table */
+        pt_set(pagedir);
+
+        uint32_t cr0;
+        __asm__ volatile("movl %%cr0, %0" : "=r"(cr0));
+        __asm__ volatile("movl %0, %%cr0" :: "r"(cr0 | CR0_WP) : "memory");
+
+        /* the page allocator's 4mb blocks are aligned to the start of
+         * the range they come from, so the window is handed over in two
+         * ranges, the second starting on a 4mb boundary */
+        uintptr_t start = (uintptr_t)(pagetable + PT_ENTRY_COUNT);
+        uintptr_t split = (start + PT_VADDR_SIZE - 1) & ~(PT_VADDR_SIZE - 1);
+        uintptr_t end = physmax + ((uintptr_t)&kernel_start) - KERNEL_PHYS_BASE;
+        if (split < end) {
+                page_add_range(start, split);
+                page_add_range(split, end);
+        } else {
+                page_add_range(start, end);
+        }
+        if (physmin < KERNEL_PHYS_BASE) {
+                page_add_range(lowmem + physmin, lowmem + KERNEL_PHYS_BASE);
+        }
 }
 
 void
@@ -328,7 +713,7 @@ pt_template_init()
          * the pt_init function above, it needs to be slighly modified
          * to remove the mapping of the first 4mb and then saved in a
          * seperate page as the template */
-        memset(current_pagedir->pd_virtual[0], 0, PAGE_SIZE);
+        page_zero(current_pagedir->pd_virtual[0]);
         tlb_flush_all();
 
         template_pagedir = page_alloc_n(2);
@@ -357,9 +742,13 @@ pt_mapping_info(const void *pt, char *buf, size_t osize)
 
         while (PT_ENTRY_COUNT > pdi) {
                 pte_t *entry = NULL;
-                if (PD_PRESENT & pagedir->pd_physical[pdi]) {
-                        if (PT_PRESENT & pagedir->pd_virtual[pdi][pti]) {
-                                entry = &pagedir->pd_virtual[pdi][pti];
+                pte_t large;
+                if (pde_is_large(pagedir->pd_physical[pdi])) {
+                        large = (pagedir->pd_physical[pdi] & PD_LARGE_MASK) + pti * PAGE_SIZE;
+                        entry = &large;
+                } else if (PD_PRESENT & pagedir->pd_physical[pdi]) {
+                        if (PT_PRESENT & _pt_table_at(pagedir, pdi)[pti]) {
+                                entry = &_pt_table_at(pagedir, pdi)[pti];
                         }
                 } else {
                         ++pdi;
@@ -14,8 +14,13 @@
 #include "mm/pframe.h"
 #include "mm/tlb.h"
 #include "mm/pagetable.h"
+#include "mm/zpage.h"
 
 #include "vm/vmmap.h"
+#include "vm/swap.h"
+#include "vm/ksmd.h"
+
+#include "fs/vnode.h"
 
 /*
  * In this file, physical pages (as represented by pframes) will be
@@ -209,6 +214,28 @@ pframe_get_resident(struct mmobj *o, uint32_t pagenum)
         return NULL;
 }
 
+/*
+ * As pframe_get_resident, but the lookup does not count as a use of the
+ * page, so scanners which visit every page (like ksmd) do not disturb
+ * the order pageoutd reclaims pages in.
+ *
+ * @param o the mmobj the page is in
+ * @param pagenum the page number identifying this page within the object
+ *
+ * @return the page requested, or NULL if it is not resident.
+ */
+pframe_t *
+pframe_peek_resident(struct mmobj *o, uint32_t pagenum)
+{
+        pframe_t *pf;
+
+        list_iterate_begin(&pframe_hash[hash_page(o, pagenum)], pf, pframe_t, pf_hlink) {
+                if ((o == pf->pf_obj) && (pagenum == pf->pf_pagenum))
+                        return pf;
+        } list_iterate_end();
+        return NULL;
+}
+
 /*
  * Allocate a pframe to hold the page identified by the object and page number.
  * The given page should not already be resident.
@@ -226,7 +253,6 @@ static pframe_t *
 pframe_alloc(mmobj_t *o, uint32_t pagenum)
 {
         pframe_t *pf;
-        dbg_print("alloccc\n");
         if (NULL == (pf = slab_obj_alloc(pframe_allocator))) {
                 dbg(DBG_PFRAME, "WARNING: not enough kernel memory\n");
                 return NULL;
@@ -266,7 +292,13 @@ pframe_fill(pframe_t *pf)
         int ret;
 
         pframe_set_busy(pf);
-        ret = pf->pf_obj->mmo_ops->fillpage(pf->pf_obj, pf);
+        /* pages pageoutd compressed on their way out come back from the
+         * compressed store without going near the object's backing store */
+        if (zpage_load(pf)) {
+                ret = 0;
+        } else {
+                ret = pf->pf_obj->mmo_ops->fillpage(pf->pf_obj, pf);
+        }
         pframe_clear_busy(pf);
 
         sched_broadcast_on(&pf->pf_waitq);
@@ -297,7 +329,39 @@ pframe_fill(pframe_t *pf)
 int
 pframe_get(struct mmobj *o, uint32_t pagenum, pframe_t **result)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_get");
+        pframe_t *pf;
+        int ret;
+
+        for (;;) {
+                if (NULL != (pf = pframe_get_resident(o, pagenum))) {
+                        if (!pframe_is_busy(pf)) {
+                                *result = pf;
+                                return 0;
+                        }
+                        /* the page may be gone by the time we wake up */
+                        sched_sleep_on(&pf->pf_waitq);
+                } else if (pageoutd_needed()) {
+                        pageoutd_wakeup();
+                        sched_sleep_on(&alloc_waitq);
+                } else {
+                        break;
+                }
+        }
+
+        if (NULL == (pf = pframe_alloc(o, pagenum))) {
+                *result = NULL;
+                return -ENOMEM;
+        }
+        if ((ret = pframe_fill(pf)) < 0) {
+                pframe_free(pf);
+                *result = NULL;
+                return ret;
+        }
+
+        if (pageoutd_needed()) {
+                pageoutd_wakeup();
+        }
+        *result = pf;
         return 0;
 }
 
@@ -313,7 +377,8 @@ pframe_lookup(struct mmobj *o, uint32_t pagenum, int forwrite, pframe_t **result
 /*
  * Migrate a page frame up the tree. The destination must be on the same
  * branch as the pframe's current object. pf must not be busy. If dest
- * already has a page with the same number as pf clean pf.
+ * already has a page with the same number as pf, pf is simply freed.
+ * Does not block.
  *
  * @param pf page to be migrated
  * @param dest destination vm object
@@ -322,10 +387,15 @@ void
 pframe_migrate(pframe_t *pf, mmobj_t *dest)
 {
         KASSERT(!pframe_is_busy(pf));
-        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)) {
-                /* dest already has a newer version of the page, clean this page */
-                pframe_unpin(pf);
-                pframe_clean(pf);
+        if (NULL != pframe_get_resident(dest, pf->pf_pagenum)
+            || zpage_has(dest, pf->pf_pagenum)
+            || swap_has(dest, pf->pf_pagenum)
+            || ksm_has(dest, pf->pf_pagenum)) {
+                /* dest already has a newer version of the page, this
+                 * one will never be read again */
+                while (pframe_is_pinned(pf))
+                        pframe_unpin(pf);
+                pframe_clear_dirty(pf);
                 pframe_free(pf);
         } else {
                 mmobj_t *src = pf->pf_obj;
@@ -357,7 +427,16 @@ pframe_migrate(pframe_t *pf, mmobj_t *dest)
 void
 pframe_pin(pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_pin");
+        KASSERT(!pframe_is_free(pf));
+        KASSERT(0 <= pf->pf_pincount);
+
+        if (!pframe_is_pinned(pf)) {
+                list_remove(&pf->pf_link);
+                nallocated--;
+                list_insert_tail(&pinned_list, &pf->pf_link);
+                npinned++;
+        }
+        pf->pf_pincount++;
 }
 
 /*
@@ -373,7 +452,15 @@ pframe_pin(pframe_t *pf)
 void
 pframe_unpin(pframe_t *pf)
 {
-        NOT_YET_IMPLEMENTED("S5FS: pframe_unpin");
+        KASSERT(!pframe_is_free(pf));
+        KASSERT(0 < pf->pf_pincount);
+
+        if (0 == --pf->pf_pincount) {
+                list_remove(&pf->pf_link);
+                npinned--;
+                list_insert_tail(&alloc_list, &pf->pf_link);
+                nallocated++;
+        }
 }
 
 /*
@@ -533,13 +620,21 @@ list_start:
  */
 void
 pframe_remove_from_pts(pframe_t *pf)
+{
+        pframe_unmap_page(pf->pf_obj, pf->pf_pagenum);
+}
+
+/* As above, for a page which need not be resident; any frame mapped at
+ * the page's address in an area over o's tree is unmapped. */
+void
+pframe_unmap_page(mmobj_t *o, uint32_t pagenum)
 {
         vmarea_t *vma;
-        list_iterate_begin(mmobj_bottom_vmas(pf->pf_obj), vma, vmarea_t, vma_olink) {
-                /* Get the virtual address in the area corresponding to this pf */
-                if ((pf->pf_pagenum >= vma->vma_off)
-                    && (pf->pf_pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))) {
-                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pf->pf_pagenum - vma->vma_off);
+        list_iterate_begin(mmobj_bottom_vmas(o), vma, vmarea_t, vma_olink) {
+                /* Get the virtual address in the area corresponding to this page */
+                if ((pagenum >= vma->vma_off)
+                    && (pagenum < vma->vma_off + (vma->vma_end - vma->vma_start))) {
+                        uintptr_t vaddr = (uintptr_t) PN_TO_ADDR(vma->vma_start + pagenum - vma->vma_off);
                         /* And unmap it from that area's proc */
                         if (NULL != vma->vma_vmmap->vmm_proc) {
                                 pt_unmap(vma->vma_vmmap->vmm_proc->p_pagedir, vaddr);
@@ -600,7 +695,18 @@ pageoutd_run(int arg1, void *arg2)
 {
         while (1) {
                 KASSERT(nallocated >= 0);
-                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))) {
+                /* pages which could not be cleaned (e.g. anonymous pages
+                 * when swap is full) are moved to the back of the list; once
+                 * every page has failed there is nothing left to reclaim */
+                int nfailed = 0;
+
+                /* unreferenced vnodes kept in core hold on to the pages
+                 * their inodes live in; let half of them go */
+                if (!pageoutd_target_met())
+                        vnode_cache_shrink(VNODE_CACHE_MAX / 2);
+
+                while ((!pageoutd_target_met()) && (!list_empty(&alloc_list))
+                       && (nfailed < nallocated)) {
                         pframe_t *pf;
 
                         /* obtain least-recently-requested page: */
@@ -609,10 +715,18 @@ pageoutd_run(int arg1, void *arg2)
                         if (pframe_is_busy(pf)) {
                                 sched_sleep_on(&pf->pf_waitq);
                         } else if (pframe_is_dirty(pf)) {
-                                pframe_clean(pf);
+                                if (pframe_clean(pf) < 0
+                                    && pf == list_head(&alloc_list, pframe_t, pf_link)) {
+                                        list_remove(&pf->pf_link);
+                                        list_insert_tail(&alloc_list, &pf->pf_link);
+                                        nfailed++;
+                                }
                         } else {
                                 /* it's not busy, it's clean, and it's
-                                 * least-recently-requested; reclaim it: */
+                                 * least-recently-requested; keep a
+                                 * compressed copy if there is room (this
+                                 * does not block) and reclaim it: */
+                                zpage_store(pf, 0);
                                 pframe_free(pf);
                         }
                 }
@@ -620,6 +734,9 @@ pageoutd_run(int arg1, void *arg2)
                 /*   release the thundering herd... */
                 sched_broadcast_on(&alloc_waitq);
 
+                /* memory is tight, have ksmd look for duplicate pages */
+                ksmd_wakeup();
+
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: Falling asleep\n");
                 dbg(DBG_PFRAME, "PAGEOUT DEMAON: "
                     "nfreepages_target=|%d| "
@@ -51,3 +51,21 @@ phys_detect_highmem(void)
         return 0;
 }
 
+
+uintptr_t
+phys_detect_lowmem(void)
+{
+        uint32_t i;
+        struct mmap_def *mmap = (struct mmap_def *)MEMORY_MAP_BASE;
+        for (i = 0; i < mmap->md_count; ++i) {
+                uint32_t base = mmap->md_ents[i].me_baselo;
+                uint32_t length = mmap->md_ents[i].me_lenlo;
+                uint32_t type = mmap->md_ents[i].me_type;
+
+                if (1 /* Usable */ == type && KERNEL_PHYS_BASE >= base && KERNEL_PHYS_BASE < base + length) {
+                        return (uintptr_t)MAX(base, 0x100000);
+                }
+        }
+        KASSERT(0 && "Failed to detect correct physical addresses.");
+        return 0;
+}
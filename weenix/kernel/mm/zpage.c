@@ -0,0 +1,464 @@
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/printf.h"
+#include "util/init.h"
+
+#include "proc/sched.h"
+#include "proc/kmutex.h"
+
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/page.h"
+#include "mm/kmalloc.h"
+#include "mm/zpage.h"
+
+#include "vm/swap.h"
+#include "vm/ksmd.h"
+
+#ifdef __ZPAGE_KB__
+#define ZPAGE_POOL_SIZE (__ZPAGE_KB__ * 1024)
+#else
+#define ZPAGE_POOL_SIZE 0
+#endif
+
+/*
+ * Each page in the pool is a single kmalloc'd block: the entry below
+ * followed by the compressed data. Entries are on a hash chain for
+ * lookups and on an lru list, oldest first, for eviction.
+ */
+typedef struct zpage {
+        mmobj_t        *zp_obj;
+        uint32_t        zp_pagenum;
+        uint16_t        zp_len;      /* length of the compressed data */
+        uint8_t         zp_dirty;    /* the pool holds the only copy */
+        uint8_t         zp_busy;     /* being written out to swap */
+        list_link_t     zp_hlink;    /* link on the hash chain */
+        list_link_t     zp_link;     /* link on the lru list */
+} zpage_t;
+
+#define zpage_data(zp) ((uint8_t *) ((zp) + 1))
+
+#define ZPAGE_HASH_SIZE 64
+#define hash_zpage(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
+                                   % ZPAGE_HASH_SIZE)
+static list_t zpage_hash[ZPAGE_HASH_SIZE];
+static list_t zpage_lru;
+
+/* A page is only worth keeping if it fits in half a page */
+#define ZPAGE_MAX_CHARGE (PAGE_SIZE / 2)
+#define ZPAGE_MAX_LEN (ZPAGE_MAX_CHARGE - sizeof(zpage_t) - sizeof(void *))
+static uint8_t zpage_buf[ZPAGE_MAX_LEN];
+
+/* Threads waiting for a page to finish going out to swap */
+static ktqueue_t zpage_waitq;
+
+/* Dirty pages are decompressed here on their way to swap */
+static void *zpage_scratch = NULL;
+static kmutex_t zpage_scratch_mutex;
+
+static size_t zpage_used = 0;
+static uint32_t zpage_npages = 0;
+
+static uint32_t zpage_nhits = 0;
+static uint32_t zpage_nmisses = 0;
+static uint32_t zpage_nstores = 0;
+static uint32_t zpage_nrejects = 0;
+static uint32_t zpage_ndropped = 0;
+static uint32_t zpage_nswapped = 0;
+
+static __attribute__((unused)) void
+zpage_init(void)
+{
+        int i;
+        for (i = 0; i < ZPAGE_HASH_SIZE; ++i)
+                list_init(&zpage_hash[i]);
+        list_init(&zpage_lru);
+        sched_queue_init(&zpage_waitq);
+        kmutex_init(&zpage_scratch_mutex);
+
+        if (0 != ZPAGE_POOL_SIZE) {
+                zpage_scratch = page_alloc();
+                KASSERT(NULL != zpage_scratch);
+        }
+        dbg(DBG_PFRAME, "zpage: %d byte compressed page pool\n", ZPAGE_POOL_SIZE);
+}
+init_func(zpage_init);
+
+/* ------------------------------------------------------------------ */
+/* -------------------------- COMPRESSION --------------------------- */
+/* ------------------------------------------------------------------ */
+
+/*
+ * A simple LZ77 scheme in the style of LZRW1, cheap enough to run on
+ * every page pageoutd reclaims. The output is a sequence of groups: a
+ * 16 bit control word followed by up to 16 items. An item whose control
+ * bit is clear is a literal byte, one whose bit is set is a two byte
+ * copy of 3 to 18 bytes from up to 4095 bytes back in the page. Matches
+ * are found through a hash table of the last position each 3 byte
+ * sequence was seen at.
+ */
+#define ZPAGE_MIN_MATCH 3
+#define ZPAGE_MAX_MATCH (ZPAGE_MIN_MATCH + 0xf)
+#define ZPAGE_MAX_OFFSET 0xfff
+#define ZPAGE_DICT_BITS 12
+static uint16_t zpage_dict[1 << ZPAGE_DICT_BITS];
+
+#define zpage_dict_hash(p) \
+        ((((((uint32_t)(p)[0]) << 16) | ((p)[1] << 8) | (p)[2]) * 2654435761U) \
+         >> (32 - ZPAGE_DICT_BITS))
+
+/* Returns the compressed length, or -1 if the page does not compress
+ * to dstlen bytes or fewer. */
+static int
+zpage_compress(const uint8_t *src, uint8_t *dst, size_t dstlen)
+{
+        const uint8_t *p = src, *end = src + PAGE_SIZE;
+        uint8_t *out = dst, *ctrl = NULL;
+        uint16_t bits = 0;
+        int nitems = 16;
+
+        memset(zpage_dict, 0, sizeof(zpage_dict));
+        while (p < end) {
+                if (16 == nitems) {
+                        if (NULL != ctrl) {
+                                ctrl[0] = bits & 0xff;
+                                ctrl[1] = bits >> 8;
+                        }
+                        /* a full group is at most 2 + 16 * 2 bytes */
+                        if ((size_t)(out - dst) + 34 > dstlen)
+                                return -1;
+                        ctrl = out;
+                        out += 2;
+                        bits = 0;
+                        nitems = 0;
+                }
+
+                if (end - p >= ZPAGE_MIN_MATCH) {
+                        uint32_t h = zpage_dict_hash(p);
+                        const uint8_t *m = src + zpage_dict[h];
+                        uint32_t off = p - m;
+                        zpage_dict[h] = p - src;
+                        if (0 < off && off <= ZPAGE_MAX_OFFSET
+                            && m[0] == p[0] && m[1] == p[1] && m[2] == p[2]) {
+                                uint32_t len = ZPAGE_MIN_MATCH;
+                                uint32_t max = MIN(ZPAGE_MAX_MATCH, (uint32_t)(end - p));
+                                while (len < max && m[len] == p[len])
+                                        ++len;
+                                *out++ = (off >> 4) & 0xff;
+                                *out++ = ((off & 0xf) << 4) | (len - ZPAGE_MIN_MATCH);
+                                bits |= 1 << nitems++;
+                                p += len;
+                                continue;
+                        }
+                }
+                *out++ = *p++;
+                nitems++;
+        }
+        if (NULL != ctrl) {
+                ctrl[0] = bits & 0xff;
+                ctrl[1] = bits >> 8;
+        }
+        return out - dst;
+}
+
+static void
+zpage_decompress(const uint8_t *src, size_t srclen, uint8_t *dst)
+{
+        const uint8_t *in = src, *iend = src + srclen;
+        uint8_t *out = dst;
+        int i;
+
+        while (in < iend) {
+                uint16_t bits = in[0] | (in[1] << 8);
+                in += 2;
+                for (i = 0; i < 16 && in < iend; ++i) {
+                        if (bits & (1 << i)) {
+                                uint32_t off = (in[0] << 4) | (in[1] >> 4);
+                                uint32_t len = (in[1] & 0xf) + ZPAGE_MIN_MATCH;
+                                const uint8_t *m = out - off;
+                                in += 2;
+                                KASSERT(off <= (uint32_t)(out - dst)
+                                        && out + len <= dst + PAGE_SIZE);
+                                /* the copy may overlap itself, go byte by byte */
+                                while (len--)
+                                        *out++ = *m++;
+                        } else {
+                                *out++ = *in++;
+                        }
+                }
+        }
+        KASSERT(out == dst + PAGE_SIZE && "corrupt compressed page");
+}
+
+/* ------------------------------------------------------------------ */
+/* ------------------------------ POOL ------------------------------ */
+/* ------------------------------------------------------------------ */
+
+/* kmalloc rounds every request, plus the pointer it keeps in front of
+ * it, up to a power of two of at least 64 bytes; that is what an entry
+ * really costs. */
+static size_t
+zpage_charge(size_t len)
+{
+        size_t size = sizeof(zpage_t) + len + sizeof(void *);
+        size_t charge = 64;
+        while (charge < size)
+                charge <<= 1;
+        return charge;
+}
+
+static zpage_t *
+zpage_find(mmobj_t *o, uint32_t pagenum)
+{
+        zpage_t *zp;
+
+        if (0 == zpage_npages)
+                return NULL;
+
+        list_iterate_begin(&zpage_hash[hash_zpage(o, pagenum)], zp, zpage_t, zp_hlink) {
+                if (zp->zp_obj == o && zp->zp_pagenum == pagenum)
+                        return zp;
+        } list_iterate_end();
+        return NULL;
+}
+
+/* As zpage_find, but first waits for the page to finish going out to
+ * swap if it is on its way. */
+static zpage_t *
+zpage_find_idle(mmobj_t *o, uint32_t pagenum)
+{
+        zpage_t *zp;
+        while (NULL != (zp = zpage_find(o, pagenum)) && zp->zp_busy)
+                sched_sleep_on(&zpage_waitq);
+        return zp;
+}
+
+static void
+zpage_free(zpage_t *zp)
+{
+        KASSERT(!zp->zp_busy);
+        list_remove(&zp->zp_hlink);
+        if (list_link_is_linked(&zp->zp_link))
+                list_remove(&zp->zp_link);
+        zpage_used -= zpage_charge(zp->zp_len);
+        zpage_npages--;
+        kfree(zp);
+}
+
+/* Writes a dirty page out to swap and drops it from the pool. The entry
+ * stays in the hash, marked busy, while we sleep on the disk so that
+ * nobody fills the page from swap before the write is done. */
+static int
+zpage_writeout(zpage_t *zp)
+{
+        int ret;
+        mmobj_t *o = zp->zp_obj;
+
+        /* keep the object around while we sleep */
+        o->mmo_ops->ref(o);
+        zp->zp_busy = 1;
+        list_remove(&zp->zp_link);
+
+        kmutex_lock(&zpage_scratch_mutex);
+        zpage_decompress(zpage_data(zp), zp->zp_len, zpage_scratch);
+        ret = swap_write(o, zp->zp_pagenum, zpage_scratch);
+        kmutex_unlock(&zpage_scratch_mutex);
+
+        zp->zp_busy = 0;
+        if (ret < 0) {
+                list_insert_tail(&zpage_lru, &zp->zp_link);
+        } else {
+                zpage_free(zp);
+                zpage_nswapped++;
+        }
+        sched_broadcast_on(&zpage_waitq);
+        o->mmo_ops->put(o);
+        return ret;
+}
+
+/* Evicts the oldest pages until there is room for charge more bytes.
+ * Clean pages are simply dropped. Dirty pages are written to swap, but
+ * only if mayblock. Returns 0 once there is room, -ENOSPC if there is
+ * no way to make it. */
+static int
+zpage_make_room(size_t charge, int mayblock)
+{
+        list_link_t *link = zpage_lru.l_next;
+
+        while (zpage_used + charge > ZPAGE_POOL_SIZE) {
+                zpage_t *zp;
+
+                if (link == &zpage_lru)
+                        return -ENOSPC;
+                zp = list_item(link, zpage_t, zp_link);
+                link = link->l_next;
+
+                if (!zp->zp_dirty) {
+                        zpage_free(zp);
+                        zpage_ndropped++;
+                } else if (mayblock) {
+                        if (zpage_writeout(zp) < 0)
+                                return -ENOSPC;
+                        /* we slept, start over from the oldest page */
+                        link = zpage_lru.l_next;
+                }
+        }
+        return 0;
+}
+
+int
+zpage_store(pframe_t *pf, int dirty)
+{
+        zpage_t *zp;
+        int len;
+        size_t charge;
+
+        if (0 == ZPAGE_POOL_SIZE)
+                return -ENOSPC;
+
+        if (!dirty) {
+                /* an existing copy is at least as new, and may be dirty */
+                if (NULL != zpage_find(pf->pf_obj, pf->pf_pagenum))
+                        return 0;
+        } else if (NULL != (zp = zpage_find_idle(pf->pf_obj, pf->pf_pagenum))) {
+                zpage_free(zp);
+        }
+
+        if ((len = zpage_compress(pf->pf_addr, zpage_buf, ZPAGE_MAX_LEN)) < 0) {
+                zpage_nrejects++;
+                return -ENOSPC;
+        }
+        charge = zpage_charge(len);
+
+        /* copy the data out of zpage_buf before anything can block */
+        if (NULL == (zp = (zpage_t *) kmalloc(sizeof(zpage_t) + len)))
+                return -ENOMEM;
+        zp->zp_obj = pf->pf_obj;
+        zp->zp_pagenum = pf->pf_pagenum;
+        zp->zp_len = len;
+        zp->zp_dirty = !!dirty;
+        zp->zp_busy = 0;
+        memcpy(zpage_data(zp), zpage_buf, len);
+
+        if (zpage_make_room(charge, dirty) < 0) {
+                kfree(zp);
+                zpage_nrejects++;
+                return -ENOSPC;
+        }
+
+        zpage_used += charge;
+        zpage_npages++;
+        zpage_nstores++;
+        list_insert_head(&zpage_hash[hash_zpage(zp->zp_obj, zp->zp_pagenum)], &zp->zp_hlink);
+        list_insert_tail(&zpage_lru, &zp->zp_link);
+
+        dbg(DBG_PFRAME, "zpage: stored %s page %d of obj %p in %d bytes\n",
+            dirty ? "dirty" : "clean", pf->pf_pagenum, pf->pf_obj, len);
+        return 0;
+}
+
+int
+zpage_load(pframe_t *pf)
+{
+        zpage_t *zp;
+
+        if (0 == ZPAGE_POOL_SIZE)
+                return 0;
+
+        if (NULL == (zp = zpage_find_idle(pf->pf_obj, pf->pf_pagenum))) {
+                zpage_nmisses++;
+                return 0;
+        }
+
+        zpage_decompress(zpage_data(zp), zp->zp_len, pf->pf_addr);
+        if (zp->zp_dirty)
+                pframe_set_dirty(pf);
+        zpage_free(zp);
+        zpage_nhits++;
+        return 1;
+}
+
+int
+zpage_has(mmobj_t *o, uint32_t pagenum)
+{
+        return NULL != zpage_find(o, pagenum);
+}
+
+void
+zpage_discard(mmobj_t *o, uint32_t pagenum)
+{
+        zpage_t *zp;
+        if (NULL != (zp = zpage_find_idle(o, pagenum)))
+                zpage_free(zp);
+}
+
+void
+zpage_discard_obj(mmobj_t *o)
+{
+        int i;
+        zpage_t *zp;
+
+        for (i = 0; i < ZPAGE_HASH_SIZE && 0 != zpage_npages; ++i) {
+                list_iterate_begin(&zpage_hash[i], zp, zpage_t, zp_hlink) {
+                        /* pages on their way to swap hold a reference on
+                         * their object, so it can't be going away */
+                        if (zp->zp_obj == o)
+                                zpage_free(zp);
+                } list_iterate_end();
+        }
+}
+
+void
+zpage_migrate(mmobj_t *src, mmobj_t *dest)
+{
+        int i;
+        zpage_t *zp;
+        list_t moved;
+
+        list_init(&moved);
+        for (i = 0; i < ZPAGE_HASH_SIZE && 0 != zpage_npages; ++i) {
+                list_iterate_begin(&zpage_hash[i], zp, zpage_t, zp_hlink) {
+                        if (zp->zp_obj != src)
+                                continue;
+                        KASSERT(!zp->zp_busy);
+                        if (NULL != pframe_get_resident(dest, zp->zp_pagenum)
+                            || NULL != zpage_find(dest, zp->zp_pagenum)
+                            || swap_has(dest, zp->zp_pagenum)
+                            || ksm_has(dest, zp->zp_pagenum)) {
+                                /* dest already has a newer version of the page */
+                                zpage_free(zp);
+                        } else {
+                                list_remove(&zp->zp_hlink);
+                                list_insert_head(&moved, &zp->zp_hlink);
+                        }
+                } list_iterate_end();
+        }
+
+        /* rehash only once the walk is done so no entry is visited twice */
+        list_iterate_begin(&moved, zp, zpage_t, zp_hlink) {
+                list_remove(&zp->zp_hlink);
+                zp->zp_obj = dest;
+                list_insert_head(&zpage_hash[hash_zpage(dest, zp->zp_pagenum)], &zp->zp_hlink);
+        } list_iterate_end();
+}
+
+size_t
+zpage_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "pool:     %u pages in %u of %u bytes\n",
+                zpage_npages, zpage_used, ZPAGE_POOL_SIZE);
+        iprintf(&buf, &size, "loads:    %u hits, %u misses\n", zpage_nhits, zpage_nmisses);
+        iprintf(&buf, &size, "stores:   %u, %u rejected\n", zpage_nstores, zpage_nrejects);
+        iprintf(&buf, &size, "evicted:  %u dropped, %u to swap\n", zpage_ndropped, zpage_nswapped);
+        return size;
+}
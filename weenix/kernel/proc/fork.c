@@ -21,6 +21,7 @@
 
 #include "vm/shadow.h"
 #include "vm/vmmap.h"
+#include "vm/shadowd.h"
 
 #include "api/exec.h"
 
@@ -72,63 +73,77 @@ do_fork(struct regs *regs)
 		
 		/* Remember to check the reference counts on the underlying memory objects */
 		
-		/* Finding the vm_areas in the parent process that have vma_flags set to 
-		private to find private mapping is present or not */
+		/* Walk the parent's and the child's areas side by side (vmmap_clone
+		 * keeps them in the same order). Private areas get a fresh shadow object
+		 * on each side, both shadowing the object the parent used to have, while
+		 * shared areas simply share the parent's object. */
 		vmarea_t *parent_vmarea;
+		list_link_t *child_link = child_process->p_vmmap->vmm_list.l_next;
+		int nprotected = 0;
 		list_iterate_begin(&(curproc->p_vmmap->vmm_list), parent_vmarea, vmarea_t, vma_plink)
 		{
-			if (parent_vmarea->vma_flags == MAP_PRIVATE)
+			vmarea_t *child_vmarea = list_item(child_link, vmarea_t, vma_plink);
+			mmobj_t *old_obj = parent_vmarea->vma_obj;
+			int cow = (parent_vmarea->vma_flags & MAP_PRIVATE);
+			
+			if (cow)
 			{
-				/* Creating new shadow objects which in turn point to the original underlying memory
-				object */
 				mmobj_t *shadowobject_parent = shadow_create();
+				mmobj_t *shadowobject_child = shadow_create();
+				KASSERT(NULL != shadowobject_parent && NULL != shadowobject_child);
 				
-				/* Pointing the shadow object of the parent to the underlying memory object */
-				shadowobject_parent = parent_vmarea->vma_obj;
+				/* The parent's reference on old_obj moves to its new shadow
+				 * object, the child's shadow object needs one of its own */
+				shadowobject_parent->mmo_shadowed = old_obj;
+				shadowobject_parent->mmo_un.mmo_bottom_obj = mmobj_bottom_obj(old_obj);
+				shadowobject_child->mmo_shadowed = old_obj;
+				shadowobject_child->mmo_un.mmo_bottom_obj = mmobj_bottom_obj(old_obj);
+				old_obj->mmo_ops->ref(old_obj);
 				
-				/* Pointing the vm_area of the parent process to the above shadow object */
-				parent_vmarea->vma_obj = shadowobject_parent;	
+				parent_vmarea->vma_obj = shadowobject_parent;
+				child_vmarea->vma_obj = shadowobject_child;
 			}
-			/*
-			else (parent_vmarea->vma_flags == MAP_SHARED)
+			else
 			{
-				DO NOTHING AS SAID IN DOCUMENT
+				child_vmarea->vma_obj = old_obj;
+				old_obj->mmo_ops->ref(old_obj);
 			}
-			*/
-		}
-		list_iterate_end();
-		
-		/* Finding the vm_areas in the child process that have vma_flags set to 
-		private to find private mapping is present or not */
-		vmarea_t *child_vmarea;
-		list_iterate_begin(&(child_process->p_vmmap->vmm_list), child_vmarea, vmarea_t, vma_plink)
-		{
-			if (child_vmarea->vma_flags == MAP_PRIVATE)
+			/* the bottom object is the same on both sides, pageout finds
+			 * the child's mappings through it */
+			list_insert_tail(mmobj_bottom_vmas(child_vmarea->vma_obj), &child_vmarea->vma_olink);
+			if (cow)
+			        shadowd_chain_changed(parent_vmarea);
+			
+			/* Instead of unmapping the parent and making both processes fault
+			 * every page back in, write-protect the parent's entries in place and
+			 * hand the child the same (read-only) entries. Reads never fault again
+			 * on either side; only the first write to a page takes the COW fault. */
+			int ret = pt_copy_range(curproc->p_pagedir, child_process->p_pagedir,
+						(uintptr_t)PN_TO_ADDR(parent_vmarea->vma_start),
+						(uintptr_t)PN_TO_ADDR(parent_vmarea->vma_end), cow);
+			if (ret < 0)
 			{
-				/* Creating new shadow objects which in turn point to the original underlying memory
-				object */
-				mmobj_t *shadowobject_child = shadow_create();
-				
-				/* Pointing the shadow object of the child to the underlying memory object */
-				shadowobject_child = parent_vmarea->vma_obj;
-				
-				/* Pointing the vm_area of the child process to the above shadow object */
-				child_vmarea->vma_obj= shadowobject_child;
+				/* The child will simply fault these pages in itself */
+				dbg(DBG_VM, "fork: could not copy page table entries for [0x%p, 0x%p)\n",
+				    PN_TO_ADDR(parent_vmarea->vma_start), PN_TO_ADDR(parent_vmarea->vma_end));
 			}
-			/*
-			else (child_vmarea->vma_flags == MAP_SHARED)
+			else
 			{
-				DO NOTHING AS SAID IN DOCUMENT
+				nprotected += ret;
 			}
-			*/
+			
+			child_link = child_link->l_next;
 		}
 		list_iterate_end();
 		
-		/* Unmap the userland page table entries of the parent process */
-		pt_unmap_range(curproc->p_pagedir, 0, 0);
-		
-		/* Flush the TLB */
-		tlb_flush_all();
+		/* One TLB flush for the whole address space, and only if some
+		 * writable entry actually lost its write permission */
+		if (nprotected > 0)
+		{
+			tlb_flush_all();
+		}
+		dbg(DBG_VM, "fork: write-protected %d page(s) shared with child %d\n",
+		    nprotected, child_process->p_pid);
 		
 		/* Create a thread of the child process */
 		kthread_t *child_thread = kthread_create(child_process, NULL, 0, NULL);
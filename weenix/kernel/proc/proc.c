@@ -27,6 +27,7 @@
 #include "fs/file.h"
 
 proc_t *curproc = NULL; /* global */
+struct rusage proc_rusage_total;
 static slab_allocator_t *proc_allocator = NULL;
 
 static list_t _proc_list;
@@ -505,6 +506,30 @@ do_exit(int status)
 }
 
 
+int
+do_getrusage(int who, struct rusage *usage)
+{
+        proc_t *p;
+
+        switch (who) {
+                case RUSAGE_SELF:
+                        *usage = curproc->p_rusage;
+                        usage->ru_resident = pt_resident(curproc->p_pagedir);
+                        return 0;
+                case RUSAGE_SYSTEM:
+                        *usage = proc_rusage_total;
+                        usage->ru_resident = 0;
+                        list_iterate_begin(&_proc_list, p, proc_t, p_list_link) {
+                                if (NULL != p->p_pagedir) {
+                                        usage->ru_resident += pt_resident(p->p_pagedir);
+                                }
+                        } list_iterate_end();
+                        return 0;
+                default:
+                        return -EINVAL;
+        }
+}
+
 size_t
 proc_info(const void *arg, char *buf, size_t osize)
 {
@@ -560,6 +585,13 @@ proc_info(const void *arg, char *buf, size_t osize)
 #ifdef __VM__
         iprintf(&buf, &size, "start brk:    0x%p\n", p->p_start_brk);
         iprintf(&buf, &size, "brk:          0x%p\n", p->p_brk);
+        iprintf(&buf, &size, "faults:       %i minor, %i major\n",
+                p->p_rusage.ru_minflt, p->p_rusage.ru_majflt);
+        iprintf(&buf, &size, "fills:        %i cow, %i zero, %i in\n",
+                p->p_rusage.ru_cowflt, p->p_rusage.ru_zeroflt, p->p_rusage.ru_inblock);
+        if (NULL != p->p_pagedir) {
+                iprintf(&buf, &size, "resident:     %u pages\n", pt_resident(p->p_pagedir));
+        }
 #endif
 
         return size;
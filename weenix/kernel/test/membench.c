@@ -0,0 +1,163 @@
+/*
+ * Times memcpy, memset and memcmp at boot against the plain byte
+ * string instructions they replaced, and page_copy/page_zero against
+ * memcpy/memset of a page, for a range of sizes with the destination
+ * aligned and misaligned. Turn on with MEMBENCH=1 in Config.mk. The
+ * numbers are cycles per call, averaged over MEMBENCH_ROUNDS calls.
+ */
+
+#include "types.h"
+#include "kernel.h"
+
+#include "util/init.h"
+#include "util/string.h"
+#include "util/debug.h"
+
+#include "mm/page.h"
+
+#ifdef __MEMBENCH__
+
+#define MEMBENCH_ROUNDS 64
+
+static uint32_t
+membench_cycles(void)
+{
+        uint32_t lo, hi;
+        __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+        return lo;
+}
+
+/* the old implementations, for comparison */
+static void *
+membench_movsb(void *dest, const void *src, size_t count)
+{
+        __asm__ volatile(
+                "cld\n\t"
+                "rep\n\t"
+                "movsb"
+                : "+D"(dest), "+S"(src), "+c"(count)
+                : /* No input */
+                : "cc", "memory"
+        );
+        return dest;
+}
+
+static void *
+membench_stosb(void *s, int c, size_t count)
+{
+        __asm__ volatile(
+                "cld\n\t"
+                "rep\n\t"
+                "stosb"
+                : "+D"(s), "+c"(count)
+                : "a"(c)
+                : "cc", "memory"
+        );
+        return s;
+}
+
+static int
+membench_cmpsb(const void *cs, const void *ct, size_t count)
+{
+        const unsigned char *su1, *su2;
+
+        for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
+                if (*su1 != *su2)
+                        return *su1 - *su2;
+        return 0;
+}
+
+static void
+membench_size(char *dst, char *src, size_t size, size_t off)
+{
+        uint32_t start, old, new;
+        int i;
+
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                membench_movsb(dst + off, src, size);
+        old = membench_cycles() - start;
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                memcpy(dst + off, src, size);
+        new = membench_cycles() - start;
+        dbgq(DBG_TEST, "membench: memcpy %4d bytes%s: movsb %6d, memcpy %6d\n",
+             size, off ? " (unaligned)" : "            ",
+             old / MEMBENCH_ROUNDS, new / MEMBENCH_ROUNDS);
+
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                membench_stosb(dst + off, 0x5a, size);
+        old = membench_cycles() - start;
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                memset(dst + off, 0x5a, size);
+        new = membench_cycles() - start;
+        dbgq(DBG_TEST, "membench: memset %4d bytes%s: stosb %6d, memset %6d\n",
+             size, off ? " (unaligned)" : "            ",
+             old / MEMBENCH_ROUNDS, new / MEMBENCH_ROUNDS);
+
+        /* equal buffers, the worst case for a compare */
+        memcpy(dst + off, src, size);
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                membench_cmpsb(dst + off, src, size);
+        old = membench_cycles() - start;
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                memcmp(dst + off, src, size);
+        new = membench_cycles() - start;
+        dbgq(DBG_TEST, "membench: memcmp %4d bytes%s: bytes %6d, memcmp %6d\n",
+             size, off ? " (unaligned)" : "            ",
+             old / MEMBENCH_ROUNDS, new / MEMBENCH_ROUNDS);
+}
+
+static __attribute__((unused)) void
+membench_init(void)
+{
+        char *src, *dst;
+        uint32_t start, old, new;
+        size_t size;
+        int i;
+
+        src = page_alloc_n(2);
+        dst = page_alloc_n(2);
+        KASSERT(NULL != src && NULL != dst);
+        for (i = 0; i < (int) (2 * PAGE_SIZE); ++i)
+                src[i] = (char) i;
+
+        for (size = 8; size <= PAGE_SIZE; size <<= 3) {
+                membench_size(dst, src, size, 0);
+                membench_size(dst, src, size, 1);
+        }
+        if (0 != memcmp(dst + 1, src, PAGE_SIZE))
+                panic("membench: copy came out wrong\n");
+
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                memcpy(dst, src, PAGE_SIZE);
+        old = membench_cycles() - start;
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                page_copy(dst, src);
+        new = membench_cycles() - start;
+        dbgq(DBG_TEST, "membench: page copy: memcpy %6d, page_copy %6d\n",
+             old / MEMBENCH_ROUNDS, new / MEMBENCH_ROUNDS);
+
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                memset(dst, 0, PAGE_SIZE);
+        old = membench_cycles() - start;
+        start = membench_cycles();
+        for (i = 0; i < MEMBENCH_ROUNDS; ++i)
+                page_zero(dst);
+        new = membench_cycles() - start;
+        dbgq(DBG_TEST, "membench: page zero: memset %6d, page_zero %6d\n",
+             old / MEMBENCH_ROUNDS, new / MEMBENCH_ROUNDS);
+
+        page_free_n(src, 2);
+        page_free_n(dst, 2);
+}
+init_func(membench_init);
+
+#endif /* __MEMBENCH__ */
@@ -1,54 +1,34 @@
 #include "ctype.h"
 #include "errno.h"
 
-int memcmp(const void *cs, const void *ct, size_t count)
-{
-        int ret;
-        /* Compare bytes at %esi and %edi up to %ecx bytes OR until
-         * the bytes are not equal */
-        /* If not equal, set zf = 0 and stop */
-        /* Find out zf and sf and use them to return 0,1, or -1 */
-        __asm__ volatile(
-                "xor %%eax, %%eax\n\t"  /* Zero output */
-                "cld\n\t"               /* Make sure direction is forwards */
-                "repe\n\t"
-                "cmpsb\n\t"
-                "setnz %%al\n\t"        /* If it is not zero, put 1 in low part */
-                "sets %%ah"             /* If sign set (means 2nd arg larger),
-                                         * put 1 in high part */
-                : "=a"(ret)
-                : "S"(cs), "D"(ct), "c"(count)
-                : "cc"                  /* Overwrite flags */
-        );
-        return ((ret & 1) ? ((ret >> 8) ? -1 : 1) : 0);
-}
+#include "mm/page.h"
+
+#include "util/string_common.h"
 
-void *memcpy(void *dest, const void *src, size_t count)
+void page_copy(void *dest, const void *src)
 {
-        /* Move %ecx bytes from %esi to %edi */
+        size_t n = PAGE_SIZE >> 2;
         __asm__ volatile(
-                "cld\n\t" /* Make sure direction is forwards */
+                "cld\n\t"
                 "rep\n\t"
-                "movsb"
-                : /* No output */
-                : "S"(src), "D"(dest), "c"(count)
-                : "cc" /* We overwrite condition codes - i.e., flags */
+                "movsl"
+                : "+D"(dest), "+S"(src), "+c"(n)
+                : /* No input */
+                : "cc", "memory"
         );
-        return dest;
 }
 
-void *memset(void *s, int c, size_t count)
+void page_zero(void *page)
 {
-        /* Fill %ecx bytes at %edi with %eax (actually %al) */
+        size_t n = PAGE_SIZE >> 2;
         __asm__ volatile(
-                "cld\n\t" /* Make sure direction is forwards */
+                "cld\n\t"
                 "rep\n\t"
-                "stosb"
-                : /* No output */
-                : "a"(c), "D"(s), "c"(count)
-                : "cc" /* Overwrite flags */
+                "stosl"
+                : "+D"(page), "+c"(n)
+                : "a"(0)
+                : "cc", "memory"
         );
-        return s;
 }
 
 int strncmp(const char *cs, const char *ct, size_t count)
@@ -64,18 +44,6 @@ int strncmp(const char *cs, const char *ct, size_t count)
         return __res;
 }
 
-int strcmp(const char *cs, const char *ct)
-{
-        register signed char __res;
-
-        while (1) {
-                if ((__res = *cs - *ct++) != 0 || !*cs++)
-                        break;
-        }
-
-        return __res;
-}
-
 char *strcpy(char *dest, const char *src)
 {
         char *tmp = dest;
@@ -117,23 +85,6 @@ char *strcat(char *dest, const char *src)
         return tmp;
 }
 
-size_t strlen(const char *s)
-{
-        const char *sc;
-
-        for (sc = s; *sc != '\0'; ++sc)
-                /* nothing */;
-        return sc - s;
-}
-
-char *strchr(const char *s, int c)
-{
-        for (; *s != (char) c; ++s)
-                if (*s == '\0')
-                        return NULL;
-        return (char *)s;
-}
-
 char *strrchr(const char *s, int c)
 {
         char *r = NULL;
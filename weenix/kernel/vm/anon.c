@@ -10,6 +10,9 @@
 #include "mm/page.h"
 #include "mm/slab.h"
 #include "mm/tlb.h"
+#include "mm/zpage.h"
+
+#include "vm/swap.h"
 
 int anon_count = 0; /* for debugging/verification purposes */
 
@@ -47,6 +50,12 @@ anon_init()
 /*        NOT_YET_IMPLEMENTED("VM: anon_init");*/
 }
 
+int
+mmobj_is_anon(mmobj_t *o)
+{
+        return &anon_mmobj_ops == o->mmo_ops;
+}
+
 /*
  * You'll want to use the anon_allocator to allocate the mmobj to
  * return, then then initialize it. Take a look in mm/mmobj.h for
@@ -117,10 +126,10 @@ anon_put(mmobj_t *o)
                                         pframe_unpin(pf);
                                 if (pframe_is_busy(pf)){
                                        sched_sleep_on(&pf->pf_waitq);
-                                } else if (pframe_is_dirty(pf)) {
-                                        pframe_clean(pf);
                                 } else {
-                                        /* it's not busy, it's clean, free it */
+                                        /* nobody will ever read the page
+                                         * again, don't write it to swap */
+                                        pframe_clear_dirty(pf);
                                         pframe_free(pf);
                                 }
                              }list_iterate_end();
@@ -130,7 +139,8 @@ anon_put(mmobj_t *o)
 	dbg(DBG_VNREF,"after shadow_put: object = 0x%p , reference_count =%d, nrespages=%d\n",o,o->mmo_refcount,o->mmo_nrespages);
         if(0 == o->mmo_refcount && 0 == o->mmo_nrespages )
         {
-                 o = NULL;
+                 zpage_discard_obj(o);
+                 swap_discard_obj(o);
                  slab_obj_free(anon_allocator, o);
         }
         
@@ -172,18 +182,18 @@ anon_fillpage(mmobj_t *o,pframe_t *pf)
  	KASSERT(!pframe_is_pinned(pf));
  	dbg(DBG_VM,"GRADING: I've made it ! May I have 2 points please ! \n");
  	
- 	/*first get the page  pf->pf_obj and pf->pf_pagenum*/
-	pframe_t *page = pframe_get_resident(pf->pf_obj,pf->pf_pagenum);
-	if(page){
-		/*fill the page with data and marked it a pinned*/
-		memcpy(pf->pf_addr,page->pf_addr,PAGE_SIZE);
-		if(!pframe_is_pinned(page)){
-			pframe_pin(page);
-		}
-	}else{
-dbg(DBG_VNREF|DBG_ERROR, "No resident page found for given object = 0x%p and  page number=0x%p",pf->pf_obj,pf->pf_addr);
-		return -EFAULT;
-	}	
+        /* a page which was paged out comes back from swap, a new
+         * anonymous page always starts out zeroed. Without a swap disk
+         * there is nothing to write it back to, so it stays pinned */
+        int ret = swap_in(pf);
+        if (ret < 0)
+                return ret;
+        if (0 == ret) {
+                page_zero(pf->pf_addr);
+                proc_account(ru_zeroflt);
+        }
+        if (!swap_enabled())
+                pframe_pin(pf);
         /*NOT_YET_IMPLEMENTED("VM: anon_fillpage");*/
         return 0;
 }
@@ -208,20 +218,9 @@ anon_dirtypage(mmobj_t *o, pframe_t *pf)
 static int
 anon_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-	/*MOHIT: Even though we are writing the content at pf->pf_addr to the
-	 * page identified by the pf->pf_obj and pf->pf_pagenum, we still don't
-	 * have to do any preparation to write this data back to disk as 
-	 * anonymous memory object doesn't have any associated file. This makes
-	 * me wonder whether we really need to do any operation in this function???
-	 * open question to all!!!*/
-	
-	pframe_t *page = pframe_get_resident(pf->pf_obj,pf->pf_pagenum);
-	if(page){
-		memcpy(page->pf_addr,pf->pf_addr,PAGE_SIZE);
-	}else{
-		return -EFAULT;
-	}
-	
-        /*NOT_YET_IMPLEMENTED("VM: anon_cleanpage");*/
-        return 0;
+        /* anonymous memory has no file behind it; keep it compressed in
+         * memory if possible, otherwise write it to the swap disk */
+        if (0 == zpage_store(pf, 1))
+                return 0;
+        return swap_out(pf);
 }
@@ -56,8 +56,50 @@
 int
 do_brk(void *addr, void **ret)
 {
-		
-        
-        NOT_YET_IMPLEMENTED("VM: do_brk");
+        vmmap_t *map = curproc->p_vmmap;
+
+        if (NULL == addr) {
+                *ret = curproc->p_brk;
+                return 0;
+        }
+        if ((uintptr_t) addr < (uintptr_t) curproc->p_start_brk
+            || (uintptr_t) addr > USER_MEM_HIGH) {
+                return -ENOMEM;
+        }
+
+        /* the heap proper starts on the page after the one holding the
+         * starting break, that page already belongs to the bss */
+        uint32_t start = ADDR_TO_PN(PAGE_ALIGN_UP(curproc->p_start_brk));
+        uint32_t oldend = ADDR_TO_PN(PAGE_ALIGN_UP(curproc->p_brk));
+        uint32_t newend = ADDR_TO_PN(PAGE_ALIGN_UP(addr));
+
+        if (newend > oldend) {
+                if (!vmmap_is_range_empty(map, oldend, newend - oldend)) {
+                        return -ENOMEM;
+                }
+
+                vmarea_t *heap = (oldend > start) ? vmmap_lookup(map, oldend - 1) : NULL;
+                if (NULL != heap) {
+                        /* the heap is a single anonymous area, so it grows
+                         * in place; nothing is allocated until the new
+                         * pages are touched */
+                        heap->vma_end = newend;
+                } else {
+                        int err = vmmap_map(map, NULL, oldend, newend - oldend,
+                                            PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                                            0, VMMAP_DIR_LOHI, NULL);
+                        if (0 > err) {
+                                return err;
+                        }
+                }
+        } else if (newend < oldend) {
+                /* throw the pages away first, if the heap grows back
+                 * over them it has to see zeros, not the old data */
+                do_madvise(PN_TO_ADDR(newend), (size_t) PN_TO_ADDR(oldend - newend), MADV_DONTNEED);
+                vmmap_remove(map, newend, oldend - newend);
+        }
+
+        curproc->p_brk = addr;
+        *ret = addr;
         return 0;
 }
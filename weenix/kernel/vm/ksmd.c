@@ -0,0 +1,610 @@
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/printf.h"
+#include "util/init.h"
+
+#include "proc/proc.h"
+#include "proc/sched.h"
+#include "proc/kthread.h"
+
+#include "mm/mm.h"
+#include "mm/mman.h"
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "mm/kmalloc.h"
+#include "mm/zpage.h"
+
+#include "vm/vmmap.h"
+#include "vm/shadow.h"
+#include "vm/swap.h"
+#include "vm/ksmd.h"
+
+/*
+ * Every distinct page ksmd has found more than one copy of is kept in a
+ * "stable" frame belonging to ksm_obj below, pinned so pageoutd leaves
+ * it alone. Stable frames are hashed by their contents, and each page
+ * merged into one has an rmap entry, hashed by (object, page number)
+ * like the pframe hash, pointing at it.
+ *
+ * During a pass, pages which did not match any stable frame go into an
+ * "unstable" table, also hashed by contents. They are not protected in
+ * any way, so when a later page hashes the same the earlier one is
+ * looked up again and compared byte for byte before the two are merged.
+ * The unstable table is emptied at the end of every pass.
+ *
+ * Only pages of shadow objects are merged: private memory, which is
+ * where identical pages come from (forked copies of the same program,
+ * zeroed heap). Pages of shared anonymous objects and files are left
+ * alone, because everyone mapping them expects to see each other's
+ * writes.
+ */
+
+typedef struct ksm_stable {
+        pframe_t       *ks_pf;       /* the shared frame */
+        uint32_t        ks_hash;     /* hash of its contents */
+        int             ks_refcount; /* pages merged into it */
+        list_link_t     ks_link;     /* link on the stable hash chain */
+} ksm_stable_t;
+
+typedef struct ksm_rmap {
+        mmobj_t        *kr_obj;
+        uint32_t        kr_pagenum;
+        ksm_stable_t   *kr_stable;
+        list_link_t     kr_link;     /* link on the rmap hash chain */
+} ksm_rmap_t;
+
+typedef struct ksm_unstable {
+        mmobj_t        *ku_obj;
+        uint32_t        ku_pagenum;
+        uint32_t        ku_hash;
+        list_link_t     ku_link;     /* link on the unstable hash chain */
+} ksm_unstable_t;
+
+/* A page of some object, remembered while ksmd may sleep. */
+typedef struct ksm_page {
+        mmobj_t        *kp_obj;
+        uint32_t        kp_pagenum;
+} ksm_page_t;
+
+#define KSM_HASH_SIZE 64
+#define hash_rmap(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
+                                  % KSM_HASH_SIZE)
+static list_t ksm_stable_hash[KSM_HASH_SIZE];
+static list_t ksm_rmap_hash[KSM_HASH_SIZE];
+static list_t ksm_unstable_hash[KSM_HASH_SIZE];
+
+/* pages looked at between giving up the cpu */
+#define KSM_BATCH 32
+
+static slab_allocator_t *ksm_stable_allocator = NULL;
+static slab_allocator_t *ksm_rmap_allocator = NULL;
+static slab_allocator_t *ksm_unstable_allocator = NULL;
+
+static uint32_t ksm_nstable = 0;     /* stable frames */
+static uint32_t ksm_nshared = 0;     /* pages merged into them */
+static uint32_t ksm_nmerged = 0;     /* merges ever */
+static uint32_t ksm_nsplit = 0;      /* merged pages written to since */
+static uint32_t ksm_nscanned = 0;    /* pages hashed */
+static uint32_t ksm_npasses = 0;
+
+/*
+ * The object owning the stable frames. Frames are filled by ksmd
+ * itself, are never dirtied and never cleaned, and the object is never
+ * freed.
+ */
+static void
+ksm_obj_ref(mmobj_t *o)
+{
+        o->mmo_refcount++;
+}
+
+static void
+ksm_obj_put(mmobj_t *o)
+{
+        KASSERT(1 < o->mmo_refcount);
+        o->mmo_refcount--;
+}
+
+static int
+ksm_obj_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
+{
+        KASSERT(!forwrite);
+        return pframe_get(o, pagenum, pf);
+}
+
+static int
+ksm_obj_fillpage(mmobj_t *o, pframe_t *pf)
+{
+        return 0;
+}
+
+static int
+ksm_obj_dirtypage(mmobj_t *o, pframe_t *pf)
+{
+        panic("ksm: writing to the shared frame %p\n", pf->pf_addr);
+        return -EFAULT;
+}
+
+static int
+ksm_obj_cleanpage(mmobj_t *o, pframe_t *pf)
+{
+        panic("ksm: cleaning the shared frame %p\n", pf->pf_addr);
+        return -EFAULT;
+}
+
+static mmobj_ops_t ksm_obj_ops = {
+        .ref = ksm_obj_ref,
+        .put = ksm_obj_put,
+        .lookuppage = ksm_obj_lookuppage,
+        .fillpage  = ksm_obj_fillpage,
+        .dirtypage = ksm_obj_dirtypage,
+        .cleanpage = ksm_obj_cleanpage
+};
+
+static mmobj_t ksm_obj;
+static uint32_t ksm_nextpage = 0;
+
+/* FNV-1a over the words of the page */
+static uint32_t
+ksm_hash(const void *page)
+{
+        const uint32_t *w = (const uint32_t *) page;
+        uint32_t h = 2166136261u;
+        int i;
+        for (i = 0; i < (int)(PAGE_SIZE / sizeof(uint32_t)); ++i)
+                h = (h ^ w[i]) * 16777619;
+        return h;
+}
+
+static ksm_rmap_t *
+ksm_find(mmobj_t *o, uint32_t pagenum)
+{
+        ksm_rmap_t *kr;
+
+        if (0 == ksm_nshared)
+                return NULL;
+
+        list_iterate_begin(&ksm_rmap_hash[hash_rmap(o, pagenum)], kr, ksm_rmap_t, kr_link) {
+                if (kr->kr_obj == o && kr->kr_pagenum == pagenum)
+                        return kr;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+ksm_stable_put(ksm_stable_t *ks)
+{
+        KASSERT(0 < ks->ks_refcount);
+        if (0 < --ks->ks_refcount)
+                return;
+
+        list_remove(&ks->ks_link);
+        pframe_unpin(ks->ks_pf);
+        pframe_free(ks->ks_pf);
+        slab_obj_free(ksm_stable_allocator, ks);
+        ksm_nstable--;
+}
+
+/* Drops a page's share of its frame, which may free the frame. Callers
+ * must make sure nothing still maps the frame at the page's address. */
+static void
+ksm_release(ksm_rmap_t *kr)
+{
+        list_remove(&kr->kr_link);
+        ksm_stable_put(kr->kr_stable);
+        slab_obj_free(ksm_rmap_allocator, kr);
+        ksm_nshared--;
+}
+
+pframe_t *
+ksm_lookup(mmobj_t *o, uint32_t pagenum)
+{
+        ksm_rmap_t *kr = ksm_find(o, pagenum);
+        return (NULL == kr) ? NULL : kr->kr_stable->ks_pf;
+}
+
+int
+ksm_has(mmobj_t *o, uint32_t pagenum)
+{
+        return NULL != ksm_find(o, pagenum);
+}
+
+int
+ksm_in(pframe_t *pf)
+{
+        ksm_rmap_t *kr;
+
+        if (NULL == (kr = ksm_find(pf->pf_obj, pf->pf_pagenum)))
+                return 0;
+
+        page_copy(pf->pf_addr, kr->kr_stable->ks_pf->pf_addr);
+        /* other areas over the object may still map the shared frame */
+        pframe_unmap_page(pf->pf_obj, pf->pf_pagenum);
+        ksm_release(kr);
+        pframe_set_dirty(pf);
+        ksm_nsplit++;
+        return 1;
+}
+
+void
+ksm_discard(mmobj_t *o, uint32_t pagenum)
+{
+        ksm_rmap_t *kr;
+        if (NULL != (kr = ksm_find(o, pagenum))) {
+                pframe_unmap_page(o, pagenum);
+                ksm_release(kr);
+        }
+}
+
+/* The object is not mapped anywhere any more, so there is nothing to
+ * unmap. */
+void
+ksm_discard_obj(mmobj_t *o)
+{
+        int i;
+        ksm_rmap_t *kr;
+
+        for (i = 0; i < KSM_HASH_SIZE && 0 != ksm_nshared; ++i) {
+                list_iterate_begin(&ksm_rmap_hash[i], kr, ksm_rmap_t, kr_link) {
+                        if (kr->kr_obj == o)
+                                ksm_release(kr);
+                } list_iterate_end();
+        }
+}
+
+void
+ksm_migrate(mmobj_t *src, mmobj_t *dest)
+{
+        int i;
+        ksm_rmap_t *kr;
+        list_t moved;
+
+        list_init(&moved);
+        for (i = 0; i < KSM_HASH_SIZE && 0 != ksm_nshared; ++i) {
+                list_iterate_begin(&ksm_rmap_hash[i], kr, ksm_rmap_t, kr_link) {
+                        if (kr->kr_obj != src)
+                                continue;
+                        if (NULL != pframe_get_resident(dest, kr->kr_pagenum)
+                            || NULL != ksm_find(dest, kr->kr_pagenum)
+                            || zpage_has(dest, kr->kr_pagenum)
+                            || swap_has(dest, kr->kr_pagenum)) {
+                                /* dest already has a newer version of the page */
+                                pframe_unmap_page(src, kr->kr_pagenum);
+                                ksm_release(kr);
+                        } else {
+                                list_remove(&kr->kr_link);
+                                list_insert_head(&moved, &kr->kr_link);
+                        }
+                } list_iterate_end();
+        }
+
+        /* rehash only once the walk is done so no entry is visited twice */
+        list_iterate_begin(&moved, kr, ksm_rmap_t, kr_link) {
+                list_remove(&kr->kr_link);
+                kr->kr_obj = dest;
+                list_insert_head(&ksm_rmap_hash[hash_rmap(dest, kr->kr_pagenum)], &kr->kr_link);
+        } list_iterate_end();
+}
+
+/* Returns the page if it is resident and may be merged right now. */
+static pframe_t *
+ksm_candidate(mmobj_t *o, uint32_t pagenum)
+{
+        pframe_t *pf = pframe_peek_resident(o, pagenum);
+        if (NULL == pf || !mmobj_is_shadow(pf->pf_obj)
+            || pframe_is_busy(pf) || pframe_is_pinned(pf))
+                return NULL;
+        return pf;
+}
+
+/* Frees the page in favour of a share of the stable frame. The page's
+ * mappings are removed by pframe_free, the next read fault finds the
+ * stable frame through ksm_lookup. */
+static void
+ksm_merge(pframe_t *pf, ksm_stable_t *ks)
+{
+        ksm_rmap_t *kr;
+
+        if (NULL == (kr = (ksm_rmap_t *) slab_obj_alloc(ksm_rmap_allocator)))
+                return;
+        kr->kr_obj = pf->pf_obj;
+        kr->kr_pagenum = pf->pf_pagenum;
+        kr->kr_stable = ks;
+        list_insert_head(&ksm_rmap_hash[hash_rmap(kr->kr_obj, kr->kr_pagenum)], &kr->kr_link);
+        ks->ks_refcount++;
+        ksm_nshared++;
+        ksm_nmerged++;
+
+        /* the stable frame holds the contents now, nothing to write out */
+        pframe_clear_dirty(pf);
+        pframe_free(pf);
+}
+
+/* Two pages hash and compare the same: copy them into a new stable
+ * frame and merge both. Allocating the frame may sleep, so both pages
+ * are looked up again afterwards. */
+static void
+ksm_promote(ksm_page_t *a, ksm_page_t *b, uint32_t hash)
+{
+        ksm_stable_t *ks;
+        pframe_t *spf, *pf;
+
+        if (NULL == (ks = (ksm_stable_t *) slab_obj_alloc(ksm_stable_allocator)))
+                return;
+        if (pframe_get(&ksm_obj, ksm_nextpage++, &spf) < 0) {
+                slab_obj_free(ksm_stable_allocator, ks);
+                return;
+        }
+        pframe_pin(spf);
+
+        if (NULL == (pf = ksm_candidate(a->kp_obj, a->kp_pagenum))
+            || hash != ksm_hash(pf->pf_addr)) {
+                pframe_unpin(spf);
+                pframe_free(spf);
+                slab_obj_free(ksm_stable_allocator, ks);
+                return;
+        }
+        page_copy(spf->pf_addr, pf->pf_addr);
+
+        ks->ks_pf = spf;
+        ks->ks_hash = hash;
+        ks->ks_refcount = 1;
+        list_insert_head(&ksm_stable_hash[hash % KSM_HASH_SIZE], &ks->ks_link);
+        ksm_nstable++;
+
+        ksm_merge(pf, ks);
+        if (NULL != (pf = ksm_candidate(b->kp_obj, b->kp_pagenum))
+            && 0 == memcmp(pf->pf_addr, spf->pf_addr, PAGE_SIZE)) {
+                ksm_merge(pf, ks);
+        }
+        /* drop the reference we started with, freeing the frame if
+         * neither page could be merged after all */
+        ksm_stable_put(ks);
+}
+
+static void
+ksm_scan_page(ksm_page_t *kp)
+{
+        pframe_t *pf, *other;
+        ksm_stable_t *ks;
+        ksm_unstable_t *ku;
+        uint32_t hash;
+
+        if (NULL == (pf = ksm_candidate(kp->kp_obj, kp->kp_pagenum)))
+                return;
+        hash = ksm_hash(pf->pf_addr);
+        ksm_nscanned++;
+
+        /* an identical page has been merged before */
+        list_iterate_begin(&ksm_stable_hash[hash % KSM_HASH_SIZE], ks, ksm_stable_t, ks_link) {
+                if (ks->ks_hash == hash
+                    && 0 == memcmp(ks->ks_pf->pf_addr, pf->pf_addr, PAGE_SIZE)) {
+                        ksm_merge(pf, ks);
+                        return;
+                }
+        } list_iterate_end();
+
+        /* an identical page was seen earlier in this pass */
+        list_iterate_begin(&ksm_unstable_hash[hash % KSM_HASH_SIZE], ku, ksm_unstable_t, ku_link) {
+                ksm_page_t twin;
+                if (ku->ku_hash != hash)
+                        continue;
+                twin.kp_obj = ku->ku_obj;
+                twin.kp_pagenum = ku->ku_pagenum;
+                /* whatever happens the entry is used up, either the pages
+                 * are merged or it went stale */
+                list_remove(&ku->ku_link);
+                slab_obj_free(ksm_unstable_allocator, ku);
+                if (NULL != (other = ksm_candidate(twin.kp_obj, twin.kp_pagenum))
+                    && other != pf
+                    && 0 == memcmp(other->pf_addr, pf->pf_addr, PAGE_SIZE)) {
+                        ksm_promote(kp, &twin, hash);
+                        return;
+                }
+        } list_iterate_end();
+
+        if (NULL != (ku = (ksm_unstable_t *) slab_obj_alloc(ksm_unstable_allocator))) {
+                ku->ku_obj = kp->kp_obj;
+                ku->ku_pagenum = kp->kp_pagenum;
+                ku->ku_hash = hash;
+                list_insert_head(&ksm_unstable_hash[hash % KSM_HASH_SIZE], &ku->ku_link);
+        }
+}
+
+static void
+ksm_unstable_clear(void)
+{
+        int i;
+        ksm_unstable_t *ku;
+
+        for (i = 0; i < KSM_HASH_SIZE; ++i) {
+                list_iterate_begin(&ksm_unstable_hash[i], ku, ksm_unstable_t, ku_link) {
+                        list_remove(&ku->ku_link);
+                        slab_obj_free(ksm_unstable_allocator, ku);
+                } list_iterate_end();
+        }
+}
+
+size_t
+ksm_info(const void *arg, char *buf, size_t osize)
+{
+        size_t size = osize;
+
+        KASSERT(NULL == arg);
+        KASSERT(NULL != buf);
+
+        iprintf(&buf, &size, "shared:   %u pages in %u frames, %u KB saved\n",
+                ksm_nshared, ksm_nstable, (ksm_nshared - ksm_nstable) * (PAGE_SIZE / 1024));
+        iprintf(&buf, &size, "merges:   %u, %u split again on write\n", ksm_nmerged, ksm_nsplit);
+        iprintf(&buf, &size, "scanned:  %u pages in %u passes\n", ksm_nscanned, ksm_npasses);
+        return size;
+}
+
+#ifdef __KSMD__
+static ktqueue_t ksmd_waitq;
+static int ksmd_wanted = 0;
+static proc_t *ksmd_proc;
+static kthread_t *ksmd_thr = NULL;
+
+void
+ksmd_wakeup(void)
+{
+        if (NULL == ksmd_thr)
+                return;
+        ksmd_wanted = 1;
+        sched_broadcast_on(&ksmd_waitq);
+}
+
+/* ksmd is only there to save memory, let everyone else go first */
+static void
+ksmd_yield(void)
+{
+        sched_make_runnable(curthr);
+        sched_switch();
+}
+
+/* Looks at the resident pages of top and every shadow object under it.
+ * The page numbers are copied out first since merging frees pages, and
+ * ksmd sleeps between batches; top is referenced, so nothing in the
+ * chain goes away except objects shadowd collapses, whose pages just
+ * stop being found. */
+static void
+ksmd_scan(mmobj_t *top)
+{
+        mmobj_t *o;
+        ksm_page_t *pages;
+        pframe_t *pf;
+        int npages = 0, i;
+
+        for (o = top; NULL != o && mmobj_is_shadow(o); o = o->mmo_shadowed)
+                npages += o->mmo_nrespages;
+        if (0 == npages)
+                return;
+        if (NULL == (pages = (ksm_page_t *) kmalloc(npages * sizeof(ksm_page_t)))) {
+                dbg(DBG_VM, "ksmd: no memory to scan %d pages of %p\n", npages, top);
+                return;
+        }
+
+        i = 0;
+        for (o = top; NULL != o && mmobj_is_shadow(o); o = o->mmo_shadowed) {
+                list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
+                        pages[i].kp_obj = o;
+                        pages[i].kp_pagenum = pf->pf_pagenum;
+                        ++i;
+                } list_iterate_end();
+        }
+        KASSERT(i == npages);
+
+        for (i = 0; i < npages; ++i) {
+                ksm_scan_page(&pages[i]);
+                if (0 == (i + 1) % KSM_BATCH)
+                        ksmd_yield();
+        }
+        kfree(pages);
+}
+
+/* One pass over every process's private memory. The objects at the top
+ * of each private area are collected and referenced first, because
+ * processes may exit while ksmd is asleep. */
+static void
+ksmd_pass(void)
+{
+        proc_t *p;
+        vmarea_t *vma;
+        mmobj_t **tops;
+        int ntops = 0, max = 0, i, j;
+
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (PROC_RUNNING == p->p_state && NULL != p->p_vmmap)
+                        list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                                max++;
+                        } list_iterate_end();
+        } list_iterate_end();
+        if (0 == max || NULL == (tops = (mmobj_t **) kmalloc(max * sizeof(mmobj_t *))))
+                return;
+
+        list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
+                if (PROC_RUNNING != p->p_state || NULL == p->p_vmmap)
+                        continue;
+                list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                        if (!(MAP_PRIVATE & vma->vma_flags) || !mmobj_is_shadow(vma->vma_obj))
+                                continue;
+                        for (j = 0; j < ntops && tops[j] != vma->vma_obj; ++j)
+                                ;
+                        if (j < ntops)
+                                continue;
+                        vma->vma_obj->mmo_ops->ref(vma->vma_obj);
+                        tops[ntops++] = vma->vma_obj;
+                } list_iterate_end();
+        } list_iterate_end();
+
+        for (i = 0; i < ntops; ++i) {
+                ksmd_scan(tops[i]);
+                tops[i]->mmo_ops->put(tops[i]);
+        }
+        kfree(tops);
+        ksm_unstable_clear();
+        ksm_npasses++;
+
+        dbg(DBG_VM, "ksmd: %u pages shared in %u frames, %u KB saved\n",
+            ksm_nshared, ksm_nstable, (ksm_nshared - ksm_nstable) * (PAGE_SIZE / 1024));
+}
+
+static void *
+ksmd(int arg1, void *arg2)
+{
+        while (1) {
+                ksmd_wanted = 0;
+                ksmd_pass();
+                /* wakeups while we were scanning ask for another pass */
+                if (!ksmd_wanted && sched_cancellable_sleep_on(&ksmd_waitq) < 0) {
+                        return (void *)0;
+                }
+        }
+}
+#else
+void
+ksmd_wakeup(void)
+{
+}
+#endif
+
+static __attribute__((unused)) void
+ksm_init(void)
+{
+        int i;
+        for (i = 0; i < KSM_HASH_SIZE; ++i) {
+                list_init(&ksm_stable_hash[i]);
+                list_init(&ksm_rmap_hash[i]);
+                list_init(&ksm_unstable_hash[i]);
+        }
+        mmobj_init(&ksm_obj, &ksm_obj_ops);
+        ksm_obj.mmo_refcount = 1;
+
+        ksm_stable_allocator = slab_allocator_create("ksmstable", sizeof(ksm_stable_t));
+        KASSERT(NULL != ksm_stable_allocator);
+        ksm_rmap_allocator = slab_allocator_create("ksmrmap", sizeof(ksm_rmap_t));
+        KASSERT(NULL != ksm_rmap_allocator);
+        ksm_unstable_allocator = slab_allocator_create("ksmunstable", sizeof(ksm_unstable_t));
+        KASSERT(NULL != ksm_unstable_allocator);
+
+#ifdef __KSMD__
+        sched_queue_init(&ksmd_waitq);
+
+        KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
+        ksmd_proc = proc_create("ksmd");
+        KASSERT(NULL != ksmd_proc);
+        ksmd_thr = kthread_create(ksmd_proc, ksmd, 0, NULL);
+        KASSERT(NULL != ksmd_thr);
+
+        sched_make_runnable(ksmd_thr);
+#endif
+}
+init_func(ksm_init);
+init_depends(sched_init);
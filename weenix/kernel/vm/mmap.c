@@ -6,8 +6,13 @@
 #include "mm/tlb.h"
 #include "mm/mman.h"
 #include "mm/page.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
+#include "mm/mmobj.h"
+#include "mm/zpage.h"
 
 #include "proc/proc.h"
+#include "proc/sched.h"
 
 #include "util/string.h"
 #include "util/debug.h"
@@ -18,6 +23,9 @@
 
 #include "vm/vmmap.h"
 #include "vm/mmap.h"
+#include "vm/anon.h"
+#include "vm/swap.h"
+#include "vm/ksmd.h"
 
 /*
  * This function implements the mmap(2) syscall, but only
@@ -146,32 +154,184 @@ do_mmap(void *addr, size_t len, int prot, int flags,int fd, off_t off, void **re
 int
 do_munmap(void *addr, size_t len)
 {
+        uintptr_t start = (uintptr_t) addr;
+        uintptr_t end = start + len;
+
         /* Ivalid addr */
-		if(PAGE_ALIGNED(addr)==0)
+		if(!PAGE_ALIGNED(start) || start < USER_MEM_LOW)
 		{
 			dbg(DBG_ERROR | DBG_VM, "ERROR: do_munmap: Invalid addr\n");
             return -EINVAL; 
 		}
 		
-		/* Invalid len, len should be not be NULL */
-		if (sizeof(len) == NULL)
+		/* Invalid len, the range must be non-empty and lie in user memory */
+		if (0 == len || end < start || end > USER_MEM_HIGH)
 		{
-			dbg(DBG_ERROR | DBG_VM, "ERROR: do_munmap: Invalid prot\n");
+			dbg(DBG_ERROR | DBG_VM, "ERROR: do_munmap: Invalid len\n");
             return -EINVAL; 
 
 		}
 		
-		/* Flushing the TLB */
-		int address = (uintptr_t)addr;
-		tlb_flush(address);
+		uint32_t lopage = ADDR_TO_PN(start);
+		uint32_t npages = ADDR_TO_PN(PAGE_ALIGN_UP(end)) - lopage;
+
 		dbg(DBG_VM,"GRADING: KASSERT(NULL != curproc->p_pagedir) is going getting invoked right now ! \n");
 		KASSERT(NULL != curproc->p_pagedir);
 		dbg(DBG_VM,"GRADING: I've made it ! May I have 2 points please ! \n");
+
+		/* Unmapping the pages and flushing the TLB */
+		pt_unmap_range(curproc->p_pagedir, start, (uintptr_t) PN_TO_ADDR(lopage + npages));
+		tlb_flush_range(start, npages);
+
 		/* Calling the function vmmap_remove */
-		int i = vmmap_remove(curproc->p_vmmap, 0, 0);
-		return 0;
-		
-        NOT_YET_IMPLEMENTED("VM: do_munmap");
-        return -1;
+		return vmmap_remove(curproc->p_vmmap, lopage, npages);
+}
+
+
+/*
+ * Throws away the pages of the private area vma backing virtual pages
+ * [lopage, hipage), so the next touch faults in a fresh copy from the
+ * object below (zeros for anonymous memory). Shared areas are only
+ * unmapped, their pages belong to everyone who maps the object.
+ */
+static void
+madvise_dontneed(vmarea_t *vma, uint32_t lopage, uint32_t hipage)
+{
+        pt_unmap_range(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(lopage),
+                       (uintptr_t) PN_TO_ADDR(hipage));
+        tlb_flush_range((uintptr_t) PN_TO_ADDR(lopage), hipage - lopage);
+
+        if (!(MAP_PRIVATE & vma->vma_flags)) {
+                return;
+        }
+
+        uint32_t page;
+        for (page = lopage; page < hipage; ++page) {
+                uint32_t pagenum = vma->vma_off + page - vma->vma_start;
+                pframe_t *pf;
+                zpage_discard(vma->vma_obj, pagenum);
+                swap_discard(vma->vma_obj, pagenum);
+                ksm_discard(vma->vma_obj, pagenum);
+                while (NULL != (pf = pframe_get_resident(vma->vma_obj, pagenum))
+                       && pframe_is_busy(pf)) {
+                        sched_sleep_on(&pf->pf_waitq);
+                }
+                /* without swap an anonymous object holds one pin on each
+                 * of its pages; any other pin means the page is still in
+                 * use (e.g. by a read or write into it), so it stays */
+                if (NULL == pf || pf->pf_pincount > ((mmobj_is_anon(pf->pf_obj) && !swap_enabled()) ? 1 : 0)) {
+                        continue;
+                }
+                if (pframe_is_pinned(pf)) {
+                        pframe_unpin(pf);
+                }
+                pframe_clear_dirty(pf);
+                pframe_free(pf);
+        }
 }
 
+/*
+ * Reads the file pages behind virtual pages [lopage, hipage) of vma
+ * into memory without mapping them. Anonymous memory and devices have
+ * nothing to read, so they are left alone.
+ */
+static void
+madvise_willneed(vmarea_t *vma, uint32_t lopage, uint32_t hipage)
+{
+        mmobj_t *bottom = mmobj_bottom_obj(vma->vma_obj);
+        if (NULL == mmobj_as_vnode(bottom)) {
+                return;
+        }
+
+        uint32_t page;
+        for (page = lopage; page < hipage; ++page) {
+                pframe_t *pf;
+                /* the lookup fails past the end of the file */
+                if (0 > pframe_lookup(bottom, vma->vma_off + page - vma->vma_start, 0, &pf)) {
+                        break;
+                }
+        }
+}
+
+/*
+ * This function implements the madvise(2) syscall for the MADV_NORMAL,
+ * MADV_RANDOM, MADV_SEQUENTIAL, MADV_WILLNEED and MADV_DONTNEED hints.
+ *
+ * MADV_SEQUENTIAL (and MADV_NORMAL/MADV_RANDOM, which undo it) changes
+ * how the file under the range is read as a whole: see VN_SEQUENTIAL.
+ * Areas which are not backed by a file ignore these three.
+ * WILLNEED reads the pages in before returning; weenix has no
+ * asynchronous disk I/O, so this is as early as it gets. DONTNEED
+ * drops the pages; note that the private copy of a page in a process
+ * which forked after writing it is shared with the other process and
+ * comes back with its old contents rather than zeros.
+ *
+ * Returns -EINVAL for a bad address or advice, and -ENOMEM if part of
+ * the range is not mapped.
+ */
+int
+do_madvise(void *addr, size_t len, int advice)
+{
+        uintptr_t start = (uintptr_t) addr;
+        uintptr_t end = start + len;
+        vmarea_t *vma;
+        vnode_t *vn;
+
+        if (!PAGE_ALIGNED(start) || 0 == len || end < start
+            || start < USER_MEM_LOW || end > USER_MEM_HIGH) {
+                return -EINVAL;
+        }
+        if (MADV_NORMAL > advice || MADV_DONTNEED < advice) {
+                return -EINVAL;
+        }
+
+        uint32_t lopage = ADDR_TO_PN(start);
+        uint32_t hipage = ADDR_TO_PN(PAGE_ALIGN_UP(end));
+
+        /* the areas are sorted, so the range is covered exactly when
+         * each area picks up where the one before it left off */
+        uint32_t next = lopage;
+        list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                if (vma->vma_end <= next) {
+                        continue;
+                }
+                if (vma->vma_start > next || next >= hipage) {
+                        break;
+                }
+                next = vma->vma_end;
+        } list_iterate_end();
+        if (next < hipage) {
+                return -ENOMEM;
+        }
+
+        list_iterate_begin(&curproc->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
+                uint32_t lo = MAX(lopage, vma->vma_start);
+                uint32_t hi = MIN(hipage, vma->vma_end);
+                if (lo >= hi) {
+                        continue;
+                }
+
+                switch (advice) {
+                        case MADV_NORMAL:
+                        case MADV_RANDOM:
+                        case MADV_SEQUENTIAL:
+                                vn = mmobj_as_vnode(mmobj_bottom_obj(vma->vma_obj));
+                                if (NULL != vn) {
+                                        if (MADV_SEQUENTIAL == advice) {
+                                                vn->vn_flags |= VN_SEQUENTIAL;
+                                        } else {
+                                                vn->vn_flags &= ~VN_SEQUENTIAL;
+                                        }
+                                }
+                                break;
+                        case MADV_WILLNEED:
+                                madvise_willneed(vma, lo, hi);
+                                break;
+                        case MADV_DONTNEED:
+                                madvise_dontneed(vma, lo, hi);
+                                break;
+                }
+        } list_iterate_end();
+
+        return 0;
+}
@@ -4,6 +4,7 @@
 #include "errno.h"
 
 #include "util/debug.h"
+#include "util/string.h"
 
 #include "proc/proc.h"
 
@@ -13,10 +14,85 @@
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
 #include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 #include "vm/pagefault.h"
 #include "vm/vmmap.h"
 
+/* A fault the process had no right to take. In user mode that kills
+ * the process, in kernel mode the caller is told so it can back out. */
+static int
+pagefault_bad(uint32_t cause)
+{
+        if (cause & FAULT_USER) {
+                proc_kill(curproc, EFAULT);
+        }
+        return -EFAULT;
+}
+
+/*
+ * Once every page of the 4mb block around vaddr is mapped writable,
+ * copies the block's pages into one 4mb frame and maps the block with
+ * a single large entry. The pages stay pframes of the area's object,
+ * so paging one out (or copying on write after a fork) splits the
+ * block up again. Only done while this area is the object's one user
+ * (its other references are its own pages), so no other page table
+ * points at the old frames. Leaves the block alone if any page is busy
+ * or pinned, or if no 4mb frame is free.
+ */
+static void
+promote_block(vmarea_t *area, uintptr_t vaddr)
+{
+        pagedir_t *pd = curproc->p_pagedir;
+        uintptr_t vbase = vaddr - vaddr % PT_LARGE_PAGE_SIZE;
+        uint32_t pagenum = ADDR_TO_PN(vbase) - area->vma_start + area->vma_off;
+        uint32_t npages = PT_LARGE_PAGE_SIZE / PAGE_SIZE;
+        uint32_t flags = PT_PRESENT | PT_WRITE | PT_USER;
+        mmobj_t *obj = area->vma_obj;
+        pframe_t *pf;
+        char *block;
+        uint32_t i;
+
+        if (!pt_large_supported() || !pt_block_full(pd, vbase, flags)) {
+                return;
+        }
+        /* the frames may happen to be in order already */
+        if (pt_promote(pd, vbase)) {
+                return;
+        }
+
+        if (NULL == (block = page_alloc_n(npages))) {
+                return;
+        }
+        /* allocating may have blocked, so look at the block again */
+        if (!PT_LARGE_ALIGNED(pt_virt_to_phys((uintptr_t)block))
+            || !pt_block_full(pd, vbase, flags)
+            || 1 != obj->mmo_refcount - obj->mmo_nrespages) {
+                goto fail;
+        }
+        for (i = 0; i < npages; i++) {
+                pf = pframe_get_resident(obj, pagenum + i);
+                if (NULL == pf || pframe_is_busy(pf) || pframe_is_pinned(pf)) {
+                        goto fail;
+                }
+        }
+
+        /* nothing below blocks; the large entry replaces (and frees)
+         * the page table pointing at the old frames */
+        for (i = 0; i < npages; i++) {
+                pf = pframe_get_resident(obj, pagenum + i);
+                page_copy(block + i * PAGE_SIZE, pf->pf_addr);
+                page_free(pf->pf_addr);
+                pf->pf_addr = block + i * PAGE_SIZE;
+        }
+        pt_map_large(pd, vbase, pt_virt_to_phys((uintptr_t)block), PD_PRESENT | PD_WRITE | PD_USER);
+        tlb_flush_range(vbase, npages);
+        return;
+
+fail:
+        page_free_n(block, npages);
+}
+
 /*
  * This gets called by _pt_fault_handler in mm/pagetable.c The
  * calling function has already done a lot of error checking for
@@ -47,8 +123,14 @@
  * @param cause this is the type of operation on the memory
  *              address which caused the fault, possible values
  *              can be found in pagefault.h
+ *
+ * Faults taken in kernel mode by copy_to_user and copy_from_user
+ * come here too (see _pt_fault_handler); those never kill the
+ * process, the copy just fails with -EFAULT.
+ *
+ * @return 0 if the page was mapped, -EFAULT otherwise
  */
-void
+int
 handle_pagefault(uintptr_t vaddr, uint32_t cause)
 {
 
@@ -67,8 +149,7 @@ handle_pagefault(uintptr_t vaddr, uint32_t cause)
         vmarea_t *faulted_vmarea= vmmap_lookup(curproc->p_vmmap, ADDR_TO_PN(vaddr));
        	if(faulted_vmarea==NULL){
                 dbg(DBG_PGTBL|DBG_ERROR,"A fault occured while fetching the vmarea for virtual address 0x%u\nKilling the process!!!\n",vaddr);
-                proc_kill(curproc, EFAULT);
-                return;
+                return pagefault_bad(cause);
         }
 	mmobj_t *obj = faulted_vmarea->vma_obj;
  
@@ -76,8 +157,7 @@ dbg_print("== anon object = 0x%p ,area = 0x%p, pagenum = %d vaddr= %d\n",obj,fau
 
         if(faulted_vmarea==NULL){ 
                 dbg(DBG_TEST,"Null vmarea recieved\n"); 
-                proc_kill(curproc, EFAULT); 
-                return;
+                return pagefault_bad(cause);
              }
         
         if ((cause & FAULT_WRITE))
@@ -85,7 +165,7 @@ dbg_print("== anon object = 0x%p ,area = 0x%p, pagenum = %d vaddr= %d\n",obj,fau
                 if (!(faulted_vmarea->vma_prot & PROT_WRITE))
 
                 {
-	        	proc_kill(curproc, EFAULT); return;
+	        	return pagefault_bad(cause);
 		}
 	}
 		/* Check the protection of the vmarea to PROT_EXEC and if cause is
@@ -94,7 +174,7 @@ dbg_print("== anon object = 0x%p ,area = 0x%p, pagenum = %d vaddr= %d\n",obj,fau
         {
 			if (!(faulted_vmarea->vma_prot & PROT_EXEC))
 			{
-				proc_kill(curproc, EFAULT);return;
+				return pagefault_bad(cause);
 			}
 	}
 		
@@ -104,7 +184,7 @@ dbg_print("== anon object = 0x%p ,area = 0x%p, pagenum = %d vaddr= %d\n",obj,fau
         {
 			if (faulted_vmarea->vma_prot ==PROT_NONE)
 			{
-				proc_kill(curproc, EFAULT);return;
+				return pagefault_bad(cause);
 			}
 
 	}
@@ -112,29 +192,57 @@ dbg_print("== anon object = 0x%p ,area = 0x%p, pagenum = %d vaddr= %d\n",obj,fau
         {
 			if (!(faulted_vmarea->vma_prot & PROT_READ))
 			{
-				proc_kill(curproc, EFAULT);return;
+				return pagefault_bad(cause);
 			}
 	}	
-		/* Finding the correct page physical address */
-
+		/* Finding the correct page physical address. Only a write fault asks
+		 * for a writable page (this is where copy-on-write happens); a read
+		 * fault maps whatever page the shadow chain already has, read-only,
+		 * so that a later write still faults. This is also what keeps the
+		 * read-only entries fork shares between parent and child sound. */
+		int forwrite = (cause & FAULT_WRITE) ? 1 : 0;
+		uint32_t pagenum = ADDR_TO_PN(vaddr) - faulted_vmarea->vma_start + faulted_vmarea->vma_off;
+
+                /* any page read in from a file while looking the page up
+                 * makes this a major fault (the fillpage operations keep
+                 * the cow, zero-fill and read-in counts themselves) */
+                int inblock = curproc->p_rusage.ru_inblock;
                 pframe_t *needed_frm = NULL;
-                int ret=0;                
-                ret=pframe_get(obj,PAGE_OFFSET(vaddr),&needed_frm);
-                if(ret<0)
+                int ret = pframe_lookup(obj, pagenum, forwrite, &needed_frm);
+                if (ret < 0 || NULL == needed_frm)
                 {
-                        return;
+                        return pagefault_bad(cause);
+                }
+                if (curproc->p_rusage.ru_inblock != inblock) {
+                        proc_account(ru_majflt);
+                } else {
+                        proc_account(ru_minflt);
                 }
-                
-                pframe_clear_busy(needed_frm);
-
-                uintptr_t paddr = pt_virt_to_phys((uint32_t)needed_frm->pf_addr);
-               
 
+                if (forwrite && pframe_dirty(needed_frm) < 0)
+                {
+                        return pagefault_bad(cause);
+                }
 
-	pt_map(curproc->p_pagedir, (uintptr_t)PN_TO_ADDR(ADDR_TO_PN(vaddr)), paddr, PD_PRESENT|PD_WRITE|PD_USER, PT_PRESENT|PT_WRITE|PT_USER);
-	sched_broadcast_on(&needed_frm->pf_waitq);
+                uintptr_t paddr = pt_virt_to_phys((uint32_t)needed_frm->pf_addr);
+                uint32_t ptflags = PT_PRESENT | PT_USER | (forwrite ? PT_WRITE : 0);
+
+	pt_map(curproc->p_pagedir, (uintptr_t)PAGE_ALIGN_DOWN(vaddr), paddr, PD_PRESENT|PD_WRITE|PD_USER, ptflags);
+	/* the entry may have been present but read-only before */
+	tlb_flush((uintptr_t)PAGE_ALIGN_DOWN(vaddr));
+
+        /* an anonymous area which covers a whole 4mb block might now
+         * have every page of it mapped, in which case the block is
+         * moved to a large page */
+        if (forwrite && (faulted_vmarea->vma_flags & MAP_ANON)) {
+                uint32_t blkpage = ADDR_TO_PN(vaddr - vaddr % PT_LARGE_PAGE_SIZE);
+                if (blkpage >= faulted_vmarea->vma_start
+                    && blkpage + PT_LARGE_PAGE_SIZE / PAGE_SIZE <= faulted_vmarea->vma_end) {
+                        promote_block(faulted_vmarea, vaddr);
+                }
+        }
 
         /*NOT_YET_IMPLEMENTED("VM: handle_pagefault");*/
-
+        return 0;
 }
 
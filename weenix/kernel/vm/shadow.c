@@ -10,10 +10,13 @@
 #include "mm/page.h"
 #include "mm/slab.h"
 #include "mm/tlb.h"
+#include "mm/zpage.h"
 
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/shadowd.h"
+#include "vm/swap.h"
+#include "vm/ksmd.h"
 
 #define SHADOW_SINGLETON_THRESHOLD 5
 
@@ -82,6 +85,15 @@ shadow_create()
         return new_shadow_obj;
 }
 
+/*
+ * Returns non-zero if o is a shadow object.
+ */
+int
+mmobj_is_shadow(mmobj_t *o)
+{
+        return &shadow_mmobj_ops == o->mmo_ops;
+}
+
 /* Implementation of mmobj entry points: */
 
 /*
@@ -128,10 +140,10 @@ dbg(DBG_VM,"GRADING: I've made it ! May I have 2 points please ! \n");
                                         pframe_unpin(pf);
                                 if (pframe_is_busy(pf)){
                                        sched_sleep_on(&pf->pf_waitq);
-                                } else if (pframe_is_dirty(pf)) {
-                                        pframe_clean(pf);
                                 } else {
-                                        /* it's not busy, it's clean, free it */
+                                        /* nobody will ever read the page
+                                         * again, don't write it to swap */
+                                        pframe_clear_dirty(pf);
                                         pframe_free(pf);
                                 }
                              }list_iterate_end();
@@ -141,6 +153,9 @@ dbg(DBG_VM,"GRADING: I've made it ! May I have 2 points please ! \n");
 dbg(DBG_VNREF,"after shadow_put: object = 0x%p , reference_count =%d, nrespages=%d\n",o,o->mmo_refcount,o->mmo_nrespages);
           if(0 == o->mmo_refcount && 0 == o->mmo_nrespages )
               {
+                 zpage_discard_obj(o);
+                 swap_discard_obj(o);
+                 ksm_discard_obj(o);
                  slab_obj_free(shadow_allocator, o);
               }
         
@@ -161,6 +176,7 @@ shadow_lookuppage(mmobj_t *o, uint32_t pagenum, int forwrite, pframe_t **pf)
 dbg(DBG_VNREF,"lookuppage: searching for object: 0x%p, pagenum: %d, with forwrite: %d \n",o,pagenum,forwrite);
         /* need to call pframe_get_resident for each frame in the object */
         mmobj_t *temp = o; pframe_t *pg_frame; int flag=0;
+        *pf = NULL;
      
             if(!forwrite) /* Readonly --- look for nearest object with this page */
                {
@@ -176,22 +192,27 @@ dbg(DBG_VNREF,"lookuppage: searching for object: 0x%p, pagenum: %d, with forwrit
                                    *pf = pg_frame;
                                     flag=1;                       
                              }
+                            else if(NULL != (pg_frame = ksm_lookup(temp,pagenum)))
+                             {
+                                    /* merged by ksmd, share the frame read-only */
+                                    *pf = pg_frame;
+                                    flag=1;
+                             }
+                            else if((zpage_has(temp,pagenum) || swap_has(temp,pagenum))
+                                    && 0 == pframe_get(temp,pagenum,pf))
+                             {
+                                    /* paged out, but this object still has it */
+                                    flag=1;
+                             }
                        if(flag)break;
                        temp = temp->mmo_shadowed;                       
                        }
                        if(flag==0) /* look into the bottom most object of the chain*/
                        {
-                         pg_frame = pframe_get_resident(o,pagenum);
-                            if(pg_frame)
-                             {
-                               if (pframe_is_busy(pg_frame))
-                                       sched_sleep_on(&pg_frame->pf_waitq);
-                                       
-                                *pf =pg_frame;
-                             }
-                              else {
-                                pframe_get(o,PAGE_OFFSET(pagenum),pf);
-                            }
+                         /* reading must not give o a private copy, or
+                          * pages never written after a fork stop being
+                          * shared */
+                         temp->mmo_ops->lookuppage(temp,pagenum,0,pf);
                        }
                   }
                   if(o->mmo_shadowed==NULL)
@@ -203,6 +224,10 @@ dbg(DBG_VNREF,"lookuppage: searching for object: 0x%p, pagenum: %d, with forwrit
                                 if (pframe_is_busy(pg_frame))
                                        sched_sleep_on(&pg_frame->pf_waitq);
                                        *pf =pg_frame;
+                            }
+                            else if(NULL != (pg_frame = ksm_lookup(o,pagenum)))
+                            {
+                                *pf = pg_frame;
                             }
                              else {
                                 pframe_get(o,pagenum,pf);
@@ -249,13 +274,30 @@ shadow_fillpage(mmobj_t *o, pframe_t *pf)
         KASSERT(!pframe_is_pinned(pf));
         dbg(DBG_VM,"GRADING: I've made it ! May I have 2 points please ! \n");
 	dbg(DBG_VNREF,"Fillpage: destinaiton object: 0x%ppf->pf_pagenum: %d\n",o,pf->pf_pagenum);
+        /* a page of this object which was paged out comes back from
+         * swap, a page ksmd merged is copied out of the shared frame
+         * (the first write to it got us here), private anonymous memory
+         * with nothing underneath it starts out zeroed */
+        int ret = swap_in(pf);
+        if (ret != 0)
+                return (ret < 0) ? ret : 0;
+        if (ksm_in(pf))
+                return 0;
+        if (NULL == o->mmo_shadowed) {
+                page_zero(pf->pf_addr);
+                pframe_set_dirty(pf);
+                proc_account(ru_zeroflt);
+                return 0;
+        }
+
         /* look for the source page frame */
         pframe_set_dirty(pf);
-        int ret = shadow_lookuppage(o->mmo_shadowed,pf->pf_pagenum,0,&src_pf);
+        ret = shadow_lookuppage(o->mmo_shadowed,pf->pf_pagenum,0,&src_pf);
         if(ret == 0)
              {
                 if(src_pf){
-        		memcpy(pf->pf_addr,src_pf->pf_addr,PAGE_SIZE);
+        		page_copy(pf->pf_addr, src_pf->pf_addr);
+        		proc_account(ru_cowflt);
         	}else{
         	        pframe_clear_dirty(pf);
         		return -EFAULT;
@@ -289,20 +331,11 @@ dbg(DBG_VNREF,"Fillpage: destinaiton object: 0x%p, source pf->pf_obj: 0%p, pf->p
 static int
 shadow_cleanpage(mmobj_t *o, pframe_t *pf)
 {
-        pframe_t *src_pf, *dest_pf;        
-
-        int  ret = shadow_lookuppage(o->mmo_shadowed,pf->pf_pagenum,0,&dest_pf);
-        if(dest_pf){
-		if(pframe_is_busy(pf)){
-			pframe_clear_busy(pf);
-			sched_broadcast_on(&pf->pf_waitq);
-		}
-                       while(pframe_is_pinned(pf))
-                        pframe_unpin(pf);
-                        memcpy(dest_pf,pf,PAGE_SIZE);
-                        pframe_free(pf);
-                      }
-        else return -1;
-       /* NOT_YET_IMPLEMENTED("VM: shadow_cleanpage");*/
-        return 0;
+        /* the page is this object's private copy, pushing it down into
+         * the object it shadows would change what the other objects
+         * sharing that one see, so it can only go to the compressed
+         * store or the swap disk */
+        if (0 == zpage_store(pf, 1))
+                return 0;
+        return swap_out(pf);
 }
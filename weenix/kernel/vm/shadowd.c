@@ -3,6 +3,12 @@
 
 #include "mm/mmobj.h"
 #include "mm/pframe.h"
+#include "mm/zpage.h"
+
+#include "vm/vmmap.h"
+#include "vm/shadowd.h"
+#include "vm/swap.h"
+#include "vm/ksmd.h"
 
 #include "util/debug.h"
 #include "util/string.h"
@@ -15,6 +21,12 @@
 static ktqueue_t shadowd_waitq, kmem_alloc_waitq;
 static int shadowd_initialized = 0;
 
+/* areas whose chain changed since shadowd last collapsed it */
+static list_t shadowd_dirty;
+
+/* pages migrated between giving up the cpu */
+#define SHADOWD_BATCH 64
+
 void
 shadowd_wakeup()
 {
@@ -36,9 +48,40 @@ shadowd_alloc_sleep()
 }
 
 /*
- * The shadow daemon main routine. This should periodically
- * traverese all the shadow object trees, removing any
- * unnecessary shadow objects.
+ * An object only loses a parent when an area over it goes away (exit,
+ * munmap) and only gains shadow objects when an area is forked, and in
+ * every case the areas whose chains are affected are exactly those with
+ * the same object at the bottom. Queueing them here means shadowd's work
+ * is proportional to how much changed, instead of rescanning every
+ * area of every process each time it runs.
+ */
+void
+shadowd_chain_changed(vmarea_t *vma)
+{
+        vmarea_t *v;
+
+        if (!shadowd_initialized || NULL == vma->vma_obj
+            || !list_link_is_linked(&vma->vma_olink)) {
+                return;
+        }
+
+        list_iterate_begin(mmobj_bottom_vmas(vma->vma_obj), v, vmarea_t, vma_olink) {
+                v->vma_chaingen++;
+                if (!list_link_is_linked(&v->vma_dlink)) {
+                        list_insert_tail(&shadowd_dirty, &v->vma_dlink);
+                }
+        } list_iterate_end();
+}
+
+static void
+shadowd_yield(void)
+{
+        sched_make_runnable(curthr);
+        sched_switch();
+}
+
+/*
+ * Collapses the chain under last, the object at the top of an area.
  *
  * A shadow object is considered unnecessary if it is not top most
  * (directly descendant from a vmarea), and if it has only 1
@@ -49,59 +92,81 @@ shadowd_alloc_sleep()
  * one, then remove this object from the tree (if we remove it any
  * earlier we can cause big problems).
  *
+ * Pages are migrated in batches, giving up the cpu in between. Nothing
+ * can add a parent to an object with only one while we are away, and
+ * last is referenced, so the chain stays put.
  */
+static void
+shadowd_collapse(mmobj_t *last)
+{
+        mmobj_t *o;
+        int nmigrated = 0;
+
+        /* ref last, so if all processes on this branch die while shadowd is
+         * sleeping, the branch won't get destroyed until shadowd() is done
+         * with it */
+        last->mmo_ops->ref(last);
+        o = last->mmo_shadowed;
+        while (NULL != o && NULL != o->mmo_shadowed) {
+                /* iff the object has only one parent, and is not right under vm_area */
+                KASSERT(o != last);
+                if (o->mmo_refcount - o->mmo_nrespages == 1) {
+                        /* migrate all its pages to last, and remove it from the shadow tree */
+                        while (!list_empty(&o->mmo_respages)) {
+                                pframe_t *pf = list_head(&o->mmo_respages, pframe_t, pf_olink);
+                                /* a read may be bringing a page of o
+                                 * back from swap while we were away */
+                                if (pframe_is_busy(pf)) {
+                                        sched_sleep_on(&pf->pf_waitq);
+                                        continue;
+                                }
+                                /* o has refcount 1+nrespages, so this won't delete it yet */
+                                pframe_migrate(pf, last);
+                                if (0 == ++nmigrated % SHADOWD_BATCH) {
+                                        shadowd_yield();
+                                }
+                        }
+                        zpage_migrate(o, last);
+                        swap_migrate(o, last);
+                        ksm_migrate(o, last);
+                        last->mmo_shadowed = o->mmo_shadowed;
+                        /* Ref o's shadowed, so we don't accidentally delete it when we
+                         * finally put o */
+                        o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
+                        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
+                        o->mmo_ops->put(o);
+                } else {
+                        KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);
+                        o->mmo_ops->ref(o);
+                        last->mmo_ops->put(last);
+                        last = o;
+                }
+                o = last->mmo_shadowed;
+        }
+        KASSERT(NULL != last);
+        last->mmo_ops->put(last);
+}
 
+/*
+ * The shadow daemon main routine. Each time it is woken it collapses
+ * the chains of the areas queued by shadowd_chain_changed. Areas of
+ * processes which exit are freed, and so dequeued, before shadowd sees
+ * them; the chains they leave behind are queued through the areas
+ * still using them.
+ */
 static void *
 shadowd(int arg1, void *arg2)
 {
         while (1) {
-                proc_t *p;
-                /* for each process, go through its vmareas */
-                list_iterate_begin(proc_list(), p, proc_t, p_list_link) {
-                        /* all of the dead process's shadow objects will be takenen care of by init */
-                        if (PROC_RUNNING == p->p_state) {
-                                vmarea_t *vma;
-                                list_iterate_begin(&p->p_vmmap->vmm_list, vma, vmarea_t, vma_plink) {
-                                        mmobj_t *last = vma->vma_obj, *o = last->mmo_shadowed;
-                                        /* ref last, so if all processes on this branch die while shadowd is
-                                         * sleeping, the branch won't get destroyed until shadowd() is done
-                                         * with it */
-                                        last->mmo_ops->ref(last);
-                                        while (NULL != o && NULL != o->mmo_shadowed) {
-                                                mmobj_t *shadow = o->mmo_shadowed;
-                                                /* iff the object has only one parent, and is not right under vm_area */
-                                                KASSERT(o != last);
-                                                if (o->mmo_refcount - o->mmo_nrespages == 1) {
-                                               /* migrate all its pages to last, and remove it from the shadow tree */
-                                                        pframe_t *pf;
-                                                        list_iterate_begin(&o->mmo_respages, pf, pframe_t, pf_olink) {
-                                                                /* Because the operations that could be
-                                                                 * performed with an intermediate shadow object
-                                                                 * to make pages busy are non-blocking,
-                                                                 * we always expect to see non-busy pages. */
-                                                                KASSERT(!pframe_is_busy(pf));
-                                                    /* o has refcount 1+nrespages, so this won't delete it yet */
-                                                                pframe_migrate(pf, last);
-                                                        } list_iterate_end();
-                                                        last->mmo_shadowed = o->mmo_shadowed;
-                                                        /* Ref o's shadowed, so we don't accidentally delete it when we
-                                                         * finally put o */
-                                                        o->mmo_shadowed->mmo_ops->ref(o->mmo_shadowed);
-                                                        KASSERT(o->mmo_refcount == 1 && o->mmo_nrespages == 0);
-                                                        o->mmo_ops->put(o);
-                                                } else {
-                                                        KASSERT(o->mmo_refcount - o->mmo_nrespages == 2);
-                                                        o->mmo_ops->ref(o);
-                                                        last->mmo_ops->put(last);
-                                                        last = o;
-                                                }
-                                                o = shadow;
-                                        }
-                                        KASSERT(NULL != last);
-                                        last->mmo_ops->put(last);
-                                } list_iterate_end();
-                        }
-                } list_iterate_end();
+                while (!list_empty(&shadowd_dirty)) {
+                        vmarea_t *vma = list_head(&shadowd_dirty, vmarea_t, vma_dlink);
+                        list_remove(&vma->vma_dlink);
+                        dbg(DBG_VM, "shadowd: chain of area [0x%p, 0x%p) changed, generation %u\n",
+                            PN_TO_ADDR(vma->vma_start), PN_TO_ADDR(vma->vma_end), vma->vma_chaingen);
+                        /* the area may be gone once we sleep, only its
+                         * object is used from here on */
+                        shadowd_collapse(vma->vma_obj);
+                }
 
                 sched_broadcast_on(&kmem_alloc_waitq);
                 if (sched_cancellable_sleep_on(&shadowd_waitq) < 0) {
@@ -118,6 +183,7 @@ shadowd_init()
 {
         sched_queue_init(&shadowd_waitq);
         sched_queue_init(&kmem_alloc_waitq);
+        list_init(&shadowd_dirty);
 
         KASSERT(NULL != curproc && (PID_IDLE == curproc->p_pid));
         shadowd_proc = proc_create("shadowd");
@@ -142,4 +208,9 @@ shadowd_exit()
         kthread_cancel(shadowd_thr, (void *)0);
         shadowd_thr = NULL;
 }
+#else
+void
+shadowd_chain_changed(vmarea_t *vma)
+{
+}
 #endif
@@ -0,0 +1,258 @@
+#include "types.h"
+#include "globals.h"
+#include "errno.h"
+
+#include "util/debug.h"
+#include "util/list.h"
+#include "util/string.h"
+#include "util/init.h"
+
+#include "drivers/blockdev.h"
+
+#include "proc/proc.h"
+
+#include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/slab.h"
+#include "mm/kmalloc.h"
+
+#include "vm/swap.h"
+#include "vm/ksmd.h"
+
+/* the swap disk is made by the run script, which sizes it from the
+ * same SWAP_MB setting; the drivers do not report a disk's size */
+#ifdef __SWAP_MB__
+#define SWAP_NSLOTS (__SWAP_MB__ * (1024 * 1024 / PAGE_SIZE))
+#else
+#define SWAP_NSLOTS 0
+#endif
+
+/*
+ * Each swapped out page has an entry in a small hash table, keyed the
+ * same way as the pframe hash, recording which slot of the swap disk
+ * holds it. Slots are handed out next-fit from a bitmap so that pages
+ * written out together tend to end up next to each other on disk.
+ */
+
+typedef struct swapent {
+        struct mmobj   *se_obj;
+        uint32_t        se_pagenum;
+        uint32_t        se_slot;
+        list_link_t     se_link;     /* link on the hash chain */
+} swapent_t;
+
+#define SWAP_HASH_SIZE 64
+#define hash_swap(obj, pagenum)  ((((uint32_t)(obj)) + (pagenum)) \
+                                  % SWAP_HASH_SIZE)
+static list_t swap_hash[SWAP_HASH_SIZE];
+
+#define SLOT_BITS 32
+#define slot_used(slot)  (swap_map[(slot) / SLOT_BITS] & (1 << ((slot) % SLOT_BITS)))
+
+static slab_allocator_t *swapent_allocator = NULL;
+static blockdev_t *swap_dev = NULL;
+static uint32_t *swap_map = NULL;
+static uint32_t swap_nslots = 0;
+static uint32_t swap_nused = 0;
+static uint32_t swap_rotor = 0;
+
+static __attribute__((unused)) void
+swap_init(void)
+{
+        int i;
+        for (i = 0; i < SWAP_HASH_SIZE; ++i)
+                list_init(&swap_hash[i]);
+
+        blockdev_t *dev = blockdev_lookup(SWAP_DEVID);
+        if (NULL == dev || 0 == SWAP_NSLOTS) {
+                dbg(DBG_VM, "swap: no swap disk, anonymous pages will stay pinned\n");
+                return;
+        }
+
+        size_t mapsize = sizeof(uint32_t) * ((SWAP_NSLOTS + SLOT_BITS - 1) / SLOT_BITS);
+        swapent_allocator = slab_allocator_create("swapent", sizeof(swapent_t));
+        KASSERT(NULL != swapent_allocator);
+        if (NULL == (swap_map = (uint32_t *) kmalloc(mapsize))) {
+                dbg(DBG_VM, "swap: not enough memory for the slot map\n");
+                return;
+        }
+        memset(swap_map, 0, mapsize);
+
+        swap_nslots = SWAP_NSLOTS;
+        swap_dev = dev;
+        dbg(DBG_VM, "swap: %d slots on device 0x%x\n", swap_nslots, swap_dev->bd_id);
+}
+init_func(swap_init);
+
+int
+swap_enabled(void)
+{
+        return NULL != swap_dev;
+}
+
+/* Returns a free slot, or -ENOSPC if there is none. */
+static int
+swap_slot_alloc(void)
+{
+        uint32_t i;
+
+        if (swap_nused == swap_nslots)
+                return -ENOSPC;
+
+        for (i = 0; i < swap_nslots; ++i) {
+                uint32_t slot = (swap_rotor + i) % swap_nslots;
+                if (!slot_used(slot)) {
+                        swap_map[slot / SLOT_BITS] |= 1 << (slot % SLOT_BITS);
+                        swap_nused++;
+                        swap_rotor = slot + 1;
+                        return slot;
+                }
+        }
+        panic("swap: %d of %d slots used but none are free\n", swap_nused, swap_nslots);
+        return -ENOSPC;
+}
+
+static swapent_t *
+swap_find(mmobj_t *o, uint32_t pagenum)
+{
+        swapent_t *se;
+
+        if (0 == swap_nused)
+                return NULL;
+
+        list_iterate_begin(&swap_hash[hash_swap(o, pagenum)], se, swapent_t, se_link) {
+                if (se->se_obj == o && se->se_pagenum == pagenum)
+                        return se;
+        } list_iterate_end();
+        return NULL;
+}
+
+static void
+swap_release(swapent_t *se)
+{
+        KASSERT(slot_used(se->se_slot));
+        swap_map[se->se_slot / SLOT_BITS] &= ~(1 << (se->se_slot % SLOT_BITS));
+        swap_nused--;
+        list_remove(&se->se_link);
+        slab_obj_free(swapent_allocator, se);
+}
+
+int
+swap_has(mmobj_t *o, uint32_t pagenum)
+{
+        return NULL != swap_find(o, pagenum);
+}
+
+int
+swap_write(mmobj_t *o, uint32_t pagenum, const void *buf)
+{
+        int ret;
+        swapent_t *se;
+
+        if (NULL == swap_dev)
+                return -ENOSPC;
+
+        if (NULL == (se = swap_find(o, pagenum))) {
+                int slot;
+                if ((slot = swap_slot_alloc()) < 0)
+                        return slot;
+                if (NULL == (se = (swapent_t *) slab_obj_alloc(swapent_allocator))) {
+                        swap_map[slot / SLOT_BITS] &= ~(1 << (slot % SLOT_BITS));
+                        swap_nused--;
+                        return -ENOMEM;
+                }
+                se->se_obj = o;
+                se->se_pagenum = pagenum;
+                se->se_slot = slot;
+                list_insert_head(&swap_hash[hash_swap(se->se_obj, se->se_pagenum)], &se->se_link);
+        }
+
+        dbg(DBG_VM, "swap: page %d of obj %p out to slot %d\n", pagenum, o, se->se_slot);
+        if ((ret = swap_dev->bd_ops->write_block(swap_dev, buf, se->se_slot, 1)) < 0) {
+                swap_release(se);
+                return ret;
+        }
+        return 0;
+}
+
+int
+swap_out(pframe_t *pf)
+{
+        return swap_write(pf->pf_obj, pf->pf_pagenum, pf->pf_addr);
+}
+
+int
+swap_in(pframe_t *pf)
+{
+        int ret;
+        swapent_t *se;
+
+        if (NULL == (se = swap_find(pf->pf_obj, pf->pf_pagenum)))
+                return 0;
+
+        dbg(DBG_VM, "swap: page %d of obj %p in from slot %d\n",
+            pf->pf_pagenum, pf->pf_obj, se->se_slot);
+        if ((ret = swap_dev->bd_ops->read_block(swap_dev, pf->pf_addr, se->se_slot, 1)) < 0)
+                return ret;
+
+        /* The page is busy while it is being filled, so nobody can have
+         * discarded the entry while we were asleep on the disk */
+        swap_release(se);
+        pframe_set_dirty(pf);
+        proc_account(ru_inblock);
+        return 1;
+}
+
+void
+swap_discard(mmobj_t *o, uint32_t pagenum)
+{
+        swapent_t *se;
+        if (NULL != (se = swap_find(o, pagenum)))
+                swap_release(se);
+}
+
+void
+swap_discard_obj(mmobj_t *o)
+{
+        int i;
+        swapent_t *se;
+
+        for (i = 0; i < SWAP_HASH_SIZE && 0 != swap_nused; ++i) {
+                list_iterate_begin(&swap_hash[i], se, swapent_t, se_link) {
+                        if (se->se_obj == o)
+                                swap_release(se);
+                } list_iterate_end();
+        }
+}
+
+void
+swap_migrate(mmobj_t *src, mmobj_t *dest)
+{
+        int i;
+        swapent_t *se;
+        list_t moved;
+
+        list_init(&moved);
+        for (i = 0; i < SWAP_HASH_SIZE && 0 != swap_nused; ++i) {
+                list_iterate_begin(&swap_hash[i], se, swapent_t, se_link) {
+                        if (se->se_obj != src)
+                                continue;
+                        if (NULL != pframe_get_resident(dest, se->se_pagenum)
+                            || NULL != swap_find(dest, se->se_pagenum)
+                            || ksm_has(dest, se->se_pagenum)) {
+                                /* dest already has a newer version of the page */
+                                swap_release(se);
+                        } else {
+                                list_remove(&se->se_link);
+                                list_insert_head(&moved, &se->se_link);
+                        }
+                } list_iterate_end();
+        }
+
+        /* rehash only once the walk is done so no entry is visited twice */
+        list_iterate_begin(&moved, se, swapent_t, se_link) {
+                list_remove(&se->se_link);
+                se->se_obj = dest;
+                list_insert_head(&swap_hash[hash_swap(dest, se->se_pagenum)], &se->se_link);
+        } list_iterate_end();
+}
@@ -5,6 +5,7 @@
 #include "vm/vmmap.h"
 #include "vm/shadow.h"
 #include "vm/anon.h"
+#include "vm/shadowd.h"
 
 #include "proc/proc.h"
 
@@ -23,6 +24,9 @@
 #include "mm/mm.h"
 #include "mm/mman.h"
 #include "mm/mmobj.h"
+#include "mm/pframe.h"
+#include "mm/pagetable.h"
+#include "mm/tlb.h"
 
 static slab_allocator_t *vmmap_allocator;
 static slab_allocator_t *vmarea_allocator;
@@ -42,6 +46,9 @@ vmarea_alloc(void)
         vmarea_t *newvma = (vmarea_t *) slab_obj_alloc(vmarea_allocator);
         if (newvma) {
                 newvma->vma_vmmap = NULL;
+                newvma->vma_chaingen = 0;
+                list_link_init(&newvma->vma_olink);
+                list_link_init(&newvma->vma_dlink);
         }
         return newvma;
 }
@@ -50,6 +57,12 @@ void
 vmarea_free(vmarea_t *vma)
 {
         KASSERT(NULL != vma);
+        if (list_link_is_linked(&vma->vma_olink)) {
+                list_remove(&vma->vma_olink);
+        }
+        if (list_link_is_linked(&vma->vma_dlink)) {
+                list_remove(&vma->vma_dlink);
+        }
         slab_obj_free(vmarea_allocator, vma);
 }
 
@@ -84,6 +97,9 @@ vmmap_destroy(vmmap_t *map)
 					vput(v);
 				}
 			}
+			/* the other processes sharing this chain may now
+			 * have objects in theirs with a single parent */
+			shadowd_chain_changed(area);
 			area->vma_obj->mmo_ops->put(area->vma_obj);
 			list_remove(&(area->vma_plink));
 			vmarea_free(area);
@@ -331,7 +347,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages, int pro
 			newarea->vma_end = start+npages;
 			newarea->vma_off = off;
 			newarea->vma_prot = prot;
-			newarea->vma_flags = flags;
+			newarea->vma_flags = flags | (file ? 0 : MAP_ANON);
 			/*not adding mmobj to cloned vmareas*/
 			vmmap_insert(map, newarea);
 			if(file)
@@ -346,7 +362,8 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages, int pro
 			       shadow->mmo_shadowed = newmmobj;
 			       (shadow)->mmo_un.mmo_bottom_obj = newmmobj;
 			       newmmobj->mmo_ops->ref(newmmobj);
-     			       newarea->vma_obj = shadow;       			       
+     			       newarea->vma_obj = shadow;
+     			       list_insert_tail(mmobj_bottom_vmas(shadow), &newarea->vma_olink);
        			       }
        			       }
 			}
@@ -360,6 +377,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages, int pro
 			        if(newmmobj==NULL)
 			                return -1;
       			       newarea->vma_obj = newmmobj;
+      			       list_insert_tail(mmobj_bottom_vmas(newmmobj), &newarea->vma_olink);
        			       newmmobj->mmo_ops->ref(newmmobj);
 			}
 			
@@ -383,7 +401,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages, int pro
 			newarea->vma_end = lopage+npages;
 			newarea->vma_off = off;
 			newarea->vma_prot = prot;
-			newarea->vma_flags = flags;
+			newarea->vma_flags = flags | (file ? 0 : MAP_ANON);
 			/*not adding mmobj to cloned vmareas*/
 			vmmap_insert(map, newarea);
 			if(file)
@@ -399,7 +417,8 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages, int pro
 			       shadow->mmo_shadowed = newmmobj;
 			       (shadow)->mmo_un.mmo_bottom_obj = newmmobj;
 			       newmmobj->mmo_ops->ref(newmmobj);
-       			       newarea->vma_obj = shadow;       			       
+       			       newarea->vma_obj = shadow;
+       			       list_insert_tail(mmobj_bottom_vmas(shadow), &newarea->vma_olink);
        			       }
        			       }
 			}
@@ -413,6 +432,7 @@ vmmap_map(vmmap_t *map, vnode_t *file, uint32_t lopage, uint32_t npages, int pro
 			        if(newmmobj==NULL)
 			                return -1;
 				newarea->vma_obj=newmmobj;
+				list_insert_tail(mmobj_bottom_vmas(newmmobj), &newarea->vma_olink);
 				newmmobj->mmo_ops->ref(newmmobj);
 			}
 		}
@@ -474,8 +494,10 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 				vmmap_insert(map, newvma);
 				newvma->vma_obj = area->vma_obj;
 				newvma->vma_flags = area->vma_flags;
-				if(newvma->vma_obj)
+				if(newvma->vma_obj){
 				        (newvma->vma_obj->mmo_ops->ref)(newvma->vma_obj);
+				        list_insert_tail(mmobj_bottom_vmas(newvma->vma_obj), &newvma->vma_olink);
+				}
 				
 				/*Doubt at this point revisit later*/
 				
@@ -490,6 +512,11 @@ vmmap_remove(vmmap_t *map, uint32_t lopage, uint32_t npages)
 				area->vma_start = lopage+npages;
 			}else if (area->vma_start >= lopage && area->vma_end <= lopage+npages){
 				list_remove(&(area->vma_plink));
+				shadowd_chain_changed(area);
+				area->vma_obj->mmo_ops->put(area->vma_obj);
+				/* also takes it off the bottom object's list, so
+				 * pageout no longer unmaps pages through it */
+				vmarea_free(area);
 			}
 			else
 			{
@@ -520,7 +547,7 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
         if(!list_empty(&(map->vmm_list))){
                 vmarea_t *area;
                 list_iterate_begin(&(map->vmm_list), area, vmarea_t, vma_plink){
-                        if(area->vma_start > endvfn || area->vma_end <= startvfn){
+                        if(area->vma_start >= endvfn || area->vma_end <= startvfn){
                                 i=1;
                         }else{
 				i=0;
@@ -533,6 +560,45 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
         return i;
 }
 
+/*
+ * Finds the frame holding page vfn of map, as a fault on it would. For
+ * writing the page is dirtied, and if map is the current address space
+ * the entry for the page is replaced: it may still map the frame of an
+ * object further down the shadow chain, which must no longer be seen.
+ */
+static int
+vmmap_lookup_frame(vmmap_t *map, uint32_t vfn, int forwrite, pframe_t **pf)
+{
+        vmarea_t *vma;
+        int ret;
+
+        if (NULL == (vma = vmmap_lookup(map, vfn))) {
+                return -EFAULT;
+        }
+        *pf = NULL;
+        ret = pframe_lookup(vma->vma_obj, vfn - vma->vma_start + vma->vma_off, forwrite, pf);
+        if (ret < 0 || NULL == *pf) {
+                return (ret < 0) ? ret : -EFAULT;
+        }
+        if (forwrite) {
+                if ((ret = pframe_dirty(*pf)) < 0) {
+                        return ret;
+                }
+                if (NULL != curproc && map == curproc->p_vmmap) {
+                        if (vma->vma_prot & PROT_WRITE) {
+                                pt_map(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(vfn),
+                                       pt_virt_to_phys((uintptr_t) (*pf)->pf_addr),
+                                       PD_PRESENT | PD_WRITE | PD_USER,
+                                       PT_PRESENT | PT_WRITE | PT_USER);
+                        } else {
+                                pt_unmap(curproc->p_pagedir, (uintptr_t) PN_TO_ADDR(vfn));
+                        }
+                        tlb_flush((uintptr_t) PN_TO_ADDR(vfn));
+                }
+        }
+        return 0;
+}
+
 /* Read into 'buf' from the virtual address space of 'map' starting at
  * 'vaddr' for size 'count'. To do so, you will want to find the vmareas
  * to read from, then find the pframes within those vmareas corresponding
@@ -544,37 +610,20 @@ vmmap_is_range_empty(vmmap_t *map, uint32_t startvfn, uint32_t npages)
 int
 vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
 {
-	/*MOHIT: TODO revisit this function later*/
-	uint32_t vfn = ADDR_TO_PN(vaddr);
-        uint32_t size = count/PAGE_SIZE==0?1:count%PAGE_SIZE==0?count/PAGE_SIZE:(count/PAGE_SIZE)+1;
-        int i=0;
+        size_t done = 0;
 
-        /*First iterate through the list to get correct vmareas*/
-         if(!list_empty(&(map->vmm_list))){
-                vmarea_t *area;
-                pframe_t *frame;
-                while(size>0){
-                        area = vmmap_lookup(map,vfn);
-                        if(!area){
-                                return -EFAULT;
-                        }
-                        /*pframe_lookup(area->vma_obj,vfn,1,&frame);*/
-                        pframe_get(area->vma_obj,vfn,&frame);
-                        if(frame){
-                                char *charBuf = (char*)buf;
-                                memcpy(charBuf+i*PAGE_SIZE,frame->pf_addr,count-i*PAGE_SIZE);
-                                i+=PAGE_SIZE;
-                                size--;
-                                vfn+=1;
-                        }else{
-                                return -EFAULT;
-                        }
-                }
-        }else{
-                return -EFAULT;
-        }        
+        while (done < count) {
+                uintptr_t addr = (uintptr_t) vaddr + done;
+                size_t n = MIN(count - done, PAGE_SIZE - PAGE_OFFSET(addr));
+                pframe_t *pf;
+                int ret;
 
-        /*NOT_YET_IMPLEMENTED("VM: vmmap_read");*/
+                if ((ret = vmmap_lookup_frame(map, ADDR_TO_PN(addr), 0, &pf)) < 0) {
+                        return ret;
+                }
+                memcpy((char *) buf + done, (char *) pf->pf_addr + PAGE_OFFSET(addr), n);
+                done += n;
+        }
         return 0;
 }
 
@@ -589,39 +638,48 @@ vmmap_read(vmmap_t *map, const void *vaddr, void *buf, size_t count)
 int
 vmmap_write(vmmap_t *map, void *vaddr, const void *buf, size_t count)
 {
-	/*MOHIT: TODO revisit this function again*/
-		
-	uint32_t vfn = ADDR_TO_PN(vaddr);
-	uint32_t size = count/PAGE_SIZE==0?1:count%PAGE_SIZE==0?count/PAGE_SIZE:(count/PAGE_SIZE)+1;
-	int i=0;
-	
-	/*First iterate through the list to get correct vmareas*/
-	 if(!list_empty(&(map->vmm_list))){
-                vmarea_t *area;
-		pframe_t *frame;
-                while(size>0){
-			area = vmmap_lookup(map,vfn);
-			if(!area){
-				return -EFAULT;
-			}
-			/*pframe_lookup(area->vma_obj,vfn,1,&frame);*/
-			pframe_get(area->vma_obj,vfn,&frame);
-			if(frame){
-				char *charBuf = (char*)buf;
-				memcpy(frame->pf_addr,charBuf+i*PAGE_SIZE,count-i*PAGE_SIZE);
-				i+=PAGE_SIZE;
-				size--;
-				vfn+=1;
-			}else{
-				return -EFAULT;
-			}
-		}
-	}else{
-		return -EFAULT;
-	}	
-	
-	
-        /*NOT_YET_IMPLEMENTED("VM: vmmap_write");*/
+        size_t done = 0;
+
+        while (done < count) {
+                uintptr_t addr = (uintptr_t) vaddr + done;
+                size_t n = MIN(count - done, PAGE_SIZE - PAGE_OFFSET(addr));
+                pframe_t *pf;
+                int ret;
+
+                if ((ret = vmmap_lookup_frame(map, ADDR_TO_PN(addr), 1, &pf)) < 0) {
+                        return ret;
+                }
+                memcpy((char *) pf->pf_addr + PAGE_OFFSET(addr), (const char *) buf + done, n);
+                done += n;
+        }
+        return 0;
+}
+
+/*
+ * Finds the frame a user access to the page containing vaddr would
+ * reach and pins it, so that the caller can do I/O straight into or out
+ * of it even if it blocks: sys_read has the file system fill the user's
+ * frames directly instead of going through a kernel buffer. The area
+ * must allow the access (PROT_WRITE if forwrite, PROT_READ otherwise).
+ * The data for vaddr is at pf_addr + PAGE_OFFSET(vaddr); unpin the
+ * frame with pframe_unpin when done.
+ * Returns 0 on success, -errno on error.
+ */
+int
+vmmap_pin_user_page(vmmap_t *map, const void *vaddr, int forwrite, pframe_t **pf)
+{
+        vmarea_t *vma;
+        int ret;
+
+        if ((uintptr_t) vaddr < USER_MEM_LOW || (uintptr_t) vaddr >= USER_MEM_HIGH
+            || NULL == (vma = vmmap_lookup(map, ADDR_TO_PN(vaddr)))
+            || !(vma->vma_prot & (forwrite ? PROT_WRITE : PROT_READ))) {
+                return -EFAULT;
+        }
+        if ((ret = vmmap_lookup_frame(map, ADDR_TO_PN(vaddr), forwrite, pf)) < 0) {
+                return ret;
+        }
+        pframe_pin(*pf);
         return 0;
 }
 
@@ -3,13 +3,23 @@ import math
 import struct
 
 S5_MAGIC = 0x727f
-S5_CURRENT_VERSION = 3
+S5_CURRENT_VERSION = 4
+S5_OLDEST_VERSION = 3
+
+# s5s_state, see s5fs.h
+S5_STATE_CLEAN = 1
+S5_STATE_DIRTY = 2
 S5_BLOCK_SIZE = 4096
 
 S5_NBLKS_PER_FNODE = 30
+S5_BITS_PER_BLOCK = S5_BLOCK_SIZE * 8
 S5_NDIRECT_BLOCKS = 28
 S5_MAX_FILE_BLOCKS = S5_NDIRECT_BLOCKS + math.floor(S5_BLOCK_SIZE / 4)
 S5_MAX_FILE_SIZE = S5_MAX_FILE_BLOCKS * S5_BLOCK_SIZE
+S5_NIDIRECT_BLOCKS = S5_BLOCK_SIZE / 4
+# with S5_FLAG_DINDIRECT the last direct block is the double indirect
+# block; the size limit is then the one of the 32 bit size field
+S5_MAX_DINDIRECT_FILE_SIZE = 0xffffffff
 
 S5_NAME_LEN = 28
 S5_DIRENT_SIZE = S5_NAME_LEN + 4
@@ -23,6 +33,35 @@ S5_TYPE_DIR = 0x2
 S5_TYPE_CHR = 0x4
 S5_TYPE_BLK = 0x8
 S5_TYPES = set([ S5_TYPE_FREE, S5_TYPE_DATA, S5_TYPE_DIR, S5_TYPE_CHR, S5_TYPE_BLK ])
+S5_TYPE_MASK = 0xff
+
+S5_FLAG_HASHED = 0x100
+S5_FLAG_DINDIRECT = 0x200
+S5_FLAG_INLINE = 0x400
+
+# small data files keep their contents in place of the direct blocks
+S5_INLINE_SIZE = S5_NDIRECT_BLOCKS * 4
+
+# the metadata journal, see s5fs.h
+S5_JOURNAL_MAGIC = 0x4a524e4c
+S5_JDESC_MAGIC = 0x4a444553
+S5_JCOMMIT_MAGIC = 0x4a434d54
+S5_JTAG_REVOKE = 0x80000000
+S5_JOURNAL_NTAGS = (S5_BLOCK_SIZE - 12) / 4
+S5_JOURNAL_TXN_MAX = 64
+S5_JOURNAL_MIN_BLOCKS = S5_JOURNAL_TXN_MAX + 3
+S5_JOURNAL_MAX_BLOCKS = S5_JOURNAL_NTAGS - S5_JOURNAL_TXN_MAX
+
+# hashed directories, see s5fs.h
+S5_DIR_NBUCKETS = 512
+S5_DIR_NINDEXED = 64
+S5_DIRHASH_SIZE = S5_DIR_NINDEXED / 8
+
+def name_bucket(name):
+    h = 2166136261
+    for c in name:
+        h = ((h ^ ord(c)) * 16777619) & 0xffffffff
+    return h % S5_DIR_NBUCKETS
 
 class S5fsException(Exception):
 
@@ -68,7 +107,10 @@ class Block:
             self._simdisk._simfile.write('\0')
 
     def free(self):
-        if (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
+        if (self._simdisk.get_version() >= S5_CURRENT_VERSION):
+            self._simdisk._bitmap_set(self._blockno, False)
+            self._simdisk.set_nfree_blocks(self._simdisk.get_nfree_blocks() + 1)
+        elif (self._simdisk.get_nfree() < S5_NBLKS_PER_FNODE - 1):
             self._simdisk.set_free_block(self._simdisk.get_nfree(), self._blockno)
             self._simdisk.set_nfree(self._simdisk.get_nfree() + 1)
         else:
@@ -120,13 +162,66 @@ class Inode:
         self._simfile.write(struct.pack("I", val))
 
     def get_type(self):
+        return self._get_type_field() & S5_TYPE_MASK
+
+    def set_type(self, val):
+        self._set_type_field(val)
+
+    def get_flags(self):
+        return self._get_type_field() & ~S5_TYPE_MASK
+
+    def set_flags(self, val):
+        self._set_type_field(self.get_type() | val)
+
+    def _get_type_field(self):
         self._simfile.seek(int(self._offset + 8))
         return struct.unpack("H", self._simfile.read(2))[0]
 
-    def set_type(self, val):
+    def _set_type_field(self, val):
         self._simfile.seek(int(self._offset + 8))
         self._simfile.write(struct.pack("H", val))
 
+    def is_hashed(self):
+        return self.get_type() == S5_TYPE_DIR and (self.get_flags() & S5_FLAG_HASHED) != 0
+
+    def is_dindirect(self):
+        return self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ]) and (self.get_flags() & S5_FLAG_DINDIRECT) != 0
+
+    def get_ndirect(self):
+        return S5_NDIRECT_BLOCKS - 1 if self.is_dindirect() else S5_NDIRECT_BLOCKS
+
+    def get_max_size(self):
+        return S5_MAX_DINDIRECT_FILE_SIZE if self.is_dindirect() else S5_MAX_FILE_SIZE
+
+    def _init_flags(self):
+        """Gives a new file or directory the flags new ones get on this disk"""
+        flags = 0
+        if (self.get_type() == S5_TYPE_DIR and self._simdisk.get_version() >= S5_CURRENT_VERSION):
+            flags |= S5_FLAG_HASHED
+        if (self._simdisk.get_version() >= S5_CURRENT_VERSION):
+            flags |= S5_FLAG_DINDIRECT
+        if (self.get_type() == S5_TYPE_DATA and self._simdisk.get_version() >= S5_CURRENT_VERSION):
+            flags |= S5_FLAG_INLINE
+        self.set_flags(flags)
+
+    def is_inline(self):
+        return self.get_type() == S5_TYPE_DATA and (self.get_flags() & S5_FLAG_INLINE) != 0
+
+    def _spill(self):
+        """Moves an inline file's data out to a block"""
+        data = self.read()
+        self.set_flags(self.get_flags() & ~S5_FLAG_INLINE)
+        self._simfile.seek(int(self._offset + 12))
+        self._simfile.write('\0' * S5_INLINE_SIZE)
+        if (len(data) > 0):
+            self.write(0, data)
+
+    def get_dirent_base(self):
+        return S5_BLOCK_SIZE if self.is_hashed() else 0
+
+    def get_dirent_bytes(self):
+        return self.get_size() - self.get_dirent_base()
+
     def get_link_count(self):
         self._simfile.seek(int(self._offset + 10))
         return struct.unpack("h", self._simfile.read(2))[0]
@@ -157,6 +252,9 @@ class Inode:
         self._simfile.seek(int(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS))
         self._simfile.write(struct.pack("I", val))
 
+    def get_dindirect_blockno(self):
+        return self.get_direct_blockno(S5_NDIRECT_BLOCKS - 1) if self.is_dindirect() else 0
+
     def get_type_str(self, short=False):
         t = self.get_type()
         name = "INV" if short else "INVALID"
@@ -176,50 +274,146 @@ class Inode:
         res = ""
         res += "num:   {0}{1}\n".format(self.get_number(), "" if self.get_number() == self._number else " (INVALID, should be {0})".format(self.get_number()))
         res += "type:  {0}\n".format(self.get_type_str())
+        flags = []
+        if (self.is_hashed()):
+            flags.append("hashed")
+        if (self.is_dindirect()):
+            flags.append("double indirect")
+        if (self.is_inline()):
+            flags.append("inline")
+        if (len(flags) > 0):
+            res += "flags: {0}\n".format(", ".join(flags))
         if (self.get_type() != S5_TYPE_FREE):
             res += "links: {0}\n".format(self.get_link_count())
         if (self.get_type() in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             res += "size:  {0} bytes".format(self.get_size())
-            if (self.get_size() > S5_MAX_FILE_SIZE):
-                res += " (INVALID, max file size is {0})".format(S5_MAX_FILE_SIZE)
-            elif (self.get_type() == S5_TYPE_DIR and self.get_size() % S5_DIRENT_SIZE != 0):
+            if (self.get_size() > self.get_max_size()):
+                res += " (INVALID, max file size is {0})".format(self.get_max_size())
+            elif (self.get_type() == S5_TYPE_DIR and (self.get_dirent_bytes() < 0 or self.get_dirent_bytes() % S5_DIRENT_SIZE != 0)):
                 res += " (INVALID, directory size must be multiple of dirent size ({0}))".format(S5_DIRENT_SIZE)
             elif (self.get_type() == S5_TYPE_DIR):
-                res += " ({0} dirents)".format(self.get_size() / S5_DIRENT_SIZE)
+                res += " ({0} dirents)".format(self.get_dirent_bytes() / S5_DIRENT_SIZE)
             res += "\n"
-            res += "direct blocks ({0}):\n".format(S5_NDIRECT_BLOCKS)
-            for i in xrange(S5_NDIRECT_BLOCKS):
+            if (self.is_inline()):
+                if (self.get_size() > S5_INLINE_SIZE):
+                    res += "(INVALID, inline files hold at most {0} bytes)\n".format(S5_INLINE_SIZE)
+                res = res[:-1]
+                return res
+            res += "direct blocks ({0}):\n".format(self.get_ndirect())
+            for i in xrange(self.get_ndirect()):
                 res += " {0:5}".format(self.get_direct_blockno(i))
                 if ((i + 1) % 4 == 0):
                     res += "\n"
             if (res[-1] != "\n"):
                 res += "\n"
             res += "indirect block: {0}\n".format(self.get_indirect_blockno())
+            if (self.is_dindirect()):
+                res += "double indirect block: {0}\n".format(self.get_dindirect_blockno())
         elif (self.get_type() == S5_TYPE_FREE):
             res += "next free: {0}\n".format(self.get_next_free())
         res = res[:-1]
         return res
 
+    def _read_pointer(self, pos):
+        self._simfile.seek(int(pos))
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def _write_pointer(self, pos, val):
+        self._simfile.seek(int(pos))
+        self._simfile.write(struct.pack("I", val))
+
+    def _get_indirect(self, pos, index, alloc):
+        """Returns the indirect block pointed to from disk offset 'pos' on
+        the way to block 'index' of the file, allocating it if it is
+        sparse and alloc is set, otherwise returning None for it."""
+        blockno = self._read_pointer(pos)
+        if (blockno != 0):
+            return self._simdisk.get_block(blockno)
+        if (not alloc):
+            return None
+        block = self._simdisk.alloc_block(self._block_goal(index))
+        block.zero()
+        self._write_pointer(pos, block.get_blockno())
+        return block
+
+    def _pointer_offset(self, index, alloc=False):
+        """Returns the disk offset of the pointer to block 'index' of the
+        file, or None if an indirect block on the way there is sparse and
+        alloc is not set."""
+        blockloc = index
+        ndirect = self.get_ndirect()
+        if (index < ndirect):
+            return self._offset + 12 + index * 4
+        index -= ndirect
+        if (index < S5_NIDIRECT_BLOCKS):
+            indirect = self._get_indirect(self._offset + 12 + 4 * S5_NDIRECT_BLOCKS, blockloc, alloc)
+            return None if indirect == None else indirect._offset + index * 4
+        index -= S5_NIDIRECT_BLOCKS
+        if (not self.is_dindirect() or index >= S5_NIDIRECT_BLOCKS * S5_NIDIRECT_BLOCKS):
+            raise S5fsException("block {0} is past the end of the largest file inode {1} can hold".format(blockloc, self._number))
+        dindirect = self._get_indirect(self._offset + 12 + 4 * (S5_NDIRECT_BLOCKS - 1), blockloc, alloc)
+        if (dindirect == None):
+            return None
+        indirect = self._get_indirect(dindirect._offset + (index / S5_NIDIRECT_BLOCKS) * 4, blockloc, alloc)
+        return None if indirect == None else indirect._offset + (index % S5_NIDIRECT_BLOCKS) * 4
+
+    def get_blockno(self, index):
+        """Returns the disk block holding block 'index' of the file, or 0
+        if that block is sparse (or the file is inline)."""
+        if (self.is_inline()):
+            return 0
+        pos = self._pointer_offset(index)
+        return 0 if pos == None else self._read_pointer(pos)
+
+    def _alloc_blockno(self, index):
+        """Like get_blockno, but allocates a zeroed block if it is sparse"""
+        pos = self._pointer_offset(index, alloc=True)
+        blockno = self._read_pointer(pos)
+        if (blockno == 0):
+            block = self._simdisk.alloc_block(self._block_goal(index))
+            block.zero()
+            blockno = block.get_blockno()
+            self._write_pointer(pos, blockno)
+        return blockno
+
+    def get_fragments(self):
+        """Returns how many runs of consecutive disk blocks the file's
+        blocks (the indirect block aside) are in, and how many blocks
+        there are."""
+        frags = 0
+        nblocks = 0
+        prev = 0
+        for i in xrange(int(math.ceil(float(self.get_size()) / S5_BLOCK_SIZE))):
+            blockno = self.get_blockno(i)
+            if (blockno == 0):
+                continue
+            if (blockno != prev + 1):
+                frags += 1
+            nblocks += 1
+            prev = blockno
+        return (frags, nblocks)
+
+    def _block_goal(self, index):
+        if (index == 0):
+            return 0
+        prev = self.get_blockno(index - 1)
+        return prev + 1 if prev != 0 else 0
+
     def read(self, offset=0, size=None):
         if (size == None):
             size = self.get_size()
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot read from inode of type " + self.get_type_str())
-        size = min(size, min(S5_MAX_FILE_SIZE, self.get_size()) - offset)
+        size = min(size, min(self.get_max_size(), self.get_size()) - offset)
+        if (self.is_inline()):
+            self._simfile.seek(int(self._offset + 12 + offset))
+            return self._simfile.read(max(size, 0))
         res = ""
         while (size > 0):
             blockno = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, size)
-            if (blockno < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockno)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno -= S5_NDIRECT_BLOCKS
-                    blockno = struct.unpack("I", indirect.read(blockno * 4, 4))[0]
+            blockno = self.get_blockno(int(blockno))
             if (blockno == 0):
                 for i in xrange(ammount):
                     res += '\0'
@@ -232,34 +426,21 @@ class Inode:
     def write(self, offset, data):
         if (self.get_type() not in set([ S5_TYPE_DATA, S5_TYPE_DIR ])):
             raise S5fsException("cannot write to inode of type " + self.get_type_str())
-        if (offset + len(data) > S5_MAX_FILE_SIZE):
-            raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), S5_MAX_FILE_SIZE))
+        if (offset + len(data) > self.get_max_size()):
+            raise S5fsException("cannot write up to byte {0}, max file size is {1}".format(offset + len(data), self.get_max_size()))
+        if (self.is_inline()):
+            if (offset + len(data) <= S5_INLINE_SIZE):
+                self._simfile.seek(int(self._offset + 12 + offset))
+                self._simfile.write(data)
+                self.set_size(max(self.get_size(), offset + len(data)))
+                return
+            self._spill()
         remaining = len(data)
         while (remaining > 0):
             blockloc = math.floor(offset / S5_BLOCK_SIZE)
             blockoff = offset % S5_BLOCK_SIZE
             ammount = min(S5_BLOCK_SIZE - blockoff, remaining)
-            if (blockloc < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(blockloc)
-            else:
-                if (self.get_indirect_blockno() == 0):
-                    indirect = self._simdisk.alloc_block()
-                    indirect.zero()
-                    self.set_indirect_blockno(indirect.get_blockno())
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((blockloc - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno == 0):
-                block = self._simdisk.alloc_block()
-                block.zero()
-                if (blockloc < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(blockloc, block.get_blockno())
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((blockloc - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", block.get_blockno()))
-            else:
-                block = self._simdisk.get_block(blockno)
+            block = self._simdisk.get_block(self._alloc_blockno(int(blockloc)))
             if (remaining == ammount):
                 block.write(blockoff, data[-remaining:])
             else:
@@ -270,46 +451,51 @@ class Inode:
             self.set_size(offset)
 
     def truncate(self, size=0):
-        target = math.floor((size - 1) / S5_BLOCK_SIZE)
-        curr = math.floor(self.get_size() / S5_BLOCK_SIZE)
-        while (curr > target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                blockno = self.get_direct_blockno(curr)
+        if (self.is_inline()):
+            if (size > S5_INLINE_SIZE):
+                self._spill()
             else:
-                if (self.get_indirect_blockno() == 0):
-                    blockno = 0
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    blockno = struct.unpack("I", indirect.read((curr - S5_NDIRECT_BLOCKS) * 4, 4))[0]
-            if (blockno > 0):
-                block = self._simdisk.get_block(blockno)
-                block.free()
-                if (curr < S5_NDIRECT_BLOCKS):
-                    self.set_direct_blockno(curr, 0)
-                else:
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
-                    if (curr == S5_NDIRECT_BLOCKS):
-                        indirect.free()
-                        self.set_indirect_blockno(0)
-            curr -= 1
-        while (curr < target):
-            if (curr < S5_NDIRECT_BLOCKS):
-                self.set_direct_blockno(0)
-            else:
-                if (self.get_indirect_blockno() != 0):
-                    indirect = self._simdisk.get_block(self.get_indirect_blockno())
-                    indirect.write((curr - S5_NDIRECT_BLOCKS) * 4, struct.pack("I", 0))
+                self._simfile.seek(int(self._offset + 12 + size))
+                self._simfile.write('\0' * (S5_INLINE_SIZE - size))
+                self.set_size(size)
+                return
+        keep = int(math.ceil(float(size) / S5_BLOCK_SIZE))
+        nblocks = int(math.ceil(float(self.get_size()) / S5_BLOCK_SIZE))
+        for index in xrange(keep, nblocks):
+            pos = self._pointer_offset(index)
+            if (pos != None and self._read_pointer(pos) != 0):
+                self._simdisk.get_block(self._read_pointer(pos)).free()
+                self._write_pointer(pos, 0)
+        self._free_indirect(keep)
         self.set_size(size)
 
+    def _free_indirect(self, keep):
+        """Frees the indirect blocks only needed for blocks from 'keep' on"""
+        ndirect = self.get_ndirect()
+        if (keep <= ndirect and self.get_indirect_blockno() != 0):
+            self._simdisk.get_block(self.get_indirect_blockno()).free()
+            self.set_indirect_blockno(0)
+        if (self.get_dindirect_blockno() == 0):
+            return
+        first = ndirect + S5_NIDIRECT_BLOCKS
+        dindirect = self._simdisk.get_block(self.get_dindirect_blockno())
+        for i in xrange(S5_NIDIRECT_BLOCKS):
+            pos = dindirect._offset + i * 4
+            if (self._read_pointer(pos) != 0 and first + i * S5_NIDIRECT_BLOCKS >= keep):
+                self._simdisk.get_block(self._read_pointer(pos)).free()
+                self._write_pointer(pos, 0)
+        if (keep <= first):
+            dindirect.free()
+            self.set_direct_blockno(S5_NDIRECT_BLOCKS - 1, 0)
+
     def _find_dirent(self, name, types=S5_TYPES):
         if (self.get_type() != S5_TYPE_DIR):
             raise S5fsException("cannot remove directory entry in non-directory inode of type " + self.get_type_str())
-        if (self.get_size() % S5_DIRENT_SIZE != 0):
+        if (self.get_dirent_bytes() % S5_DIRENT_SIZE != 0):
             raise S5fsException("cannot remove directory entry, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
         if (len(name) >= S5_NAME_LEN):
             raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
-        for i in xrange(0, self.get_size(), S5_DIRENT_SIZE):
+        for i in xrange(self.get_dirent_base(), self.get_size(), S5_DIRENT_SIZE):
             inode = struct.unpack("I", self.read(i, 4))[0]
             parts = self.read(i + 4, S5_NAME_LEN).split('\0', 1)
             if (len(parts) == 1):
@@ -355,28 +541,61 @@ class Inode:
     def _make_dirent(self, inode, name):
         if (self.get_type() != S5_TYPE_DIR):
             raise S5fsException("cannot create directory entry in non-directory inode of type " + self.get_type_str())
-        if (self.get_size() % S5_DIRENT_SIZE != 0):
+        if (self.get_dirent_bytes() % S5_DIRENT_SIZE != 0):
             raise S5fsException("cannot create directory entry, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
         if (len(name) >= S5_NAME_LEN):
             raise S5fsException("directroy entry name '{0}' too long, limit is {1} characters".format(name, S5_NAME_LEN - 1))
         empty = -1
-        for i in xrange(0, self.get_size(), S5_DIRENT_SIZE):
+        for i in xrange(self.get_dirent_base(), self.get_size(), S5_DIRENT_SIZE):
             direntname = self.read(i + 4, S5_NAME_LEN).split('\0', 1)[0]
             if (direntname == name):
                 raise S5fsException("directory already has entry with same name: {0}".format(name))
             if (len(name) == 0):
                 empty = i
-        if (empty >= 0):
-            self.write(empty, struct.pack("I", inode))
-            self.write(empty + 4, name.ljust(S5_NAME_LEN, '\0'))
-        else:
-            self.write(self.get_size(), struct.pack("I", inode))
-            self.write(self.get_size(), name.ljust(S5_NAME_LEN, '\0'))
+        if (empty < 0):
+            empty = self.get_size()
+        if (self.is_hashed()):
+            self._mark_dirhash(empty, name_bucket(name))
+        self.write(empty, struct.pack("I", inode))
+        self.write(empty + 4, name.ljust(S5_NAME_LEN, '\0'))
+
+    def _get_dirhash(self, bucket):
+        return struct.unpack("II", self.read(bucket * S5_DIRHASH_SIZE, S5_DIRHASH_SIZE))
+
+    def _mark_dirhash(self, offset, bucket):
+        blk = (offset - S5_BLOCK_SIZE) / S5_BLOCK_SIZE
+        if (blk < S5_DIR_NINDEXED):
+            words = list(self._get_dirhash(bucket))
+            words[blk / 32] |= 1 << (blk % 32)
+            self.write(bucket * S5_DIRHASH_SIZE, struct.pack("II", *words))
+
+    def check_dirhash(self):
+        """Returns a list of the names in a hashed directory which its
+        index does not lead to."""
+        res = []
+        if (not self.is_hashed()):
+            return res
+        if (self.get_size() < S5_BLOCK_SIZE):
+            return [ "<directory is smaller than its index>" ]
+        for dirent in self.getdents():
+            blk = (dirent._offset - S5_BLOCK_SIZE) / S5_BLOCK_SIZE
+            if (blk >= S5_DIR_NINDEXED):
+                continue
+            words = self._get_dirhash(name_bucket(dirent.name))
+            if (not words[blk / 32] & (1 << (blk % 32))):
+                res.append(dirent.name)
+        return res
+
+    def _init_dir(self):
+        self.set_type(S5_TYPE_DIR)
+        self._init_flags()
+        self.set_size(S5_BLOCK_SIZE if self.is_hashed() else 0)
 
     def create(self, name):
-        inode = self._simdisk.alloc_inode()
+        inode = self._simdisk.alloc_inode(near=self._number)
         try:
             inode.set_type(S5_TYPE_DATA)
+            inode._init_flags()
             inode.set_size(0)
             inode.set_link_count(1)
             for i in xrange(S5_NDIRECT_BLOCKS):
@@ -389,14 +608,13 @@ class Inode:
             raise e
 
     def mkdir(self, name):
-        inode = self._simdisk.alloc_inode()
+        inode = self._simdisk.alloc_inode(near=self._number)
         try:
-            inode.set_type(S5_TYPE_DIR)
-            inode.set_size(0)
-            inode.set_link_count(1)
             for i in xrange(S5_NDIRECT_BLOCKS):
                 inode.set_direct_blockno(i, 0)
             inode.set_indirect_blockno(0)
+            inode._init_dir()
+            inode.set_link_count(1)
             inode._make_dirent(inode.get_number(), ".")
             inode._make_dirent(self.get_number(), "..")
             self.set_link_count(self.get_link_count() + 1)
@@ -409,14 +627,14 @@ class Inode:
     def getdents(self):
         if (self.get_type() != S5_TYPE_DIR):
             raise S5fsException("cannot get dirents from inode of type " + self.get_type_str())
-        if (self.get_size() % S5_DIRENT_SIZE != 0):
+        if (self.get_dirent_bytes() % S5_DIRENT_SIZE != 0):
             raise S5fsException("cannot get dirents, inode has size {0} not a multiple of dirent size {1}".format(self.get_size(), S5_DIRENT_SIZE))
-        for i in xrange(0, self.get_size(), S5_DIRENT_SIZE):
+        for i in xrange(self.get_dirent_base(), self.get_size(), S5_DIRENT_SIZE):
             inode = struct.unpack("I", self.read(i, 4))[0]
             name = self.read(i + 4, S5_NAME_LEN)
             parts = name.split('\0', 1)
             if (len(parts) == 1):
-                raise S5fsException("directory entry {0} in inode {1} does not contain a null character".format(i / S5_DIRENT_SIZE, self._number))
+                raise S5fsException("directory entry {0} in inode {1} does not contain a null character".format((i - self.get_dirent_base()) / S5_DIRENT_SIZE, self._number))
             name = parts[0]
             if (len(name) > 0):
                 yield Dirent(self, inode, name, i)
@@ -462,8 +680,13 @@ class Inode:
         if (self.get_size() != 0):
             self.truncate()
         self.set_type(S5_TYPE_FREE)
-        self.set_next_free(self._simdisk.get_free_inode())
-        self._simdisk.set_free_inode(self._number)
+        if (self._simdisk.get_version() >= S5_CURRENT_VERSION):
+            self.set_next_free(0)
+            self._simdisk._ibitmap_set(self._number, False)
+            self._simdisk.set_nfree_inodes(self._simdisk.get_nfree_inodes() + 1)
+        else:
+            self.set_next_free(self._simdisk.get_free_inode())
+            self._simdisk.set_free_inode(self._number)
 
 class Simdisk:
 
@@ -536,13 +759,297 @@ class Simdisk:
         self._simfile.seek(20 + 4 * S5_NBLKS_PER_FNODE)
         self._simfile.write(struct.pack("I", val))
 
+    def get_num_blocks(self):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_num_blocks(self, val):
+        self._simfile.seek(24 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_block(self):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_block(self, val):
+        self._simfile.seek(28 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_bitmap_nblocks(self):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_bitmap_nblocks(self, val):
+        self._simfile.seek(32 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_nfree_blocks(self):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_nfree_blocks(self, val):
+        self._simfile.seek(36 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_ibitmap_block(self):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_ibitmap_block(self, val):
+        self._simfile.seek(40 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_ibitmap_nblocks(self):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_ibitmap_nblocks(self, val):
+        self._simfile.seek(44 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_nfree_inodes(self):
+        self._simfile.seek(48 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_nfree_inodes(self, val):
+        self._simfile.seek(48 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_block(self):
+        self._simfile.seek(52 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_block(self, val):
+        self._simfile.seek(52 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_journal_nblocks(self):
+        self._simfile.seek(56 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_journal_nblocks(self, val):
+        self._simfile.seek(56 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def get_state(self):
+        self._simfile.seek(60 + 4 * S5_NBLKS_PER_FNODE)
+        return struct.unpack("I", self._simfile.read(4))[0]
+
+    def set_state(self, val):
+        self._simfile.seek(60 + 4 * S5_NBLKS_PER_FNODE)
+        self._simfile.write(struct.pack("I", val))
+
+    def _journal_size(self, blocks):
+        """The journal size format and migrate pick for a disk of
+        'blocks' blocks: a sixteenth of it, within the limits."""
+        return max(S5_JOURNAL_MIN_BLOCKS, min(S5_JOURNAL_MAX_BLOCKS, int(blocks / 16)))
+
+    def _init_journal(self, seq=1):
+        """Writes an empty journal header. The journal must be in place
+        (get_journal_block)."""
+        block = self.get_block(self.get_journal_block())
+        block.zero()
+        block.write(0, struct.pack("II", S5_JOURNAL_MAGIC, seq))
+
+    def get_journal(self):
+        """Returns the committed transactions in the journal, as a list
+        of (sequence number, journal block, tags), where a tag is a
+        home block number, or one with S5_JTAG_REVOKE set"""
+        res = []
+        start = self.get_journal_block()
+        nblocks = self.get_journal_nblocks()
+        magic, seq = struct.unpack("II", self.get_block(start).read(0, 8))
+        if (magic != S5_JOURNAL_MAGIC):
+            raise S5fsException("journal header has a bad magic number 0x{0:08x}".format(magic))
+        pos = 1
+        while (pos + 2 <= nblocks):
+            # blocks past the end of the simdisk file read short
+            desc = self.get_block(start + pos)
+            magic, dseq, ntags = struct.unpack("III", desc.read(0, 12).ljust(12, "\0"))
+            if (magic != S5_JDESC_MAGIC or dseq != seq or ntags > S5_JOURNAL_NTAGS):
+                break
+            tags = list(struct.unpack("{0}I".format(ntags), desc.read(12, 4 * ntags)))
+            ndata = len([ tag for tag in tags if not (tag & S5_JTAG_REVOKE) ])
+            if (pos + ndata + 2 > nblocks):
+                break
+            magic, cseq, cntags = struct.unpack("III", self.get_block(start + pos + ndata + 1).read(0, 12).ljust(12, "\0"))
+            if (magic != S5_JCOMMIT_MAGIC or cseq != seq or cntags != ntags):
+                break
+            res.append((seq, pos, tags))
+            pos += ndata + 2
+            seq += 1
+        return res
+
+    def replay_journal(self):
+        """Copies the committed transactions in the journal home, as
+        mounting does, and empties it. Returns how many there were."""
+        txns = self.get_journal()
+        if (len(txns) == 0):
+            return 0
+        start = self.get_journal_block()
+        revoked = {}
+        for seq, pos, tags in txns:
+            for tag in tags:
+                if (tag & S5_JTAG_REVOKE):
+                    revoked[tag & ~S5_JTAG_REVOKE] = seq
+        for seq, pos, tags in txns:
+            data = pos + 1
+            for tag in tags:
+                if (tag & S5_JTAG_REVOKE):
+                    continue
+                if (revoked.get(tag, 0) < seq):
+                    self.get_block(tag).write(0, self.get_block(start + data).read())
+                data += 1
+        self._init_journal(txns[-1][0] + 1)
+        return len(txns)
+
+    def _ibitmap_test(self, num):
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_ibitmap_block() + num / 8)
+        return (ord(self._simfile.read(1)) & (1 << (num % 8))) != 0
+
+    def _ibitmap_set(self, num, used):
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_ibitmap_block() + num / 8)
+        byte = ord(self._simfile.read(1))
+        if (used):
+            byte |= 1 << (num % 8)
+        else:
+            byte &= ~(1 << (num % 8))
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_ibitmap_block() + num / 8)
+        self._simfile.write(chr(byte))
+
+    def _init_ibitmap(self, free):
+        """Lays out an inode bitmap with only the inodes in 'free' clear.
+        The bitmap must be in place (get_ibitmap_block)."""
+        data = bytearray([ 0xff ]) * (self.get_ibitmap_nblocks() * S5_BLOCK_SIZE)
+        for num in free:
+            data[num / 8] &= ~(1 << (num % 8))
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_ibitmap_block())
+        self._simfile.write(str(data))
+        self.set_nfree_inodes(len(free))
+        self.set_free_inode(0xffffffff)
+
+    def _bitmap_offset(self, blockno):
+        return S5_BLOCK_SIZE * self.get_bitmap_block() + blockno / 8
+
+    def _bitmap_test(self, blockno):
+        self._simfile.seek(self._bitmap_offset(blockno))
+        return (ord(self._simfile.read(1)) & (1 << (blockno % 8))) != 0
+
+    def _bitmap_set(self, blockno, used):
+        self._simfile.seek(self._bitmap_offset(blockno))
+        byte = ord(self._simfile.read(1))
+        if (used):
+            byte |= 1 << (blockno % 8)
+        else:
+            byte &= ~(1 << (blockno % 8))
+        self._simfile.seek(self._bitmap_offset(blockno))
+        self._simfile.write(chr(byte))
+
+    def _init_bitmap(self, blocks, free):
+        """Lays out a free block bitmap covering 'blocks' blocks with
+        only the blocks in 'free' clear. The bitmap itself must be in
+        place (get_bitmap_block) and its blocks not in 'free'."""
+        nblocks = self.get_bitmap_nblocks()
+        data = bytearray([ 0xff ]) * (nblocks * S5_BLOCK_SIZE)
+        for num in free:
+            data[num / 8] &= ~(1 << (num % 8))
+        self._simfile.seek(S5_BLOCK_SIZE * self.get_bitmap_block())
+        self._simfile.write(str(data))
+        self.set_num_blocks(blocks)
+        self.set_nfree_blocks(len(free))
+        self.set_nfree(0)
+        for i in xrange(S5_NBLKS_PER_FNODE - 1):
+            self.set_free_block(i, 0)
+        self.set_last_free_block(0xffffffff)
+
+    def get_size_blocks(self):
+        self._simfile.seek(0, os.SEEK_END)
+        return int(self._simfile.tell() / S5_BLOCK_SIZE)
+
+    def _free_list_blocks(self):
+        """Returns the set of blocks on a version 3 disk's free list"""
+        res = set()
+        for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
+            res.add(self.get_free_block(i))
+        num = self.get_last_free_block()
+        while (num != 0xffffffff):
+            if (num in res):
+                raise S5fsException("free block list goes round in a loop at block {0}".format(num))
+            res.add(num)
+            block = self.get_block(num)
+            for i in xrange(S5_NBLKS_PER_FNODE - 1):
+                res.add(struct.unpack("I", block.read(i * 4, 4))[0])
+            num = struct.unpack("I", block.read((S5_NBLKS_PER_FNODE - 1) * 4, 4))[0]
+        return res
+
+    def migrate(self):
+        """Makes a version 3 disk a current version one. Its free block
+        list is turned into a bitmap, then the free inode list into an
+        inode bitmap, and a journal is added. Each goes in the first run
+        of free blocks long enough to hold it. Files already on the disk
+        keep their layout."""
+        if (self.get_version() >= S5_CURRENT_VERSION):
+            raise S5fsException("disk is already version {0}".format(self.get_version()))
+
+        blocks = self.get_size_blocks()
+        nblocks = int((blocks + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
+        # old versions of format put the last inode block on the
+        # free list, it is not free
+        iblocks = int(math.floor((self.get_num_inodes() - 1) / S5_INODES_PER_BLOCK) + 1)
+        free = set(num for num in self._free_list_blocks() if num > iblocks)
+        start = self._find_run(free, nblocks)
+        for i in xrange(nblocks):
+            free.remove(start + i)
+        self.set_bitmap_block(start)
+        self.set_bitmap_nblocks(nblocks)
+        self._init_bitmap(blocks, free)
+
+        nblocks = int((self.get_num_inodes() + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK)
+        free = set(num for num in xrange(self.get_num_blocks()) if not self._bitmap_test(num))
+        start = self._find_run(free, nblocks)
+        for i in xrange(nblocks):
+            self._bitmap_set(start + i, True)
+        self.set_nfree_blocks(self.get_nfree_blocks() - nblocks)
+        self.set_ibitmap_block(start)
+        self.set_ibitmap_nblocks(nblocks)
+        self._init_ibitmap(set(num for num in xrange(self.get_num_inodes()) if self.get_inode(num).get_type() == S5_TYPE_FREE))
+
+        nblocks = self._journal_size(self.get_num_blocks())
+        free = set(num for num in xrange(self.get_num_blocks()) if not self._bitmap_test(num))
+        start = self._find_run(free, nblocks)
+        for i in xrange(nblocks):
+            self._bitmap_set(start + i, True)
+        self.set_nfree_blocks(self.get_nfree_blocks() - nblocks)
+        self.set_journal_block(start)
+        self.set_journal_nblocks(nblocks)
+        self._init_journal()
+
+        self.set_state(S5_STATE_CLEAN)
+        self.set_version(S5_CURRENT_VERSION)
+
+    def _find_run(self, free, nblocks):
+        for num in sorted(free):
+            if (all((num + i) in free for i in xrange(nblocks))):
+                return num
+        raise S5fsException("no run of {0} free blocks to put the bitmap or journal in".format(nblocks))
+
     def get_super_block_summary(self):
         res = ""
         res += "magic:      0x{0:04x} ({1})\n".format(self.get_magic(), "VALID" if self.get_magic() == S5_MAGIC else "INVALID")
-        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if self.get_version() == S5_CURRENT_VERSION else " (INVALID)")
+        res += "version:    0x{0:04x}{1}\n".format(self.get_version(), "" if S5_OLDEST_VERSION <= self.get_version() <= S5_CURRENT_VERSION else " (INVALID)")
         res += "num inodes: {0}\n".format(self.get_num_inodes())
-        res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
+        if (self.get_version() < S5_CURRENT_VERSION):
+            res += "free inode: {0}{1}\n".format(self.get_free_inode(), "" if self.get_free_inode() < self.get_num_inodes() else " (INVALID)")
         res += "root inode: {0}{1}\n".format(self.get_root_inode(), "" if self.get_root_inode() < self.get_num_inodes() else " (INVALID)")
+        if (self.get_version() >= S5_CURRENT_VERSION):
+            res += "num blocks: {0}\n".format(self.get_num_blocks())
+            res += "bitmap:     {0} blocks from block {1}\n".format(self.get_bitmap_nblocks(), self.get_bitmap_block())
+            res += "free blocks: {0}\n".format(self.get_nfree_blocks())
+            res += "inode bitmap: {0} blocks from block {1}\n".format(self.get_ibitmap_nblocks(), self.get_ibitmap_block())
+            res += "free inodes: {0}\n".format(self.get_nfree_inodes())
+            res += "journal:    {0} blocks from block {1}\n".format(self.get_journal_nblocks(), self.get_journal_block())
+            res += "state:      {0}\n".format("clean" if self.get_state() == S5_STATE_CLEAN else "dirty (will be checked when mounted)")
+            return res
         res += "free blocks ({0}{1}):\n".format(self.get_nfree(), "" if self.get_nfree() <= S5_NBLKS_PER_FNODE else (", too large shouldn't exceed " + str(S5_NBLKS_PER_FNODE)))
         for i in xrange(min(self.get_nfree(), S5_NBLKS_PER_FNODE - 1)):
             res += "  {0}".format(self.get_free_block(i))
@@ -553,7 +1060,9 @@ class Simdisk:
         res += "  last free block: {0}\n".format(self.get_last_free_block())
         return res
 
-    def format(self, inodes, size):
+    def format(self, inodes, size, version=S5_CURRENT_VERSION, journal=None):
+        if (version < S5_OLDEST_VERSION or version > S5_CURRENT_VERSION):
+            raise S5fsException("cannot format disk as version {0}, only versions {1} to {2} are supported".format(version, S5_OLDEST_VERSION, S5_CURRENT_VERSION))
         if (inodes < 1):
             raise S5fsException("cannot format disk with {0} inodes, must have at least one".format(inodes))
         if (size % S5_BLOCK_SIZE != 0):
@@ -562,12 +1071,15 @@ class Simdisk:
         iblocks = int(math.floor((inodes - 1) / S5_INODES_PER_BLOCK) + 1)
         if (iblocks + 1 >= blocks):
             raise S5fsException("cannot format disk of size {0} with {1} inodes, the inodes require at least {2} bytes of space".format(size, inodes, (1 + iblocks) * S5_BLOCK_SIZE))
+        # writing the last byte makes the image the full size of the
+        # disk, so the emulator does not see a disk cut short at the
+        # last block in use
         self._simfile.truncate()
-        self._simfile.seek(size)
-        self._simfile.write("")
+        self._simfile.seek(size - 1)
+        self._simfile.write("\0")
 
         self.set_magic(S5_MAGIC)
-        self.set_version(S5_CURRENT_VERSION)
+        self.set_version(version)
         self.set_num_inodes(inodes)
         for i in xrange(inodes):
             inode = self.get_inode(i)
@@ -577,9 +1089,34 @@ class Simdisk:
         inode.set_next_free(0xffffffff)
         self.set_free_inode(0)
 
+        self._rotor = 0
+        if (version >= S5_CURRENT_VERSION):
+            # superblock, inodes, bitmap, inode bitmap, journal, data
+            self.set_bitmap_block(iblocks + 1)
+            self.set_bitmap_nblocks(int((blocks + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK))
+            datastart = iblocks + 1 + self.get_bitmap_nblocks()
+            self.set_ibitmap_block(datastart)
+            self.set_ibitmap_nblocks(int((inodes + S5_BITS_PER_BLOCK - 1) / S5_BITS_PER_BLOCK))
+            datastart += self.get_ibitmap_nblocks()
+            if (journal == None):
+                journal = self._journal_size(blocks)
+            if (journal < S5_JOURNAL_MIN_BLOCKS or journal > S5_JOURNAL_MAX_BLOCKS):
+                raise S5fsException("cannot format disk with a journal of {0} blocks, must be {1} to {2}".format(journal, S5_JOURNAL_MIN_BLOCKS, S5_JOURNAL_MAX_BLOCKS))
+            self.set_journal_block(datastart)
+            self.set_journal_nblocks(journal)
+            datastart += journal
+            if (datastart >= blocks):
+                raise S5fsException("cannot format disk of size {0} with {1} inodes, no room left for data".format(size, inodes))
+            self._init_bitmap(blocks, set(xrange(datastart, blocks)))
+            for i in xrange(inodes):
+                self.get_inode(i).set_next_free(0)
+            self._init_ibitmap(set(xrange(inodes)))
+            self._init_journal()
+            self.set_state(S5_STATE_CLEAN)
+
         self.set_last_free_block(0xffffffff)
         i = 0
-        for num in xrange(iblocks, blocks):
+        for num in xrange(iblocks, blocks if version < S5_CURRENT_VERSION else 0):
             if (i == S5_NBLKS_PER_FNODE - 1):
                 block = self.get_block(num)
                 for j in xrange(S5_NBLKS_PER_FNODE - 1):
@@ -590,26 +1127,31 @@ class Simdisk:
             else:
                 self.set_free_block(i, num)
                 i += 1
-        self.set_nfree(i)
+        if (version < S5_CURRENT_VERSION):
+            self.set_nfree(i)
 
         root = self.alloc_inode()
         for i in xrange(S5_NDIRECT_BLOCKS):
             root.set_direct_blockno(i, 0)
         root.set_indirect_blockno(0)
-        root.set_type(S5_TYPE_DIR)
-        root.set_size(0)
+        root._init_dir()
         root.set_link_count(1)
         root._make_dirent(root.get_number(), ".")
         root._make_dirent(root.get_number(), "..")
         root.set_link_count(1)
 
     def free_inodes(self):
+        if (self.get_version() >= S5_CURRENT_VERSION):
+            for num in xrange(self.get_num_inodes()):
+                if (not self._ibitmap_test(num)):
+                    yield num
+            return
         inext = self.get_free_inode()
         while (inext != 0xffffffff):
             try:
                 curr = self.get_inode(inext)
                 yield inext
-                inext = curr.get_free_inode()
+                inext = curr.get_next_free()
             except S5fsException as e:
                 raise S5fsException("error encountered while iterating free inodes: {0}".format(str(e)))
 
@@ -619,7 +1161,22 @@ class Simdisk:
             raise S5fsException("cannot get inode {0}, there are only {1} inodes on disk".format(index, self.get_num_inodes()))
         return Inode(self, index, offset)
 
-    def alloc_inode(self):
+    def _alloc_inode_bitmap(self, near):
+        """Takes the first free inode from the block inode 'near' is in on"""
+        if (self.get_nfree_inodes() == 0):
+            raise S5fsException("disk is out of inodes")
+        inodes = self.get_num_inodes()
+        goal = near - near % S5_INODES_PER_BLOCK if near < inodes else 0
+        for num in range(goal, inodes) + range(0, goal):
+            if (not self._ibitmap_test(num)):
+                self._ibitmap_set(num, True)
+                self.set_nfree_inodes(self.get_nfree_inodes() - 1)
+                return self.get_inode(num)
+        raise S5fsException("disk is out of inodes")
+
+    def alloc_inode(self, near=0):
+        if (self.get_version() >= S5_CURRENT_VERSION):
+            return self._alloc_inode_bitmap(near)
         if (self.get_free_inode() == 0xffffffff):
             raise S5fsException("disk is out of inodes")
         inode = self.get_inode(self.get_free_inode())
@@ -630,7 +1187,23 @@ class Simdisk:
         offset = S5_BLOCK_SIZE * index
         return Block(self, offset, index)
 
-    def alloc_block(self):
+    def _alloc_block_bitmap(self, goal):
+        if (self.get_nfree_blocks() == 0):
+            raise S5fsDiskSpaceException()
+        blocks = self.get_num_blocks()
+        if (goal == 0 or goal >= blocks):
+            goal = getattr(self, "_rotor", 0) % blocks
+        for num in range(goal, blocks) + range(0, goal):
+            if (not self._bitmap_test(num)):
+                self._bitmap_set(num, True)
+                self.set_nfree_blocks(self.get_nfree_blocks() - 1)
+                self._rotor = num + 1
+                return self.get_block(num)
+        raise S5fsDiskSpaceException()
+
+    def alloc_block(self, goal=0):
+        if (self.get_version() >= S5_CURRENT_VERSION):
+            return self._alloc_block_bitmap(goal)
         if (self.get_nfree() > S5_NBLKS_PER_FNODE - 1):
             raise S5fsException("nfree {0} is invalid, maximum value is {1}".format(self.get_nfree(), S5_NBLKS_PER_FNODE - 1))
         if (self.get_nfree() == 0):
@@ -70,6 +70,19 @@ class FsmakerShell(cmd.Cmd):
                                       help="number of inodes to put on the disk, this must be specified and be compatible with the size of the disk (there must be enough space for the inodes)")
         self._parse_format.add_option("-d", "--directory", action="store", type="str", default=None,
                                       help="initializes the disk with the contents of the specified directory")
+        self._parse_format.add_option("-v", "--version", action="store", type="int", default=api.S5_CURRENT_VERSION,
+                                      help="disk format version (defaults to %default); version {0} has no bitmaps, journal or hashed directories".format(api.S5_OLDEST_VERSION))
+        self._parse_format.add_option("-j", "--journal", action="store", type="int", default=None,
+                                      help="journal size in blocks, from version {0} on (defaults to a sixteenth of the disk)".format(api.S5_CURRENT_VERSION))
+
+        self._parse_migrate = OptionParser(usage="usage: %prog", prog="migrate", description="makes a version {0} disk a version {1} disk, replacing its free block and inode lists with bitmaps and adding a journal".format(api.S5_OLDEST_VERSION, api.S5_CURRENT_VERSION))
+        self._parse_journal = OptionParser(usage="usage: %prog", prog="journal", description="lists the committed transactions in the journal, which mounting the disk would replay")
+        self._parse_journal.add_option("-r", "--replay", action="store_true", default=False,
+                                       help="copies the transactions home and empties the journal, as mounting does")
+
+        self._parse_frag = OptionParser(usage="usage: %prog [files...]", prog="frag", description="prints how many runs of consecutive blocks files are stored in, for every file on the disk if none are given")
+
+        self._parse_check = OptionParser(usage="usage: %prog", prog="check", description="checks that the index of every hashed directory on the disk leads to all of its entries")
 
     def open(self, path, create=False):
         if (path.startswith("/")):
@@ -648,7 +661,7 @@ class FsmakerShell(cmd.Cmd):
                 size = options.size
             else:
                 size = options.blocks * api.S5_BLOCK_SIZE
-            self._simdisk.format(options.inodes, size)
+            self._simdisk.format(options.inodes, size, version=options.version, journal=options.journal)
 
         if (options.directory):
             q = Queue.Queue()
@@ -668,6 +681,181 @@ class FsmakerShell(cmd.Cmd):
                     dest = self.open(os.path.join("/", curr), create=True)
                     self.getfile(source, dest)
 
+    def do_migrate(self, args):
+        try:
+            (options, args) = self._parse_migrate.parse_args(shlex.split(args))
+        except ValueError as e:
+            self._parse_migrate.error(str(e))
+            return
+
+        if (len(args) != 0):
+            self._parse_migrate.error("command does not take arguments")
+            return
+        try:
+            self._simdisk.migrate()
+        except api.S5fsException as e:
+            self._parse_migrate.error(str(e))
+
+    def help_migrate(self):
+        self._parse_migrate.print_help()
+
+    def complete_migrate(self, text, line, begidx, endidx):
+        return []
+
+    def do_journal(self, args):
+        try:
+            (options, args) = self._parse_journal.parse_args(shlex.split(args))
+        except ValueError as e:
+            self._parse_journal.error(str(e))
+            return
+
+        if (len(args) != 0):
+            self._parse_journal.error("command does not take arguments")
+            return
+        if (self._simdisk.get_version() < api.S5_CURRENT_VERSION):
+            self._parse_journal.error("disk is version {0}, which has no journal".format(self._simdisk.get_version()))
+            return
+        try:
+            if (options.replay):
+                print("replayed {0} transactions".format(self._simdisk.replay_journal()))
+                return
+            txns = self._simdisk.get_journal()
+            for seq, pos, tags in txns:
+                blocks = [ str(tag) for tag in tags if not (tag & api.S5_JTAG_REVOKE) ]
+                revoked = [ str(tag & ~api.S5_JTAG_REVOKE) for tag in tags if (tag & api.S5_JTAG_REVOKE) ]
+                print("transaction {0} at block {1}: {2}{3}".format(seq, pos, " ".join(blocks) if blocks else "no blocks",
+                                                                   (", revokes " + " ".join(revoked)) if revoked else ""))
+            print("{0} committed transactions".format(len(txns)))
+        except api.S5fsException as e:
+            self._parse_journal.error(str(e))
+
+    def help_journal(self):
+        self._parse_journal.print_help()
+
+    def complete_journal(self, text, line, begidx, endidx):
+        return []
+
+    def _all_files(self):
+        seen = set()
+        q = Queue.Queue()
+        q.put(("/", self._simdisk.get_inode(self._simdisk.get_root_inode())))
+        while (not q.empty()):
+            path, inode = q.get()
+            if (inode.get_number() in seen):
+                continue
+            seen.add(inode.get_number())
+            yield path, inode
+            if (inode.get_type() == api.S5_TYPE_DIR):
+                for dirent in inode.getdents():
+                    if (dirent.name != "." and dirent.name != ".."):
+                        q.put((os.path.join(path, dirent.name), self._simdisk.get_inode(dirent.inode)))
+
+    def do_frag(self, args):
+        try:
+            (options, args) = self._parse_frag.parse_args(shlex.split(args))
+        except ValueError as e:
+            self._parse_frag.error(str(e))
+            return
+
+        try:
+            if (len(args) != 0):
+                for arg in args:
+                    inode = self.open(arg)
+                    if (inode == None):
+                        self._parse_frag.error("no such file or directory: {0}".format(arg))
+                        continue
+                    frags, nblocks = inode.get_fragments()
+                    print("{0}: {1} blocks in {2} fragments".format(arg, nblocks, frags))
+                return
+            nfiles = 0
+            nfrags = 0
+            nblocks = 0
+            nsplit = 0
+            for path, inode in self._all_files():
+                if (inode.get_type() != api.S5_TYPE_DATA):
+                    continue
+                frags, blocks = inode.get_fragments()
+                nfiles += 1
+                nfrags += frags
+                nblocks += blocks
+                if (frags > 1):
+                    nsplit += 1
+            print("{0} files, {1} blocks in {2} fragments, {3} files in more than one".format(nfiles, nblocks, nfrags, nsplit))
+        except api.S5fsException as e:
+            self._parse_frag.error(str(e))
+
+    def help_frag(self):
+        self._parse_frag.print_help()
+
+    def complete_frag(self, text, line, begidx, endidx):
+        return self.filepath_completion(text, line, begidx, endidx, types=set([ api.S5_TYPE_DATA ]))
+
+    def do_check(self, args):
+        try:
+            (options, args) = self._parse_check.parse_args(shlex.split(args))
+        except ValueError as e:
+            self._parse_check.error(str(e))
+            return
+
+        if (len(args) != 0):
+            self._parse_check.error("command does not take arguments")
+            return
+        ndirs = 0
+        nhashed = 0
+        nbad = 0
+        seen = set()
+        q = Queue.Queue()
+        q.put(("/", self._simdisk.get_inode(self._simdisk.get_root_inode())))
+        while (not q.empty()):
+            path, inode = q.get()
+            if (inode.get_number() in seen):
+                continue
+            seen.add(inode.get_number())
+            ndirs += 1
+            try:
+                if (inode.is_hashed()):
+                    nhashed += 1
+                    for name in inode.check_dirhash():
+                        print("{0}: '{1}' is missing from the directory index".format(path, name))
+                        nbad += 1
+                for dirent in inode.getdents():
+                    if (dirent.name != "." and dirent.name != ".."):
+                        child = self._simdisk.get_inode(dirent.inode)
+                        if (child.get_type() == api.S5_TYPE_DIR):
+                            q.put((os.path.join(path, dirent.name), child))
+            except api.S5fsException as e:
+                print("{0}: {1}".format(path, str(e)))
+                nbad += 1
+        if (self._simdisk.get_version() >= api.S5_CURRENT_VERSION):
+            nfree = 0
+            for num in xrange(self._simdisk.get_num_inodes()):
+                free = self._simdisk.get_inode(num).get_type() == api.S5_TYPE_FREE
+                if (free):
+                    nfree += 1
+                if (free == self._simdisk._ibitmap_test(num)):
+                    print("inode {0} is {1} but marked {2} in the inode bitmap".format(num, "free" if free else "in use", "used" if free else "free"))
+                    nbad += 1
+            if (nfree != self._simdisk.get_nfree_inodes()):
+                print("superblock says {0} inodes are free, there are {1}".format(self._simdisk.get_nfree_inodes(), nfree))
+                nbad += 1
+        if (self._simdisk.get_version() >= api.S5_CURRENT_VERSION):
+            try:
+                ntxns = len(self._simdisk.get_journal())
+                if (ntxns):
+                    print("journal holds {0} committed transactions, the disk is as of before them (see journal -r)".format(ntxns))
+            except api.S5fsException as e:
+                print("journal: {0}".format(str(e)))
+                nbad += 1
+        if (self._simdisk.get_version() >= api.S5_CURRENT_VERSION and self._simdisk.get_state() != api.S5_STATE_CLEAN):
+            print("disk was not unmounted cleanly, mounting it will check it")
+        print("checked {0} directories ({1} hashed), found {2} problems".format(ndirs, nhashed, nbad))
+
+    def help_check(self):
+        self._parse_check.print_help()
+
+    def complete_check(self, text, line, begidx, endidx):
+        return []
+
     def default(self, line):
         if (line.strip() == "EOF"):
             print("\n")
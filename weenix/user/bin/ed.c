@@ -1458,6 +1458,8 @@ putd()
         putchar(r + '0');
 #else
         printf("%d", count[1]);
+        /* the rest of ed writes to the terminal itself */
+        fflush(stdout);
 #endif
 }
 
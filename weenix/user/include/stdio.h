@@ -5,8 +5,13 @@
 #include "stdarg.h"
 #include "sys/types.h"
 
-/* Output not buffered */
-#define __IONBF 1
+/* Buffering modes for setvbuf */
+#define _IOFBF  0       /* write when the buffer fills up */
+#define _IOLBF  1       /* ... or a newline is written */
+#define _IONBF  2       /* write straight away */
+
+#define BUFSIZ          4096
+#define FOPEN_MAX       20
 
 #ifndef EOF
 #define EOF     (-1)
@@ -16,8 +21,23 @@
 #define NULL    0
 #endif
 
-/* For now, just store a file descriptor */
-typedef int FILE;
+/* A stream's buffer holds either input read ahead of the caller or
+ * output not yet written, never both; switching from one to the other
+ * flushes it. stdin and stdout are line buffered (there is no way to
+ * ask whether a descriptor is a terminal, so they are assumed to be),
+ * stderr is unbuffered and streams from fopen and fdopen are fully
+ * buffered. */
+typedef struct __file {
+        int             _fd;    /* file descriptor */
+        int             _flags; /* __S* in stream.c, 0 if the slot is free */
+        int             _mode;  /* _IOFBF, _IOLBF or _IONBF */
+        unsigned char  *_buf;   /* the buffer, allocated on first use */
+        size_t          _size;  /* size of _buf (0 for the default) */
+        unsigned char  *_p;     /* next byte of input in _buf */
+        int             _r;     /* bytes of input left at _p */
+        int             _w;     /* bytes of output waiting at _buf */
+        unsigned char   _ubuf;  /* buffer of an unbuffered stream */
+} FILE;
 typedef off_t fpos_t;
 extern FILE *stdin;
 extern FILE *stdout;
@@ -34,7 +54,29 @@ int sprintf(char *buf, const char *fmt, ...)
         __attribute__((__format__(printf, 2, 3)))
         __attribute__((__nonnull__(2)));
 
+FILE *fopen(const char *path, const char *mode);
+FILE *fdopen(int fd, const char *mode);
+int fclose(FILE *stream);
+int fileno(FILE *stream);
+
+/* fflush(NULL) flushes every stream; exit, fork and execve do that
+ * so nothing is lost or written twice */
 int fflush(FILE *stream);
+int setvbuf(FILE *stream, char *buf, int mode, size_t size);
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *stream);
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *stream);
+int fgetc(FILE *stream);
+int fputc(int c, FILE *stream);
+int fputs(const char *s, FILE *stream);
+
+/* getc takes the next byte straight from the buffer when it can */
+#define getc(f) (0 < (f)->_r ? ((f)->_r--, (int) *(f)->_p++) : fgetc(f))
+#define putc(c, f) fputc((c), (f))
+
+int feof(FILE *stream);
+int ferror(FILE *stream);
+void clearerr(FILE *stream);
 
 int vprintf(const char *fmt, va_list args)
         __attribute__((__format__(printf, 1, 0)))
@@ -56,6 +56,7 @@ int     stat(const char *path, struct stat *buf);
 /* VM-related */
 void    *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t off);
 int     munmap(void *addr, size_t len);
+int     madvise(void *addr, size_t len, int advice);
 int     brk(void *addr);
 void    *sbrk(int incr);
 
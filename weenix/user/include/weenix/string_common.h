@@ -0,0 +1 @@
+../../../kernel/include/util/string_common.h
\ No newline at end of file
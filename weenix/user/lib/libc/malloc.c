@@ -69,6 +69,7 @@ static int fdzero;
 #define INIT_MMAP() \
         { if ((fdzero = _open("/dev/zero", O_RDWR, 0000)) == -1) \
                         wrterror("open of /dev/zero"); }
+#define HAS_MADVISE
 #define MADV_FREE                       MADV_DONTNEED
 
 /*
@@ -192,7 +193,7 @@ static int suicide;
 static int malloc_realloc;
 
 /* pass the kernel a hint on free pages ?  */
-static int malloc_hint = 0;
+static int malloc_hint = 1;
 
 /* xmalloc behaviour ?  */
 static int malloc_xmalloc;
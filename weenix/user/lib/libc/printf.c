@@ -113,7 +113,7 @@ int vfprintf(FILE *stream, const char *fmt, va_list args)
         char buf[__LIBC_PRINTF_BUFSIZE];
         int ret = vsnprintf(buf, __LIBC_PRINTF_BUFSIZE, fmt, args);
         if (ret > 0) {
-                write(*stream, buf, ret);
+                fwrite(buf, 1, MIN(ret, __LIBC_PRINTF_BUFSIZE - 1), stream);
         }
         return ret;
 }
@@ -122,9 +122,3 @@ int vsprintf(char *buf, const char *fmt, va_list args)
 {
         return vsnprintf(buf, 0xffffffffUL, fmt, args);
 }
-
-int fflush(FILE *stream)
-{
-        /* no-op */
-        return 0;
-}
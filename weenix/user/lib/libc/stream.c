@@ -1,7 +1,348 @@
 #include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "errno.h"
+#include "fcntl.h"
+#include "unistd.h"
 
-static int stdstreams[3] = { 0, 1, 2 };
+#define __SRD   0x01    /* the buffer holds input */
+#define __SWR   0x02    /* the buffer holds output */
+#define __SEOF  0x04    /* hit end of file */
+#define __SERR  0x08    /* a read or write failed */
+#define __SMBF  0x10    /* _buf came from malloc */
+#define __SCANRD 0x20   /* opened for reading */
+#define __SCANWR 0x40   /* opened for writing */
 
-FILE *stdin = &stdstreams[0];
-FILE *stdout = &stdstreams[1];
-FILE *stderr = &stdstreams[2];
+static unsigned char stdinbuf[BUFSIZ];
+static unsigned char stdoutbuf[BUFSIZ];
+
+static FILE streams[FOPEN_MAX] = {
+        { 0, __SCANRD, _IOLBF, stdinbuf, BUFSIZ, NULL, 0, 0, 0 },
+        { 1, __SCANWR, _IOLBF, stdoutbuf, BUFSIZ, NULL, 0, 0, 0 },
+        { 2, __SCANWR, _IONBF, NULL, 0, NULL, 0, 0, 0 }
+};
+
+FILE *stdin = &streams[0];
+FILE *stdout = &streams[1];
+FILE *stderr = &streams[2];
+
+/* Gives the stream a buffer if it does not have one yet. If no memory
+ * can be had the stream just becomes unbuffered. */
+static void smakebuf(FILE *f)
+{
+        if (NULL != f->_buf)
+                return;
+        if (_IONBF != f->_mode) {
+                if (0 == f->_size)
+                        f->_size = BUFSIZ;
+                if (NULL != (f->_buf = (unsigned char *) malloc(f->_size))) {
+                        f->_flags |= __SMBF;
+                        return;
+                }
+                f->_mode = _IONBF;
+        }
+        f->_buf = &f->_ubuf;
+        f->_size = 1;
+}
+
+/* Writes all of buf, going round again after short writes */
+static int swrite(FILE *f, const unsigned char *buf, size_t n)
+{
+        int ret;
+
+        while (0 < n) {
+                if (0 > (ret = write(f->_fd, buf, n))) {
+                        f->_flags |= __SERR;
+                        return EOF;
+                }
+                buf += ret;
+                n -= ret;
+        }
+        return 0;
+}
+
+/* Writes out any buffered output */
+static int swflush(FILE *f)
+{
+        int n = f->_w;
+
+        f->_flags &= ~__SWR;
+        f->_w = 0;
+        return swrite(f, f->_buf, n);
+}
+
+/* Throws away input read ahead, moving the file offset back to
+ * where the caller thinks it is. */
+static void srdiscard(FILE *f)
+{
+        if (0 < f->_r)
+                (void) lseek(f->_fd, -f->_r, SEEK_CUR);
+        f->_flags &= ~__SRD;
+        f->_r = 0;
+}
+
+static FILE *sopen(int fd, const char *mode)
+{
+        FILE *f;
+
+        for (f = streams; f < streams + FOPEN_MAX; ++f) {
+                if (0 == f->_flags) {
+                        f->_fd = fd;
+                        f->_flags = ('r' == mode[0] ? __SCANRD : __SCANWR);
+                        if (NULL != strchr(mode, '+'))
+                                f->_flags |= __SCANRD | __SCANWR;
+                        f->_mode = _IOFBF;
+                        f->_buf = NULL;
+                        f->_size = 0;
+                        f->_p = NULL;
+                        f->_r = 0;
+                        f->_w = 0;
+                        return f;
+                }
+        }
+        errno = EMFILE;
+        return NULL;
+}
+
+FILE *fopen(const char *path, const char *mode)
+{
+        int flags, fd;
+        FILE *f;
+
+        switch (mode[0]) {
+                case 'r':
+                        flags = O_RDONLY;
+                        break;
+                case 'w':
+                        flags = O_WRONLY | O_CREAT | O_TRUNC;
+                        break;
+                case 'a':
+                        flags = O_WRONLY | O_CREAT | O_APPEND;
+                        break;
+                default:
+                        errno = EINVAL;
+                        return NULL;
+        }
+        if (NULL != strchr(mode, '+'))
+                flags = (flags & ~(O_WRONLY | O_RDONLY)) | O_RDWR;
+
+        if (0 > (fd = open(path, flags, 0)))
+                return NULL;
+        if (NULL == (f = sopen(fd, mode)))
+                close(fd);
+        return f;
+}
+
+FILE *fdopen(int fd, const char *mode)
+{
+        if ('r' != mode[0] && 'w' != mode[0] && 'a' != mode[0]) {
+                errno = EINVAL;
+                return NULL;
+        }
+        return sopen(fd, mode);
+}
+
+int fclose(FILE *f)
+{
+        int ret = 0;
+
+        if ((f->_flags & __SWR) && 0 != swflush(f))
+                ret = EOF;
+        if (0 > close(f->_fd))
+                ret = EOF;
+        if (f->_flags & __SMBF)
+                free(f->_buf);
+        f->_flags = 0;
+        f->_buf = NULL;
+        f->_r = 0;
+        return ret;
+}
+
+int fileno(FILE *f)
+{
+        return f->_fd;
+}
+
+int fflush(FILE *f)
+{
+        int ret = 0;
+
+        if (NULL == f) {
+                for (f = streams; f < streams + FOPEN_MAX; ++f) {
+                        if ((f->_flags & __SWR) && 0 != swflush(f))
+                                ret = EOF;
+                }
+                return ret;
+        }
+        if (f->_flags & __SWR)
+                return swflush(f);
+        return 0;
+}
+
+int setvbuf(FILE *f, char *buf, int mode, size_t size)
+{
+        if (_IOFBF != mode && _IOLBF != mode && _IONBF != mode)
+                return EOF;
+        if (0 != fflush(f))
+                return EOF;
+        if (f->_flags & __SRD)
+                srdiscard(f);
+        if (f->_flags & __SMBF)
+                free(f->_buf);
+        f->_flags &= ~__SMBF;
+        f->_mode = mode;
+        f->_buf = (unsigned char *) buf;
+        f->_size = (NULL == buf || _IONBF == mode) ? 0 : size;
+        if (_IONBF == mode)
+                f->_buf = NULL;
+        return 0;
+}
+
+size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *f)
+{
+        const unsigned char *p = ptr;
+        size_t total = size * nmemb, done = 0, n;
+
+        if (!(f->_flags & __SCANWR)) {
+                errno = EBADF;
+                f->_flags |= __SERR;
+                return 0;
+        }
+        if (0 == total)
+                return 0;
+        if (f->_flags & __SRD)
+                srdiscard(f);
+        smakebuf(f);
+        f->_flags |= __SWR;
+
+        while (done < total) {
+                if (0 == f->_w && (_IONBF == f->_mode || total - done >= f->_size)) {
+                        /* nothing to gain from copying it */
+                        if (0 != swrite(f, p + done, total - done))
+                                return done / size;
+                        done = total;
+                        break;
+                }
+                n = f->_size - f->_w;
+                if (n > total - done)
+                        n = total - done;
+                memcpy(f->_buf + f->_w, p + done, n);
+                f->_w += n;
+                done += n;
+                if ((size_t) f->_w == f->_size && 0 != swflush(f))
+                        return (done - n) / size;
+        }
+
+        if (_IOLBF == f->_mode && 0 < f->_w) {
+                for (n = total; 0 < n; --n) {
+                        if ('\n' == p[n - 1]) {
+                                if (0 != swflush(f))
+                                        return 0;
+                                break;
+                        }
+                }
+        }
+        return nmemb;
+}
+
+size_t fread(void *ptr, size_t size, size_t nmemb, FILE *f)
+{
+        unsigned char *p = ptr;
+        size_t total = size * nmemb, done = 0, n;
+        int ret;
+        FILE *o;
+
+        if (!(f->_flags & __SCANRD)) {
+                errno = EBADF;
+                f->_flags |= __SERR;
+                return 0;
+        }
+        if (0 == total)
+                return 0;
+        if ((f->_flags & __SWR) && 0 != swflush(f))
+                return 0;
+        smakebuf(f);
+        f->_flags |= __SRD;
+
+        while (done < total) {
+                if (0 < f->_r) {
+                        n = f->_r;
+                        if (n > total - done)
+                                n = total - done;
+                        memcpy(p + done, f->_p, n);
+                        f->_p += n;
+                        f->_r -= n;
+                        done += n;
+                        continue;
+                }
+
+                /* about to wait for input, which is likely an answer
+                 * to a prompt sitting in a line buffered stream */
+                if (_IOFBF != f->_mode) {
+                        for (o = streams; o < streams + FOPEN_MAX; ++o) {
+                                if (_IOLBF == o->_mode && (o->_flags & __SWR))
+                                        (void) swflush(o);
+                        }
+                }
+
+                if (total - done >= f->_size) {
+                        ret = read(f->_fd, p + done, total - done);
+                        if (0 < ret)
+                                done += ret;
+                } else {
+                        ret = read(f->_fd, f->_buf, f->_size);
+                        if (0 < ret) {
+                                f->_p = f->_buf;
+                                f->_r = ret;
+                        }
+                }
+                if (0 == ret) {
+                        f->_flags |= __SEOF;
+                        break;
+                } else if (0 > ret) {
+                        f->_flags |= __SERR;
+                        break;
+                }
+        }
+        return done / size;
+}
+
+int fgetc(FILE *f)
+{
+        unsigned char c;
+
+        if (0 < f->_r) {
+                f->_r--;
+                return *f->_p++;
+        }
+        return (1 == fread(&c, 1, 1, f)) ? c : EOF;
+}
+
+int fputc(int c, FILE *f)
+{
+        unsigned char ch = (unsigned char) c;
+
+        return (1 == fwrite(&ch, 1, 1, f)) ? ch : EOF;
+}
+
+int fputs(const char *s, FILE *f)
+{
+        size_t len = strlen(s);
+
+        return (len == fwrite(s, 1, len, f)) ? 0 : EOF;
+}
+
+int feof(FILE *f)
+{
+        return 0 != (f->_flags & __SEOF);
+}
+
+int ferror(FILE *f)
+{
+        return 0 != (f->_flags & __SERR);
+}
+
+void clearerr(FILE *f)
+{
+        f->_flags &= ~(__SEOF | __SERR);
+}
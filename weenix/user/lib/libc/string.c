@@ -3,27 +3,7 @@
 #include "string.h"
 #include "errno.h"
 
-int memcmp(const void *cs, const void *ct, size_t count)
-{
-        const unsigned char *su1, *su2;
-        signed char res = 0;
-
-        for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
-                if ((res = *su1 - *su2) != 0)
-                        break;
-        return res;
-}
-
-void *memcpy(void *dest, const void *src, size_t count)
-{
-        char *tmp = (char *) dest;
-        const char *s = src;
-
-        while (count--)
-                *tmp++ = *s++;
-
-        return dest;
-}
+#include "weenix/string_common.h"
 
 int strncmp(const char *cs, const char *ct, size_t count)
 {
@@ -38,18 +18,6 @@ int strncmp(const char *cs, const char *ct, size_t count)
         return __res;
 }
 
-int strcmp(const char *cs, const char *ct)
-{
-        register signed char __res;
-
-        while (1) {
-                if ((__res = *cs - *ct++) != 0 || !*cs++)
-                        break;
-        }
-
-        return __res;
-}
-
 char *strcpy(char *dest, const char *src)
 {
         char *tmp = dest;
@@ -69,16 +37,6 @@ char *strncpy(char *dest, const char *src, size_t count)
         return tmp;
 }
 
-void *memset(void *s, int c, size_t count)
-{
-        char *xs = (char *) s;
-
-        while (count--)
-                *xs++ = c;
-
-        return s;
-}
-
 size_t strnlen(const char *s, size_t count)
 {
         const char *sc;
@@ -101,23 +59,6 @@ char *strcat(char *dest, const char *src)
         return tmp;
 }
 
-size_t strlen(const char *s)
-{
-        const char *sc;
-
-        for (sc = s; *sc != '\0'; ++sc)
-                /* nothing */;
-        return sc - s;
-}
-
-char *strchr(const char *s, int c)
-{
-        for (; *s != (char) c; ++s)
-                if (*s == '\0')
-                        return NULL;
-        return (char *)s;
-}
-
 char *strrchr(const char *s, int c)
 {
         char *r = NULL;
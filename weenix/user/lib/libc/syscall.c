@@ -3,13 +3,20 @@
 
 #include "string.h"
 #include "stdlib.h"
+#include "stdio.h"
 
 #include "unistd.h"
 #include "weenix/trap.h"
 
 #include "dirent.h"
+#include "sys/resource.h"
 
+/* __curbrk is the break as sbrk() callers see it, __brklimit is the
+ * break the kernel really has. sbrk() moves the kernel's break in steps
+ * of SBRK_BATCH bytes and hands out the memory below it from here. */
 static void *__curbrk = NULL;
+static void *__brklimit = NULL;
+#define SBRK_BATCH      (64 * 4096)
 #define MAX_EXIT_HANDLERS 32
 
 static void     (*atexit_func[MAX_EXIT_HANDLERS])();
@@ -18,13 +25,16 @@ static int      atexit_handlers = 0;
 
 void *sbrk(intptr_t incr)
 {
-        uintptr_t oldbrk;
+        uintptr_t oldbrk, newbrk, batch;
+        void *kbrk;
 
         /* If we don't have a saved break, find it from the kernel */
         if (!__curbrk) {
                 if (0 > (long)(__curbrk = (void *) trap(SYS_brk, (uint32_t) NULL))) {
+                        __curbrk = NULL;
                         return (void *) -1;
                 }
+                __brklimit = __curbrk;
         }
 
         oldbrk = (uintptr_t) __curbrk;
@@ -32,15 +42,31 @@ void *sbrk(intptr_t incr)
         /* Increment or decrement the saved break */
 
         if (incr < 0) {
+                /* let the kernel check (and reclaim) a shrinking heap */
                 if ((uintptr_t) - incr > oldbrk) {
                         return (void *) -1;
                 } else if (brk((void *)(oldbrk - (uintptr_t) - incr)) < 0) {
                         return (void *) -1;
                 }
         } else if (incr > 0) {
-                if (brk((void *)(oldbrk + (uintptr_t) incr)) < 0) {
+                newbrk = oldbrk + (uintptr_t) incr;
+                if (newbrk < oldbrk) {
                         return (void *) -1;
                 }
+                if (newbrk > (uintptr_t) __brklimit) {
+                        /* take a whole batch if there is room for it,
+                         * otherwise just what was asked for */
+                        batch = (newbrk + SBRK_BATCH - 1) & ~(uintptr_t)(SBRK_BATCH - 1);
+                        kbrk = (void *) trap(SYS_brk, (uint32_t) batch);
+                        if (kbrk == (void *) -1) {
+                                kbrk = (void *) trap(SYS_brk, (uint32_t) newbrk);
+                        }
+                        if (kbrk == (void *) -1) {
+                                return (void *) -1;
+                        }
+                        __brklimit = kbrk;
+                }
+                __curbrk = (void *) newbrk;
         }
         return (void *) oldbrk;
 }
@@ -53,11 +79,14 @@ int brk(void *addr)
         if (newbrk == (void *) -1)
                 return -1;
         __curbrk = newbrk;
+        __brklimit = newbrk;
         return 0;
 }
 
 int fork(void)
 {
+        /* otherwise both processes would write what is buffered */
+        fflush(NULL);
         return trap(SYS_fork, 0);
 }
 
@@ -85,6 +114,7 @@ void exit(int status)
         while (atexit_handlers--) {
                 atexit_func[atexit_handlers]();
         }
+        fflush(NULL);
 
         _exit(status);
         exit(status); /* gcc doesn't realize that _exit() exits */
@@ -159,6 +189,17 @@ int munmap(void *addr, size_t len)
         return trap(SYS_munmap, (uint32_t) &args);
 }
 
+int madvise(void *addr, size_t len, int advice)
+{
+        madvise_args_t args;
+
+        args.addr = addr;
+        args.len = len;
+        args.advice = advice;
+
+        return trap(SYS_madvise, (uint32_t) &args);
+}
+
 void sync(void)
 {
         trap(SYS_sync, 0);
@@ -330,6 +371,7 @@ int execve(const char *filename, char *const argv[], char *const envp[])
 
         /* Note that we don't need to worry about freeing since we are going to exec
          * (so all our memory will be cleaned up) */
+        fflush(NULL);
 
         return trap(SYS_execve, (uint32_t) &args);
 }
@@ -401,6 +443,17 @@ uname(struct utsname *buf)
         return trap(SYS_uname, (uint32_t) buf);
 }
 
+int
+getrusage(int who, struct rusage *usage)
+{
+        getrusage_args_t args;
+
+        args.who = who;
+        args.usage = usage;
+
+        return trap(SYS_getrusage, (uint32_t) &args);
+}
+
 int
 debug(const char *str)
 {
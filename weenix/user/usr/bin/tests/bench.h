@@ -0,0 +1,52 @@
+#pragma once
+
+/* Shared by the benchmarks in usr/bin/tests: timing, reporting and
+ * the checks which decide whether a run passed. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/* The name the benchmark prints in front of its messages; main sets
+ * it before doing anything else. */
+static const char *bench_name = "bench";
+
+/* Timing for the benchmarks. There is no clock to ask the kernel for,
+ * so they count processor cycles; the low 32 bits of the time stamp
+ * counter are plenty for anything that finishes within a second or so. */
+static unsigned long bench_cycles(void)
+{
+        unsigned long lo, hi;
+        __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+        return lo;
+}
+
+/* Prints how long moving nbytes took, in thousands of cycles and in
+ * bytes per thousand cycles. */
+static void bench_report(const char *what, unsigned long nbytes, unsigned long cycles)
+{
+        unsigned long kcycles = cycles / 1000;
+        if (0 == kcycles)
+                kcycles = 1;
+        printf("%-32s %8lu kcycles %8lu bytes/kcycle\n", what, kcycles, nbytes / kcycles);
+}
+
+/* Prints how long each of n operations took, in cycles. */
+static void bench_report_each(const char *what, unsigned long cycles, unsigned long n)
+{
+        printf("%-32s %8lu cycles each\n", what, cycles / n);
+}
+
+/* A system call the benchmark depends on failed, so the run fails. */
+static void check_failed(const char *what)
+{
+        (void) printf("%s: %s failed: errno %d\n", bench_name, what, errno);
+        exit(1);
+}
+
+/* Something the benchmark checks came back wrong, so the run fails. */
+static void bench_fail(const char *what)
+{
+        (void) printf("%s: %s\n", bench_name, what);
+        exit(1);
+}
@@ -0,0 +1,99 @@
+/*
+ * Writes a file bigger than a single indirect block can map, so that
+ * its end is reached through the double indirect block, checks that
+ * all of it is there, and reads it back in order and at scattered
+ * offsets, checking every byte. The
+ * in-order read is timed, since that is where remembering the last
+ * indirect block used should pay off. The file is removed afterwards.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define PATH "/bigfile"
+#define CHUNK 4096
+/* 6 MB, where a file without a double indirect block stops near 4 MB */
+#define NCHUNKS 1536
+/* The first block of a file found through the double indirect block:
+ * past the 27 direct blocks left and the 1024 the indirect block maps */
+#define DINDIRECT_START (27 + 1024)
+
+static char buf[CHUNK];
+static char want[CHUNK];
+
+static void fill(char *b, int chunk)
+{
+        int ii;
+
+        for (ii = 0; ii < CHUNK; ii += sizeof(int))
+                *(int *)(b + ii) = chunk * CHUNK + ii;
+}
+
+static void check_chunk(int chunk)
+{
+        fill(want, chunk);
+        if (0 != memcmp(want, buf, CHUNK))
+                bench_fail("data read back differs from what was written");
+}
+
+int main(int argc, char **argv)
+{
+        struct stat st;
+        unsigned long start;
+        int fd, ii, chunk;
+
+        bench_name = "bigfile";
+
+        if (0 > (fd = open(PATH, O_RDWR | O_CREAT | O_TRUNC, 0)))
+                check_failed("open");
+        start = bench_cycles();
+        for (ii = 0; ii < NCHUNKS; ii++) {
+                fill(buf, ii);
+                if (CHUNK != write(fd, buf, CHUNK))
+                        check_failed("write");
+        }
+        bench_report("write, in order", NCHUNKS * CHUNK, bench_cycles() - start);
+
+        /* the data blocks, and at least the indirect, double indirect
+         * and one more indirect block on top of them */
+        if (0 > stat(PATH, &st))
+                check_failed("stat");
+        if (NCHUNKS * CHUNK != st.st_size)
+                bench_fail("the file is not the size that was written");
+        if (st.st_size <= DINDIRECT_START * CHUNK)
+                bench_fail("the file does not reach the double indirect block");
+        if (st.st_blocks < NCHUNKS + 3)
+                bench_fail("the file has fewer blocks than were written");
+
+        if (0 > lseek(fd, 0, SEEK_SET))
+                check_failed("lseek");
+        start = bench_cycles();
+        for (ii = 0; ii < NCHUNKS; ii++) {
+                if (CHUNK != read(fd, buf, CHUNK))
+                        check_failed("read");
+                check_chunk(ii);
+        }
+        bench_report("read, in order", NCHUNKS * CHUNK, bench_cycles() - start);
+
+        /* jump about, so the indirect block needed keeps changing */
+        for (ii = 0; ii < NCHUNKS; ii++) {
+                chunk = (ii * 389) % NCHUNKS;
+                if (0 > lseek(fd, chunk * CHUNK, SEEK_SET))
+                        check_failed("lseek");
+                if (CHUNK != read(fd, buf, CHUNK))
+                        check_failed("read");
+                check_chunk(chunk);
+        }
+
+        close(fd);
+        if (0 > unlink(PATH))
+                check_failed("unlink");
+        return 0;
+}
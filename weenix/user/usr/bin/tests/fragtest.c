@@ -0,0 +1,96 @@
+/*
+ * Writes two files a block at a time, taking turns, which is the worst
+ * case for an allocator that just hands out the next free block: the
+ * files end up interleaved on disk. Then reads each back from the start
+ * and times it, after checking that every block holds what was written.
+ * The files are left behind as /fragtest.a and /fragtest.b so that
+ * "fsmaker disk.img -e 'frag /fragtest.a /fragtest.b'" can show how
+ * many pieces they were stored in.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define CHUNK 1024
+#define NCHUNKS 256
+
+static const char *names[2] = { "/fragtest.a", "/fragtest.b" };
+
+static char buf[CHUNK];
+
+static void fill(int file, int chunk)
+{
+        int ii;
+
+        for (ii = 0; ii < CHUNK; ii++)
+                buf[ii] = (char) (file * 131 + chunk * 7 + ii);
+}
+
+static void write_files(void)
+{
+        int fds[2], ii, jj;
+
+        for (jj = 0; jj < 2; jj++) {
+                if (0 > (fds[jj] = open(names[jj], O_WRONLY | O_CREAT | O_TRUNC, 0)))
+                        check_failed(names[jj]);
+        }
+        for (ii = 0; ii < NCHUNKS; ii++) {
+                for (jj = 0; jj < 2; jj++) {
+                        fill(jj, ii);
+                        if (CHUNK != write(fds[jj], buf, CHUNK))
+                                check_failed("write");
+                }
+        }
+        for (jj = 0; jj < 2; jj++)
+                close(fds[jj]);
+}
+
+static void read_file(int file)
+{
+        char want[CHUNK];
+        unsigned long start;
+        int fd, ii;
+
+        if (0 > (fd = open(names[file], O_RDONLY, 0)))
+                check_failed(names[file]);
+        for (ii = 0; ii < NCHUNKS; ii++) {
+                if (CHUNK != read(fd, buf, CHUNK))
+                        check_failed("read");
+                memcpy(want, buf, CHUNK);
+                fill(file, ii);
+                if (0 != memcmp(want, buf, CHUNK))
+                        bench_fail("data read back differs from what was written");
+        }
+        close(fd);
+
+        if (0 > (fd = open(names[file], O_RDONLY, 0)))
+                check_failed(names[file]);
+        start = bench_cycles();
+        for (ii = 0; ii < NCHUNKS; ii++) {
+                if (CHUNK != read(fd, buf, CHUNK))
+                        check_failed("read");
+        }
+        bench_report(names[file], NCHUNKS * CHUNK, bench_cycles() - start);
+        close(fd);
+}
+
+int main(int argc, char **argv)
+{
+        unsigned long start;
+
+        bench_name = "fragtest";
+
+        start = bench_cycles();
+        write_files();
+        bench_report("write, taking turns", 2 * NCHUNKS * CHUNK, bench_cycles() - start);
+        read_file(0);
+        read_file(1);
+        return 0;
+}
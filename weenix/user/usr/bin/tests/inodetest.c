@@ -0,0 +1,119 @@
+/*
+ * Makes a few directories and creates files in them taking turns, then
+ * reports how many different inode blocks each directory's files ended
+ * up in. New inodes are put near their directory's, so each should
+ * need only a block or two rather than all of them. Checks that every
+ * file got an inode of its own and reads back its name, which it was
+ * written with. Also times stat(2) of every file, one directory after
+ * the other. Everything is removed afterwards, and must then be gone.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define TOP "/inodetest.d"
+#define NDIRS 4
+#define PER_DIR 24
+/* inodes in a block of the inode table */
+#define INODES_PER_BLOCK 32
+
+static void name(char *buf, size_t size, int dir, int file)
+{
+        if (0 > file)
+                (void) snprintf(buf, size, "%s/%d", TOP, dir);
+        else
+                (void) snprintf(buf, size, "%s/%d/f%d", TOP, dir, file);
+}
+
+int main(int argc, char **argv)
+{
+        char path[64], got[64];
+        unsigned long start;
+        struct stat st;
+        int dir, file, fd, nblocks, ii, len;
+        int blocks[PER_DIR];
+        int inos[NDIRS * PER_DIR];
+
+        bench_name = "inodetest";
+        if (0 > mkdir(TOP, 0))
+                check_failed("mkdir");
+        for (dir = 0; dir < NDIRS; dir++) {
+                name(path, sizeof(path), dir, -1);
+                if (0 > mkdir(path, 0))
+                        check_failed("mkdir");
+        }
+        for (file = 0; file < PER_DIR; file++) {
+                for (dir = 0; dir < NDIRS; dir++) {
+                        name(path, sizeof(path), dir, file);
+                        if (0 > (fd = open(path, O_WRONLY | O_CREAT, 0)))
+                                check_failed("open");
+                        len = strlen(path);
+                        if (len != write(fd, path, len))
+                                check_failed("write");
+                        close(fd);
+                }
+        }
+
+        for (dir = 0; dir < NDIRS; dir++) {
+                nblocks = 0;
+                for (file = 0; file < PER_DIR; file++) {
+                        name(path, sizeof(path), dir, file);
+                        if (0 > stat(path, &st))
+                                check_failed("stat");
+                        for (ii = 0; ii < dir * PER_DIR + file; ii++) {
+                                if (inos[ii] == (int)st.st_ino)
+                                        bench_fail("two files have the same inode");
+                        }
+                        inos[dir * PER_DIR + file] = st.st_ino;
+
+                        if (0 > (fd = open(path, O_RDONLY, 0)))
+                                check_failed("open");
+                        len = read(fd, got, sizeof(got));
+                        close(fd);
+                        if (len != (int)strlen(path) || 0 != memcmp(got, path, len))
+                                bench_fail("data read back differs from what was written");
+
+                        for (ii = 0; ii < nblocks; ii++) {
+                                if (blocks[ii] == (int)(st.st_ino / INODES_PER_BLOCK))
+                                        break;
+                        }
+                        if (ii == nblocks)
+                                blocks[nblocks++] = st.st_ino / INODES_PER_BLOCK;
+                }
+                (void) printf("directory %d: %d files in %d inode blocks\n",
+                              dir, PER_DIR, nblocks);
+        }
+
+        start = bench_cycles();
+        for (dir = 0; dir < NDIRS; dir++) {
+                for (file = 0; file < PER_DIR; file++) {
+                        name(path, sizeof(path), dir, file);
+                        if (0 > stat(path, &st))
+                                check_failed("stat");
+                }
+        }
+        bench_report_each("stat", bench_cycles() - start, NDIRS * PER_DIR);
+
+        for (dir = 0; dir < NDIRS; dir++) {
+                for (file = 0; file < PER_DIR; file++) {
+                        name(path, sizeof(path), dir, file);
+                        if (0 > unlink(path))
+                                check_failed("unlink");
+                }
+                name(path, sizeof(path), dir, -1);
+                if (0 > rmdir(path))
+                        check_failed("rmdir");
+        }
+        if (0 > rmdir(TOP))
+                check_failed("rmdir");
+        if (0 == stat(TOP, &st) || ENOENT != errno)
+                bench_fail(TOP " is still there after it was removed");
+        return 0;
+}
@@ -0,0 +1,108 @@
+/*
+ * Measures read(2) and write(2) throughput on a regular file for a range
+ * of buffer sizes, with page aligned and unaligned buffers. The kernel
+ * moves the data straight between the file's pages and the buffer's, so
+ * large transfers should cost about the same per byte as small ones and
+ * take one system call no matter how big they are. Exits non-zero if
+ * the file does not read back as it was written.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define PAGE_SIZE 4096
+
+#define FILE_NAME "/iobench.tmp"
+#define FILE_SIZE (64 * PAGE_SIZE)
+
+static char *buf;
+
+/* Writes the whole file in chunks of size bytes from buf + offset */
+static void write_file(int size, int offset)
+{
+        int fd, total = 0, n, ii;
+        char what[64];
+        unsigned long start;
+
+        if ((fd = open(FILE_NAME, O_WRONLY | O_CREAT | O_TRUNC, 0)) < 0)
+                check_failed("open");
+        for (ii = 0; ii < FILE_SIZE; ii++)
+                buf[offset + ii] = (char) ii;
+
+        start = bench_cycles();
+        while (total < FILE_SIZE) {
+                n = FILE_SIZE - total < size ? FILE_SIZE - total : size;
+                if (write(fd, buf + offset + total, n) != n)
+                        check_failed("write");
+                total += n;
+        }
+        (void) snprintf(what, sizeof(what), "write, %d byte buffer%s", size,
+                        offset ? ", unaligned" : "");
+        bench_report(what, total, bench_cycles() - start);
+        close(fd);
+}
+
+/* Reads the whole file in chunks of size bytes into buf + offset */
+static void read_file(int size, int offset)
+{
+        int fd, total = 0, n, ii;
+        char what[64];
+        unsigned long start;
+
+        if ((fd = open(FILE_NAME, O_RDONLY, 0)) < 0)
+                check_failed("open");
+
+        memset(buf, 0, FILE_SIZE + PAGE_SIZE);
+        start = bench_cycles();
+        while (0 < (n = read(fd, buf + offset + total, size)))
+                total += n;
+        if (n < 0)
+                check_failed("read");
+        (void) snprintf(what, sizeof(what), "read, %d byte buffer%s", size,
+                        offset ? ", unaligned" : "");
+        bench_report(what, total, bench_cycles() - start);
+        close(fd);
+
+        if (total != FILE_SIZE)
+                bench_fail("read came back short");
+        for (ii = 0; ii < FILE_SIZE; ii++) {
+                if (buf[offset + ii] != (char) ii)
+                        bench_fail("data read back differs from what was written");
+        }
+}
+
+int main(int argc, char **argv)
+{
+        int size;
+
+        bench_name = "iobench";
+        buf = (char *) mmap(NULL, FILE_SIZE + PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (buf == MAP_FAILED)
+                check_failed("mmap");
+
+        /* every write is checked by reading the file back, and every
+         * read by comparing it with what was written */
+        for (size = 512; size <= FILE_SIZE; size *= 8) {
+                write_file(size, 1);
+                read_file(FILE_SIZE, 0);
+        }
+        write_file(FILE_SIZE, 0);
+        for (size = 512; size <= FILE_SIZE; size *= 8) {
+                read_file(size, 0);
+                read_file(size, 1);
+        }
+
+        if (unlink(FILE_NAME) < 0)
+                check_failed("unlink");
+        munmap(buf, FILE_SIZE + PAGE_SIZE);
+        return 0;
+}
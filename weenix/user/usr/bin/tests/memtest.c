@@ -591,6 +591,55 @@ static int test_mmap_beyond(void)
         return 0;
 }
 
+static int test_madvise(void)
+{
+#define MADVISE_FILE "madvisetest"
+#define MADVISE_STR "Advice!"
+
+        int fd;
+        char *addr, *anon;
+
+        printf("Testing madvise()\n");
+
+        /* Set up test file */
+        test_assert(-1 != (fd = open(MADVISE_FILE, O_RDWR | O_CREAT, 0)), NULL);
+        test_assert(8 == write(fd, MADVISE_STR, 8), NULL);
+        test_assert(0 == unlink(MADVISE_FILE), NULL);
+
+        /* Bad arguments */
+        test_assert(MAP_FAILED != (addr = mmap(NULL, PAGE_SIZE * 2,
+                                               PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)), NULL);
+        test_assert(-1 == madvise(addr + 1, PAGE_SIZE, MADV_NORMAL), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE, 42), NULL);
+        test_assert(EINVAL == errno, NULL);
+        test_assert(-1 == madvise(addr, PAGE_SIZE * 3, MADV_NORMAL), NULL);
+        test_assert(ENOMEM == errno, NULL);
+
+        /* Hints which don't change the contents */
+        test_assert(0 == madvise(addr, PAGE_SIZE, MADV_WILLNEED), NULL);
+        test_assert(0 == madvise(addr, PAGE_SIZE, MADV_SEQUENTIAL), NULL);
+        test_assert(!strcmp(addr, MADVISE_STR), NULL);
+        test_assert(0 == madvise(addr, PAGE_SIZE, MADV_NORMAL), NULL);
+
+        /* Dropping a private copy brings back the file's contents */
+        *addr = 'a';
+        test_assert(0 == madvise(addr, PAGE_SIZE, MADV_DONTNEED), NULL);
+        test_assert(!strcmp(addr, MADVISE_STR), NULL);
+
+        /* And for anonymous memory, zeros */
+        test_assert(MAP_FAILED != (anon = mmap(NULL, PAGE_SIZE * 4, PROT_READ | PROT_WRITE,
+                                               MAP_PRIVATE | MAP_ANON, -1, 0)), NULL);
+        memset(anon, 'b', PAGE_SIZE * 4);
+        test_assert(0 == madvise(anon + PAGE_SIZE, PAGE_SIZE * 2, MADV_DONTNEED), NULL);
+        test_assert('b' == *anon, NULL);
+        test_assert('\0' == *(anon + PAGE_SIZE), NULL);
+        test_assert('\0' == *(anon + PAGE_SIZE * 3 - 1), NULL);
+        test_assert('b' == *(anon + PAGE_SIZE * 3), NULL);
+
+        return 0;
+}
+
 int main(int argc, char **argv)
 {
         if (argc != 1) {
@@ -622,6 +671,7 @@ int main(int argc, char **argv)
         childtest(test_mmap_fill);
         childtest(test_mmap_repeat);
         childtest(test_mmap_beyond);
+        childtest(test_madvise);
         test_fini();
 
         return 0;
@@ -0,0 +1,133 @@
+/*
+ * Times the calls that change file system metadata: creating, renaming
+ * and removing files and directories. On s5fs each of these is a
+ * journal handle, and the transactions they join are committed in the
+ * background, so back to back calls should cost little more than the
+ * blocks they change. Checks afterwards that every name ended up where
+ * it should and that the renamed files still hold what was written to
+ * them, then removes everything. After the kernel is halted, which
+ * unmounts the disk, "fsmaker disk.img -e check" should find no
+ * transactions left in the journal and the disk marked clean.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define TOP "/metabench.d"
+#define NNAMES 64
+
+static void name(char *buf, size_t size, const char *prefix, int num)
+{
+        (void) snprintf(buf, size, "%s/%s%d", TOP, prefix, num);
+}
+
+static void expect(const char *prefix, int there)
+{
+        char path[64];
+        struct stat st;
+        int ii;
+
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), prefix, ii);
+                if (there && 0 > stat(path, &st))
+                        bench_fail("a name went missing");
+                if (!there && (0 == stat(path, &st) || ENOENT != errno))
+                        bench_fail("a removed name is still there");
+                if (there && 'd' == *prefix && !S_ISDIR(st.st_mode))
+                        bench_fail("a directory is no longer one");
+        }
+}
+
+/* Each file is written with the name it was created under, which it
+ * should still hold after it was renamed. */
+static void expect_contents(void)
+{
+        char path[64], want[64], got[64];
+        int ii, fd, len;
+
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), "g", ii);
+                name(want, sizeof(want), "f", ii);
+                if (0 > (fd = open(path, O_RDONLY, 0)))
+                        check_failed("open");
+                len = read(fd, got, sizeof(got));
+                close(fd);
+                if (len != (int)strlen(want) || 0 != memcmp(got, want, len))
+                        bench_fail("data read back differs from what was written");
+        }
+}
+
+int main(int argc, char **argv)
+{
+        char path[64], to[64];
+        unsigned long start;
+        int ii, fd, len;
+
+        bench_name = "metabench";
+        if (0 > mkdir(TOP, 0))
+                check_failed("mkdir");
+
+        start = bench_cycles();
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), "f", ii);
+                if (0 > (fd = open(path, O_WRONLY | O_CREAT, 0)))
+                        check_failed("open");
+                len = strlen(path);
+                if (len != write(fd, path, len))
+                        check_failed("write");
+                close(fd);
+        }
+        bench_report_each("create", bench_cycles() - start, NNAMES);
+
+        start = bench_cycles();
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), "d", ii);
+                if (0 > mkdir(path, 0))
+                        check_failed("mkdir");
+        }
+        bench_report_each("mkdir", bench_cycles() - start, NNAMES);
+
+        start = bench_cycles();
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), "f", ii);
+                name(to, sizeof(to), "g", ii);
+                if (0 > rename(path, to))
+                        check_failed("rename");
+        }
+        bench_report_each("rename", bench_cycles() - start, NNAMES);
+
+        sync();
+        expect("f", 0);
+        expect("g", 1);
+        expect("d", 1);
+        expect_contents();
+
+        start = bench_cycles();
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), "g", ii);
+                if (0 > unlink(path))
+                        check_failed("unlink");
+        }
+        bench_report_each("unlink", bench_cycles() - start, NNAMES);
+
+        start = bench_cycles();
+        for (ii = 0; ii < NNAMES; ii++) {
+                name(path, sizeof(path), "d", ii);
+                if (0 > rmdir(path))
+                        check_failed("rmdir");
+        }
+        bench_report_each("rmdir", bench_cycles() - start, NNAMES);
+
+        expect("g", 0);
+        expect("d", 0);
+        if (0 > rmdir(TOP))
+                check_failed("rmdir");
+        return 0;
+}
@@ -0,0 +1,240 @@
+/*
+ * Times path resolution through the kernel's name cache: opening a file
+ * several directories deep, and stat(2) of names that are not there,
+ * over and over. Before timing, checks that the cache follows files and
+ * directories being created, removed, linked and renamed, since a stale
+ * entry would show up as a name that exists but cannot be found or the
+ * other way around. Exits non-zero if any lookup comes back wrong.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define ROUNDS 1000
+
+#define TOP "/namebench.d"
+#define DEPTH 8
+
+#define MARK "namebench"
+
+static char deepdir[256];
+static char deepfile[256];
+static int deepino;
+
+static int exists(const char *path)
+{
+        struct stat st;
+
+        if (0 == stat(path, &st))
+                return 1;
+        if (ENOENT != errno)
+                check_failed(path);
+        return 0;
+}
+
+static void expect(const char *path, int there)
+{
+        char what[300];
+
+        if (exists(path) != there) {
+                (void) snprintf(what, sizeof(what), "%s %s", path,
+                                there ? "went missing" : "is still there");
+                bench_fail(what);
+        }
+}
+
+static void touch(const char *path)
+{
+        int fd;
+
+        if (0 > (fd = open(path, O_WRONLY | O_CREAT, 0)))
+                check_failed(path);
+        close(fd);
+}
+
+/* Makes TOP/d0/d1/.../d7 and a file at the bottom of it, holding MARK */
+static void make_tree(void)
+{
+        struct stat st;
+        int ii, fd;
+
+        strcpy(deepdir, TOP);
+        if (0 > mkdir(deepdir, 0))
+                check_failed("mkdir");
+        for (ii = 0; ii < DEPTH; ii++) {
+                (void) snprintf(deepdir + strlen(deepdir),
+                                sizeof(deepdir) - strlen(deepdir), "/d%d", ii);
+                if (0 > mkdir(deepdir, 0))
+                        check_failed("mkdir");
+        }
+        (void) snprintf(deepfile, sizeof(deepfile), "%s/file", deepdir);
+        if (0 > (fd = open(deepfile, O_WRONLY | O_CREAT, 0)))
+                check_failed(deepfile);
+        if ((int) sizeof(MARK) != write(fd, MARK, sizeof(MARK)))
+                check_failed("write");
+        close(fd);
+        if (0 > stat(deepfile, &st))
+                check_failed("stat");
+        deepino = st.st_ino;
+}
+
+/* The cached lookups still have to find the file make_tree made, with
+ * what was written to it */
+static void check_deepfile(void)
+{
+        char buf[sizeof(MARK)];
+        struct stat st;
+        int fd;
+
+        if (0 > stat(deepfile, &st))
+                check_failed("stat");
+        if (st.st_ino != deepino)
+                bench_fail("the deep path leads to the wrong file");
+        if (0 > (fd = open(deepfile, O_RDONLY, 0)))
+                check_failed("open");
+        if ((int) sizeof(MARK) != read(fd, buf, sizeof(buf)))
+                check_failed("read");
+        if (0 != memcmp(buf, MARK, sizeof(MARK)))
+                bench_fail("data read back differs from what was written");
+        close(fd);
+}
+
+static void remove_tree(void)
+{
+        char *slash;
+
+        if (0 > unlink(deepfile))
+                check_failed("unlink");
+        while (0 != strcmp(deepdir, TOP)) {
+                if (0 > rmdir(deepdir))
+                        check_failed("rmdir");
+                slash = strrchr(deepdir, '/');
+                *slash = '\0';
+        }
+        if (0 > rmdir(TOP))
+                check_failed("rmdir");
+}
+
+static void check(void)
+{
+        char a[256], b[256], sub[256];
+
+        (void) snprintf(a, sizeof(a), "%s/a", deepdir);
+        (void) snprintf(b, sizeof(b), "%s/b", deepdir);
+        (void) snprintf(sub, sizeof(sub), "%s/a/sub", deepdir);
+
+        /* cache a negative entry, then make the name */
+        expect(a, 0);
+        expect(a, 0);
+        touch(a);
+        expect(a, 1);
+        expect(a, 1);
+
+        /* and take it away again */
+        if (0 > unlink(a))
+                check_failed("unlink");
+        expect(a, 0);
+
+        /* a second name for the same file */
+        touch(a);
+        expect(b, 0);
+        if (0 > link(a, b))
+                check_failed("link");
+        expect(b, 1);
+        if (0 > unlink(b))
+                check_failed("unlink");
+        expect(b, 0);
+        expect(a, 1);
+
+        /* renaming removes one name and adds the other */
+        if (0 > rename(a, b))
+                check_failed("rename");
+        expect(a, 0);
+        expect(b, 1);
+        if (0 > unlink(b))
+                check_failed("unlink");
+        expect(b, 0);
+
+        /* names cached inside a directory must go with it, even if
+         * a new directory of the same name is made */
+        if (0 > mkdir(a, 0))
+                check_failed("mkdir");
+        expect(a, 1);
+        touch(sub);
+        expect(sub, 1);
+        if (0 > unlink(sub))
+                check_failed("unlink");
+        expect(sub, 0);
+        touch(sub);
+        expect(sub, 1);
+        if (0 > unlink(sub))
+                check_failed("unlink");
+        if (0 > rmdir(a))
+                check_failed("rmdir");
+        expect(a, 0);
+        expect(sub, 0);
+        if (0 > mkdir(a, 0))
+                check_failed("mkdir");
+        expect(sub, 0);
+        if (0 > rmdir(a))
+                check_failed("rmdir");
+        expect(a, 0);
+}
+
+static void bench(void)
+{
+        char missing[256];
+        unsigned long start;
+        struct stat st;
+        int ii, fd;
+
+        start = bench_cycles();
+        for (ii = 0; ii < ROUNDS; ii++) {
+                if (0 > (fd = open(deepfile, O_RDONLY, 0)))
+                        check_failed("open");
+                close(fd);
+        }
+        bench_report_each("open, 10 components", bench_cycles() - start, ROUNDS);
+        check_deepfile();
+
+        start = bench_cycles();
+        for (ii = 0; ii < ROUNDS; ii++) {
+                if (0 > (fd = open("/usr/bin/namebench", O_RDONLY, 0)))
+                        check_failed("open /usr/bin/namebench");
+                close(fd);
+        }
+        bench_report_each("open /usr/bin/namebench", bench_cycles() - start, ROUNDS);
+
+        (void) snprintf(missing, sizeof(missing), "%s/missing", deepdir);
+        start = bench_cycles();
+        for (ii = 0; ii < ROUNDS; ii++) {
+                if (0 == stat(missing, &st) || ENOENT != errno)
+                        check_failed("stat of a missing file");
+        }
+        bench_report_each("stat, missing, 10 components", bench_cycles() - start, ROUNDS);
+
+        start = bench_cycles();
+        for (ii = 0; ii < ROUNDS; ii++) {
+                if (0 == stat("/usr/bin/missing", &st) || ENOENT != errno)
+                        check_failed("stat of a missing file");
+        }
+        bench_report_each("stat /usr/bin/missing", bench_cycles() - start, ROUNDS);
+}
+
+int main(int argc, char **argv)
+{
+        bench_name = "namebench";
+        make_tree();
+        check_deepfile();
+        check();
+        bench();
+        remove_tree();
+        return 0;
+}
@@ -0,0 +1,125 @@
+/*
+ * Small files keep their data in the inode until they grow past what
+ * fits there. Checks a file's contents as it is written a few bytes at
+ * a time across that limit, and with a hole that starts inline and is
+ * only filled in after it moved out. Then times creating, reading and
+ * removing a batch of small files.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define PATH "/smallfile"
+/* a bit past the 112 bytes an inode holds */
+#define GROW_TO 300
+#define STEP 7
+
+#define NSMALL 64
+#define FILE_SIZE 64
+
+static void check_contents(const char *path, const char *want, int len)
+{
+        char got[GROW_TO + 1];
+        int fd, n;
+
+        if (0 > (fd = open(path, O_RDONLY, 0)))
+                check_failed("open");
+        n = read(fd, got, sizeof(got));
+        close(fd);
+        if (n != len)
+                bench_fail("the file is not the size that was written");
+        if (0 != memcmp(got, want, len))
+                bench_fail("data read back differs from what was written");
+}
+
+static void check(void)
+{
+        char want[GROW_TO];
+        int fd, ii, n;
+
+        for (ii = 0; ii < GROW_TO; ii++)
+                want[ii] = 'a' + ii % 26;
+
+        if (0 > (fd = open(PATH, O_WRONLY | O_CREAT | O_TRUNC, 0)))
+                check_failed("open");
+        for (ii = 0; ii < GROW_TO; ii += n) {
+                n = (GROW_TO - ii < STEP) ? GROW_TO - ii : STEP;
+                if (n != write(fd, want + ii, n))
+                        check_failed("write");
+                check_contents(PATH, want, ii + n);
+        }
+        close(fd);
+        if (0 > unlink(PATH))
+                check_failed("unlink");
+
+        /* 10 bytes, a hole, then 10 bytes which do not fit inline */
+        memset(want, 0, sizeof(want));
+        memcpy(want, "0123456789", 10);
+        memcpy(want + 200, "abcdefghij", 10);
+        if (0 > (fd = open(PATH, O_WRONLY | O_CREAT | O_TRUNC, 0)))
+                check_failed("open");
+        if (10 != write(fd, want, 10))
+                check_failed("write");
+        if (0 > lseek(fd, 200, SEEK_SET) || 10 != write(fd, want + 200, 10))
+                check_failed("write");
+        close(fd);
+        check_contents(PATH, want, 210);
+        if (0 > unlink(PATH))
+                check_failed("unlink");
+}
+
+static void bench(void)
+{
+        char path[32], buf[FILE_SIZE], got[FILE_SIZE];
+        unsigned long start;
+        int fd, ii;
+
+        memset(buf, 'x', sizeof(buf));
+
+        start = bench_cycles();
+        for (ii = 0; ii < NSMALL; ii++) {
+                (void) snprintf(path, sizeof(path), "/smallfile.%d", ii);
+                if (0 > (fd = open(path, O_WRONLY | O_CREAT, 0)))
+                        check_failed("open");
+                if (FILE_SIZE != write(fd, buf, FILE_SIZE))
+                        check_failed("write");
+                close(fd);
+        }
+        bench_report("create and write", NSMALL * FILE_SIZE, bench_cycles() - start);
+
+        start = bench_cycles();
+        for (ii = 0; ii < NSMALL; ii++) {
+                (void) snprintf(path, sizeof(path), "/smallfile.%d", ii);
+                if (0 > (fd = open(path, O_RDONLY, 0)))
+                        check_failed("open");
+                if (FILE_SIZE != read(fd, got, FILE_SIZE))
+                        check_failed("read");
+                close(fd);
+                if (0 != memcmp(got, buf, FILE_SIZE))
+                        bench_fail("data read back differs from what was written");
+        }
+        bench_report("open and read", NSMALL * FILE_SIZE, bench_cycles() - start);
+
+        start = bench_cycles();
+        for (ii = 0; ii < NSMALL; ii++) {
+                (void) snprintf(path, sizeof(path), "/smallfile.%d", ii);
+                if (0 > unlink(path))
+                        check_failed("unlink");
+        }
+        bench_report("unlink", NSMALL * FILE_SIZE, bench_cycles() - start);
+}
+
+int main(int argc, char **argv)
+{
+        bench_name = "smallfile";
+        check();
+        bench();
+        return 0;
+}
@@ -0,0 +1,225 @@
+/*
+ * Times libc's strlen, strchr, strcmp and memcmp, which look at a word
+ * at a time, against the byte at a time loops they replaced, over a
+ * range of string lengths. First checks that they agree with the old
+ * loops, and that none of them reads past the page a string ends on;
+ * exits non-zero if any of them gets an answer wrong.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <stdio.h>
+
+#include "bench.h"
+
+#define PAGE_SIZE 4096
+
+#define MAX_LEN 4096
+/* each measurement scans about this many bytes in all */
+#define TOTAL_BYTES (1024 * 1024)
+
+static char *buf1, *buf2;
+
+/* the old implementations, for comparison */
+static size_t old_strlen(const char *s)
+{
+        const char *sc;
+
+        for (sc = s; *sc != '\0'; ++sc)
+                /* nothing */;
+        return sc - s;
+}
+
+static char *old_strchr(const char *s, int c)
+{
+        for (; *s != (char) c; ++s)
+                if (*s == '\0')
+                        return NULL;
+        return (char *)s;
+}
+
+static int old_strcmp(const char *cs, const char *ct)
+{
+        register signed char __res;
+
+        while (1) {
+                if ((__res = *cs - *ct++) != 0 || !*cs++)
+                        break;
+        }
+
+        return __res;
+}
+
+static int old_memcmp(const void *cs, const void *ct, size_t count)
+{
+        const unsigned char *su1, *su2;
+        signed char res = 0;
+
+        for (su1 = cs, su2 = ct; 0 < count; ++su1, ++su2, count--)
+                if ((res = *su1 - *su2) != 0)
+                        break;
+        return res;
+}
+
+/* Fills buf1 + off1 and buf2 + off2 with the same len character string */
+static void make_strings(int len, int off1, int off2)
+{
+        int ii;
+
+        for (ii = 0; ii < len; ii++)
+                buf1[off1 + ii] = buf2[off2 + ii] = 'a' + ii % 26;
+        buf1[off1 + len] = buf2[off2 + len] = '\0';
+}
+
+static int sign(int x)
+{
+        return (x > 0) - (x < 0);
+}
+
+static void check(void)
+{
+        int len, off1, off2, ii;
+        char *page, *end;
+
+        for (len = 0; len < 64; len++) {
+                for (off1 = 0; off1 < 4; off1++) {
+                        for (off2 = 0; off2 < 4; off2++) {
+                                make_strings(len, off1, off2);
+                                if (strlen(buf1 + off1) != (size_t) len)
+                                        bench_fail("strlen came back wrong");
+                                for (ii = 0; ii <= len; ii++) {
+                                        if (strchr(buf1 + off1, buf1[off1 + ii])
+                                            != old_strchr(buf1 + off1, buf1[off1 + ii]))
+                                                bench_fail("strchr came back wrong");
+                                }
+                                if (NULL != strchr(buf1 + off1, '!'))
+                                        bench_fail("strchr came back wrong");
+                                if (0 != strcmp(buf1 + off1, buf2 + off2))
+                                        bench_fail("strcmp came back wrong");
+                                for (ii = 0; ii < len; ii++) {
+                                        buf2[off2 + ii] ^= 0x80;
+                                        if (sign(strcmp(buf1 + off1, buf2 + off2))
+                                            != sign((unsigned char) buf1[off1 + ii]
+                                                    - (unsigned char) buf2[off2 + ii]))
+                                                bench_fail("strcmp came back wrong");
+                                        if (sign(memcmp(buf1 + off1, buf2 + off2, len))
+                                            != sign((unsigned char) buf1[off1 + ii]
+                                                    - (unsigned char) buf2[off2 + ii]))
+                                                bench_fail("memcmp came back wrong");
+                                        buf2[off2 + ii] ^= 0x80;
+                                }
+                        }
+                }
+        }
+
+        /* strings which end right before an unmapped page; reading
+         * a word past the end would kill us */
+        page = (char *) mmap(NULL, 2 * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (page == MAP_FAILED || 0 > munmap(page + PAGE_SIZE, PAGE_SIZE))
+                check_failed("mmap");
+        end = page + PAGE_SIZE;
+        for (len = 0; len < 8; len++) {
+                memset(end - len - 1, 'x', len);
+                end[-1] = '\0';
+                if (strlen(end - len - 1) != (size_t) len
+                    || NULL != strchr(end - len - 1, 'y')
+                    || 0 != strcmp(end - len - 1, end - len - 1))
+                        bench_fail("string at the end of a page came back wrong");
+        }
+        munmap(page, PAGE_SIZE);
+}
+
+/* The timed loops keep the results and check them afterwards, so a
+ * routine which is fast because it is wrong fails the run (and the
+ * compiler cannot drop the calls) */
+static void bench(int len)
+{
+        unsigned long start, old, new;
+        int rounds = TOTAL_BYTES / (len + 1), ii;
+        size_t oldsum = 0, newsum = 0;
+        int oldres = 0, newres = 0;
+        char what[64];
+
+        make_strings(len, 0, 0);
+
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                oldsum += old_strlen(buf1);
+        old = bench_cycles() - start;
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                newsum += strlen(buf1);
+        new = bench_cycles() - start;
+        if (oldsum != newsum || newsum != (size_t) rounds * len)
+                bench_fail("strlen came back wrong");
+        (void) snprintf(what, sizeof(what), "strlen, %d bytes, old", len);
+        bench_report(what, rounds * len, old);
+        (void) snprintf(what, sizeof(what), "strlen, %d bytes, new", len);
+        bench_report(what, rounds * len, new);
+
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                oldres |= (NULL != old_strchr(buf1, '!'));
+        old = bench_cycles() - start;
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                newres |= (NULL != strchr(buf1, '!'));
+        new = bench_cycles() - start;
+        if (oldres || newres)
+                bench_fail("strchr came back wrong");
+        (void) snprintf(what, sizeof(what), "strchr, %d bytes, old", len);
+        bench_report(what, rounds * len, old);
+        (void) snprintf(what, sizeof(what), "strchr, %d bytes, new", len);
+        bench_report(what, rounds * len, new);
+
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                oldres |= old_strcmp(buf1, buf2);
+        old = bench_cycles() - start;
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                newres |= strcmp(buf1, buf2);
+        new = bench_cycles() - start;
+        if (oldres || newres)
+                bench_fail("strcmp came back wrong");
+        (void) snprintf(what, sizeof(what), "strcmp, %d bytes, old", len);
+        bench_report(what, rounds * len, old);
+        (void) snprintf(what, sizeof(what), "strcmp, %d bytes, new", len);
+        bench_report(what, rounds * len, new);
+
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                oldres |= old_memcmp(buf1, buf2, len);
+        old = bench_cycles() - start;
+        start = bench_cycles();
+        for (ii = 0; ii < rounds; ii++)
+                newres |= memcmp(buf1, buf2, len);
+        new = bench_cycles() - start;
+        if (oldres || newres)
+                bench_fail("memcmp came back wrong");
+        (void) snprintf(what, sizeof(what), "memcmp, %d bytes, old", len);
+        bench_report(what, rounds * len, old);
+        (void) snprintf(what, sizeof(what), "memcmp, %d bytes, new", len);
+        bench_report(what, rounds * len, new);
+}
+
+int main(int argc, char **argv)
+{
+        int len;
+
+        bench_name = "strbench";
+        buf1 = (char *) malloc(MAX_LEN + 8);
+        buf2 = (char *) malloc(MAX_LEN + 8);
+        if (NULL == buf1 || NULL == buf2)
+                bench_fail("out of memory");
+
+        check();
+        for (len = 4; len <= MAX_LEN; len *= 4)
+                bench(len);
+        return 0;
+}
@@ -9,6 +9,7 @@
 #include <sys/mman.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -51,27 +52,76 @@ static void fork_test()
         }
 }
 
+#define COW_PAGES 16
+static char cow_buf[COW_PAGES * 4096];
+
+/* Reads one byte from every page of cow_buf, returns the number of pages
+ * which don't hold the pattern written before the fork */
+static int cow_check_pages()
+{
+        int ii, bad = 0;
+        for (ii = 0; ii < COW_PAGES; ii++) {
+                if (cow_buf[ii * 4096] != (char) ii)
+                        bad++;
+        }
+        return bad;
+}
+
 static void cow_fork()
 {
         int     status;
         int     foo = 0;
+        int     ii;
+        int     faults;
+        struct rusage before, after;
 
         (void) printf("-- COW fork test start\n");
 
+        /* Make every page of the buffer resident (and writable) before
+         * forking; afterwards neither process should need to fault just
+         * to read them */
+        for (ii = 0; ii < COW_PAGES; ii++)
+                cow_buf[ii * 4096] = (char) ii;
+
+        if (getrusage(RUSAGE_SELF, &before) < 0)
+                check_failed("getrusage");
+
         if (!myfork()) {
                 /* We are in the child process, and should be accessing
                  * our own memory
                  */
+                if (cow_check_pages())
+                        exit(1);
                 foo = 1;
+                cow_buf[0] = -1;
                 exit(0);
         }
 
+        if (cow_check_pages()) {
+                (void) printf("Parent lost its pages across fork.\n");
+                exit(1);
+        }
+
+        if (getrusage(RUSAGE_SELF, &after) < 0)
+                check_failed("getrusage");
+        faults = after.ru_minflt + after.ru_majflt - before.ru_minflt - before.ru_majflt;
+        (void) printf("Parent took %d faults reading %d pages after fork.\n", faults, COW_PAGES);
+        if (faults >= COW_PAGES) {
+                (void) printf("Fork should leave the parent's pages mapped (read-only).\n");
+                exit(1);
+        }
+
         if (wait(&status) == -1) {
                 (void) printf("wait failed (errno=%d)\n", errno);
                 exit(1);
         }
 
-        if (foo) {
+        if (status) {
+                (void) printf("Child did not see the parent's pages.\n");
+                exit(1);
+        }
+
+        if (foo || cow_buf[0] != 0) {
                 (void) printf("Data changed in child affected parent.\n"
                               "Make sure you mark writable private mappings copy-on-write.\n");
                 (void) printf("Copy-on-write failed.\n");
@@ -81,6 +131,92 @@ static void cow_fork()
         (void) printf("-- COW fork test passed\n");
 }
 
+/* More anonymous memory than the machine has RAM; this only completes if
+ * pageoutd can write anonymous pages out to swap. The run script gives
+ * the machine 32mb of RAM and 16mb of swap, and the kernel needs a few
+ * mb of its own, so 36mb overflows RAM but still fits. */
+#define SWAP_PAGES (36 * 256)
+
+static void swap_test()
+{
+        int     *mem;
+        int     ii;
+        struct rusage before, after;
+
+        (void) printf("-- swap test start\n");
+
+        mem = (int *) mmap(NULL, SWAP_PAGES * 4096, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (mem == MAP_FAILED)
+                check_failed("mmap");
+
+        if (getrusage(RUSAGE_SELF, &before) < 0)
+                check_failed("getrusage");
+        for (ii = 0; ii < SWAP_PAGES; ii++)
+                mem[ii * 1024] = ii;
+        for (ii = 0; ii < SWAP_PAGES; ii++) {
+                if (mem[ii * 1024] != ii) {
+                        (void) printf("Page %d lost its contents (%d).\n", ii, mem[ii * 1024]);
+                        exit(1);
+                }
+        }
+        if (getrusage(RUSAGE_SELF, &after) < 0)
+                check_failed("getrusage");
+        (void) printf("Touched %d pages twice, %d came back from disk.\n",
+                      SWAP_PAGES, after.ru_majflt - before.ru_majflt);
+
+        if (munmap(mem, SWAP_PAGES * 4096) < 0)
+                check_failed("munmap");
+
+        (void) printf("-- swap test passed\n");
+}
+
+/* Identical private pages, which ksmd should merge once swap_test has
+ * run the machine short of memory; writing to half of them afterwards
+ * must split those off again without disturbing the others */
+#define KSM_PAGES 256
+#define KSM_BYTE 0x5a
+
+static char *ksm_mem;
+
+static void ksm_test_start()
+{
+        int     ii;
+
+        (void) printf("-- page merging test start\n");
+
+        ksm_mem = (char *) mmap(NULL, KSM_PAGES * 4096, PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANON, -1, 0);
+        if (ksm_mem == MAP_FAILED)
+                check_failed("mmap");
+        for (ii = 0; ii < KSM_PAGES; ii++)
+                memset(ksm_mem + ii * 4096, KSM_BYTE, 4096);
+}
+
+static void ksm_test_finish()
+{
+        int     ii, jj;
+
+        for (ii = 0; ii < KSM_PAGES; ii += 2)
+                ksm_mem[ii * 4096] = (char) ii;
+
+        for (ii = 0; ii < KSM_PAGES; ii++) {
+                for (jj = 0; jj < 4096; jj++) {
+                        char expect = (0 == jj && 0 == ii % 2) ? (char) ii : KSM_BYTE;
+                        if (ksm_mem[ii * 4096 + jj] != expect) {
+                                (void) printf("Byte %d of page %d is %d, not %d.\n",
+                                              jj, ii, ksm_mem[ii * 4096 + jj], expect);
+                                exit(1);
+                        }
+                }
+        }
+
+        if (munmap(ksm_mem, KSM_PAGES * 4096) < 0)
+                check_failed("munmap");
+
+        (void) printf("-- page merging test passed\n");
+}
+
 static void fault_test()
 {
         int     status;
@@ -418,6 +554,9 @@ int main(int argc, char **argv)
         fault_test();
 
         wait_test();
+        ksm_test_start();
+        swap_test();
+        ksm_test_finish();
         cow_fork();
 
         fork_test();